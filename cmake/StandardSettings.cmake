@@ -3,6 +3,10 @@
 option(${PROJECT_NAME}_WARNINGS_AS_ERRORS "Treat compiler warnings as errors." OFF)
 option(${PROJECT_NAME}_CHECKOUT_GIT_SUBMODULES "If git is found, initialize all submodules." ON)
 option(${PROJECT_NAME}_ENABLE_UNIT_TESTING "Enable unit tests for the projects (from the `test` subfolder)." ON)
+option(${PROJECT_NAME}_ENABLE_LOADGEN "Build the load generator, which simulates clients against a server (from the `tools` subfolder)." OFF)
+option(${PROJECT_NAME}_ENABLE_REPLAY "Build the traffic replay tool, which feeds captured traffic into a headless server (from the `tools` subfolder)." OFF)
+option(${PROJECT_NAME}_ENABLE_AUTH_MOCK "Let the BEAMMP_AUTH_MOCK environment variable replace the auth backend with one that accepts any key. For load testing only, never for servers players join." OFF)
+option(${PROJECT_NAME}_ENABLE_BENCHMARKS "Build the microbenchmarks of the packet and serialization hot paths (runner in the `test` subfolder)." OFF)
 option(${PROJECT_NAME}_ENABLE_CLANG_TIDY "Enable static analysis with Clang-Tidy." OFF)
 option(${PROJECT_NAME}_ENABLE_CPPCHECK "Enable static analysis with Cppcheck." OFF)
 # TODO Implement code coverage
@@ -0,0 +1,102 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+/*
+ * Microbenchmarks, written next to the code they measure, like TEST_CASEs:
+ *
+ *  BEAMMP_BENCHMARK("Comp 4KB") {
+ *      auto Data = ...;
+ *      State.Run([&] { Benchmark::DoNotOptimize(Comp(Data)); });
+ *  }
+ *
+ * They're only registered in the BeamMP-Server-bench target, which defines
+ * BEAMMP_ENABLE_BENCHMARKS, and are dead code everywhere else.
+ */
+
+class TBenchmarkState {
+public:
+    explicit TBenchmarkState(std::chrono::nanoseconds MinTime)
+        : mMinTime(MinTime) { }
+
+    /// Calls Fn repeatedly until enough time has passed to get a stable
+    /// measurement. Only the time spent in Fn is measured.
+    void Run(const std::function<void()>& Fn);
+    /// For benchmarks where one call handles many items (e.g. clients),
+    /// so that items per second can be reported.
+    void SetItemsPerIteration(size_t Items) { mItemsPerIteration = Items; }
+
+    size_t Iterations() const { return mIterations; }
+    double NsPerIteration() const { return mNsPerIteration; }
+    size_t ItemsPerIteration() const { return mItemsPerIteration; }
+
+private:
+    std::chrono::nanoseconds mMinTime;
+    size_t mIterations { 0 };
+    double mNsPerIteration { 0 };
+    size_t mItemsPerIteration { 1 };
+};
+
+namespace Benchmark {
+
+using TFunction = void (*)(TBenchmarkState&);
+
+struct TResult {
+    std::string Name;
+    size_t Iterations;
+    double NsPerIteration;
+    double ItemsPerSecond;
+};
+
+bool Register(const char* Name, TFunction Fn);
+/// Runs all benchmarks whose name contains Filter.
+std::vector<TResult> RunAll(const std::string& Filter, std::chrono::nanoseconds MinTime);
+
+template <typename T>
+inline void DoNotOptimize(const T& Value) {
+#if defined(_MSC_VER)
+    static const volatile void* Sink;
+    Sink = &Value;
+#else
+    asm volatile("" : : "g"(&Value) : "memory");
+#endif
+}
+
+}
+
+#define BEAMMP_BENCHMARK_CONCAT_IMPL(a, b) a##b
+#define BEAMMP_BENCHMARK_CONCAT(a, b) BEAMMP_BENCHMARK_CONCAT_IMPL(a, b)
+
+#if defined(BEAMMP_ENABLE_BENCHMARKS)
+#define BEAMMP_BENCHMARK_IMPL(Fn, Name)                                                                           \
+    static void Fn(TBenchmarkState& State);                                                                       \
+    [[maybe_unused]] static const bool BEAMMP_BENCHMARK_CONCAT(Fn, _Registered) = Benchmark::Register(Name, &Fn); \
+    static void Fn([[maybe_unused]] TBenchmarkState& State)
+#else
+#define BEAMMP_BENCHMARK_IMPL(Fn, Name) \
+    [[maybe_unused]] static void Fn([[maybe_unused]] TBenchmarkState& State)
+#endif
+
+#define BEAMMP_BENCHMARK(Name) BEAMMP_BENCHMARK_IMPL(BEAMMP_BENCHMARK_CONCAT(BeamMPBenchmark_, __LINE__), Name)
@@ -28,6 +28,8 @@
 #include "BoostAliases.h"
 #include "Common.h"
 #include "Compat.h"
+#include "TLuaHookChain.h"
+#include "TTrafficStats.h"
 #include "VehicleData.h"
 
 class TServer;
@@ -83,7 +85,12 @@ public:
     [[nodiscard]] std::string GetName() const { return mName; }
     void SetUnicycleID(int ID) { mUnicycleID = ID; }
     void SetID(int ID) { mID = ID; }
-    [[nodiscard]] int GetOpenCarID() const;
+    // the lowest ID which is neither used nor reserved, reserved until
+    // ReleaseCarID, so that spawns waiting on Lua don't get the same one
+    [[nodiscard]] int ReserveCarID();
+    void ReleaseCarID(int Ident);
+    [[nodiscard]] bool IsCarIDReserved(int Ident) const;
+    [[nodiscard]] bool HasCar(int Ident) const;
     [[nodiscard]] int GetCarCount() const;
     void ClearCars();
     [[nodiscard]] int GetID() const { return mID; }
@@ -92,6 +99,9 @@ public:
     [[nodiscard]] bool IsSynced() const { return mIsSynced; }
     [[nodiscard]] bool IsSyncing() const { return mIsSyncing; }
     [[nodiscard]] bool IsGuest() const { return mIsGuest; }
+    // true if the client negotiated 16-bit player IDs during the 'VC' handshake
+    [[nodiscard]] bool IsWideID() const { return mIsWideID; }
+    void SetIsWideID(bool NewIsWideID) { mIsWideID = NewIsWideID; }
     void SetIsGuest(bool NewIsGuest) { mIsGuest = NewIsGuest; }
     void SetIsSynced(bool NewIsSynced) { mIsSynced = NewIsSynced; }
     void SetIsSyncing(bool NewIsSyncing) { mIsSyncing = NewIsSyncing; }
@@ -104,6 +114,9 @@ public:
     [[nodiscard]] TServer& Server() const;
     void UpdatePingTime();
     int SecondsSinceLastPing();
+    [[nodiscard]] TTrafficStats& Traffic() { return mTraffic; }
+    [[nodiscard]] const TTrafficStats& Traffic() const { return mTraffic; }
+    [[nodiscard]] TLuaHookChain& LuaHooks() { return mLuaHooks; }
 
 private:
     void InsertVehicle(int ID, const std::string& Data);
@@ -116,9 +129,11 @@ private:
     std::queue<std::vector<uint8_t>> mPacketsSync;
     std::unordered_map<std::string, std::string> mIdentifiers;
     bool mIsGuest = false;
+    bool mIsWideID = false;
     mutable std::mutex mVehicleDataMutex;
     mutable std::mutex mVehiclePositionMutex;
     TSetOfVehicleData mVehicleData;
+    std::vector<int> mReservedCarIDs;
     SparseArray<std::string> mVehiclePosition;
     std::string mName = "Unknown Client";
     ip::tcp::socket mSocket;
@@ -129,6 +144,8 @@ private:
     std::string mDID;
     int mID = -1;
     std::chrono::time_point<std::chrono::high_resolution_clock> mLastPingTime;
+    TTrafficStats mTraffic;
+    TLuaHookChain mLuaHooks;
 };
 
 std::optional<std::weak_ptr<TClient>> GetClient(class TServer& Server, int ID);
@@ -36,7 +36,9 @@
 #include <filesystem>
 namespace fs = std::filesystem;
 
+#include "Metrics.h"
 #include "TConsole.h"
+#include "TScheduler.h"
 
 struct Version {
     uint8_t major;
@@ -82,6 +84,18 @@ public:
         std::string HTTPServerIP { "127.0.0.1" };
         bool HTTPServerUseSSL { false };
         bool HideUpdateMessages { false };
+        // Server.log rotation, 0 disables each
+        int LogMaxSizeMB { 100 };
+        int LogRotateHours { 24 };
+        int LogRetention { 10 };
+        // how long to wait for Lua handlers which can veto a client's action, 0 waits forever
+        int LuaHookTimeout { 5000 };
+        // memory each Lua state may use, 0 is unlimited
+        int LuaStateMemoryLimitMB { 1024 };
+        // most CPU time a single Lua call may use before it's aborted, 0 is unlimited,
+        // LuaEventBudgetsMs overrides it for handlers of specific events
+        int LuaCallBudgetMs { 10000 };
+        std::unordered_map<std::string, int> LuaEventBudgetsMs {};
         [[nodiscard]] bool HasCustomIP() const { return !CustomIP.empty(); }
     };
 
@@ -95,6 +109,8 @@ public:
     // Causes all threads to finish up and exit gracefull gracefully
     static void GracefullyShutdown();
     static TConsole& Console() { return mConsole; }
+    // shared timers and worker pool for the background subsystems
+    static TScheduler& Scheduler();
     static std::string ServerVersionString();
     static const Version& ServerVersion() { return mVersion; }
     static uint8_t ClientMajorVersion() { return 2; }
@@ -219,25 +235,25 @@ void RegisterThread(const std::string& str);
             Application::Console().Write(_this_location + std::string("[LUA WARN] ") + (x)); \
         } while (false)
     #define luaprint(x) Application::Console().Write(_this_location + std::string("[LUA] ") + (x))
-    #define beammp_debug(x)                                                                   \
-        do {                                                                                  \
-            if (Application::Settings.DebugModeEnabled) {                                     \
-                Application::Console().Write(_this_location + std::string("[DEBUG] ") + (x)); \
-            }                                                                                 \
+    #define beammp_debug(x)                                                                                              \
+        do {                                                                                                             \
+            if (Application::Settings.DebugModeEnabled) {                                                                \
+                Application::Console().Write(_this_location + std::string("[DEBUG] ") + (x), TLogQueue::Overflow::Drop); \
+            }                                                                                                            \
         } while (false)
-    #define beammp_event(x)                                                                   \
-        do {                                                                                  \
-            if (Application::Settings.DebugModeEnabled) {                                     \
-                Application::Console().Write(_this_location + std::string("[EVENT] ") + (x)); \
-            }                                                                                 \
+    #define beammp_event(x)                                                                                              \
+        do {                                                                                                             \
+            if (Application::Settings.DebugModeEnabled) {                                                                \
+                Application::Console().Write(_this_location + std::string("[EVENT] ") + (x), TLogQueue::Overflow::Drop); \
+            }                                                                                                            \
         } while (false)
     // trace() is a debug-build debug()
     #if defined(DEBUG)
-        #define beammp_trace(x)                                                                   \
-            do {                                                                                  \
-                if (Application::Settings.DebugModeEnabled) {                                     \
-                    Application::Console().Write(_this_location + std::string("[TRACE] ") + (x)); \
-                }                                                                                 \
+        #define beammp_trace(x)                                                                                              \
+            do {                                                                                                             \
+                if (Application::Settings.DebugModeEnabled) {                                                                \
+                    Application::Console().Write(_this_location + std::string("[TRACE] ") + (x), TLogQueue::Overflow::Drop); \
+                }                                                                                                            \
             } while (false)
     #else
         #define beammp_trace(x)
@@ -287,6 +303,7 @@ void LogChatMessage(const std::string& name, int id, const std::string& msg);
 
 template <typename T>
 inline T Comp(const T& Data) {
+    const auto Start = std::chrono::steady_clock::now();
     std::array<char, Biggest> C {};
     // obsolete
     C.fill(0);
@@ -307,11 +324,13 @@ inline T Comp(const T& Data) {
     Ret.resize(TotalOut);
     std::fill(Ret.begin(), Ret.end(), 0);
     std::copy_n(C.begin(), TotalOut, Ret.begin());
+    Metrics::CompressTime.Observe(std::chrono::steady_clock::now() - Start);
     return Ret;
 }
 
 template <typename T>
 inline T DeComp(const T& Compressed) {
+    const auto Start = std::chrono::steady_clock::now();
     std::array<char, Biggest> C {};
     // not needed
     C.fill(0);
@@ -332,6 +351,7 @@ inline T DeComp(const T& Compressed) {
     Ret.resize(TotalOut);
     std::fill(Ret.begin(), Ret.end(), 0);
     std::copy_n(C.begin(), TotalOut, Ret.begin());
+    Metrics::DecompressTime.Observe(std::chrono::steady_clock::now() - Start);
     return Ret;
 }
 
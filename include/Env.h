@@ -25,6 +25,8 @@ namespace Env {
 enum class Key {
     // provider settings
     PROVIDER_UPDATE_MESSAGE,
+    // testing
+    AUTH_MOCK,
 };
 
 std::optional<std::string> Get(Key key);
@@ -0,0 +1,173 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Counters and histograms for the /metrics endpoint (Prometheus text format).
+ *
+ * Every metric is split into a fixed number of cache line sized shards, and
+ * each thread only ever adds to its own shard with a relaxed atomic add. So
+ * recording never waits on another thread, and scraping just sums the shards
+ * without stopping anyone.
+ *
+ * Values which are cheaper to read on demand (queue lengths and such) are
+ * registered as gauges by the subsystem which owns them, and totals which it
+ * already keeps count of (drops, aborts) as counters.
+ */
+namespace Metrics {
+
+constexpr size_t ShardCount = 16;
+
+// the shard the calling thread writes to
+size_t ThisThreadShard();
+
+template <size_t N>
+class TShardedCounters {
+public:
+    void Add(size_t Index, uint64_t Value = 1) {
+        mShards[ThisThreadShard()].Values[Index].fetch_add(Value, std::memory_order_relaxed);
+    }
+    uint64_t Sum(size_t Index) const {
+        uint64_t Total = 0;
+        for (const auto& Shard : mShards) {
+            Total += Shard.Values[Index].load(std::memory_order_relaxed);
+        }
+        return Total;
+    }
+
+private:
+    struct alignas(64) TShard {
+        std::array<std::atomic_uint64_t, N> Values {};
+    };
+    std::array<TShard, ShardCount> mShards {};
+};
+
+class THistogram {
+public:
+    // upper bounds, in seconds
+    static constexpr std::array<double, 21> Buckets { 0.000001, 0.0000025, 0.000005, 0.00001, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+
+    struct TSnapshot {
+        std::array<uint64_t, Buckets.size() + 1> Counts {}; // not cumulative, last one is +Inf
+        uint64_t Count { 0 };
+        double Sum { 0 };
+
+        TSnapshot& operator+=(const TSnapshot& Other);
+        TSnapshot& operator-=(const TSnapshot& Other);
+        /// Estimated the way Prometheus' histogram_quantile does it, by
+        /// interpolating within the bucket the quantile falls into.
+        std::chrono::nanoseconds Quantile(double Q) const;
+    };
+
+    void Observe(std::chrono::nanoseconds Duration);
+    TSnapshot Snapshot() const;
+
+private:
+    static constexpr size_t CountIndex = Buckets.size() + 1;
+    static constexpr size_t SumIndex = Buckets.size() + 2;
+    // buckets, +Inf, count, sum in nanoseconds
+    TShardedCounters<Buckets.size() + 3> mValues;
+};
+
+// one histogram per label value, created on first use
+class THistogramFamily {
+public:
+    THistogram& WithLabel(const std::string& Value);
+    std::map<std::string, THistogram::TSnapshot> Snapshot() const;
+
+private:
+    mutable std::shared_mutex mMutex;
+    std::map<std::string, std::unique_ptr<THistogram>> mHistograms;
+};
+
+// counters per packet code; compressed packets which are sent without being
+// decompressed first are counted separately, under "compressed"
+class TPacketCounters {
+public:
+    static constexpr size_t CompressedIndex = 256;
+
+    void Add(const std::vector<uint8_t>& Packet, size_t Bytes);
+    void Add(char Code, size_t Bytes);
+    uint64_t Packets(size_t Index) const { return mPackets.Sum(Index); }
+    uint64_t Bytes(size_t Index) const { return mBytes.Sum(Index); }
+
+private:
+    TShardedCounters<257> mPackets;
+    TShardedCounters<257> mBytes;
+};
+
+struct TGaugeSample {
+    std::string Labels; // e.g. `state="MyPlugin"`, may be empty
+    double Value;
+};
+using TGaugeFunction = std::function<std::vector<TGaugeSample>()>;
+
+// unregisters the gauge when destroyed
+class TGaugeRegistration {
+public:
+    TGaugeRegistration() = default;
+    explicit TGaugeRegistration(size_t ID)
+        : mID(ID) { }
+    TGaugeRegistration(TGaugeRegistration&& Other) noexcept
+        : mID(std::exchange(Other.mID, 0)) { }
+    TGaugeRegistration& operator=(TGaugeRegistration&& Other) noexcept;
+    TGaugeRegistration(const TGaugeRegistration&) = delete;
+    TGaugeRegistration& operator=(const TGaugeRegistration&) = delete;
+    ~TGaugeRegistration() { Reset(); }
+
+    void Reset();
+
+private:
+    size_t mID { 0 };
+};
+
+/// Fn is called on every scrape, from the HTTP server's thread.
+[[nodiscard]] TGaugeRegistration RegisterGauge(const std::string& Name, const std::string& Help, TGaugeFunction Fn);
+/// Like RegisterGauge, for values which only ever go up. Name should end in _total.
+[[nodiscard]] TGaugeRegistration RegisterCounter(const std::string& Name, const std::string& Help, TGaugeFunction Fn);
+
+/// Renders all metrics in the Prometheus text exposition format.
+std::string Render();
+
+// escapes a label value for the text format
+std::string EscapeLabel(const std::string& Value);
+
+extern TPacketCounters PacketsReceived;
+extern TPacketCounters PacketsSent;
+extern THistogram CompressTime;
+extern THistogram DecompressTime;
+extern THistogram AuthRequestTime;
+extern THistogramFamily LuaEventHandlerTime;
+extern THistogramFamily LuaQueueWaitTime;
+extern THistogramFamily LuaHandlerTime; // by "state:function"
+extern THistogramFamily ProbeTime; // TScopedProbe and friends, by probe name
+
+}
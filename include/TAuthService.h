@@ -0,0 +1,120 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Resolves player keys to identities via the auth backend (/pkToUser).
+ *
+ * Requests are handed to a small pool of workers, each of which keeps one
+ * keep-alive HTTPS session to the backend open, so a join doesn't pay for a
+ * new TLS handshake. Concurrent requests for the same key share one backend
+ * call, and successful responses are cached for a while so that rejoining
+ * players (e.g. after a server restart) don't hit the backend at all.
+ *
+ * In builds with BEAMMP_ENABLE_AUTH_MOCK (the BeamMP-Server_ENABLE_AUTH_MOCK
+ * cmake option, for load testing only), setting BEAMMP_AUTH_MOCK replaces the
+ * backend with a local mock which derives a stable identity from the key. If
+ * its value is a number, the mock waits that many milliseconds per request to
+ * simulate backend latency. Release builds ignore the variable.
+ */
+class TAuthService final {
+public:
+    // gets the request body, returns the raw response body
+    using TBackend = std::function<std::string(const std::string& Body)>;
+
+    struct TStats {
+        size_t Requests { 0 };
+        size_t CacheHits { 0 };
+        size_t Coalesced { 0 };
+        size_t Failures { 0 };
+        size_t Rejected { 0 };
+        size_t Pending { 0 };
+        double P50Ms { 0 };
+        double P90Ms { 0 };
+        double P99Ms { 0 };
+    };
+
+    static constexpr size_t DefaultWorkerCount = 4;
+    static constexpr size_t MaxQueuedRequests = 256;
+    static constexpr size_t MaxCacheEntries = 4096;
+    static constexpr std::chrono::seconds DefaultCacheTTL { 300 };
+    // how long a connection thread waits for a response before giving up
+    static constexpr std::chrono::seconds ResponseTimeout { 15 };
+
+    // if Backend is empty, the real auth backend (or the mock) is used
+    explicit TAuthService(size_t WorkerCount = DefaultWorkerCount, std::chrono::seconds CacheTTL = DefaultCacheTTL, TBackend Backend = nullptr);
+    ~TAuthService();
+    TAuthService(const TAuthService&) = delete;
+    TAuthService& operator=(const TAuthService&) = delete;
+
+    /// Queues a lookup of Key, with Body being the json request to send.
+    /// The future throws if the request was rejected because the queue is full
+    /// or the backend could not be reached.
+    std::future<std::string> Authenticate(const std::string& Key, const std::string& Body);
+
+    TStats GetStats() const;
+
+    static std::string MockBackend(const std::string& Body);
+
+private:
+    struct TRequest {
+        std::string Key;
+        std::string Body;
+        std::chrono::steady_clock::time_point QueuedAt;
+    };
+    struct TCacheEntry {
+        std::string Response;
+        std::chrono::steady_clock::time_point Expiry;
+    };
+
+    void WorkerMain(size_t Index);
+    void Complete(const TRequest& Request, const std::string& Response, std::exception_ptr Error);
+    void RecordLatency(std::chrono::steady_clock::duration Latency);
+    static bool IsValidIdentity(const std::string& Response);
+
+    TBackend mBackend;
+    std::chrono::seconds mCacheTTL;
+
+    mutable std::mutex mMutex;
+    std::condition_variable mQueueCond;
+    std::queue<TRequest> mQueue;
+    // every key which is queued or being sent, with everyone waiting for it
+    std::unordered_map<std::string, std::vector<std::promise<std::string>>> mInFlight;
+    std::unordered_map<std::string, TCacheEntry> mCache;
+    bool mShutdown { false };
+
+    // ring of the most recent backend latencies, in ms
+    std::array<double, 1024> mLatencies {};
+    size_t mLatencyCount { 0 };
+    TStats mStats {};
+
+    std::vector<std::thread> mWorkers;
+};
@@ -43,6 +43,7 @@ private:
     void TryReadValue(toml::value& Table, const std::string& Category, const std::string_view& Key, const std::string_view& Env, std::string& OutValue);
     void TryReadValue(toml::value& Table, const std::string& Category, const std::string_view& Key, const std::string_view& Env, bool& OutValue);
     void TryReadValue(toml::value& Table, const std::string& Category, const std::string_view& Key, const std::string_view& Env, int& OutValue);
+    void TryReadValue(toml::value& Table, const std::string& Category, const std::string_view& Key, std::unordered_map<std::string, int>& OutValue);
 
     void ParseOldFormat();
     std::string TagsAsPrettyArray() const;
@@ -19,12 +19,17 @@
 #pragma once
 
 #include "Cryptography.h"
+#include "Metrics.h"
+#include "TLogFile.h"
+#include "TLogQueue.h"
 #include "commandline.h"
 #include <atomic>
 #include <fstream>
 #include <functional>
+#include <map>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <unordered_map>
 #include <vector>
@@ -34,30 +39,43 @@ class TLuaEngine;
 class TConsole {
 public:
     TConsole();
+    ~TConsole();
 
     // Initializes the commandline app to take over I/O
     void InitializeCommandline();
 
-    void Write(const std::string& str);
+    // both only queue the line, the logger thread writes it out shortly after
+    void Write(const std::string& str, TLogQueue::Overflow Policy = TLogQueue::Overflow::Block);
     void WriteRaw(const std::string& str);
+    // writes out everything queued so far
+    void Flush();
+    TLogQueue::TStats GetLogStats() const { return mLogQueue.GetStats(); }
     void InitializeLuaConsole(TLuaEngine& Engine);
-    void BackupOldLog();
     void StartLoggingToFile();
     Commandline& Internal() { return *mCommandline; }
 
 private:
+    void LoggerMain();
+    void WriteRecord(const TLogQueue::TRecord& Record);
+
     void RunAsCommand(const std::string& cmd, bool IgnoreNotACommand = false);
     void ChangeToLuaConsole(const std::string& LuaStateId);
     void ChangeToRegularConsole();
     void HandleLuaInternalCommand(const std::string& cmd);
 
     void Command_Lua(const std::string& cmd, const std::vector<std::string>& args);
+    // `lua profile <state id> <seconds> [file]`
+    void LuaProfile(const std::vector<std::string>& args);
     void Command_Help(const std::string& cmd, const std::vector<std::string>& args);
     void Command_Kick(const std::string& cmd, const std::vector<std::string>& args);
     void Command_List(const std::string& cmd, const std::vector<std::string>& args);
     void Command_Status(const std::string& cmd, const std::vector<std::string>& args);
     void Command_Settings(const std::string& cmd, const std::vector<std::string>& args);
     void Command_Clear(const std::string&, const std::vector<std::string>& args);
+    void Command_Capture(const std::string& cmd, const std::vector<std::string>& args);
+    void Command_Latency(const std::string& cmd, const std::vector<std::string>& args);
+    void Command_Trace(const std::string& cmd, const std::vector<std::string>& args);
+    void Command_Traffic(const std::string& cmd, const std::vector<std::string>& args);
 
     void Command_Say(const std::string& FullCommand);
     bool EnsureArgsCount(const std::vector<std::string>& args, size_t n);
@@ -74,6 +92,10 @@ private:
         { "status", [this](const auto& a, const auto& b) { Command_Status(a, b); } },
         { "settings", [this](const auto& a, const auto& b) { Command_Settings(a, b); } },
         { "clear", [this](const auto& a, const auto& b) { Command_Clear(a, b); } },
+        { "capture", [this](const auto& a, const auto& b) { Command_Capture(a, b); } },
+        { "latency", [this](const auto& a, const auto& b) { Command_Latency(a, b); } },
+        { "trace", [this](const auto& a, const auto& b) { Command_Trace(a, b); } },
+        { "traffic", [this](const auto& a, const auto& b) { Command_Traffic(a, b); } },
         { "say", [this](const auto&, const auto&) { Command_Say(""); } }, // shouldn't actually be called
     };
 
@@ -85,6 +107,19 @@ private:
     bool mFirstTime { true };
     std::string mStateId;
     const std::string mDefaultStateId = "BEAMMP_SERVER_CONSOLE";
-    std::ofstream mLogFileStream;
-    std::mutex mLogFileStreamMtx;
+    static constexpr int MaxProfileSeconds = 600;
+    static constexpr size_t ProfileTopCount = 20;
+    // probe histograms as of the last `latency reset`, subtracted from what's
+    // shown, since the histograms themselves only count up for /metrics
+    std::map<std::string, Metrics::THistogram::TSnapshot> mLatencyBaseline;
+    std::unique_ptr<TLogFile> mLogFile;
+    std::mutex mLogFileMutex;
+
+    TLogQueue mLogQueue;
+    // held while writing out records, and while the commandline is set up
+    std::mutex mLogWriteMutex;
+    std::vector<TLogQueue::TRecord> mLogBatch;
+    std::atomic_bool mLoggerRunning { false };
+    std::atomic_bool mLoggerShutdown { false };
+    std::thread mLogger;
 };
@@ -19,20 +19,29 @@
 #pragma once
 
 #include "Common.h"
-#include "IThreaded.h"
 #include "TResourceManager.h"
 #include "TServer.h"
 
-class THeartbeatThread : public IThreaded {
+// sends the heartbeat to the backend, checked once a second on Application::Scheduler(),
+// as a blocking task since it waits for the backend
+class THeartbeatThread {
 public:
     THeartbeatThread(TResourceManager& ResourceManager, TServer& Server);
-    //~THeartbeatThread();
-    void operator()() override;
+    ~THeartbeatThread();
 
 private:
+    void Beat();
     std::string GenerateCall();
     std::string GetPlayers();
+    std::string GetTraffic();
 
     TResourceManager& mResourceManager;
     TServer& mServer;
+    TScheduler::TTaskID mTask { 0 };
+
+    // these are "hot-change" related variables
+    std::string mLast;
+    std::chrono::high_resolution_clock::time_point mLastNormalUpdateTime { std::chrono::high_resolution_clock::now() };
+    bool mIsAuth { false };
+    size_t mUpdateReminderCounter { 0 };
 };
@@ -0,0 +1,96 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Server.log, rotated by size and age.
+ *
+ * A rotated segment is renamed to `Server.<date>_<time>.log` and gzip'ed to
+ * `.log.gz` on a background thread, after which the oldest segments beyond
+ * the retention limit are deleted, whether they could be compressed or not.
+ * The log from the previous run is rotated the same way when the file is
+ * opened.
+ *
+ * Open, Write and Rotate aren't thread safe, the caller serializes them
+ * (TConsole holds its mLogFileMutex around every Write).
+ */
+class TLogFile final {
+public:
+    struct TLimits {
+        // 0 disables either limit
+        uint64_t MaxBytes { 0 };
+        std::chrono::seconds MaxAge { 0 };
+        // rotated segments to keep, compressed or not, 0 keeps all
+        size_t Retention { 0 };
+    };
+
+    explicit TLogFile(std::filesystem::path Path);
+    ~TLogFile();
+    TLogFile(const TLogFile&) = delete;
+    TLogFile& operator=(const TLogFile&) = delete;
+
+    /// Rotates a leftover log from the previous run, and opens a fresh one.
+    void Open(const TLimits& Limits);
+    /// Writes a line, rotating first if a limit is reached.
+    void Write(const std::string& Line, const TLimits& Limits);
+    void Rotate(const TLimits& Limits);
+    /// Blocks until all queued compressions are done.
+    void WaitForCompression();
+
+    /// All compressed segments of Path, oldest first.
+    static std::vector<std::filesystem::path> CompressedSegments(const std::filesystem::path& Path);
+    /// All rotated segments of Path, compressed or not (e.g. because
+    /// compressing them failed), oldest first.
+    static std::vector<std::filesystem::path> RotatedSegments(const std::filesystem::path& Path);
+    /// Gzips From into To, removes From on success.
+    static bool Compress(const std::filesystem::path& From, const std::filesystem::path& To);
+
+private:
+    struct TJob {
+        std::filesystem::path Segment;
+        size_t Retention;
+    };
+
+    void CompressorMain();
+    std::filesystem::path NextSegmentPath() const;
+    static std::vector<std::filesystem::path> Segments(const std::filesystem::path& Path, const std::string& Suffix);
+
+    std::filesystem::path mPath;
+    std::ofstream mFile;
+    uint64_t mBytes { 0 };
+    std::chrono::steady_clock::time_point mOpened;
+
+    std::mutex mJobsMutex;
+    std::condition_variable mJobsCond;
+    std::deque<TJob> mJobs;
+    bool mBusy { false };
+    bool mShutdown { false };
+    std::thread mCompressor;
+};
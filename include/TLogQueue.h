@@ -0,0 +1,91 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * The queue between the threads which log and TConsole's logger thread.
+ *
+ * Every thread which logs gets its own single-producer single-consumer ring,
+ * so pushing a record never takes a lock or waits on another thread, unless
+ * the thread's ring is full. What happens then depends on the record's
+ * overflow policy: it's either dropped, or the thread waits for the logger
+ * to make space. Both are counted.
+ */
+class TLogQueue final {
+public:
+    enum class Overflow {
+        Block,
+        Drop,
+    };
+
+    struct TRecord {
+        std::chrono::system_clock::time_point Time;
+        std::string Message;
+        // written as-is, without a date
+        bool Raw { false };
+    };
+
+    struct TStats {
+        size_t Pushed { 0 };
+        size_t Dropped { 0 };
+        size_t Blocked { 0 };
+    };
+
+    static constexpr size_t RingCapacity = 512;
+
+    TLogQueue();
+    ~TLogQueue();
+    TLogQueue(const TLogQueue&) = delete;
+    TLogQueue& operator=(const TLogQueue&) = delete;
+
+    void Push(TRecord&& Record, Overflow Policy);
+    /// Moves all queued records into Out, ordered by time. Only one thread
+    /// may drain at a time.
+    void Drain(std::vector<TRecord>& Out);
+    TStats GetStats() const;
+
+private:
+    struct TRing {
+        std::array<TRecord, RingCapacity> Slots;
+        // next slot to read, only written by the draining thread
+        alignas(64) std::atomic_size_t Head { 0 };
+        // next slot to write, only written by the owning thread
+        alignas(64) std::atomic_size_t Tail { 0 };
+        // set when the owning thread exits, the ring is removed once drained
+        std::atomic_bool Orphaned { false };
+    };
+
+    TRing& ThisThreadRing();
+
+    const uint64_t mID;
+    mutable std::mutex mRingsMutex;
+    std::vector<std::shared_ptr<TRing>> mRings;
+    std::atomic_size_t mPushed { 0 };
+    std::atomic_size_t mDropped { 0 };
+    std::atomic_size_t mBlocked { 0 };
+};
@@ -0,0 +1,109 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * The lua_Alloc every Lua state is created with, one per state.
+ *
+ * Small blocks (most of what Lua allocates: strings, table nodes, closures)
+ * come from per-size free lists which are carved out of 64 KiB slabs, so
+ * they don't go through malloc. Slabs are only given back when the state
+ * is destroyed. Larger blocks go to malloc as before.
+ *
+ * It also enforces the state's memory limit, so a leaking plugin gets
+ * "not enough memory" errors instead of taking the server down with it,
+ * and keeps the stats shown in `status` and /metrics.
+ *
+ * Mostly the state's thread allocates, but not only: other threads read
+ * values out of the state (console completion, hook results), which can
+ * allocate too. So allocations are locked, which costs little as the lock
+ * is almost never contended, and the counters are atomics so that stats
+ * can be read without it.
+ */
+class TLuaAllocator final {
+public:
+    struct TStats {
+        size_t Used { 0 }; // bytes the state asked for and hasn't freed
+        size_t Peak { 0 }; // highest Used so far
+        size_t Reserved { 0 }; // bytes taken from the system, slabs and large blocks
+        size_t Limit { 0 }; // 0 if there is none
+        uint64_t Allocations { 0 }; // new blocks and resizes
+        uint64_t Refused { 0 }; // over the limit, or the system was out of memory
+
+        // share of Reserved not in use: free small blocks, rounding, unused slab space
+        double Fragmentation() const;
+    };
+
+    static constexpr size_t Granularity = 16; // Lua needs max_align_t alignment
+    static constexpr size_t MaxPooledSize = 256;
+    static constexpr size_t SlabSize = 64 * 1024;
+
+    /// Name is only used in the warning logged when Limit is reached.
+    explicit TLuaAllocator(std::string Name, size_t Limit = 0);
+    ~TLuaAllocator();
+    TLuaAllocator(const TLuaAllocator&) = delete;
+    TLuaAllocator& operator=(const TLuaAllocator&) = delete;
+
+    /// The lua_Alloc, UserData is the TLuaAllocator.
+    static void* Alloc(void* UserData, void* Ptr, size_t OldSize, size_t NewSize);
+
+    TStats GetStats() const;
+
+private:
+    struct TFreeBlock {
+        TFreeBlock* Next;
+    };
+
+    static constexpr size_t ClassCount = MaxPooledSize / Granularity;
+    static size_t ClassOf(size_t Size) { return (Size - 1) / Granularity; }
+
+    void* Allocate(size_t Size);
+    void Free(void* Ptr, size_t Size);
+    void* Reallocate(void* Ptr, size_t OldSize, size_t NewSize);
+    bool Admit(size_t Growth);
+    static void Add(std::atomic_size_t& Counter, size_t Value) {
+        Counter.store(Counter.load(std::memory_order_relaxed) + Value, std::memory_order_relaxed);
+    }
+    static void Subtract(std::atomic_size_t& Counter, size_t Value) {
+        Counter.store(Counter.load(std::memory_order_relaxed) - Value, std::memory_order_relaxed);
+    }
+
+    std::string mName;
+    std::mutex mMutex;
+    std::array<TFreeBlock*, ClassCount> mFreeLists {};
+    std::vector<void*> mSlabs;
+    char* mSlabCursor { nullptr };
+    char* mSlabEnd { nullptr };
+    bool mLimitWarned { false };
+
+    std::atomic_size_t mUsed { 0 };
+    std::atomic_size_t mPeak { 0 };
+    std::atomic_size_t mReserved { 0 };
+    const size_t mLimit;
+    std::atomic_uint64_t mAllocations { 0 };
+    std::atomic_uint64_t mRefused { 0 };
+};
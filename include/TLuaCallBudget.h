@@ -0,0 +1,83 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <unordered_map>
+
+struct lua_State;
+
+/*
+ * The CPU time budget of one Lua call (LuaCallBudgetMs, LuaEventBudgetsMs).
+ *
+ * It's measured with the thread's CPU clock, so time the call spends
+ * waiting (MP.Sleep, a blocking C function, being preempted) doesn't count
+ * against it, only time spent running.
+ *
+ * Every state has a count hook which calls Check() every CheckInterval
+ * instructions. Once the call running on that thread is past its deadline,
+ * Check() raises an error in it, which unwinds the call. The error is
+ * raised again at every check, so a script which catches it with pcall
+ * gets it again as soon as it carries on running.
+ *
+ * Only touched by the thread which runs the call.
+ */
+class TLuaCallBudget final {
+public:
+    // CPU time used by the calling thread
+    struct TThreadCPUClock {
+        using duration = std::chrono::nanoseconds;
+        using rep = duration::rep;
+        using period = duration::period;
+        using time_point = std::chrono::time_point<TThreadCPUClock>;
+        static constexpr bool is_steady = true;
+        static time_point now() noexcept;
+    };
+    using TClock = TThreadCPUClock;
+
+    static constexpr int CheckInterval = 10000;
+
+    /// Default, or the event's entry in Overrides. Zero is unlimited.
+    static std::chrono::milliseconds Resolve(const std::string& EventName, std::chrono::milliseconds Default, const std::unordered_map<std::string, int>& Overrides);
+
+    /// Starts the budget of a call on this thread. CallName and Plugin are
+    /// only used in the error, and have to outlive the call.
+    void Begin(std::chrono::milliseconds Budget, const std::string& CallName, const std::string& Plugin);
+    /// Ends it, after which Exceeded() tells whether the call was aborted.
+    void End();
+    bool Exceeded() const { return mExceeded; }
+    /// CPU time the last call used, from Begin to End.
+    TClock::duration Spent() const { return mSpent; }
+
+    /// For the count hook: aborts the call running on this thread if it's
+    /// over its budget.
+    static void Check(lua_State* L);
+
+private:
+    static thread_local TLuaCallBudget* sRunning;
+
+    TClock::time_point mStart {};
+    TClock::time_point mDeadline { TClock::time_point::max() };
+    TClock::duration mSpent { 0 };
+    std::chrono::milliseconds mBudget { 0 };
+    const std::string* mCallName { nullptr };
+    const std::string* mPlugin { nullptr };
+    bool mExceeded { false };
+};
@@ -18,12 +18,22 @@
 
 #pragma once
 
+#include "Metrics.h"
+#include "TLuaAllocator.h"
+#include "TLuaCallBudget.h"
+#include "TLuaProfiler.h"
+#include "TLuaSharedStore.h"
 #include "TNetwork.h"
+#include "TRingBuffer.h"
 #include "TServer.h"
+#include "Tracing.h"
 #include <any>
+#include <atomic>
 #include <condition_variable>
 #include <filesystem>
+#include <functional>
 #include <initializer_list>
+#include <limits>
 #include <list>
 #include <lua.hpp>
 #include <memory>
@@ -31,6 +41,7 @@
 #include <queue>
 #include <random>
 #include <set>
+#include <shared_mutex>
 #include <toml.hpp>
 #include <unordered_map>
 #include <vector>
@@ -53,8 +64,8 @@ static constexpr size_t TLuaArgTypes_StringStringMap = 4;
 class TLuaPlugin;
 
 struct TLuaResult {
-    bool Ready;
-    bool Error;
+    bool Ready { false };
+    bool Error { false };
     std::string ErrorMessage;
     sol::object Result { sol::lua_nil };
     TLuaStateId StateId;
@@ -65,14 +76,31 @@ struct TLuaResult {
     std::shared_ptr<std::condition_variable> ReadyCondition {
         std::make_shared<std::condition_variable>()
     };
+    // called by MarkAsReady, guarded by ReadyMutex
+    std::vector<std::function<void(const TLuaResult&)>> Continuations;
 
     void MarkAsReady();
     void WaitUntilReady();
+    bool IsReady();
+    /// Calls Fn once this is ready: right away if it already is, otherwise on
+    /// the thread which marks it as ready (usually a Lua state's), so Fn has
+    /// to be quick and must not wait for that state.
+    void OnReady(std::function<void(const TLuaResult&)> Fn);
 };
 
 struct TLuaPluginConfig {
     static inline const std::string FileName = "PluginConfig.toml";
+    static constexpr size_t MaxShards = 64;
     TLuaStateId StateId;
+    // how many states the plugin runs in ("Shards" in the config), each with
+    // its own thread. Events are routed to one of them by player ID, see
+    // TLuaEngine::ShardKey.
+    size_t Shards { 1 };
+
+    // shard 0 is StateId itself, so plugins which don't shard are unaffected
+    TLuaStateId ShardStateId(size_t Index) const {
+        return Index == 0 ? StateId : StateId + "#" + std::to_string(Index);
+    }
     // TODO: Add execute list
     // TODO: Build a better toml serializer, or some way to do this in an easier way
 };
@@ -93,15 +121,33 @@ public:
         Precise,
     };
 
+    // which of a sharded plugin's states a state is
+    struct TShard {
+        TLuaStateId Group; // the plugin's StateId, empty for a state which isn't sharded
+        size_t Index { 0 };
+        size_t Count { 1 };
+    };
+
+    // event names are interned to these once, so triggering an event doesn't
+    // have to hash or compare its name
+    using TEventID = uint32_t;
+    static constexpr TEventID NoEvent = std::numeric_limits<TEventID>::max();
+    static constexpr size_t NoHandler = std::numeric_limits<size_t>::max();
+
     struct QueuedFunction {
         std::string FunctionName;
         std::shared_ptr<TLuaResult> Result;
         std::vector<TLuaArgTypes> Args;
         std::string EventName; // optional, may be empty
+        TEventID HandledEvent { NoEvent }; // event this is a handler for, for metrics only
+        uint64_t FlowID { 0 }; // trace flow of the packet which caused this call, see Tracing.h
+        size_t Handler { NoHandler }; // slot in the state's handler cache
+        std::chrono::steady_clock::time_point Enqueued {};
     };
 
     TLuaEngine();
     virtual ~TLuaEngine() noexcept {
+        CancelAllEventTimers();
         beammp_debug("Lua Engine terminated");
     }
 
@@ -114,8 +160,7 @@ public:
     void SetServer(TServer* Server) { mServer = Server; }
 
     size_t GetResultsToCheckSize() {
-        std::unique_lock Lock(mResultsToCheckMutex);
-        return mResultsToCheck.size();
+        return mResultsToCheckCount.load(std::memory_order_relaxed);
     }
 
     size_t GetLuaStateCount() {
@@ -129,29 +174,51 @@ public:
         }
         return names;
     }
+    // function calls waiting to run, per state
+    std::vector<std::pair<TLuaStateId, size_t>> GetFunctionQueueSizes();
+    std::vector<std::pair<TLuaStateId, TLuaAllocator::TStats>> GetMemoryStats();
+    // calls aborted for running over LuaCallBudgetMs / LuaEventBudgetsMs
+    uint64_t GetBudgetAborts(TLuaStateId StateId);
+    std::vector<std::pair<TLuaStateId, uint64_t>> GetBudgetAborts();
+    // starts sampling the state's Lua stacks, nullptr if there is no such
+    // state or it's already being profiled
+    std::shared_ptr<TLuaProfiler> StartProfile(TLuaStateId StateId);
+    void StopProfile(TLuaStateId StateId);
     size_t GetTimedEventsCount() {
         std::unique_lock Lock(mTimedEventsMutex);
         return mTimedEvents.size();
     }
     size_t GetRegisteredEventHandlerCount() {
-        std::unique_lock Lock(mLuaEventsMutex);
+        std::shared_lock Lock(mLuaEventsMutex);
         size_t LuaEventsCount = 0;
-        for (const auto& State : mLuaEvents) {
-            for (const auto& Events : State.second) {
-                LuaEventsCount += Events.second.size();
-            }
+        for (const auto& Handlers : mLuaEvents) {
+            LuaEventsCount += Handlers.size();
         }
         return LuaEventsCount - GetLuaStateCount();
     }
 
+    // waits until all results are ready, or until Max has passed since the call
     static void WaitForAll(std::vector<std::shared_ptr<TLuaResult>>& Results,
         const std::optional<std::chrono::high_resolution_clock::duration>& Max = std::nullopt);
+    // logs the errors of results nobody waits for, from the state thread
+    // which finishes them
     void ReportErrors(const std::vector<std::shared_ptr<TLuaResult>>& Results);
     bool HasState(TLuaStateId StateId);
     [[nodiscard]] std::shared_ptr<TLuaResult> EnqueueScript(TLuaStateId StateID, const TLuaChunk& Script);
-    [[nodiscard]] std::shared_ptr<TLuaResult> EnqueueFunctionCall(TLuaStateId StateID, const std::string& FunctionName, const std::vector<TLuaArgTypes>& Args);
-    void EnsureStateExists(TLuaStateId StateId, const std::string& Name, bool DontCallOnInit = false);
+    // EventName is only used for metrics, empty if the function isn't called as an event handler
+    [[nodiscard]] std::shared_ptr<TLuaResult> EnqueueFunctionCall(TLuaStateId StateID, const std::string& FunctionName, const std::vector<TLuaArgTypes>& Args, const std::string& EventName = "");
+    void EnsureStateExists(TLuaStateId StateId, const std::string& Name, bool DontCallOnInit = false, const TShard& Shard = {});
     void RegisterEvent(const std::string& EventName, TLuaStateId StateId, const std::string& FunctionName);
+    /// ID of EventName, which stays the same for the lifetime of the process,
+    /// so hot call sites can keep it in a static.
+    static TEventID InternEvent(const std::string& EventName);
+    /// NoEvent if the name was never interned (so nothing can handle it).
+    static TEventID FindEvent(const std::string& EventName);
+    static const std::string& EventNameOf(TEventID Event);
+    /// What events are routed by to a sharded plugin's states: the first
+    /// argument, if it's a non-negative integer (the player ID, for all events
+    /// about a player). Events without one go to every shard.
+    static std::optional<size_t> ShardKey(const std::vector<TLuaArgTypes>& Args);
     /**
      *
      * @tparam ArgsT Template Arguments for the event (Metadata) todo: figure out what this means
@@ -162,36 +229,48 @@ public:
      */
     template <typename... ArgsT>
     [[nodiscard]] std::vector<std::shared_ptr<TLuaResult>> TriggerEvent(const std::string& EventName, TLuaStateId IgnoreId, ArgsT&&... Args) {
-        std::unique_lock Lock(mLuaEventsMutex);
-        beammp_event(EventName);
-        if (mLuaEvents.find(EventName) == mLuaEvents.end()) { // if no event handler is defined for 'EventName', return immediately
+        const auto Event = FindEvent(EventName);
+        if (Event == NoEvent) { // if no event handler was ever defined for 'EventName', return immediately
+            beammp_event(EventName);
+            return {};
+        }
+        return TriggerEvent(Event, IgnoreId, std::forward<ArgsT>(Args)...);
+    }
+    template <typename... ArgsT>
+    [[nodiscard]] std::vector<std::shared_ptr<TLuaResult>> TriggerEvent(TEventID Event, TLuaStateId IgnoreId, ArgsT&&... Args) {
+        Tracing::TSpan Span("TriggerEvent", EventNameOf(Event));
+        std::shared_lock Lock(mLuaEventsMutex);
+        beammp_event(EventNameOf(Event));
+        if (Event >= mLuaEvents.size() || mLuaEvents[Event].empty()) { // if no event handler is defined for 'Event', return immediately
             return {};
         }
 
         std::vector<std::shared_ptr<TLuaResult>> Results;
         std::vector<TLuaArgTypes> Arguments { TLuaArgTypes { std::forward<ArgsT>(Args) }... };
+        const auto Key = ShardKey(Arguments);
 
-        for (const auto& Event : mLuaEvents.at(EventName)) {
-            for (const auto& Function : Event.second) {
-                if (Event.first != IgnoreId) {
-                    Results.push_back(EnqueueFunctionCall(Event.first, Function, Arguments));
-                }
+        for (const auto& Handler : mLuaEvents[Event]) {
+            if (Handler.StateId != IgnoreId && Handler.Handles(Key)) {
+                Results.push_back(Handler.State->EnqueueHandlerCall(Handler.FunctionName, Handler.Handler, Arguments, Event));
             }
         }
         return Results; //
     }
     template <typename... ArgsT>
     [[nodiscard]] std::vector<std::shared_ptr<TLuaResult>> TriggerLocalEvent(const TLuaStateId& StateId, const std::string& EventName, ArgsT&&... Args) {
-        std::unique_lock Lock(mLuaEventsMutex);
+        Tracing::TSpan Span("TriggerLocalEvent", EventName);
         beammp_event(EventName + " in '" + StateId + "'");
-        if (mLuaEvents.find(EventName) == mLuaEvents.end()) { // if no event handler is defined for 'EventName', return immediately
+        const auto Event = FindEvent(EventName);
+        std::shared_lock Lock(mLuaEventsMutex);
+        if (Event >= mLuaEvents.size()) { // if no event handler is defined for 'EventName', return immediately
             return {};
         }
         std::vector<std::shared_ptr<TLuaResult>> Results;
         std::vector<TLuaArgTypes> Arguments { TLuaArgTypes { std::forward<ArgsT>(Args) }... };
-        const auto Handlers = GetEventHandlersForState(EventName, StateId);
-        for (const auto& Handler : Handlers) {
-            Results.push_back(EnqueueFunctionCall(StateId, Handler, Arguments));
+        for (const auto& Handler : mLuaEvents[Event]) {
+            if (Handler.StateId == StateId) {
+                Results.push_back(Handler.State->EnqueueHandlerCall(Handler.FunctionName, Handler.Handler, Arguments, Event));
+            }
         }
         return Results;
     }
@@ -200,6 +279,8 @@ public:
     void CancelEventTimers(const std::string& EventName, TLuaStateId StateId);
     sol::state_view GetStateForPlugin(const fs::path& PluginPath);
     TLuaStateId GetStateIDForPlugin(const fs::path& PluginPath);
+    // all of the plugin's states, one per shard
+    std::vector<TLuaStateId> GetStateIDsForPlugin(const fs::path& PluginPath);
     void AddResultToCheck(const std::shared_ptr<TLuaResult>& Result);
 
     static constexpr const char* BeamMPFnNotFoundError = "BEAMMP_FN_NOT_FOUND";
@@ -211,7 +292,6 @@ public:
     std::unordered_map<std::string /*event name */, std::vector<std::string> /* handlers */> Debug_GetEventsForState(TLuaStateId StateId);
     std::queue<std::pair<TLuaChunk, std::shared_ptr<TLuaResult>>> Debug_GetStateExecuteQueueForState(TLuaStateId StateId);
     std::vector<QueuedFunction> Debug_GetStateFunctionQueueForState(TLuaStateId StateId);
-    std::vector<TLuaResult> Debug_GetResultsToCheckForState(TLuaStateId StateId);
 
 private:
     void CollectAndInitPlugins();
@@ -221,16 +301,32 @@ private:
 
     class StateThreadData : IThreaded {
     public:
-        StateThreadData(const std::string& Name, TLuaStateId StateId, TLuaEngine& Engine);
+        StateThreadData(const std::string& Name, TLuaStateId StateId, TLuaEngine& Engine, const TShard& Shard, std::shared_ptr<TLuaSharedStore> SharedStore);
         StateThreadData(const StateThreadData&) = delete;
-        virtual ~StateThreadData() noexcept { beammp_debug("\"" + mStateId + "\" destroyed"); }
+        virtual ~StateThreadData() noexcept {
+            // before mAllocator goes, the thread may still be using the state
+            if (mThread.joinable()) {
+                mThread.join();
+            }
+            beammp_debug("\"" + mStateId + "\" destroyed");
+        }
         [[nodiscard]] std::shared_ptr<TLuaResult> EnqueueScript(const TLuaChunk& Script);
-        [[nodiscard]] std::shared_ptr<TLuaResult> EnqueueFunctionCall(const std::string& FunctionName, const std::vector<TLuaArgTypes>& Args);
+        [[nodiscard]] std::shared_ptr<TLuaResult> EnqueueFunctionCall(const std::string& FunctionName, const std::vector<TLuaArgTypes>& Args, const std::string& EventName = "");
         [[nodiscard]] std::shared_ptr<TLuaResult> EnqueueFunctionCallFromCustomEvent(const std::string& FunctionName, const std::vector<TLuaArgTypes>& Args, const std::string& EventName, CallStrategy Strategy);
+        // Handler is the function's slot from HandlerIndex()
+        [[nodiscard]] std::shared_ptr<TLuaResult> EnqueueHandlerCall(const std::string& FunctionName, size_t Handler, const std::vector<TLuaArgTypes>& Args, TEventID Event);
+        // the handler cache slot of a function, assigned on first use
+        size_t HandlerIndex(const std::string& FunctionName);
         void RegisterEvent(const std::string& EventName, const std::string& FunctionName);
         void AddPath(const fs::path& Path); // to be added to path and cpath
         void operator()() override;
         sol::state_view State() { return sol::state_view(mState); }
+        const TShard& Shard() const { return mShard; }
+        TLuaAllocator::TStats MemoryStats() const { return mAllocator.GetStats(); }
+        // calls aborted for going over their time budget
+        uint64_t BudgetAborts() const { return mBudgetAborts.load(std::memory_order_relaxed); }
+        bool StartProfile(std::shared_ptr<TLuaProfiler> Profiler);
+        void StopProfile();
 
         std::vector<std::string> GetStateGlobalKeys();
         std::vector<std::string> GetStateTableKeys(const std::vector<std::string>& keys);
@@ -238,12 +334,14 @@ private:
         // Debug functions, slow
         std::queue<std::pair<TLuaChunk, std::shared_ptr<TLuaResult>>> Debug_GetStateExecuteQueue();
         std::vector<TLuaEngine::QueuedFunction> Debug_GetStateFunctionQueue();
+        size_t FunctionQueueSize();
 
     private:
         sol::table Lua_TriggerGlobalEvent(const std::string& EventName, sol::variadic_args EventArgs);
         sol::table Lua_TriggerLocalEvent(const std::string& EventName, sol::variadic_args EventArgs);
         sol::table Lua_GetPlayerIdentifiers(int ID);
         sol::table Lua_GetPlayers();
+        sol::table Lua_GetStats();
         std::string Lua_GetPlayerName(int ID);
         sol::table Lua_GetPlayerVehicles(int ID);
         std::pair<sol::table, std::string> Lua_GetPositionRaw(int PID, int VID);
@@ -253,46 +351,120 @@ private:
         sol::table Lua_FS_ListFiles(const std::string& Path);
         sol::table Lua_FS_ListDirectories(const std::string& Path);
 
+        // the function for a handler slot, looked up by name only the first
+        // time and after a script ran or an event was registered on this state
+        // (e.g. a hot reload), which may have replaced it. State thread only.
+        sol::protected_function CachedHandler(size_t Handler, const std::string& FunctionName);
+        Metrics::THistogram& EventHandlerTime(TEventID Event);
+        Metrics::THistogram& HandlerTime(size_t Handler, const std::string& FunctionName);
+        // LuaCallBudgetMs, or the event's entry in LuaEventBudgetsMs. Zero is unlimited.
+        std::chrono::milliseconds BudgetFor(TEventID Event);
+        // runs every TLuaCallBudget::CheckInterval instructions, takes the
+        // profiler's samples and aborts the running call once it's past its budget
+        static void CountHook(lua_State* L, lua_Debug* Debug);
+        void Sample(lua_State* L);
+        void RunScript(const TLuaChunk& Script, TLuaResult& Result);
+        void CallFunction(QueuedFunction& Call);
+
+        struct TCachedHandler {
+            sol::protected_function Fn;
+            uint64_t Generation { 0 };
+        };
+
         std::string mName;
         TLuaStateId mStateId;
+        TShard mShard;
+        std::shared_ptr<TLuaSharedStore> mSharedStore; // MP.Shared, one per plugin
+        TLuaAllocator mAllocator; // has to outlive mState
         lua_State* mState;
         std::thread mThread;
+        // most calls the state thread takes off the queue per lock, scripts
+        // are always taken all at once
+        static constexpr size_t FunctionBatchSize = 64;
+        // both queues are guarded by mStateQueueMutex, and mStateQueueCond is
+        // notified whenever either of them gets something
         std::queue<std::pair<TLuaChunk, std::shared_ptr<TLuaResult>>> mStateExecuteQueue;
-        std::recursive_mutex mStateExecuteQueueMutex;
-        std::vector<QueuedFunction> mStateFunctionQueue;
-        std::mutex mStateFunctionQueueMutex;
-        std::condition_variable mStateFunctionQueueCond;
+        TRingBuffer<QueuedFunction> mStateFunctionQueue { 256 };
+        std::mutex mStateQueueMutex;
+        std::condition_variable mStateQueueCond;
         TLuaEngine* mEngine;
         sol::state_view mStateView { mState };
         std::queue<fs::path> mPaths;
         std::recursive_mutex mPathsMutex;
         std::mt19937 mMersenneTwister;
         std::uniform_real_distribution<double> mUniformRealDistribution01;
+        std::unordered_map<std::string, size_t> mHandlerIndices;
+        std::mutex mHandlerIndicesMutex;
+        // only touched by the state's thread
+        std::vector<TCachedHandler> mHandlerCache;
+        std::atomic_uint64_t mHandlerGeneration { 1 };
+        std::vector<Metrics::THistogram*> mEventHandlerTimes; // by event
+        std::vector<Metrics::THistogram*> mHandlerTimes; // by handler slot
+        Metrics::THistogram* mQueueWaitTime;
+
+        // the state this thread runs, for CountHook
+        static thread_local StateThreadData* sThreadState;
+        TLuaCallBudget mCallBudget; // of the running call
+        std::vector<std::optional<std::chrono::milliseconds>> mEventBudgets; // by event
+        std::atomic_uint64_t mBudgetAborts { 0 };
+
+        static constexpr int MaxProfileDepth = 64;
+        std::atomic_bool mProfiling { false };
+        std::mutex mProfilerMutex;
+        std::shared_ptr<TLuaProfiler> mProfiler; // guarded by mProfilerMutex
+        std::vector<std::string> mSampleStack; // only touched by the state's thread
+    };
+
+    struct TEventHandler {
+        StateThreadData* State;
+        TLuaStateId StateId;
+        std::string FunctionName;
+        size_t Handler; // slot in the state's handler cache
+        size_t Shard { 0 };
+        size_t ShardCount { 1 };
+
+        // whether an event with this ShardKey goes to this handler's state
+        bool Handles(const std::optional<size_t>& Key) const {
+            return ShardCount == 1 || !Key || *Key % ShardCount == Shard;
+        }
     };
 
+    // runs on the application's scheduler, each fire re-arms it
     struct TimedEvent {
-        std::chrono::high_resolution_clock::duration Duration {};
-        std::chrono::high_resolution_clock::time_point LastCompletion {};
+        std::chrono::steady_clock::duration Duration {};
+        std::chrono::steady_clock::time_point Due {}; // only touched when it fires
         std::string EventName;
         TLuaStateId StateId;
+        StateThreadData* State { nullptr }; // states live as long as the engine
         CallStrategy Strategy;
-        bool Expired();
-        void Reset();
+        std::atomic<TScheduler::TTaskID> Task { 0 };
+        bool Cancelled { false }; // guarded by mTimedEventsMutex
     };
 
+    // a BestEffort timer whose last call is still queued is retried this often
+    // (or at its interval, if that's shorter) until the call can be queued
+    static constexpr auto BestEffortRetry = std::chrono::milliseconds(10);
+
+    void FireEventTimer(const std::shared_ptr<TimedEvent>& Timer);
+    void ArmEventTimer(const std::shared_ptr<TimedEvent>& Timer, std::chrono::steady_clock::time_point At);
+    void CancelAllEventTimers();
+
     TNetwork* mNetwork;
     TServer* mServer;
     const fs::path mResourceServerPath;
     std::vector<std::shared_ptr<TLuaPlugin>> mLuaPlugins;
     std::unordered_map<TLuaStateId, std::unique_ptr<StateThreadData>> mLuaStates;
     std::recursive_mutex mLuaStatesMutex;
-    std::unordered_map<std::string /* event name */, std::unordered_map<TLuaStateId, std::set<std::string>>> mLuaEvents;
-    std::recursive_mutex mLuaEventsMutex;
-    std::vector<TimedEvent> mTimedEvents;
-    std::recursive_mutex mTimedEventsMutex;
-    std::list<std::shared_ptr<TLuaResult>> mResultsToCheck;
-    std::mutex mResultsToCheckMutex;
-    std::condition_variable mResultsToCheckCond;
+    // by shard group (the plugin's StateId), guarded by mLuaStatesMutex
+    std::unordered_map<TLuaStateId, std::shared_ptr<TLuaSharedStore>> mSharedStores;
+    // by event, each state's handlers are next to each other, sorted by function name
+    std::vector<std::vector<TEventHandler>> mLuaEvents;
+    std::shared_mutex mLuaEventsMutex;
+    std::vector<std::shared_ptr<TimedEvent>> mTimedEvents;
+    std::mutex mTimedEventsMutex;
+    // results passed to ReportErrors which haven't finished yet
+    std::atomic_size_t mResultsToCheckCount { 0 };
+    std::vector<Metrics::TGaugeRegistration> mMetricsGauges;
 };
 
 // std::any TriggerLuaEvent(const std::string& Event, bool local, TLuaPlugin* Caller, std::shared_ptr<TLuaArg> arg, bool Wait);
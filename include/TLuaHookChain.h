@@ -0,0 +1,79 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct TLuaResult;
+
+/*
+ * Applies the outcome of Lua hooks which can veto something a client did
+ * (onVehicleSpawn, onChatMessage, ...) once their handlers are done, without
+ * blocking the thread which triggered them.
+ *
+ * Hooks queued on the same chain are applied in the order they were queued,
+ * even if their handlers finish out of order, so e.g. an edit is never
+ * applied before the spawn of the vehicle it edits. Every client has one.
+ *
+ * A hook whose handlers don't all finish in time is applied as timed out, and
+ * its callers should then deny whatever it could have vetoed: the handler
+ * still running may have been about to cancel it.
+ */
+class TLuaHookChain final {
+public:
+    using TResults = std::vector<std::shared_ptr<TLuaResult>>;
+    // gets the results which were ready in time, TimedOut if any weren't
+    using TApply = std::function<void(const TResults& Results, bool TimedOut)>;
+    using TExecutor = std::function<void(std::function<void()>)>;
+
+    TLuaHookChain();
+    ~TLuaHookChain();
+    TLuaHookChain(const TLuaHookChain&) = delete;
+    TLuaHookChain& operator=(const TLuaHookChain&) = delete;
+
+    /// Completed hooks are handed to Executor in order, with the chain locked,
+    /// so it should only queue them somewhere which runs them in that order.
+    /// Without one they're applied right there, on the thread which completed
+    /// them.
+    void SetExecutor(TExecutor Executor);
+    /// Applies once all of Results are ready or Timeout has passed, whichever
+    /// is first. A zero Timeout waits for as long as the handlers take.
+    void Queue(const std::string& Hook, TResults Results, std::chrono::milliseconds Timeout, TApply Apply);
+    /// Queues Apply behind the hooks which are still pending, or applies it
+    /// right away if there are none.
+    void Then(TApply Apply);
+    /// Hooks which haven't been applied yet, including those already handed
+    /// to the executor.
+    size_t Pending() const;
+
+    /// The LuaHookTimeout setting.
+    static std::chrono::milliseconds ConfiguredTimeout();
+
+private:
+    struct TEntry;
+    struct TState;
+    static void Complete(const std::shared_ptr<TState>& State, const std::shared_ptr<TEntry>& Entry);
+
+    std::shared_ptr<TState> mState;
+};
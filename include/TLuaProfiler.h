@@ -0,0 +1,78 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Collects the stack samples of `lua profile`, for one state.
+ *
+ * The state's count hook asks Due() whenever it runs while the state is
+ * being profiled, and if a sample is due, walks the Lua stack and hands it
+ * to AddSample(). So samples are taken at most once per Interval, only
+ * while Lua code runs on the state's thread. The hook only runs every so
+ * many instructions, so a function's samples tell its share of the sampled
+ * Lua time, not how long it ran for.
+ *
+ * Only the running coroutine's stack is walked, so samples taken in a
+ * coroutine lack the functions which resumed it.
+ *
+ * Not locked: the state's thread fills it in, and it's only read once the
+ * state stopped sampling into it.
+ */
+class TLuaProfiler final {
+public:
+    using TClock = std::chrono::steady_clock;
+
+    struct TFunction {
+        std::string Name;
+        uint64_t Self { 0 }; // samples in which it was running
+        uint64_t Total { 0 }; // samples in which it was on the stack
+    };
+
+    static constexpr TClock::duration DefaultInterval = std::chrono::milliseconds(1);
+
+    explicit TLuaProfiler(TClock::duration Interval = DefaultInterval);
+
+    /// Whether a sample should be taken at Now, and if so, when the next one is.
+    bool Due(TClock::time_point Now);
+    /// Stack is ordered from the outermost to the innermost (running) frame.
+    void AddSample(const std::vector<std::string>& Stack);
+
+    uint64_t SampleCount() const { return mSamples; }
+    TClock::duration Interval() const { return mInterval; }
+    /// One "outer;inner;running count" line per distinct stack, as read by
+    /// flamegraph.pl, inferno and speedscope.
+    void WriteCollapsed(std::ostream& Out) const;
+    /// The Count functions with the most self time, ties broken by total time.
+    std::vector<TFunction> Top(size_t Count) const;
+
+private:
+    const TClock::duration mInterval;
+    TClock::time_point mNextSample {};
+    uint64_t mSamples { 0 };
+    std::map<std::string, uint64_t> mStacks; // collapsed stack -> samples
+    std::unordered_map<std::string, TFunction> mFunctions;
+};
@@ -0,0 +1,69 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <variant>
+
+/*
+ * Key-value store which all states of a sharded plugin share (MP.Shared in
+ * Lua), since the states themselves can't see each other's globals. Values
+ * are copied in and out, so only plain values fit: nil, booleans, numbers
+ * and strings. Tables have to be encoded, e.g. with Util.JsonEncode.
+ *
+ * Keys are spread over a few buckets with a lock each, so states working on
+ * different keys rarely wait for each other.
+ */
+class TLuaSharedStore final {
+public:
+    using TValue = std::variant<std::monostate, bool, int64_t, double, std::string>;
+
+    TLuaSharedStore() = default;
+    TLuaSharedStore(const TLuaSharedStore&) = delete;
+    TLuaSharedStore& operator=(const TLuaSharedStore&) = delete;
+
+    /// monostate (nil) if Key isn't set.
+    TValue Get(const std::string& Key) const;
+    /// Setting monostate (nil) removes Key.
+    void Set(const std::string& Key, TValue Value);
+    /// Adds By to the integer at Key, a missing key counts as 0. Returns the
+    /// new value, or nullopt (and changes nothing) if Key holds something else.
+    std::optional<int64_t> Increment(const std::string& Key, int64_t By);
+    /// Sets Key to Desired only if it currently holds Expected.
+    bool CompareAndSet(const std::string& Key, const TValue& Expected, TValue Desired);
+    size_t Size() const;
+
+private:
+    static constexpr size_t BucketCount = 16;
+
+    struct alignas(64) TBucket {
+        mutable std::shared_mutex Mutex;
+        std::unordered_map<std::string, TValue> Values;
+    };
+
+    TBucket& BucketFor(const std::string& Key);
+    const TBucket& BucketFor(const std::string& Key) const;
+
+    std::array<TBucket, BucketCount> mBuckets;
+};
@@ -20,30 +20,92 @@
 
 #include "BoostAliases.h"
 #include "Compat.h"
+#include "Metrics.h"
+#include "TAuthService.h"
+#include "TPacketDispatcher.h"
 #include "TResourceManager.h"
 #include "TServer.h"
+#include "TTrafficCapture.h"
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/udp.hpp>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+struct TLuaResult;
 
 struct TConnection;
 
+// per-IP limit on how often new connections are accepted
+struct TAcceptTokenBucket {
+    static constexpr double Burst = 10.0;
+    static constexpr double RefillPerSecond = 2.0;
+
+    double Tokens { Burst };
+    std::chrono::steady_clock::time_point LastRefill { std::chrono::steady_clock::now() };
+
+    // refills the bucket up to Now, then takes a token if there is one
+    bool TryTake(std::chrono::steady_clock::time_point Now);
+};
+
+// a TAcceptTokenBucket per IP. Loopback addresses (local tools like the load
+// generator, tests) are never limited.
+class TAcceptLimiter {
+public:
+    bool TryAdmit(const ip::address& Address, std::chrono::steady_clock::time_point Now = std::chrono::steady_clock::now());
+    static bool IsExempt(const ip::address& Address);
+
+private:
+    std::mutex mMutex;
+    std::unordered_map<std::string, TAcceptTokenBucket> mBuckets;
+};
+
 class TNetwork {
 public:
+    // connections which were rejected or dropped before finishing their handshake
+    struct TAdmissionStats {
+        size_t RateLimited { 0 };
+        size_t TooManyHandshakes { 0 };
+        size_t TimedOut { 0 };
+        size_t HandshakesInProgress { 0 };
+    };
+
+    // deadlines for each phase of a connection's handshake
+    static constexpr std::chrono::seconds CodeTimeout { 5 };
+    static constexpr std::chrono::seconds VersionTimeout { 10 };
+    static constexpr std::chrono::seconds KeyTimeout { 10 };
+    static constexpr std::chrono::seconds PasswordTimeout { 60 };
+    static constexpr std::chrono::seconds ResourceSyncTimeout { 120 }; // per message, mod downloads happen in between
+    static constexpr size_t MaxConcurrentHandshakes = 64;
+
     TNetwork(TServer& Server, TPPSMonitor& PPSMonitor, TResourceManager& ResourceManager);
 
     [[nodiscard]] bool TCPSend(TClient& c, const std::vector<uint8_t>& Data, bool IsSync = false);
     [[nodiscard]] bool SendLarge(TClient& c, std::vector<uint8_t> Data, bool isSync = false);
     [[nodiscard]] bool Respond(TClient& c, const std::vector<uint8_t>& MSG, bool Rel, bool isSync = false);
     std::shared_ptr<TClient> CreateClient(ip::tcp::socket&& TCPSock);
-    std::vector<uint8_t> TCPRcv(TClient& c);
+    std::vector<uint8_t> TCPRcv(TClient& c, std::optional<std::chrono::milliseconds> Timeout = std::nullopt);
     void ClientKick(TClient& c, const std::string& R);
     [[nodiscard]] bool SyncClient(const std::weak_ptr<TClient>& c);
     void Identify(TConnection&& client);
-    std::shared_ptr<TClient> Authentication(TConnection&& ClientConnection);
+    // OnHandshakeDone is called once the client is authenticated, before it's handed to TCPClient
+    std::shared_ptr<TClient> Authentication(TConnection&& ClientConnection, const std::function<void()>& OnHandshakeDone = nullptr);
+    /// The kick reason if the onPlayerAuth results deny the player, which
+    /// includes handlers that didn't finish in time.
+    static std::optional<std::string> AuthDenial(const std::vector<std::shared_ptr<TLuaResult>>& Results);
     void SyncResources(TClient& c);
     [[nodiscard]] bool UDPSend(TClient& Client, std::vector<uint8_t> Data);
     void SendToAll(TClient* c, const std::vector<uint8_t>& Data, bool Self, bool Rel);
     void UpdatePlayer(TClient& Client);
+    [[nodiscard]] const TAuthService& AuthService() const { return mAuthService; }
+    [[nodiscard]] TAdmissionStats GetAdmissionStats() const;
+    [[nodiscard]] const TPacketDispatcher& Dispatcher() const { return mDispatcher; }
+    /// Starts recording all client traffic to Path, including joins of the clients already connected.
+    bool StartCapture(const std::string& Path);
+    void StopCapture() { mCapture.Stop(); }
+    [[nodiscard]] TTrafficCapture::TStats GetCaptureStats() const { return mCapture.GetStats(); }
 
 private:
     void UDPServerMain();
@@ -53,15 +115,35 @@ private:
     TPPSMonitor& mPPSMonitor;
     ip::udp::socket mUDPSock;
     TResourceManager& mResourceManager;
+    TAuthService mAuthService;
+    TPacketDispatcher mDispatcher;
+    TTrafficCapture mCapture;
     std::thread mUDPThread;
     std::thread mTCPThread;
+    TAcceptLimiter mAcceptLimiter;
+    std::atomic_size_t mHandshakesInProgress { 0 };
+    std::atomic_size_t mRejectedRateLimited { 0 };
+    std::atomic_size_t mRejectedTooManyHandshakes { 0 };
+    std::atomic_size_t mHandshakeTimeouts { 0 };
+    std::vector<Metrics::TGaugeRegistration> mMetricsGauges;
+
+    bool AdmitConnection(const ip::address& Address);
+
+    // all vehicle configs, framed and compressed exactly as SyncClient would send them one by one
+    struct TWorldSnapshot {
+        uint64_t Generation { 0 };
+        std::shared_ptr<const std::vector<uint8_t>> Frames { nullptr };
+    };
+    std::mutex mWorldSnapshotMutex;
+    TWorldSnapshot mWorldSnapshot;
+    std::shared_ptr<const std::vector<uint8_t>> GetWorldSnapshot();
 
     std::vector<uint8_t> UDPRcvFromClient(ip::udp::endpoint& ClientEndpoint);
-    void HandleDownload(TConnection&& TCPSock);
+    void HandleDownload(TConnection&& TCPSock, bool IsWideID);
     void OnConnect(const std::weak_ptr<TClient>& c);
     void TCPClient(const std::weak_ptr<TClient>& c);
     void Looper(const std::weak_ptr<TClient>& c);
-    int OpenID();
+    int OpenID(bool IsWideID);
     void OnDisconnect(const std::weak_ptr<TClient>& ClientPtr);
     void Parse(TClient& c, const std::vector<uint8_t>& Packet);
     void SendFile(TClient& c, const std::string& Name);
@@ -72,3 +154,23 @@ private:
 
 std::string HashPassword(const std::string& str);
 std::vector<uint8_t> StringToVector(const std::string& Str);
+
+/*
+ * Every UDP packet starts with the sending player's ID. Legacy clients send
+ * a single byte (ID + 1), which limits them to IDs 0-254. Clients which
+ * negotiated wide IDs in the 'VC' handshake send a zero byte followed by the
+ * ID as a 16-bit big-endian integer.
+ *
+ *  legacy: [ID+1][:][data...]
+ *  wide:   [0][hi][lo][:][data...]
+ */
+constexpr int MaxLegacyPlayerID = 254;
+constexpr int MaxWidePlayerID = 0xFFFF;
+
+struct TUDPHeader {
+    int ID;
+    size_t Size; // bytes to strip before the packet data
+};
+
+std::optional<TUDPHeader> ParseUDPHeader(const std::vector<uint8_t>& Data);
+std::vector<uint8_t> MakeUDPHeader(int ID, bool IsWideID);
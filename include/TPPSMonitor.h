@@ -24,22 +24,22 @@
 
 class TNetwork;
 
-class TPPSMonitor : public IThreaded {
+// kicks clients which stopped pinging, and updates every client's traffic
+// rates (and the server's total inbound packets per second) once a second,
+// as a task on Application::Scheduler()
+class TPPSMonitor {
 public:
     explicit TPPSMonitor(TServer& Server);
-    virtual ~TPPSMonitor() {}
+    ~TPPSMonitor();
 
-    void operator()() override;
-
-    void SetInternalPPS(int NewPPS) { mInternalPPS = NewPPS; }
-    void IncrementInternalPPS() { ++mInternalPPS; }
-    [[nodiscard]] int InternalPPS() const { return mInternalPPS; }
     void SetNetwork(TNetwork& Server) { mNetwork = std::ref(Server); }
 
 private:
+    void Update();
     TNetwork& Network() { return mNetwork->get(); }
 
     TServer& mServer;
     std::optional<std::reference_wrapper<TNetwork>> mNetwork { std::nullopt };
-    int mInternalPPS { 0 };
+    bool mStarted { false };
+    TScheduler::TTaskID mTask { 0 };
 };
@@ -0,0 +1,104 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Runs packet handlers (GlobalParser and everything it calls, like Lua hooks)
+ * off the network threads, so that receiving never waits on scripts.
+ *
+ * Each client is pinned to one worker by its ID, so packets of the same client
+ * are always handled in the order they were received, while different clients
+ * are handled in parallel.
+ *
+ * A client's TCP reader hands its packets over with DispatchOrWait, which
+ * stops it while that client has MaxQueuedPerClient tasks queued. It then
+ * stops reading from the socket, so TCP flow control slows the client down
+ * just like handling its packets inline did.
+ */
+class TPacketDispatcher final {
+public:
+    using TTask = std::function<void()>;
+
+    struct TStats {
+        size_t Queued { 0 };
+        size_t Dispatched { 0 };
+        size_t Dropped { 0 };
+        size_t Throttled { 0 }; // times a reader waited in DispatchOrWait
+    };
+
+    // unreliable (UDP) packets are dropped if a worker has this many tasks queued
+    static constexpr size_t MaxDroppableQueueSize = 4096;
+    // DispatchOrWait waits while the client has this many tasks queued
+    static constexpr size_t MaxQueuedPerClient = 1024;
+
+    // 0 workers picks a count based on the hardware
+    explicit TPacketDispatcher(size_t WorkerCount = 0);
+    ~TPacketDispatcher();
+    TPacketDispatcher(const TPacketDispatcher&) = delete;
+    TPacketDispatcher& operator=(const TPacketDispatcher&) = delete;
+
+    /// Queues Task on the worker for ClientID. Droppable tasks are discarded
+    /// when that worker is overloaded. Returns false if the task was dropped.
+    bool Dispatch(int ClientID, TTask&& Task, bool Droppable = false);
+    /// Queues Task like a reliable Dispatch, but first waits until ClientID
+    /// has fewer than MaxQueuedPerClient tasks queued. Must not be called from
+    /// a worker. Returns false if it was shut down instead.
+    bool DispatchOrWait(int ClientID, TTask&& Task);
+    /// Blocks until every task queued for ClientID so far has run.
+    void Flush(int ClientID);
+    void Shutdown();
+
+    TStats GetStats() const;
+    size_t WorkerCount() const { return mWorkers.size(); }
+
+private:
+    struct TQueued {
+        TTask Task;
+        int ClientID;
+    };
+    struct TWorker {
+        std::mutex Mutex;
+        std::condition_variable Cond;
+        std::condition_variable SpaceCond; // for DispatchOrWait
+        std::deque<TQueued> Queue;
+        std::unordered_map<int, size_t> QueuedPerClient;
+        size_t Waiting { 0 }; // readers in DispatchOrWait
+        std::thread Thread;
+    };
+
+    void WorkerMain(TWorker& Worker, size_t Index);
+    TWorker& WorkerFor(int ClientID);
+
+    std::vector<std::unique_ptr<TWorker>> mWorkers;
+    std::atomic_bool mShutdown { false };
+    std::atomic_size_t mQueued { 0 };
+    std::atomic_size_t mDispatched { 0 };
+    std::atomic_size_t mDropped { 0 };
+    std::atomic_size_t mThrottled { 0 };
+};
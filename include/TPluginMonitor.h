@@ -19,7 +19,6 @@
 #pragma once
 
 #include "Common.h"
-#include "IThreaded.h"
 
 #include <atomic>
 #include <memory>
@@ -27,13 +26,17 @@
 
 class TLuaEngine;
 
-class TPluginMonitor : IThreaded, public std::enable_shared_from_this<TPluginMonitor> {
+// checks the plugin files for changes every 3 seconds, on Application::Scheduler(),
+// as a blocking task since it waits for the reloads
+class TPluginMonitor : public std::enable_shared_from_this<TPluginMonitor> {
 public:
     TPluginMonitor(const fs::path& Path, std::shared_ptr<TLuaEngine> Engine);
-
-    void operator()();
+    ~TPluginMonitor();
 
 private:
+    void Check();
+
+    TScheduler::TTaskID mTask { 0 };
     std::shared_ptr<TLuaEngine> mEngine;
     fs::path mPath;
     std::unordered_map<std::string, fs::file_time_type> mFileTimes;
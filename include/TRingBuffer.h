@@ -0,0 +1,111 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <utility>
+#include <vector>
+
+/*
+ * FIFO queue on a power of two sized ring of preallocated slots: pushing and
+ * popping are O(1) and don't allocate, unless the ring is full, in which case
+ * it doubles in size. Not synchronized.
+ */
+template <typename T>
+class TRingBuffer {
+public:
+    explicit TRingBuffer(size_t Capacity = 64) {
+        size_t Size = 1;
+        while (Size < Capacity) {
+            Size *= 2;
+        }
+        mSlots.resize(Size);
+    }
+
+    void PushBack(T Value) {
+        if (mSize == mSlots.size()) {
+            Grow();
+        }
+        mSlots[(mHead + mSize) & (mSlots.size() - 1)] = std::move(Value);
+        ++mSize;
+    }
+
+    std::optional<T> PopFront() {
+        if (mSize == 0) {
+            return std::nullopt;
+        }
+        std::optional<T> Value { std::move(mSlots[mHead]) };
+        // don't keep whatever the moved-from value holds on to alive
+        mSlots[mHead] = T {};
+        mHead = (mHead + 1) & (mSlots.size() - 1);
+        --mSize;
+        return Value;
+    }
+
+    /// Moves up to Max values from the front into Out, returns how many.
+    size_t PopFront(std::vector<T>& Out, size_t Max) {
+        size_t Count = 0;
+        while (Count < Max && mSize > 0) {
+            Out.push_back(*PopFront());
+            ++Count;
+        }
+        return Count;
+    }
+
+    /// Calls Fn with every value, front to back, until it returns true.
+    template <typename FnT>
+    bool AnyOf(FnT&& Fn) const {
+        for (size_t i = 0; i < mSize; ++i) {
+            if (Fn(mSlots[(mHead + i) & (mSlots.size() - 1)])) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<T> ToVector() const {
+        std::vector<T> Result;
+        Result.reserve(mSize);
+        AnyOf([&Result](const T& Value) {
+            Result.push_back(Value);
+            return false;
+        });
+        return Result;
+    }
+
+    size_t Size() const { return mSize; }
+    bool Empty() const { return mSize == 0; }
+    size_t Capacity() const { return mSlots.size(); }
+
+private:
+    void Grow() {
+        std::vector<T> Slots(mSlots.size() * 2);
+        for (size_t i = 0; i < mSize; ++i) {
+            Slots[i] = std::move(mSlots[(mHead + i) & (mSlots.size() - 1)]);
+        }
+        mSlots = std::move(Slots);
+        mHead = 0;
+    }
+
+    std::vector<T> mSlots;
+    size_t mHead { 0 };
+    size_t mSize { 0 };
+};
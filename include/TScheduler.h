@@ -0,0 +1,169 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Runs the periodic and delayed work of the background subsystems (PPS
+ * monitor, heartbeat, plugin monitor, ...) so they don't each need a thread
+ * that mostly sleeps.
+ *
+ * Timers live in a hierarchical timer wheel (4 levels of 64 slots, 1ms ticks)
+ * driven by one thread, which sleeps until the next occupied slot. Due tasks
+ * are handed to a small pool of workers; each worker has its own queue and
+ * steals from the others when it runs dry.
+ *
+ * Those workers are for short tasks (Lua timers, hook timeouts, the PPS
+ * monitor). Tasks which block for a while (an HTTP request, a plugin reload)
+ * have to be scheduled as Kind::Blocking, which run on a separate pool, so
+ * they can't hold up the short ones.
+ *
+ * A periodic task is re-armed after it finished, so it never runs twice at
+ * once, and if it fell behind, missed runs are skipped instead of bunched up.
+ * How late tasks start is recorded in the "Scheduler lateness" histogram.
+ */
+class TScheduler final {
+public:
+    using TClock = std::chrono::steady_clock;
+    using TTaskID = uint64_t;
+    using TTask = std::function<void()>;
+
+    enum class Kind : uint8_t {
+        Short,
+        Blocking, // may wait on I/O or other threads for a while
+    };
+
+    static constexpr size_t LevelBits = 6;
+    static constexpr size_t SlotCount = size_t(1) << LevelBits;
+    static constexpr size_t LevelCount = 4;
+    static constexpr TClock::duration Tick = std::chrono::milliseconds(1);
+    // starting later than this counts as late in the stats
+    static constexpr TClock::duration LateThreshold = std::chrono::milliseconds(10);
+    static constexpr size_t DefaultBlockingWorkers = 2;
+
+    struct TStats {
+        size_t Workers { 0 };
+        size_t BlockingWorkers { 0 };
+        size_t Tasks { 0 };
+        uint64_t Runs { 0 };
+        uint64_t LateRuns { 0 };
+        std::chrono::nanoseconds MaxLateness { 0 };
+    };
+
+    explicit TScheduler(size_t Workers, size_t BlockingWorkers = DefaultBlockingWorkers);
+    ~TScheduler();
+    TScheduler(const TScheduler&) = delete;
+    TScheduler& operator=(const TScheduler&) = delete;
+
+    /// Runs Task every Interval, the first time one Interval from now.
+    TTaskID Every(const std::string& Name, TClock::duration Interval, TTask Task, Kind Type = Kind::Short);
+    /// Runs Task once, Delay from now.
+    TTaskID After(const std::string& Name, TClock::duration Delay, TTask Task, Kind Type = Kind::Short);
+    /// Runs Task once, as soon as a worker is free.
+    TTaskID Post(const std::string& Name, TTask Task, Kind Type = Kind::Short);
+    /// Stops the task from running again, and waits for a run which is in
+    /// progress on another thread. Returns false if the task is unknown
+    /// (e.g. a one-shot task which already ran).
+    bool Cancel(TTaskID ID);
+
+    TStats GetStats() const;
+    /// Cancels everything and joins all threads.
+    void Shutdown();
+
+private:
+    struct TTimer {
+        TTaskID ID;
+        std::string Name;
+        TTask Fn;
+        TClock::duration Interval; // zero for one-shot tasks
+        Kind Type { Kind::Short };
+        TClock::time_point Due;
+        uint64_t DueTick { 0 };
+        bool Running { false }; // guarded by mTasksMutex
+        std::atomic_bool Cancelled { false };
+    };
+    using TTimerPtr = std::shared_ptr<TTimer>;
+
+    struct TWorker {
+        std::mutex Mutex;
+        std::deque<TTimerPtr> Jobs;
+        std::thread Thread;
+    };
+
+    TTaskID Schedule(const std::string& Name, TClock::duration Interval, TClock::time_point Due, TTask Task, Kind Type);
+    void Arm(const TTimerPtr& Timer);
+    void TimerMain();
+    void WorkerMain(size_t Index);
+    void BlockingWorkerMain(size_t Index);
+    void Dispatch(TTimerPtr Timer);
+    TTimerPtr NextJob(size_t Index);
+    void Run(const TTimerPtr& Timer);
+
+    // wheel, all guarded by mWheelMutex
+    void Insert(TTimerPtr Timer);
+    void Advance(uint64_t Target, std::vector<TTimerPtr>& Expired);
+    // the next tick at which a timer fires or a slot has to be cascaded
+    uint64_t NextEventTick() const;
+    uint64_t TickOf(TClock::time_point Time, bool RoundUp) const;
+    TClock::time_point TimeOf(uint64_t Tick) const;
+
+    const TClock::time_point mEpoch;
+    mutable std::mutex mWheelMutex;
+    std::condition_variable mWheelCond;
+    std::array<std::array<std::vector<TTimerPtr>, SlotCount>, LevelCount> mWheel {};
+    uint64_t mCurrentTick { 0 };
+    size_t mArmed { 0 };
+    std::atomic_bool mShutdown { false };
+    std::thread mTimerThread;
+
+    std::vector<std::unique_ptr<TWorker>> mWorkers;
+    std::mutex mWorkMutex;
+    std::condition_variable mWorkCond;
+    size_t mQueued { 0 }; // guarded by mWorkMutex
+    std::atomic_size_t mNextWorker { 0 };
+
+    // Kind::Blocking tasks, one queue for all of their workers
+    std::vector<std::thread> mBlockingWorkers;
+    std::mutex mBlockingMutex;
+    std::condition_variable mBlockingCond;
+    std::deque<TTimerPtr> mBlockingJobs; // guarded by mBlockingMutex
+
+    mutable std::mutex mTasksMutex;
+    std::condition_variable mTaskDoneCond;
+    std::unordered_map<TTaskID, TTimerPtr> mTasks;
+    TTaskID mNextID { 1 };
+
+    std::atomic_uint64_t mRuns { 0 };
+    std::atomic_uint64_t mLateRuns { 0 };
+    std::atomic_int64_t mMaxLateness { 0 };
+};
@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include "Metrics.h"
+
 #include <chrono>
 #include <functional>
 #include <string>
@@ -41,3 +43,19 @@ private:
     std::chrono::high_resolution_clock::time_point mStartTime;
     std::string Name;
 };
+
+// records the time from construction to destruction into a histogram, usually
+// one of Metrics::ProbeTime's
+class TScopedProbe {
+public:
+    explicit TScopedProbe(Metrics::THistogram& Histogram)
+        : mHistogram(Histogram)
+        , mStart(std::chrono::steady_clock::now()) { }
+    ~TScopedProbe() { mHistogram.Observe(std::chrono::steady_clock::now() - mStart); }
+    TScopedProbe(const TScopedProbe&) = delete;
+    TScopedProbe& operator=(const TScopedProbe&) = delete;
+
+private:
+    Metrics::THistogram& mHistogram;
+    std::chrono::steady_clock::time_point mStart;
+};
@@ -21,6 +21,7 @@
 #include "IThreaded.h"
 #include "RWMutex.h"
 #include "TScopedTimer.h"
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <mutex>
@@ -46,7 +47,12 @@ public:
 
     void GlobalParser(const std::weak_ptr<TClient>& Client, std::vector<uint8_t>&& Packet, TPPSMonitor& PPSMonitor, TNetwork& Network);
     static void HandleEvent(TClient& c, const std::string& Data);
+    // merges the edit (vehicle config json) in pckt into the client's vehicle VID
+    static void Apply(TClient& c, int VID, const std::string& pckt);
     RWMutex& GetClientMutex() const { return mClientsMutex; }
+    // changes whenever any client's vehicle configs change, used to invalidate the world snapshot
+    uint64_t VehicleGeneration() const { return mVehicleGeneration.load(); }
+    void BumpVehicleGeneration() { ++mVehicleGeneration; }
 
     const TScopedTimer UptimeTimer;
 
@@ -57,10 +63,10 @@ private:
     io_context mIoCtx {};
     TClientSet mClients;
     mutable RWMutex mClientsMutex;
-    static void ParseVehicle(TClient& c, const std::string& Pckt, TNetwork& Network);
+    std::atomic_uint64_t mVehicleGeneration { 0 };
+    static void ParseVehicle(const std::shared_ptr<TClient>& Client, const std::string& Pckt, TNetwork& Network);
     static bool ShouldSpawn(TClient& c, const std::string& CarJson, int ID);
     static bool IsUnicycle(TClient& c, const std::string& CarJson);
-    static void Apply(TClient& c, int VID, const std::string& pckt);
     void HandlePosition(TClient& c, const std::string& Packet);
 };
 
@@ -0,0 +1,125 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+class TClient;
+
+/*
+ * Records every packet clients send to the server (after the handshake) into
+ * an append-only binary file, so that the traffic can later be fed back into
+ * the server with BeamMP-Server-replay.
+ *
+ * File format, all integers little endian:
+ *  "BMPCAP01"
+ *  records of: u8 kind, u16 client id, u64 microseconds since start, u32 size, data
+ *
+ * Join records carry the client's name, roles and guest/wide-id flags as json,
+ * so the replay can recreate the client.
+ *
+ * The network threads only queue records, a writer thread writes them out.
+ * If the disk can't keep up and MaxQueuedBytes are waiting, further records
+ * are dropped (and counted) rather than holding up the network.
+ */
+class TTrafficCapture final {
+public:
+    enum class Kind : uint8_t {
+        Join = 0,
+        TCP = 1,
+        UDP = 2,
+        Leave = 3,
+    };
+
+    struct TRecord {
+        Kind Type;
+        uint16_t ClientID;
+        std::chrono::microseconds Time;
+        std::vector<uint8_t> Data;
+    };
+
+    struct TStats {
+        bool Active { false };
+        std::string Path;
+        size_t Records { 0 };
+        size_t Bytes { 0 };
+        size_t Dropped { 0 };
+    };
+
+    static constexpr std::string_view Magic = "BMPCAP01";
+    static constexpr size_t RecordHeaderSize = 1 + 2 + 8 + 4;
+    // packets are at most 100 MiB (see TNetwork::TCPRcv), anything larger in
+    // a file is corrupt
+    static constexpr size_t MaxRecordSize = 100 * 1024 * 1024;
+    static constexpr size_t MaxQueuedBytes = 64 * 1024 * 1024;
+
+    TTrafficCapture() = default;
+    ~TTrafficCapture();
+    TTrafficCapture(const TTrafficCapture&) = delete;
+    TTrafficCapture& operator=(const TTrafficCapture&) = delete;
+
+    /// Starts writing to Path, replacing the file. Returns false and logs if
+    /// the file can't be opened.
+    bool Start(const std::string& Path);
+    void Stop();
+    [[nodiscard]] bool IsActive() const { return mActive; }
+
+    // all of these do nothing unless a capture is active
+    void RecordJoin(const TClient& Client);
+    void RecordLeave(int ClientID);
+    void Record(Kind Type, int ClientID, const std::vector<uint8_t>& Data);
+
+    TStats GetStats() const;
+
+    static void WriteRecord(std::ostream& Out, const TRecord& Record);
+    /// Returns nullopt at the end of the stream, on a truncated record, or
+    /// on one larger than MaxRecordSize.
+    static std::optional<TRecord> ReadRecord(std::istream& In);
+    /// Reads and checks the file magic.
+    static bool ReadHeader(std::istream& In);
+
+private:
+    void WriterMain();
+
+    std::atomic_bool mActive { false };
+    // guards everything below but mFile, which only the writer thread uses
+    mutable std::mutex mMutex;
+    std::condition_variable mQueueCond;
+    std::deque<TRecord> mQueue;
+    size_t mQueuedBytes { 0 };
+    bool mStopping { false };
+    std::thread mWriter;
+    std::ofstream mFile;
+    std::string mPath;
+    std::chrono::steady_clock::time_point mStart;
+    size_t mRecords { 0 };
+    size_t mBytes { 0 };
+    size_t mDropped { 0 };
+};
@@ -0,0 +1,131 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+
+/*
+ * Packet and byte counters of one client, by direction, transport (TCP/UDP)
+ * and packet code, plus the rates over the last interval.
+ *
+ * Counting is a relaxed atomic add, so it's safe and cheap from any of the
+ * threads which receive or send for the client. Transport counters count
+ * packets as they go over the socket (so compressed and with headers),
+ * code counters count them as the server handles or sends them, in wire
+ * bytes as well.
+ *
+ * TPPSMonitor calls UpdateRates() once a second.
+ */
+class TTrafficStats final {
+public:
+    enum class Direction : uint8_t {
+        In = 0,
+        Out = 1,
+    };
+    enum class Transport : uint8_t {
+        TCP = 0,
+        UDP = 1,
+    };
+
+    struct TCount {
+        uint64_t Packets { 0 };
+        uint64_t Bytes { 0 };
+
+        TCount& operator+=(const TCount& Other) {
+            Packets += Other.Packets;
+            Bytes += Other.Bytes;
+            return *this;
+        }
+    };
+    struct TRate {
+        double PacketsPerSecond { 0 };
+        double BytesPerSecond { 0 };
+
+        TRate& operator+=(const TRate& Other) {
+            PacketsPerSecond += Other.PacketsPerSecond;
+            BytesPerSecond += Other.BytesPerSecond;
+            return *this;
+        }
+    };
+    template <typename T>
+    struct TBreakdown {
+        // by Direction, then Transport
+        std::array<std::array<T, 2>, 2> ByTransport {};
+        // by Direction, then packet code
+        std::array<std::array<T, 256>, 2> ByCode {};
+
+        const T& Get(Direction Dir, Transport Via) const { return ByTransport[size_t(Dir)][size_t(Via)]; }
+        TBreakdown& operator+=(const TBreakdown& Other) {
+            for (size_t Dir = 0; Dir < 2; ++Dir) {
+                for (size_t Via = 0; Via < 2; ++Via) {
+                    ByTransport[Dir][Via] += Other.ByTransport[Dir][Via];
+                }
+                for (size_t Code = 0; Code < 256; ++Code) {
+                    ByCode[Dir][Code] += Other.ByCode[Dir][Code];
+                }
+            }
+            return *this;
+        }
+        T Total(Direction Dir) const {
+            T Result;
+            for (const auto& Value : ByTransport[size_t(Dir)]) {
+                Result += Value;
+            }
+            return Result;
+        }
+    };
+    using TSnapshot = TBreakdown<TCount>;
+    using TRates = TBreakdown<TRate>;
+
+    TTrafficStats();
+    TTrafficStats(const TTrafficStats&) = delete;
+    TTrafficStats& operator=(const TTrafficStats&) = delete;
+
+    void AddTransport(Direction Dir, Transport Via, size_t Bytes);
+    void AddCode(Direction Dir, uint8_t Code, size_t Bytes);
+
+    TSnapshot Snapshot() const;
+    /// Computes the rates since the last call.
+    void UpdateRates();
+    TRates GetRates() const;
+
+    /// Totals and rates in/out, split by transport, and per packet code
+    /// (only codes which were seen). Same layout as MP.GetStats().
+    static nlohmann::json ToJson(const TSnapshot& Counts, const TRates& Rates);
+    /// The code itself if it's printable ASCII, otherwise "0x.." (codes come
+    /// from clients, and keys have to be valid UTF-8).
+    static std::string CodeName(uint8_t Code);
+
+private:
+    std::array<std::array<std::atomic_uint64_t, 2>, 2> mTransportPackets {};
+    std::array<std::array<std::atomic_uint64_t, 2>, 2> mTransportBytes {};
+    std::array<std::array<std::atomic_uint64_t, 256>, 2> mCodePackets {};
+    std::array<std::array<std::atomic_uint64_t, 256>, 2> mCodeBytes {};
+
+    mutable std::mutex mRatesMutex;
+    TSnapshot mLastSnapshot;
+    std::chrono::steady_clock::time_point mLastUpdate;
+    TRates mRates;
+};
@@ -0,0 +1,107 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/*
+ * Opt-in tracing, started and stopped with the `trace` console command.
+ *
+ * Spans are recorded into a ring buffer per thread (so the oldest spans are
+ * lost if a thread records more than fit), and written out as a Chrome trace
+ * event JSON file when the trace stops. Open it in chrome://tracing or
+ * https://ui.perfetto.dev.
+ *
+ * Every received packet gets a flow ID, which follows it from the network
+ * thread to GlobalParser, the Lua handlers it triggers and the sends it
+ * causes, so its journey shows up as connected arrows in the viewer.
+ * The flow ID a thread is working on is kept in a thread local, see
+ * TFlowScope.
+ *
+ * While no trace is running, a span costs one atomic load.
+ */
+namespace Tracing {
+
+enum class FlowPhase : uint8_t {
+    None,
+    Begin,
+    Step,
+};
+
+/// Starts a trace which is written to Path when stopped. Returns false and
+/// logs if a trace is already running.
+bool Start(const std::string& Path);
+/// Stops the trace and writes the file. Returns false if no trace was running
+/// or the file couldn't be written.
+bool Stop();
+bool IsActive();
+
+struct TStats {
+    bool Active { false };
+    std::string Path;
+    size_t Threads { 0 };
+    size_t Spans { 0 };
+};
+TStats GetStats();
+
+/// A fresh flow ID, or 0 if not tracing.
+uint64_t NewFlowID();
+/// The flow ID this thread is working on, 0 if none.
+uint64_t CurrentFlowID();
+void SetCurrentFlowID(uint64_t FlowID);
+
+// sets the thread's current flow ID for the lifetime of the scope
+class TFlowScope {
+public:
+    explicit TFlowScope(uint64_t FlowID)
+        : mPrevious(CurrentFlowID()) {
+        SetCurrentFlowID(FlowID);
+    }
+    ~TFlowScope() { SetCurrentFlowID(mPrevious); }
+    TFlowScope(const TFlowScope&) = delete;
+    TFlowScope& operator=(const TFlowScope&) = delete;
+
+private:
+    uint64_t mPrevious;
+};
+
+// records a span from construction to destruction, as part of the thread's
+// current flow (if any). Name must be a string literal, Detail is shown as an
+// argument (e.g. the event name).
+class TSpan {
+public:
+    explicit TSpan(const char* Name, FlowPhase Phase = FlowPhase::Step, const std::string& Detail = {});
+    TSpan(const char* Name, const std::string& Detail)
+        : TSpan(Name, FlowPhase::Step, Detail) { }
+    ~TSpan();
+    TSpan(const TSpan&) = delete;
+    TSpan& operator=(const TSpan&) = delete;
+
+private:
+    const char* mName;
+    bool mActive;
+    FlowPhase mPhase { FlowPhase::None };
+    uint64_t mFlowID { 0 };
+    std::string mDetail;
+    std::chrono::steady_clock::time_point mStart;
+};
+
+}
@@ -0,0 +1,93 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "Benchmark.h"
+
+#include "Common.h"
+
+#include <algorithm>
+
+struct TRegisteredBenchmark {
+    std::string Name;
+    Benchmark::TFunction Fn;
+};
+
+// function-local so that registration from other translation units' static
+// initializers doesn't depend on initialization order
+static std::vector<TRegisteredBenchmark>& Registry() {
+    static std::vector<TRegisteredBenchmark> sRegistry;
+    return sRegistry;
+}
+
+bool Benchmark::Register(const char* Name, TFunction Fn) {
+    Registry().push_back({ Name, Fn });
+    return true;
+}
+
+void TBenchmarkState::Run(const std::function<void()>& Fn) {
+    using Clock = std::chrono::steady_clock;
+    Fn(); // warm up caches and lazy initialization
+    // grow the batch until one batch takes long enough, then take the median of a few batches
+    size_t Batch = 1;
+    while (true) {
+        auto Start = Clock::now();
+        for (size_t i = 0; i < Batch; ++i) {
+            Fn();
+        }
+        auto Elapsed = Clock::now() - Start;
+        if (Elapsed >= mMinTime / 5 || Batch >= (size_t(1) << 30)) {
+            break;
+        }
+        Batch *= 2;
+    }
+    std::vector<double> Samples;
+    for (int Sample = 0; Sample < 5; ++Sample) {
+        auto Start = Clock::now();
+        for (size_t i = 0; i < Batch; ++i) {
+            Fn();
+        }
+        Samples.push_back(std::chrono::duration<double, std::nano>(Clock::now() - Start).count() / double(Batch));
+    }
+    std::sort(Samples.begin(), Samples.end());
+    mIterations = Batch * Samples.size();
+    mNsPerIteration = Samples[Samples.size() / 2];
+}
+
+std::vector<Benchmark::TResult> Benchmark::RunAll(const std::string& Filter, std::chrono::nanoseconds MinTime) {
+    auto Benchmarks = Registry();
+    std::sort(Benchmarks.begin(), Benchmarks.end(), [](const auto& A, const auto& B) { return A.Name < B.Name; });
+    std::vector<TResult> Results;
+    for (const auto& Bench : Benchmarks) {
+        if (Bench.Name.find(Filter) == std::string::npos) {
+            continue;
+        }
+        TBenchmarkState State(MinTime);
+        Bench.Fn(State);
+        if (State.Iterations() == 0) {
+            beammp_warnf("Benchmark '{}' never called State.Run(), skipping", Bench.Name);
+            continue;
+        }
+        Results.push_back(TResult {
+            Bench.Name,
+            State.Iterations(),
+            State.NsPerIteration(),
+            double(State.ItemsPerIteration()) * 1e9 / State.NsPerIteration(),
+        });
+    }
+    return Results;
+}
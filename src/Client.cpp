@@ -20,6 +20,7 @@
 
 #include "CustomAssert.h"
 #include "TServer.h"
+#include <algorithm>
 #include <memory>
 #include <optional>
 
@@ -31,6 +32,7 @@ void TClient::DeleteCar(int Ident) {
     });
     if (iter != mVehicleData.end()) {
         mVehicleData.erase(iter);
+        mServer.BumpVehicleGeneration();
     } else {
         beammp_debug("tried to erase a vehicle that doesn't exist (not an error)");
     }
@@ -38,10 +40,13 @@ void TClient::DeleteCar(int Ident) {
 
 void TClient::ClearCars() {
     std::unique_lock lock(mVehicleDataMutex);
-    mVehicleData.clear();
+    if (!mVehicleData.empty()) {
+        mVehicleData.clear();
+        mServer.BumpVehicleGeneration();
+    }
 }
 
-int TClient::GetOpenCarID() const {
+int TClient::ReserveCarID() {
     int OpenID = 0;
     bool found;
     std::unique_lock lock(mVehicleDataMutex);
@@ -53,13 +58,34 @@ int TClient::GetOpenCarID() const {
                 found = false;
             }
         }
+        if (std::find(mReservedCarIDs.begin(), mReservedCarIDs.end(), OpenID) != mReservedCarIDs.end()) {
+            OpenID++;
+            found = false;
+        }
     } while (!found);
+    mReservedCarIDs.push_back(OpenID);
     return OpenID;
 }
 
+void TClient::ReleaseCarID(int Ident) {
+    std::unique_lock lock(mVehicleDataMutex);
+    std::erase(mReservedCarIDs, Ident);
+}
+
+bool TClient::IsCarIDReserved(int Ident) const {
+    std::unique_lock lock(mVehicleDataMutex);
+    return std::find(mReservedCarIDs.begin(), mReservedCarIDs.end(), Ident) != mReservedCarIDs.end();
+}
+
+bool TClient::HasCar(int Ident) const {
+    std::unique_lock lock(mVehicleDataMutex);
+    return std::any_of(mVehicleData.begin(), mVehicleData.end(), [Ident](const TVehicleData& Vehicle) { return Vehicle.ID() == Ident; });
+}
+
 void TClient::AddNewCar(int Ident, const std::string& Data) {
     std::unique_lock lock(mVehicleDataMutex);
     mVehicleData.emplace_back(Ident, Data);
+    mServer.BumpVehicleGeneration();
 }
 
 TClient::TVehicleDataLockPair TClient::GetAllCars() {
@@ -113,6 +139,7 @@ void TClient::SetCarData(int Ident, const std::string& Data) {
         for (auto& v : mVehicleData) {
             if (v.ID() == Ident) {
                 v.SetData(Data);
+                mServer.BumpVehicleGeneration();
                 return;
             }
         }
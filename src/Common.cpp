@@ -18,8 +18,10 @@
 
 #include "Common.h"
 
+#include "Benchmark.h"
 #include "Env.h"
 #include "TConsole.h"
+#include <algorithm>
 #include <array>
 #include <charconv>
 #include <fmt/core.h>
@@ -42,6 +44,13 @@ void Application::RegisterShutdownHandler(const TShutdownHandler& Handler) {
     }
 }
 
+TScheduler& Application::Scheduler() {
+    // only short tasks run on these workers, HTTP requests and plugin reloads
+    // go to the scheduler's blocking pool
+    static TScheduler sScheduler(std::clamp<size_t>(std::thread::hardware_concurrency() / 4, 2, 4));
+    return sScheduler;
+}
+
 void Application::GracefullyShutdown() {
     SetShutdown(true);
     static bool AlreadyShuttingDown = false;
@@ -253,15 +262,13 @@ void Application::CheckForUpdates() {
 
 static std::map<std::thread::id, std::string> threadNameMap {};
 static std::mutex ThreadNameMapMutex {};
+// threads only ever register themselves, so every log line can read the name
+// from here instead of locking the map
+static thread_local std::string tThreadName {};
 
 std::string ThreadName(bool DebugModeOverride) {
-    auto Lock = std::unique_lock(ThreadNameMapMutex);
-    if (DebugModeOverride || Application::Settings.DebugModeEnabled) {
-        auto id = std::this_thread::get_id();
-        if (threadNameMap.find(id) != threadNameMap.end()) {
-            // found
-            return threadNameMap.at(id) + " ";
-        }
+    if ((DebugModeOverride || Application::Settings.DebugModeEnabled) && !tThreadName.empty()) {
+        return tThreadName + " ";
     }
     return "";
 }
@@ -300,6 +307,7 @@ void RegisterThread(const std::string& str) {
         std::ofstream ThreadFile(".Threads.log", std::ios::app);
         ThreadFile << ("Thread \"" + str + "\" is TID " + ThreadId) << std::endl;
     }
+    tThreadName = str;
     auto Lock = std::unique_lock(ThreadNameMapMutex);
     threadNameMap[std::this_thread::get_id()] = str;
 }
@@ -328,6 +336,26 @@ TEST_CASE("Version::AsString") {
     CHECK(Version { 255, 255, 255 }.AsString() == "255.255.255");
 }
 
+// vehicle configs are the largest packets which are compressed regularly
+static std::vector<uint8_t> MakeBenchmarkVehicleConfig() {
+    std::string Config = R"({"jbm":"pickup","vcf":{"parts":{)";
+    for (int i = 0; Config.size() < 4096; ++i) {
+        Config += fmt::format(R"("pickup_part_{0}":"pickup_part_{0}_variant",)", i);
+    }
+    Config += "}}";
+    return std::vector<uint8_t>(Config.begin(), Config.end());
+}
+
+BEAMMP_BENCHMARK("Common/Comp 4KB vehicle config") {
+    auto Data = MakeBenchmarkVehicleConfig();
+    State.Run([&] { Benchmark::DoNotOptimize(Comp(Data)); });
+}
+
+BEAMMP_BENCHMARK("Common/DeComp 4KB vehicle config") {
+    auto Compressed = Comp(MakeBenchmarkVehicleConfig());
+    State.Run([&] { Benchmark::DoNotOptimize(DeComp(Compressed)); });
+}
+
 void LogChatMessage(const std::string& name, int id, const std::string& msg) {
     if (Application::Settings.LogChat) {
         std::stringstream ss;
@@ -33,6 +33,9 @@ std::string_view Env::ToString(Env::Key key) {
     case Key::PROVIDER_UPDATE_MESSAGE:
         return "BEAMMP_PROVIDER_UPDATE_MESSAGE";
         break;
+    case Key::AUTH_MOCK:
+        return "BEAMMP_AUTH_MOCK";
+        break;
     }
     return "";
 }
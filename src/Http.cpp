@@ -22,6 +22,7 @@
 #include "Common.h"
 #include "CustomAssert.h"
 #include "LuaAPI.h"
+#include "Metrics.h"
 
 #include <map>
 #include <nlohmann/json.hpp>
@@ -206,6 +207,10 @@ void Http::Server::THttpServerInstance::operator()() try {
             "application/json");
         res.status = 200;
     });
+    HttpLibServerInstance->Get("/metrics", [](const httplib::Request&, httplib::Response& res) {
+        res.set_content(Metrics::Render(), "text/plain; version=0.0.4");
+        res.status = 200;
+    });
     // magic endpoint
     HttpLibServerInstance->Get({ 0x2f, 0x6b, 0x69, 0x74, 0x74, 0x79 }, [](const httplib::Request&, httplib::Response& res) {
         res.set_content(std::string(Magic), "text/plain");
@@ -17,6 +17,7 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "LuaAPI.h"
+#include "Benchmark.h"
 #include "Client.h"
 #include "Common.h"
 #include "CustomAssert.h"
@@ -632,6 +633,22 @@ std::string LuaAPI::MP::JsonEncode(const sol::table& object) {
     return json.dump();
 }
 
+BEAMMP_BENCHMARK("Lua/JsonEncode") {
+    sol::state Lua;
+    sol::table Table = Lua.script(R"(return {
+        jbm = "pickup",
+        vcf = {
+            parts = { pickup_body = "pickup_body", pickup_engine = "pickup_engine_v8" },
+            paints = { { baseColor = { 0.5, 0.1, 0.1, 1.2 }, metallic = 0.5, roughness = 0.5 } },
+            partConfigFilename = "vehicles/pickup/d15_4wd_A.pc",
+        },
+        pro = "0",
+        pos = { 12.5, -3.25, 100.0 },
+        rot = { 0, 0, 0.7071, 0.7071 },
+    })");
+    State.Run([&] { Benchmark::DoNotOptimize(LuaAPI::MP::JsonEncode(Table)); });
+}
+
 std::string LuaAPI::MP::JsonDiff(const std::string& a, const std::string& b) {
     if (!nlohmann::json::accept(a)) {
         beammp_lua_error("JsonDiff first argument is not valid json: `" + a + "`");
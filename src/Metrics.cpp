@@ -0,0 +1,414 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "Metrics.h"
+
+#include "Common.h"
+#include "Environment.h"
+
+#include <mutex>
+#include <optional>
+#include <thread>
+
+namespace Metrics {
+
+TPacketCounters PacketsReceived;
+TPacketCounters PacketsSent;
+THistogram CompressTime;
+THistogram DecompressTime;
+THistogram AuthRequestTime;
+THistogramFamily LuaEventHandlerTime;
+THistogramFamily LuaQueueWaitTime;
+THistogramFamily LuaHandlerTime;
+THistogramFamily ProbeTime;
+
+}
+
+size_t Metrics::ThisThreadShard() {
+    static std::atomic_size_t sNextShard { 0 };
+    static thread_local const size_t sShard = sNextShard++ % ShardCount;
+    return sShard;
+}
+
+void Metrics::THistogram::Observe(std::chrono::nanoseconds Duration) {
+    const double Seconds = std::chrono::duration<double>(Duration).count();
+    size_t Bucket = 0;
+    while (Bucket < Buckets.size() && Seconds > Buckets[Bucket]) {
+        ++Bucket;
+    }
+    mValues.Add(Bucket);
+    mValues.Add(CountIndex);
+    mValues.Add(SumIndex, uint64_t(std::max<int64_t>(Duration.count(), 0)));
+}
+
+Metrics::THistogram::TSnapshot Metrics::THistogram::Snapshot() const {
+    TSnapshot Result;
+    for (size_t i = 0; i < Result.Counts.size(); ++i) {
+        Result.Counts[i] = mValues.Sum(i);
+    }
+    Result.Count = mValues.Sum(CountIndex);
+    Result.Sum = double(mValues.Sum(SumIndex)) / 1e9;
+    return Result;
+}
+
+Metrics::THistogram::TSnapshot& Metrics::THistogram::TSnapshot::operator+=(const TSnapshot& Other) {
+    for (size_t i = 0; i < Counts.size(); ++i) {
+        Counts[i] += Other.Counts[i];
+    }
+    Count += Other.Count;
+    Sum += Other.Sum;
+    return *this;
+}
+
+Metrics::THistogram::TSnapshot& Metrics::THistogram::TSnapshot::operator-=(const TSnapshot& Other) {
+    for (size_t i = 0; i < Counts.size(); ++i) {
+        Counts[i] -= std::min(Counts[i], Other.Counts[i]);
+    }
+    Count -= std::min(Count, Other.Count);
+    Sum = std::max(Sum - Other.Sum, 0.0);
+    return *this;
+}
+
+std::chrono::nanoseconds Metrics::THistogram::TSnapshot::Quantile(double Q) const {
+    // the shards are read one by one, so Count may be off from the buckets by a few
+    uint64_t Total = 0;
+    for (auto Bucket : Counts) {
+        Total += Bucket;
+    }
+    if (Total == 0) {
+        return std::chrono::nanoseconds(0);
+    }
+    const double Rank = Q * double(Total);
+    uint64_t Seen = 0;
+    double Seconds = Buckets.back();
+    for (size_t i = 0; i < Buckets.size(); ++i) {
+        if (Counts[i] > 0 && double(Seen + Counts[i]) >= Rank) {
+            const double Lower = i == 0 ? 0 : Buckets[i - 1];
+            Seconds = Lower + (Buckets[i] - Lower) * (Rank - double(Seen)) / double(Counts[i]);
+            break;
+        }
+        Seen += Counts[i];
+    }
+    // past the last bound (+Inf) there's nothing to interpolate, so that's the answer
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(Seconds));
+}
+
+Metrics::THistogram& Metrics::THistogramFamily::WithLabel(const std::string& Value) {
+    {
+        std::shared_lock Lock(mMutex);
+        if (auto Iter = mHistograms.find(Value); Iter != mHistograms.end()) {
+            return *Iter->second;
+        }
+    }
+    std::unique_lock Lock(mMutex);
+    auto& Histogram = mHistograms[Value];
+    if (!Histogram) {
+        Histogram = std::make_unique<THistogram>();
+    }
+    return *Histogram;
+}
+
+std::map<std::string, Metrics::THistogram::TSnapshot> Metrics::THistogramFamily::Snapshot() const {
+    std::shared_lock Lock(mMutex);
+    std::map<std::string, THistogram::TSnapshot> Result;
+    for (const auto& [Label, Histogram] : mHistograms) {
+        Result[Label] = Histogram->Snapshot();
+    }
+    return Result;
+}
+
+void Metrics::TPacketCounters::Add(const std::vector<uint8_t>& Packet, size_t Bytes) {
+    if (Packet.empty()) {
+        return;
+    }
+    constexpr std::string_view ABG = "ABG:";
+    size_t Index = Packet.front();
+    if (Packet.size() >= ABG.size() && std::equal(ABG.begin(), ABG.end(), Packet.begin())) {
+        Index = CompressedIndex;
+    }
+    mPackets.Add(Index);
+    mBytes.Add(Index, Bytes);
+}
+
+void Metrics::TPacketCounters::Add(char Code, size_t Bytes) {
+    mPackets.Add(uint8_t(Code));
+    mBytes.Add(uint8_t(Code), Bytes);
+}
+
+struct TRegisteredGauge {
+    std::string Name;
+    std::string Help;
+    Metrics::TGaugeFunction Fn;
+    const char* Type;
+};
+
+static std::mutex sGaugesMutex;
+static std::map<size_t, TRegisteredGauge> sGauges;
+static size_t sNextGaugeID = 1;
+
+static Metrics::TGaugeRegistration Register(const std::string& Name, const std::string& Help, Metrics::TGaugeFunction Fn, const char* Type) {
+    std::unique_lock Lock(sGaugesMutex);
+    const auto ID = sNextGaugeID++;
+    sGauges[ID] = TRegisteredGauge { Name, Help, std::move(Fn), Type };
+    return Metrics::TGaugeRegistration(ID);
+}
+
+Metrics::TGaugeRegistration Metrics::RegisterGauge(const std::string& Name, const std::string& Help, TGaugeFunction Fn) {
+    return Register(Name, Help, std::move(Fn), "gauge");
+}
+
+Metrics::TGaugeRegistration Metrics::RegisterCounter(const std::string& Name, const std::string& Help, TGaugeFunction Fn) {
+    return Register(Name, Help, std::move(Fn), "counter");
+}
+
+Metrics::TGaugeRegistration& Metrics::TGaugeRegistration::operator=(TGaugeRegistration&& Other) noexcept {
+    if (this != &Other) {
+        Reset();
+        mID = std::exchange(Other.mID, 0);
+    }
+    return *this;
+}
+
+void Metrics::TGaugeRegistration::Reset() {
+    if (mID != 0) {
+        std::unique_lock Lock(sGaugesMutex);
+        sGauges.erase(mID);
+        mID = 0;
+    }
+}
+
+std::string Metrics::EscapeLabel(const std::string& Value) {
+    std::string Result;
+    Result.reserve(Value.size());
+    for (char c : Value) {
+        switch (c) {
+        case '\\':
+            Result += "\\\\";
+            break;
+        case '"':
+            Result += "\\\"";
+            break;
+        case '\n':
+            Result += "\\n";
+            break;
+        default:
+            Result += c;
+        }
+    }
+    return Result;
+}
+
+static std::string PacketCodeLabel(size_t Index) {
+    if (Index == Metrics::TPacketCounters::CompressedIndex) {
+        return "compressed";
+    }
+    if (Index >= 0x20 && Index < 0x7f) {
+        return Metrics::EscapeLabel(std::string(1, char(Index)));
+    }
+    return fmt::format("0x{:02x}", Index);
+}
+
+static void RenderPacketCounters(std::string& Out, const std::string& Direction, const Metrics::TPacketCounters& Counters) {
+    std::string Packets = fmt::format("# HELP beammp_packets_{0}_total Packets {0}, by packet code.\n# TYPE beammp_packets_{0}_total counter\n", Direction);
+    std::string Bytes = fmt::format("# HELP beammp_bytes_{0}_total Bytes {0} on the wire, by packet code.\n# TYPE beammp_bytes_{0}_total counter\n", Direction);
+    for (size_t i = 0; i <= Metrics::TPacketCounters::CompressedIndex; ++i) {
+        if (auto Count = Counters.Packets(i); Count > 0) {
+            const auto Label = PacketCodeLabel(i);
+            Packets += fmt::format("beammp_packets_{}_total{{code=\"{}\"}} {}\n", Direction, Label, Count);
+            Bytes += fmt::format("beammp_bytes_{}_total{{code=\"{}\"}} {}\n", Direction, Label, Counters.Bytes(i));
+        }
+    }
+    Out += Packets + Bytes;
+}
+
+static void RenderHistogram(std::string& Out, const std::string& Name, const std::string& Labels, const Metrics::THistogram::TSnapshot& Snapshot) {
+    const std::string Prefix = Labels.empty() ? "" : Labels + ",";
+    uint64_t Cumulative = 0;
+    for (size_t i = 0; i < Metrics::THistogram::Buckets.size(); ++i) {
+        Cumulative += Snapshot.Counts[i];
+        Out += fmt::format("{}_bucket{{{}le=\"{}\"}} {}\n", Name, Prefix, Metrics::THistogram::Buckets[i], Cumulative);
+    }
+    Cumulative += Snapshot.Counts.back();
+    Out += fmt::format("{}_bucket{{{}le=\"+Inf\"}} {}\n", Name, Prefix, Cumulative);
+    const std::string Braced = Labels.empty() ? "" : "{" + Labels + "}";
+    Out += fmt::format("{}_sum{} {}\n", Name, Braced, Snapshot.Sum);
+    Out += fmt::format("{}_count{} {}\n", Name, Braced, Snapshot.Count);
+}
+
+static void RenderHistogramHeader(std::string& Out, const std::string& Name, const std::string& Help) {
+    Out += fmt::format("# HELP {} {}\n# TYPE {} histogram\n", Name, Help, Name);
+}
+
+static std::optional<size_t> ProcessThreadCount() {
+#if defined(BEAMMP_LINUX)
+    std::error_code ec;
+    size_t Count = 0;
+    for (auto Iter = fs::directory_iterator("/proc/self/task", ec); !ec && Iter != fs::directory_iterator(); Iter.increment(ec)) {
+        ++Count;
+    }
+    if (!ec) {
+        return Count;
+    }
+#endif
+    return std::nullopt;
+}
+
+std::string Metrics::Render() {
+    std::string Out;
+    RenderPacketCounters(Out, "received", PacketsReceived);
+    RenderPacketCounters(Out, "sent", PacketsSent);
+
+    RenderHistogramHeader(Out, "beammp_compression_seconds", "Time spent compressing and decompressing packets.");
+    RenderHistogram(Out, "beammp_compression_seconds", "op=\"compress\"", CompressTime.Snapshot());
+    RenderHistogram(Out, "beammp_compression_seconds", "op=\"decompress\"", DecompressTime.Snapshot());
+
+    RenderHistogramHeader(Out, "beammp_auth_request_seconds", "Time from queueing an auth request until it's answered.");
+    RenderHistogram(Out, "beammp_auth_request_seconds", "", AuthRequestTime.Snapshot());
+
+    RenderHistogramHeader(Out, "beammp_lua_event_handler_seconds", "Time spent in Lua event handlers, by event.");
+    for (const auto& [Event, Snapshot] : LuaEventHandlerTime.Snapshot()) {
+        RenderHistogram(Out, "beammp_lua_event_handler_seconds", fmt::format("event=\"{}\"", EscapeLabel(Event)), Snapshot);
+    }
+
+    RenderHistogramHeader(Out, "beammp_lua_queue_wait_seconds", "Time Lua calls wait in a state's queue before they start, by state.");
+    for (const auto& [State, Snapshot] : LuaQueueWaitTime.Snapshot()) {
+        RenderHistogram(Out, "beammp_lua_queue_wait_seconds", fmt::format("state=\"{}\"", EscapeLabel(State)), Snapshot);
+    }
+
+    RenderHistogramHeader(Out, "beammp_lua_handler_seconds", "CPU time spent in each Lua function the server called, by state and function.");
+    for (const auto& [Handler, Snapshot] : LuaHandlerTime.Snapshot()) {
+        const auto Separator = Handler.rfind(':');
+        RenderHistogram(Out, "beammp_lua_handler_seconds", fmt::format("state=\"{}\",function=\"{}\"", EscapeLabel(Handler.substr(0, Separator)), EscapeLabel(Handler.substr(Separator + 1))), Snapshot);
+    }
+
+    RenderHistogramHeader(Out, "beammp_probe_seconds", "Timings of instrumented code paths (packet parsing, sending, timers), by probe.");
+    for (const auto& [Probe, Snapshot] : ProbeTime.Snapshot()) {
+        RenderHistogram(Out, "beammp_probe_seconds", fmt::format("probe=\"{}\"", EscapeLabel(Probe)), Snapshot);
+    }
+
+    if (auto Threads = ProcessThreadCount()) {
+        Out += fmt::format("# HELP beammp_threads Threads in the server process.\n# TYPE beammp_threads gauge\nbeammp_threads {}\n", *Threads);
+    }
+
+    std::unique_lock Lock(sGaugesMutex);
+    for (const auto& [ID, Gauge] : sGauges) {
+        Out += fmt::format("# HELP {} {}\n# TYPE {} {}\n", Gauge.Name, Gauge.Help, Gauge.Name, Gauge.Type);
+        for (const auto& Sample : Gauge.Fn()) {
+            if (Sample.Labels.empty()) {
+                Out += fmt::format("{} {}\n", Gauge.Name, Sample.Value);
+            } else {
+                Out += fmt::format("{}{{{}}} {}\n", Gauge.Name, Sample.Labels, Sample.Value);
+            }
+        }
+    }
+    return Out;
+}
+
+TEST_CASE("Metrics::TShardedCounters") {
+    Metrics::TShardedCounters<2> Counters;
+    std::vector<std::thread> Threads;
+    for (int i = 0; i < 8; ++i) {
+        Threads.emplace_back([&] {
+            for (int j = 0; j < 10000; ++j) {
+                Counters.Add(0);
+                Counters.Add(1, 2);
+            }
+        });
+    }
+    for (auto& Thread : Threads) {
+        Thread.join();
+    }
+    CHECK_EQ(Counters.Sum(0), 80000);
+    CHECK_EQ(Counters.Sum(1), 160000);
+}
+
+TEST_CASE("Metrics::THistogram") {
+    Metrics::THistogram Histogram;
+    Histogram.Observe(std::chrono::nanoseconds(500)); // first bucket
+    Histogram.Observe(std::chrono::microseconds(5)); // exactly on a bound
+    Histogram.Observe(std::chrono::milliseconds(1));
+    Histogram.Observe(std::chrono::seconds(60)); // +Inf
+    auto Snapshot = Histogram.Snapshot();
+    CHECK_EQ(Snapshot.Count, 4);
+    CHECK_EQ(Snapshot.Counts[0], 1);
+    CHECK_EQ(Snapshot.Counts[2], 1);
+    CHECK_EQ(Snapshot.Counts[8], 1);
+    CHECK_EQ(Snapshot.Counts.back(), 1);
+    CHECK(Snapshot.Sum == doctest::Approx(60.0010055));
+}
+
+TEST_CASE("Metrics::THistogram::TSnapshot::Quantile") {
+    Metrics::THistogram Histogram;
+    CHECK(Histogram.Snapshot().Quantile(0.5) == std::chrono::nanoseconds(0));
+    for (int i = 1; i <= 1000; ++i) {
+        Histogram.Observe(std::chrono::microseconds(i));
+    }
+    auto Snapshot = Histogram.Snapshot();
+    // 250 samples in (250us, 500us] and 500 in (500us, 1ms], so these interpolate exactly
+    CHECK(Snapshot.Quantile(0.5) == std::chrono::microseconds(500));
+    CHECK(std::chrono::abs(Snapshot.Quantile(0.99) - std::chrono::microseconds(990)) < std::chrono::microseconds(1));
+
+    // what was recorded since a baseline
+    const auto Baseline = Snapshot;
+    Histogram.Observe(std::chrono::seconds(2));
+    Snapshot = Histogram.Snapshot();
+    Snapshot -= Baseline;
+    CHECK_EQ(Snapshot.Count, 1);
+    CHECK(Snapshot.Quantile(0.5) > std::chrono::seconds(1));
+    CHECK(Snapshot.Quantile(0.5) <= std::chrono::milliseconds(2500));
+    Snapshot += Baseline;
+    CHECK_EQ(Snapshot.Count, 1001);
+
+    // nothing to interpolate towards past the last bound
+    Metrics::THistogram Slow;
+    Slow.Observe(std::chrono::seconds(60));
+    CHECK(Slow.Snapshot().Quantile(0.99) == std::chrono::seconds(10));
+}
+
+TEST_CASE("Metrics::Render") {
+    Metrics::TPacketCounters Counters;
+    Counters.Add('O', 100);
+    Counters.Add(std::vector<uint8_t> { 'A', 'B', 'G', ':', 0 }, 5);
+    std::string Out;
+    RenderPacketCounters(Out, "test", Counters);
+    CHECK(Out.find("beammp_packets_test_total{code=\"O\"} 1\n") != std::string::npos);
+    CHECK(Out.find("beammp_bytes_test_total{code=\"O\"} 100\n") != std::string::npos);
+    CHECK(Out.find("beammp_packets_test_total{code=\"compressed\"} 1\n") != std::string::npos);
+
+    {
+        auto Gauge = Metrics::RegisterGauge("beammp_test_gauge", "Test.", [] {
+            return std::vector<Metrics::TGaugeSample> { { "state=\"a\"", 3 } };
+        });
+        CHECK(Metrics::Render().find("beammp_test_gauge{state=\"a\"} 3\n") != std::string::npos);
+        CHECK(Metrics::Render().find("# TYPE beammp_test_gauge gauge\n") != std::string::npos);
+    }
+    {
+        auto Counter = Metrics::RegisterCounter("beammp_test_total", "Test.", [] {
+            return std::vector<Metrics::TGaugeSample> { { "", 7 } };
+        });
+        const auto Rendered = Metrics::Render();
+        CHECK(Rendered.find("# TYPE beammp_test_total counter\n") != std::string::npos);
+        CHECK(Rendered.find("beammp_test_total 7\n") != std::string::npos);
+    }
+    // unregistered once the registration is gone
+    CHECK(Metrics::Render().find("beammp_test_gauge") == std::string::npos);
+    CHECK_EQ(Metrics::EscapeLabel("a\"b\\c\nd"), "a\\\"b\\\\c\\nd");
+
+    Metrics::LuaHandlerTime.WithLabel("Plugin:onTestHandler").Observe(std::chrono::milliseconds(2));
+    CHECK(Metrics::Render().find("beammp_lua_handler_seconds_count{state=\"Plugin\",function=\"onTestHandler\"} 1\n") != std::string::npos);
+}
@@ -0,0 +1,280 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "TAuthService.h"
+
+#include "Common.h"
+#include "Env.h"
+#include "Http.h"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+
+TAuthService::TAuthService(size_t WorkerCount, std::chrono::seconds CacheTTL, TBackend Backend)
+    : mBackend(std::move(Backend))
+    , mCacheTTL(CacheTTL) {
+    if (!mBackend) {
+        if (auto Mock = Env::Get(Env::Key::AUTH_MOCK); Mock.has_value()) {
+#ifdef BEAMMP_ENABLE_AUTH_MOCK
+            int DelayMs = 0;
+            std::from_chars(Mock->data(), Mock->data() + Mock->size(), DelayMs);
+            beammp_warnf("Using the mock authentication backend ({}ms delay), any key will be accepted!", DelayMs);
+            mBackend = [DelayMs](const std::string& Body) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(DelayMs));
+                return MockBackend(Body);
+            };
+#else
+            beammp_warnf("{} is set, but this server was built without the mock authentication backend, ignoring it.", Env::ToString(Env::Key::AUTH_MOCK));
+#endif
+        }
+    }
+    for (size_t i = 0; i < std::max<size_t>(WorkerCount, 1); ++i) {
+        mWorkers.emplace_back(&TAuthService::WorkerMain, this, i);
+    }
+}
+
+TAuthService::~TAuthService() {
+    {
+        std::unique_lock Lock(mMutex);
+        mShutdown = true;
+    }
+    mQueueCond.notify_all();
+    for (auto& Worker : mWorkers) {
+        if (Worker.joinable()) {
+            Worker.join();
+        }
+    }
+}
+
+std::future<std::string> TAuthService::Authenticate(const std::string& Key, const std::string& Body) {
+    std::promise<std::string> Promise;
+    auto Future = Promise.get_future();
+    std::unique_lock Lock(mMutex);
+    ++mStats.Requests;
+    auto CacheIter = mCache.find(Key);
+    if (CacheIter != mCache.end()) {
+        if (CacheIter->second.Expiry > std::chrono::steady_clock::now()) {
+            ++mStats.CacheHits;
+            Promise.set_value(CacheIter->second.Response);
+            return Future;
+        }
+        mCache.erase(CacheIter);
+    }
+    auto InFlightIter = mInFlight.find(Key);
+    if (InFlightIter != mInFlight.end()) {
+        // someone with the same key is already waiting, share their request
+        ++mStats.Coalesced;
+        InFlightIter->second.push_back(std::move(Promise));
+        return Future;
+    }
+    if (mQueue.size() >= MaxQueuedRequests) {
+        ++mStats.Rejected;
+        Promise.set_exception(std::make_exception_ptr(std::runtime_error("authentication queue is full")));
+        return Future;
+    }
+    mInFlight[Key].push_back(std::move(Promise));
+    mQueue.push(TRequest { Key, Body, std::chrono::steady_clock::now() });
+    Lock.unlock();
+    mQueueCond.notify_one();
+    return Future;
+}
+
+TAuthService::TStats TAuthService::GetStats() const {
+    std::unique_lock Lock(mMutex);
+    auto Stats = mStats;
+    Stats.Pending = mInFlight.size();
+    std::vector<double> Latencies(mLatencies.begin(), mLatencies.begin() + long(std::min(mLatencyCount, mLatencies.size())));
+    Lock.unlock();
+    if (Latencies.empty()) {
+        return Stats;
+    }
+    auto Percentile = [&Latencies](double P) {
+        auto Index = size_t(P * double(Latencies.size() - 1));
+        std::nth_element(Latencies.begin(), Latencies.begin() + long(Index), Latencies.end());
+        return Latencies[Index];
+    };
+    Stats.P50Ms = Percentile(0.5);
+    Stats.P90Ms = Percentile(0.9);
+    Stats.P99Ms = Percentile(0.99);
+    return Stats;
+}
+
+std::string TAuthService::MockBackend(const std::string& Body) {
+    auto Key = nlohmann::json::parse(Body).at("key").get<std::string>();
+    auto Id = fmt::format("{:016x}", std::hash<std::string> {}(Key));
+    return nlohmann::json {
+        { "username", "mock_" + Id.substr(0, 8) },
+        { "roles", "USER" },
+        { "guest", false },
+        { "identifiers", nlohmann::json::array({ "beammp:" + Id }) },
+    }.dump();
+}
+
+void TAuthService::WorkerMain(size_t Index) {
+    RegisterThread("Auth_" + std::to_string(Index));
+    // kept open between requests, so only the first request pays for the TLS handshake
+    std::unique_ptr<httplib::SSLClient> Client;
+    while (true) {
+        TRequest Request;
+        {
+            std::unique_lock Lock(mMutex);
+            mQueueCond.wait(Lock, [this] { return mShutdown || !mQueue.empty(); });
+            if (mShutdown) {
+                break;
+            }
+            Request = std::move(mQueue.front());
+            mQueue.pop();
+        }
+        try {
+            std::string Response;
+            if (mBackend) {
+                Response = mBackend(Request.Body);
+            } else {
+                if (!Client) {
+                    Client = std::make_unique<httplib::SSLClient>(Application::GetBackendUrlForAuth(), 443);
+                    Client->enable_server_certificate_verification(false);
+                    Client->set_address_family(AF_INET);
+                    Client->set_keep_alive(true);
+                    Client->set_connection_timeout(std::chrono::seconds(5));
+                    Client->set_read_timeout(std::chrono::seconds(10));
+                }
+                auto Res = Client->Post("/pkToUser", Request.Body.c_str(), Request.Body.size(), "application/json");
+                if (!Res) {
+                    // the session is likely dead, reconnect on the next request
+                    Client.reset();
+                    throw std::runtime_error("POST to auth backend failed: " + httplib::to_string(Res.error()));
+                }
+                Response = Res->body;
+            }
+            RecordLatency(std::chrono::steady_clock::now() - Request.QueuedAt);
+            Complete(Request, Response, nullptr);
+        } catch (const std::exception& e) {
+            beammp_debugf("Authentication request failed: {}", e.what());
+            Complete(Request, "", std::current_exception());
+        }
+    }
+    // fail everyone still waiting
+    std::unique_lock Lock(mMutex);
+    for (auto& [Key, Promises] : mInFlight) {
+        for (auto& Promise : Promises) {
+            Promise.set_exception(std::make_exception_ptr(std::runtime_error("authentication service shut down")));
+        }
+    }
+    mInFlight.clear();
+}
+
+void TAuthService::Complete(const TRequest& Request, const std::string& Response, std::exception_ptr Error) {
+    std::vector<std::promise<std::string>> Promises;
+    {
+        std::unique_lock Lock(mMutex);
+        auto Iter = mInFlight.find(Request.Key);
+        if (Iter != mInFlight.end()) {
+            Promises = std::move(Iter->second);
+            mInFlight.erase(Iter);
+        }
+        if (Error) {
+            ++mStats.Failures;
+        } else if (mCacheTTL.count() > 0 && IsValidIdentity(Response)) {
+            if (mCache.size() >= MaxCacheEntries) {
+                auto Now = std::chrono::steady_clock::now();
+                std::erase_if(mCache, [&Now](const auto& Entry) { return Entry.second.Expiry <= Now; });
+                if (mCache.size() >= MaxCacheEntries) {
+                    mCache.erase(mCache.begin());
+                }
+            }
+            mCache[Request.Key] = TCacheEntry { Response, std::chrono::steady_clock::now() + mCacheTTL };
+        }
+    }
+    for (auto& Promise : Promises) {
+        if (Error) {
+            Promise.set_exception(Error);
+        } else {
+            Promise.set_value(Response);
+        }
+    }
+}
+
+void TAuthService::RecordLatency(std::chrono::steady_clock::duration Latency) {
+    Metrics::AuthRequestTime.Observe(Latency);
+    std::unique_lock Lock(mMutex);
+    mLatencies[mLatencyCount % mLatencies.size()] = std::chrono::duration<double, std::milli>(Latency).count();
+    ++mLatencyCount;
+}
+
+bool TAuthService::IsValidIdentity(const std::string& Response) {
+    try {
+        auto Json = nlohmann::json::parse(Response);
+        return Json["username"].is_string() && Json["roles"].is_string()
+            && Json["guest"].is_boolean() && Json["identifiers"].is_array();
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+TEST_CASE("TAuthService") {
+    std::atomic_size_t BackendCalls = 0;
+    std::promise<void> Unblock;
+    auto Blocker = Unblock.get_future().share();
+    TAuthService Service(2, std::chrono::seconds(60), [&](const std::string& Body) {
+        Blocker.wait();
+        ++BackendCalls;
+        return MockBackend(Body);
+    });
+    auto Body = nlohmann::json { { "key", "some key" } }.dump();
+
+    // concurrent requests for the same key share one backend call
+    auto First = Service.Authenticate("some key", Body);
+    auto Second = Service.Authenticate("some key", Body);
+    Unblock.set_value();
+    auto FirstResult = First.get();
+    CHECK_EQ(FirstResult, Second.get());
+    CHECK_EQ(BackendCalls, 1);
+    CHECK(nlohmann::json::parse(FirstResult)["username"].is_string());
+
+    // rejoins are served from the cache
+    CHECK_EQ(Service.Authenticate("some key", Body).get(), FirstResult);
+    CHECK_EQ(BackendCalls, 1);
+
+    // a different key is a different identity
+    auto OtherResult = Service.Authenticate("other key", nlohmann::json { { "key", "other key" } }.dump()).get();
+    CHECK_NE(OtherResult, FirstResult);
+    CHECK_EQ(BackendCalls, 2);
+
+    auto Stats = Service.GetStats();
+    CHECK_EQ(Stats.Requests, 4);
+    CHECK_EQ(Stats.CacheHits, 1);
+    CHECK_EQ(Stats.Coalesced, 1);
+    CHECK_EQ(Stats.Failures, 0);
+    CHECK_EQ(Stats.Pending, 0);
+    CHECK(Stats.P99Ms >= Stats.P50Ms);
+}
+
+TEST_CASE("TAuthService failures are not cached") {
+    std::atomic_size_t BackendCalls = 0;
+    TAuthService Service(1, std::chrono::seconds(60), [&](const std::string&) -> std::string {
+        ++BackendCalls;
+        throw std::runtime_error("backend down");
+    });
+    CHECK_THROWS(Service.Authenticate("key", "{}").get());
+    CHECK_THROWS(Service.Authenticate("key", "{}").get());
+    CHECK_EQ(BackendCalls, 2);
+    CHECK_EQ(Service.GetStats().Failures, 2);
+}
@@ -56,6 +56,13 @@ static constexpr std::string_view StrPassword = "Password";
 static constexpr std::string_view StrSendErrors = "SendErrors";
 static constexpr std::string_view StrSendErrorsMessageEnabled = "SendErrorsShowMessage";
 static constexpr std::string_view StrHideUpdateMessages = "ImScaredOfUpdates";
+static constexpr std::string_view StrLogMaxSizeMB = "LogMaxSizeMB";
+static constexpr std::string_view StrLogRotateHours = "LogRotateHours";
+static constexpr std::string_view StrLogRetention = "LogRetention";
+static constexpr std::string_view StrLuaHookTimeout = "LuaHookTimeout";
+static constexpr std::string_view StrLuaStateMemoryLimitMB = "LuaStateMemoryLimitMB";
+static constexpr std::string_view StrLuaCallBudgetMs = "LuaCallBudgetMs";
+static constexpr std::string_view StrLuaEventBudgetsMs = "LuaEventBudgetsMs";
 
 TEST_CASE("TConfig::TConfig") {
     const std::string CfgFile = "beammp_server_testconfig.toml";
@@ -84,6 +91,28 @@ TEST_CASE("TConfig::TConfig") {
     fs::remove(CfgFile);
 }
 
+TEST_CASE("TConfig LuaEventBudgetsMs") {
+    const std::string CfgFile = "beammp_server_testconfig_budgets.toml";
+    {
+        std::ofstream Out(CfgFile);
+        Out << "[Misc]\nLuaEventBudgetsMs = { onChatMessage = 50, onPlayerJoin = 0, onBroken = \"fast\" }\n";
+    }
+    const auto Saved = Application::Settings.LuaEventBudgetsMs;
+    Application::Settings.LuaEventBudgetsMs.clear();
+
+    TConfig Cfg(CfgFile);
+
+    const auto& Budgets = Application::Settings.LuaEventBudgetsMs;
+    CHECK_EQ(Budgets.size(), 2);
+    CHECK_EQ(Budgets.at("onChatMessage"), 50);
+    CHECK_EQ(Budgets.at("onPlayerJoin"), 0);
+    // not an integer, so it's ignored
+    CHECK_FALSE(Budgets.contains("onBroken"));
+
+    Application::Settings.LuaEventBudgetsMs = Saved;
+    fs::remove(CfgFile);
+}
+
 TConfig::TConfig(const std::string& ConfigFileName)
     : mConfigFileName(ConfigFileName) {
     Application::SetSubsystemStatus("Config", Application::Status::Starting);
@@ -141,6 +170,24 @@ void TConfig::FlushToFile() {
     SetComment(data["Misc"][StrSendErrors.data()].comments(), " If SendErrors is `true`, the server will send helpful info about crashes and other issues back to the BeamMP developers. This info may include your config, who is on your server at the time of the error, and similar general information. This kind of data is vital in helping us diagnose and fix issues faster. This has no impact on server performance. You can opt-out of this system by setting this to `false`");
     data["Misc"][StrSendErrorsMessageEnabled.data()] = Application::Settings.SendErrorsMessageEnabled;
     SetComment(data["Misc"][StrSendErrorsMessageEnabled.data()].comments(), " You can turn on/off the SendErrors message you get on startup here");
+    data["Misc"][StrLogMaxSizeMB.data()] = Application::Settings.LogMaxSizeMB;
+    SetComment(data["Misc"][StrLogMaxSizeMB.data()].comments(), " Server.log is rotated and compressed once it reaches this size in megabytes. 0 disables this.");
+    data["Misc"][StrLogRotateHours.data()] = Application::Settings.LogRotateHours;
+    SetComment(data["Misc"][StrLogRotateHours.data()].comments(), " Server.log is rotated and compressed after this many hours. 0 disables this.");
+    data["Misc"][StrLogRetention.data()] = Application::Settings.LogRetention;
+    SetComment(data["Misc"][StrLogRetention.data()].comments(), " How many rotated logs to keep, compressed (Server.<date>_<time>.log.gz) or not, the oldest are deleted. 0 keeps all of them.");
+    data["Misc"][StrLuaHookTimeout.data()] = Application::Settings.LuaHookTimeout;
+    SetComment(data["Misc"][StrLuaHookTimeout.data()].comments(), " Milliseconds to wait for Lua handlers of events which can cancel what a player did (onVehicleSpawn, onVehicleEdited, onChatMessage, onPlayerAuth). If a handler takes longer, what the player did is cancelled (or they are not let in). 0 waits for as long as they take.");
+    data["Misc"][StrLuaStateMemoryLimitMB.data()] = Application::Settings.LuaStateMemoryLimitMB;
+    SetComment(data["Misc"][StrLuaStateMemoryLimitMB.data()].comments(), " Megabytes of memory each Lua plugin state may use. Past this, the plugin gets 'not enough memory' errors instead of the server running out of memory. 0 disables the limit.");
+    data["Misc"][StrLuaCallBudgetMs.data()] = Application::Settings.LuaCallBudgetMs;
+    SetComment(data["Misc"][StrLuaCallBudgetMs.data()].comments(), " Milliseconds of CPU time a single call into a Lua plugin (an event handler, a timer) may use. Calls which use more, e.g. because they are stuck in a loop, are aborted with an error. Time spent waiting, e.g. in MP.Sleep, doesn't count. Servers before this setting existed never aborted calls, set it to 0 to keep that.");
+    toml::table EventBudgets;
+    for (const auto& [Event, Budget] : Application::Settings.LuaEventBudgetsMs) {
+        EventBudgets[Event] = Budget;
+    }
+    data["Misc"][StrLuaEventBudgetsMs.data()] = EventBudgets;
+    SetComment(data["Misc"][StrLuaEventBudgetsMs.data()].comments(), " LuaCallBudgetMs for the handlers of specific events, e.g. { onChatMessage = 100 }. 0 disables it for that event.");
     std::stringstream Ss;
     Ss << "# This is the BeamMP-Server config file.\n"
           "# Help & Documentation: `https://wiki.beammp.com/en/home/server-maintenance`\n"
@@ -211,6 +258,18 @@ void TConfig::TryReadValue(toml::value& Table, const std::string& Category, cons
     }
 }
 
+void TConfig::TryReadValue(toml::value& Table, const std::string& Category, const std::string_view& Key, std::unordered_map<std::string, int>& OutValue) {
+    if (Table[Category.c_str()][Key.data()].is_table()) {
+        for (const auto& [Name, Value] : Table[Category.c_str()][Key.data()].as_table()) {
+            if (Value.is_integer()) {
+                OutValue[Name] = int(Value.as_integer());
+            } else {
+                beammp_warnf("{}.{}: \"{}\" has to be an integer, ignoring it", Category, Key, Name);
+            }
+        }
+    }
+}
+
 void TConfig::ParseFromFile(std::string_view name) {
     try {
         toml::value data = toml::parse<toml::preserve_comments>(name.data());
@@ -232,6 +291,13 @@ void TConfig::ParseFromFile(std::string_view name) {
         TryReadValue(data, "Misc", StrSendErrors, "", Application::Settings.SendErrors);
         TryReadValue(data, "Misc", StrHideUpdateMessages, "", Application::Settings.HideUpdateMessages);
         TryReadValue(data, "Misc", StrSendErrorsMessageEnabled, "", Application::Settings.SendErrorsMessageEnabled);
+        TryReadValue(data, "Misc", StrLogMaxSizeMB, "", Application::Settings.LogMaxSizeMB);
+        TryReadValue(data, "Misc", StrLogRotateHours, "", Application::Settings.LogRotateHours);
+        TryReadValue(data, "Misc", StrLogRetention, "", Application::Settings.LogRetention);
+        TryReadValue(data, "Misc", StrLuaHookTimeout, "", Application::Settings.LuaHookTimeout);
+        TryReadValue(data, "Misc", StrLuaStateMemoryLimitMB, "", Application::Settings.LuaStateMemoryLimitMB);
+        TryReadValue(data, "Misc", StrLuaCallBudgetMs, "", Application::Settings.LuaCallBudgetMs);
+        TryReadValue(data, "Misc", StrLuaEventBudgetsMs, Application::Settings.LuaEventBudgetsMs);
     } catch (const std::exception& err) {
         beammp_error("Error parsing config file value: " + std::string(err.what()));
         mFailed = true;
@@ -267,6 +333,15 @@ void TConfig::PrintDebug() {
     beammp_debug(std::string(StrTags) + ": " + TagsAsPrettyArray());
     beammp_debug(std::string(StrLogChat) + ": \"" + (Application::Settings.LogChat ? "true" : "false") + "\"");
     beammp_debug(std::string(StrResourceFolder) + ": \"" + Application::Settings.Resource + "\"");
+    beammp_debug(std::string(StrLogMaxSizeMB) + ": " + std::to_string(Application::Settings.LogMaxSizeMB));
+    beammp_debug(std::string(StrLogRotateHours) + ": " + std::to_string(Application::Settings.LogRotateHours));
+    beammp_debug(std::string(StrLogRetention) + ": " + std::to_string(Application::Settings.LogRetention));
+    beammp_debug(std::string(StrLuaHookTimeout) + ": " + std::to_string(Application::Settings.LuaHookTimeout));
+    beammp_debug(std::string(StrLuaStateMemoryLimitMB) + ": " + std::to_string(Application::Settings.LuaStateMemoryLimitMB));
+    beammp_debug(std::string(StrLuaCallBudgetMs) + ": " + std::to_string(Application::Settings.LuaCallBudgetMs));
+    for (const auto& [Event, Budget] : Application::Settings.LuaEventBudgetsMs) {
+        beammp_debugf("{}.{}: {}", StrLuaEventBudgetsMs, Event, Budget);
+    }
     // special!
     beammp_debug("Key Length: " + std::to_string(Application::Settings.Key.length()) + "");
     beammp_debug("Password Protected: " + std::string(Application::Settings.Password.empty() ? "false" : "true"));
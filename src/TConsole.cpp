@@ -25,6 +25,8 @@
 #include "LuaAPI.h"
 #include "TLuaEngine.h"
 
+#include <cctype>
+#include <cmath>
 #include <ctime>
 #include <mutex>
 #include <sstream>
@@ -70,8 +72,7 @@ TEST_CASE("TrimString") {
     CHECK(TrimString("") == "");
 }
 
-static std::string GetDate() {
-    std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+static std::string GetDate(std::chrono::system_clock::time_point now) {
     time_t tt = std::chrono::system_clock::to_time_t(now);
     auto local_tm = std::localtime(&tt);
     char buf[30];
@@ -94,62 +95,22 @@ static std::string GetDate() {
     return date;
 }
 
-void TConsole::BackupOldLog() {
-    fs::path Path = "Server.log";
-    if (fs::exists(Path)) {
-        auto OldLog = Path.filename().stem().string() + ".old.log";
-        try {
-            fs::rename(Path, OldLog);
-            beammp_debug("renamed old log file to '" + OldLog + "'");
-        } catch (const std::exception& e) {
-            beammp_warn(e.what());
-        }
-        /*
-        int err = 0;
-        zip* z = zip_open("ServerLogs.zip", ZIP_CREATE, &err);
-        if (!z) {
-            std::cerr << GetPlatformAgnosticErrorString() << std::endl;
-            return;
-        }
-        FILE* File = std::fopen(Path.string().c_str(), "r");
-        if (!File) {
-            std::cerr << GetPlatformAgnosticErrorString() << std::endl;
-            return;
-        }
-        std::vector<uint8_t> Buffer;
-        Buffer.resize(fs::file_size(Path));
-        std::fread(Buffer.data(), 1, Buffer.size(), File);
-        std::fclose(File);
-
-        auto s = zip_source_buffer(z, Buffer.data(), Buffer.size(), 0);
-
-        auto TimePoint = fs::last_write_time(Path);
-        auto Secs = TimePoint.time_since_epoch().count();
-        auto MyTimeT = std::time(&Secs);
-
-        std::string NewName = Path.stem().string();
-        NewName += "_";
-        std::string Time;
-        Time.resize(32);
-        size_t n = strftime(Time.data(), Time.size(), "%F_%H.%M.%S", localtime(&MyTimeT));
-        Time.resize(n);
-        NewName += Time;
-        NewName += ".log";
-
-        zip_file_add(z, NewName.c_str(), s, 0);
-        zip_close(z);
-    */
-    }
+static TLogFile::TLimits LogLimits() {
+    return {
+        uint64_t(std::max(Application::Settings.LogMaxSizeMB, 0)) * 1024 * 1024,
+        std::chrono::hours(std::max(Application::Settings.LogRotateHours, 0)),
+        size_t(std::max(Application::Settings.LogRetention, 0)),
+    };
 }
 
 void TConsole::StartLoggingToFile() {
-    mLogFileStream.open("Server.log");
+    mLogFile = std::make_unique<TLogFile>("Server.log");
+    // the previous run's log is rotated, its compression happens in the background
+    mLogFile->Open(LogLimits());
     Application::Console().Internal().on_write = [this](const std::string& ToWrite) {
         // TODO: Sanitize by removing all ansi escape codes (vt100)
-        std::unique_lock Lock(mLogFileStreamMtx);
-        mLogFileStream.write(ToWrite.c_str(), ToWrite.size());
-        mLogFileStream.write("\n", 1);
-        mLogFileStream.flush();
+        std::unique_lock Lock(mLogFileMutex);
+        mLogFile->Write(ToWrite, LogLimits());
     };
 }
 
@@ -217,6 +178,10 @@ bool TConsole::EnsureArgsCount(const std::vector<std::string>& args, size_t min,
 }
 
 void TConsole::Command_Lua(const std::string&, const std::vector<std::string>& args) {
+    if (!args.empty() && args.at(0) == "profile") {
+        LuaProfile(std::vector<std::string>(args.begin() + 1, args.end()));
+        return;
+    }
     if (!EnsureArgsCount(args, 0, 1)) {
         return;
     }
@@ -233,6 +198,63 @@ void TConsole::Command_Lua(const std::string&, const std::vector<std::string>& a
     }
 }
 
+void TConsole::LuaProfile(const std::vector<std::string>& args) {
+    if (!EnsureArgsCount(args, 2, 3)) {
+        return;
+    }
+    const auto StateId = args.at(0);
+    int Seconds = 0;
+    try {
+        Seconds = std::stoi(args.at(1));
+    } catch (const std::exception&) {
+    }
+    if (Seconds < 1 || Seconds > MaxProfileSeconds) {
+        Application::Console().WriteRaw("Error: Expected a duration of 1 to " + std::to_string(MaxProfileSeconds) + " seconds, got '" + args.at(1) + "'.");
+        return;
+    }
+    const auto Path = args.size() == 3 ? args.at(2) : "profile-" + StateId + ".folded";
+    auto Profiler = mLuaEngine->StartProfile(StateId);
+    if (!Profiler) {
+        Application::Console().WriteRaw("Error: Lua state '" + StateId + "' is not a known state, or is already being profiled.");
+        return;
+    }
+    Application::Console().WriteRaw(fmt::format("Profiling Lua state '{}' for {}s...", StateId, Seconds));
+    auto Report = [Engine = mLuaEngine, StateId, Path, Profiler] {
+        Engine->StopProfile(StateId);
+        const auto SampleMs = double(std::chrono::duration_cast<std::chrono::microseconds>(Profiler->Interval()).count()) / 1000.0;
+        const auto Samples = Profiler->SampleCount();
+        std::stringstream ss;
+        // samples are only taken when the count hook runs, so they give each function's share of the
+        // sampled Lua time, not how long it ran for
+        ss << fmt::format("Profile of Lua state '{}': {} samples, at most one per {:.1f}ms while Lua code runs\n", StateId, Samples, SampleMs);
+        if (Samples > 0) {
+            ss << "Self and Total are samples in which a function was running or on the stack, and their share of all samples.\n"
+               << "Only the running coroutine's stack is sampled, so the functions which resumed a coroutine are missing from its samples.\n";
+            ss << std::left << std::setw(60) << "Function" << std::right << std::setw(12) << "Self" << std::setw(8) << "%"
+               << std::setw(12) << "Total" << std::setw(8) << "%" << "\n";
+            for (const auto& Function : Profiler->Top(ProfileTopCount)) {
+                ss << std::left << std::setw(60) << Function.Name << std::right
+                   << std::setw(12) << Function.Self
+                   << std::setw(8) << fmt::format("{:.1f}", 100.0 * double(Function.Self) / double(Samples))
+                   << std::setw(12) << Function.Total
+                   << std::setw(8) << fmt::format("{:.1f}", 100.0 * double(Function.Total) / double(Samples)) << "\n";
+            }
+            std::ofstream File(Path, std::ios::trunc);
+            if (File) {
+                Profiler->WriteCollapsed(File);
+            }
+            if (File) {
+                ss << "Collapsed stacks written to '" << Path << "', for flamegraph.pl, inferno or speedscope.";
+            } else {
+                ss << "Error: Failed to write collapsed stacks to '" << Path << "'.";
+            }
+        }
+        Application::Console().WriteRaw(ss.str());
+    };
+    // writes the collapsed stacks to a file, so it goes on the blocking pool
+    Application::Scheduler().After("Lua profile", std::chrono::seconds(Seconds), std::move(Report), TScheduler::Kind::Blocking);
+}
+
 void TConsole::Command_Help(const std::string&, const std::vector<std::string>& args) {
     if (!EnsureArgsCount(args, 0)) {
         return;
@@ -245,8 +267,14 @@ void TConsole::Command_Help(const std::string&, const std::vector<std::string>&
         list                    lists all players and info about them
         say <message>           sends the message to all players in chat
         lua [state id]          switches to lua, optionally into a specific state id's lua
+        lua profile <state id> <seconds> [file]
+                                samples where a state's lua spends its time, writes a flamegraph file
         settings [command]      sets or gets settings for the server, run `settings help` for more info
         status                  how the server is doing and what it's up to
+        capture <file>|stop     records all player traffic to a file, for BeamMP-Server-replay
+        latency [reset]         p50/p99/p99.9 timings of packet handling, sending, timers and lua calls
+        trace <file>|stop       records a Chrome/Perfetto trace of what the server is doing
+        traffic [id]            packet and byte rates per player, or per packet type for one player
         clear                   clears the console window)";
     Application::Console().WriteRaw("BeamMP-Server Console: " + std::string(sHelpString));
 }
@@ -363,6 +391,156 @@ void TConsole::Command_Settings(const std::string&, const std::vector<std::strin
     }
 }
 
+void TConsole::Command_Capture(const std::string&, const std::vector<std::string>& args) {
+    if (!EnsureArgsCount(args, 1)) {
+        return;
+    }
+    if (args.at(0) == "stop") {
+        if (!mLuaEngine->Network().GetCaptureStats().Active) {
+            Application::Console().WriteRaw("Error: No capture is running.");
+            return;
+        }
+        mLuaEngine->Network().StopCapture();
+    } else if (!mLuaEngine->Network().StartCapture(args.at(0))) {
+        Application::Console().WriteRaw("Error: Failed to start capture to '" + args.at(0) + "', see log.");
+    }
+}
+
+void TConsole::Command_Trace(const std::string&, const std::vector<std::string>& args) {
+    if (!EnsureArgsCount(args, 1)) {
+        return;
+    }
+    if (args.at(0) == "stop") {
+        if (!Tracing::GetStats().Active) {
+            Application::Console().WriteRaw("Error: No trace is running.");
+            return;
+        }
+        Tracing::Stop();
+    } else if (!Tracing::Start(args.at(0))) {
+        Application::Console().WriteRaw("Error: Failed to start trace to '" + args.at(0) + "', see log.");
+    }
+}
+
+void TConsole::Command_Traffic(const std::string&, const std::vector<std::string>& args) {
+    if (!EnsureArgsCount(args, 0, 1)) {
+        return;
+    }
+    auto KB = [](double Bytes) { return fmt::format("{:.1f}", Bytes / 1024.0); };
+    using Dir = TTrafficStats::Direction;
+    using Via = TTrafficStats::Transport;
+    std::stringstream ss;
+    if (args.empty()) {
+        ss << std::left << std::setw(25) << "Name" << std::setw(6) << "ID" << std::right
+           << std::setw(10) << "In pps" << std::setw(10) << "In kB/s" << std::setw(10) << "UDP kB/s"
+           << std::setw(10) << "Out pps" << std::setw(10) << "Out kB/s" << std::setw(10) << "UDP kB/s" << "\n";
+        mLuaEngine->Server().ForEachClient([&](std::weak_ptr<TClient> Client) -> bool {
+            if (auto locked = Client.lock()) {
+                auto Rates = locked->Traffic().GetRates();
+                auto In = Rates.Total(Dir::In);
+                auto Out = Rates.Total(Dir::Out);
+                ss << std::left << std::setw(25) << locked->GetName() << std::setw(6) << locked->GetID() << std::right
+                   << std::setw(10) << std::lround(In.PacketsPerSecond) << std::setw(10) << KB(In.BytesPerSecond)
+                   << std::setw(10) << KB(Rates.Get(Dir::In, Via::UDP).BytesPerSecond)
+                   << std::setw(10) << std::lround(Out.PacketsPerSecond) << std::setw(10) << KB(Out.BytesPerSecond)
+                   << std::setw(10) << KB(Rates.Get(Dir::Out, Via::UDP).BytesPerSecond) << "\n";
+            }
+            return true;
+        });
+        Application::Console().WriteRaw(ss.str());
+        return;
+    }
+    int ID = -1;
+    try {
+        ID = std::stoi(args.at(0));
+    } catch (const std::exception&) {
+        Application::Console().WriteRaw("Error: Expected a player ID, see `traffic` for a list.");
+        return;
+    }
+    auto MaybeClient = GetClient(mLuaEngine->Server(), ID);
+    if (!MaybeClient || MaybeClient->expired()) {
+        Application::Console().WriteRaw("Error: No player with ID " + std::to_string(ID) + ".");
+        return;
+    }
+    auto Client = MaybeClient->lock();
+    auto Counts = Client->Traffic().Snapshot();
+    auto Rates = Client->Traffic().GetRates();
+    ss << Client->GetName() << " (" << ID << "):\n"
+       << std::left << std::setw(8) << "Code" << std::right
+       << std::setw(10) << "In pps" << std::setw(10) << "In kB/s" << std::setw(12) << "In total"
+       << std::setw(10) << "Out pps" << std::setw(10) << "Out kB/s" << std::setw(12) << "Out total" << "\n";
+    for (size_t Code = 0; Code < 256; ++Code) {
+        const auto& InCount = Counts.ByCode[size_t(Dir::In)][Code];
+        const auto& OutCount = Counts.ByCode[size_t(Dir::Out)][Code];
+        if (InCount.Packets == 0 && OutCount.Packets == 0) {
+            continue;
+        }
+        const auto& In = Rates.ByCode[size_t(Dir::In)][Code];
+        const auto& Out = Rates.ByCode[size_t(Dir::Out)][Code];
+        ss << std::left << std::setw(8) << TTrafficStats::CodeName(uint8_t(Code)) << std::right
+           << std::setw(10) << std::lround(In.PacketsPerSecond) << std::setw(10) << KB(In.BytesPerSecond) << std::setw(12) << InCount.Packets
+           << std::setw(10) << std::lround(Out.PacketsPerSecond) << std::setw(10) << KB(Out.BytesPerSecond) << std::setw(12) << OutCount.Packets << "\n";
+    }
+    for (auto Transport : { Via::TCP, Via::UDP }) {
+        const auto& In = Counts.Get(Dir::In, Transport);
+        const auto& Out = Counts.Get(Dir::Out, Transport);
+        ss << (Transport == Via::TCP ? "TCP" : "UDP") << ": " << In.Packets << " packets (" << KB(double(In.Bytes)) << " kB) in, "
+           << Out.Packets << " packets (" << KB(double(Out.Bytes)) << " kB) out\n";
+    }
+    Application::Console().WriteRaw(ss.str());
+}
+
+// the probes, plus the Lua histograms summed over all states and functions
+static std::map<std::string, Metrics::THistogram::TSnapshot> LatencySnapshots() {
+    auto Result = Metrics::ProbeTime.Snapshot();
+    auto Sum = [](const Metrics::THistogramFamily& Family) {
+        Metrics::THistogram::TSnapshot Total;
+        for (const auto& [Label, Snapshot] : Family.Snapshot()) {
+            Total += Snapshot;
+        }
+        return Total;
+    };
+    Result["Lua queue wait"] = Sum(Metrics::LuaQueueWaitTime);
+    Result["Lua handler CPU"] = Sum(Metrics::LuaHandlerTime);
+    return Result;
+}
+
+void TConsole::Command_Latency(const std::string&, const std::vector<std::string>& args) {
+    if (!EnsureArgsCount(args, 0, 1)) {
+        return;
+    }
+    if (args.size() == 1) {
+        if (args.at(0) != "reset") {
+            Application::Console().WriteRaw("Error: Unknown argument '" + args.at(0) + "', expected 'reset'.");
+            return;
+        }
+        mLatencyBaseline = LatencySnapshots();
+        Application::Console().WriteRaw("Latency histograms reset.");
+        return;
+    }
+    auto Format = [](std::chrono::nanoseconds Time) {
+        if (Time < std::chrono::microseconds(1)) {
+            return fmt::format("{}ns", Time.count());
+        } else if (Time < std::chrono::milliseconds(1)) {
+            return fmt::format("{:.1f}us", double(Time.count()) / 1e3);
+        }
+        return fmt::format("{:.2f}ms", double(Time.count()) / 1e6);
+    };
+    std::stringstream ss;
+    ss << std::left << std::setw(20) << "Probe" << std::right << std::setw(12) << "Count" << std::setw(12) << "p50" << std::setw(12) << "p99" << std::setw(12) << "p99.9" << std::setw(12) << "mean" << "\n";
+    for (auto [Name, Snapshot] : LatencySnapshots()) {
+        if (auto Baseline = mLatencyBaseline.find(Name); Baseline != mLatencyBaseline.end()) {
+            Snapshot -= Baseline->second;
+        }
+        const auto Mean = Snapshot.Count == 0 ? std::chrono::nanoseconds(0) : std::chrono::nanoseconds(int64_t(Snapshot.Sum * 1e9 / double(Snapshot.Count)));
+        ss << std::left << std::setw(20) << Name << std::right << std::setw(12) << Snapshot.Count
+           << std::setw(12) << Format(Snapshot.Quantile(0.5))
+           << std::setw(12) << Format(Snapshot.Quantile(0.99))
+           << std::setw(12) << Format(Snapshot.Quantile(0.999))
+           << std::setw(12) << Format(Mean) << "\n";
+    }
+    Application::Console().WriteRaw(ss.str());
+}
+
 void TConsole::Command_Say(const std::string& FullCmd) {
     if (FullCmd.size() > 3) {
         auto Message = FullCmd.substr(4);
@@ -470,6 +648,25 @@ void TConsole::Command_Status(const std::string&, const std::vector<std::string>
     SystemsShutdownList = SystemsShutdownList.substr(0, SystemsShutdownList.size() - 2);
 
     auto ElapsedTime = mLuaEngine->Server().UptimeTimer.GetElapsedTime();
+    auto AuthStats = mLuaEngine->Network().AuthService().GetStats();
+    auto AdmissionStats = mLuaEngine->Network().GetAdmissionStats();
+    auto DispatchStats = mLuaEngine->Network().Dispatcher().GetStats();
+    auto CaptureStats = mLuaEngine->Network().GetCaptureStats();
+    auto TraceStats = Tracing::GetStats();
+    auto LogStats = GetLogStats();
+    auto SchedulerStats = Application::Scheduler().GetStats();
+    auto TimerJitter = Metrics::ProbeTime.WithLabel("Lua timer jitter").Snapshot();
+    if (auto Baseline = mLatencyBaseline.find("Lua timer jitter"); Baseline != mLatencyBaseline.end()) {
+        TimerJitter -= Baseline->second;
+    }
+    TLuaAllocator::TStats LuaMemory;
+    for (const auto& [StateId, Stats] : mLuaEngine->GetMemoryStats()) {
+        LuaMemory.Used += Stats.Used;
+        LuaMemory.Peak += Stats.Peak;
+        LuaMemory.Reserved += Stats.Reserved;
+        LuaMemory.Allocations += Stats.Allocations;
+        LuaMemory.Refused += Stats.Refused;
+    }
 
     Status << "BeamMP-Server Status:\n"
            << "\tTotal Players:             " << mLuaEngine->Server().ClientCount() << "\n"
@@ -483,7 +680,30 @@ void TConsole::Command_Status(const std::string&, const std::vector<std::string>
            << "\t\tQueued results to check:     " << mLuaEngine->GetResultsToCheckSize() << "\n"
            << "\t\tStates:                      " << mLuaEngine->GetLuaStateCount() << "\n"
            << "\t\tEvent timers:                " << mLuaEngine->GetTimedEventsCount() << "\n"
+           << "\t\tTimer jitter p50/p99/p99.9:  " << fmt::format("{:.2f}/{:.2f}/{:.2f}ms", double(TimerJitter.Quantile(0.5).count()) / 1e6, double(TimerJitter.Quantile(0.99).count()) / 1e6, double(TimerJitter.Quantile(0.999).count()) / 1e6) << "\n"
            << "\t\tEvent handlers:              " << mLuaEngine->GetRegisteredEventHandlerCount() << "\n"
+           << "\t\tMemory used/peak/reserved:   " << fmt::format("{:.1f}/{:.1f}/{:.1f} MiB ({:.0f}% fragmented)", double(LuaMemory.Used) / 1048576.0, double(LuaMemory.Peak) / 1048576.0, double(LuaMemory.Reserved) / 1048576.0, LuaMemory.Fragmentation() * 100) << "\n"
+           << "\t\tAllocations/refused:         " << LuaMemory.Allocations << "/" << LuaMemory.Refused << "\n"
+           << "\tPacket dispatch:\n"
+           << "\t\tWorkers:                     " << mLuaEngine->Network().Dispatcher().WorkerCount() << "\n"
+           << "\t\tQueued/Handled/Dropped:      " << DispatchStats.Queued << "/" << DispatchStats.Dispatched << "/" << DispatchStats.Dropped << "\n"
+           << "\t\tReaders throttled:           " << DispatchStats.Throttled << "\n"
+           << "\tScheduler:\n"
+           << "\t\tWorkers/Blocking/Tasks:      " << SchedulerStats.Workers << "/" << SchedulerStats.BlockingWorkers << "/" << SchedulerStats.Tasks << "\n"
+           << "\t\tRuns/Late (>10ms):           " << SchedulerStats.Runs << "/" << SchedulerStats.LateRuns << "\n"
+           << "\t\tMax lateness:                " << fmt::format("{:.1f}ms", double(SchedulerStats.MaxLateness.count()) / 1e6) << "\n"
+           << "\tLog lines:                 " << fmt::format("{} ({} dropped, {} waited for space)", LogStats.Pushed, LogStats.Dropped, LogStats.Blocked) << "\n"
+           << "\tTraffic capture:           " << (CaptureStats.Active ? fmt::format("{} ({} records, {} bytes, {} dropped)", CaptureStats.Path, CaptureStats.Records, CaptureStats.Bytes, CaptureStats.Dropped) : "off") << "\n"
+           << "\tTrace:                     " << (TraceStats.Active ? fmt::format("{} ({} spans on {} threads)", TraceStats.Path, TraceStats.Spans, TraceStats.Threads) : "off") << "\n"
+           << "\tHandshakes:\n"
+           << "\t\tIn progress:                 " << AdmissionStats.HandshakesInProgress << "\n"
+           << "\t\tRejected (rate/concurrency): " << AdmissionStats.RateLimited << "/" << AdmissionStats.TooManyHandshakes << "\n"
+           << "\t\tTimed out:                   " << AdmissionStats.TimedOut << "\n"
+           << "\tAuthentication:\n"
+           << "\t\tRequests/Cache hits:         " << AuthStats.Requests << "/" << AuthStats.CacheHits << "\n"
+           << "\t\tCoalesced/Failed/Rejected:   " << AuthStats.Coalesced << "/" << AuthStats.Failures << "/" << AuthStats.Rejected << "\n"
+           << "\t\tPending:                     " << AuthStats.Pending << "\n"
+           << "\t\tLatency p50/p90/p99:         " << fmt::format("{:.1f}/{:.1f}/{:.1f}ms", AuthStats.P50Ms, AuthStats.P90Ms, AuthStats.P99Ms) << "\n"
            << "\tSubsystems:\n"
            << "\t\tGood/Starting/Bad:           " << SystemsGood << "/" << SystemsStarting << "/" << SystemsBad << "\n"
            << "\t\tShutting down/Shut down:     " << SystemsShuttingDown << "/" << SystemsShutdown << "\n"
@@ -568,10 +788,7 @@ void TConsole::HandleLuaInternalCommand(const std::string& cmd) {
                 }
             }
         }
-        Application::Console().WriteRaw("Executed functions waiting to be checked in State '" + mStateId + "'");
-        for (const auto& Function : LuaAPI::MP::Engine->Debug_GetResultsToCheckForState(mStateId)) {
-            Application::Console().WriteRaw("    '" + Function.Function + "' (Ready? " + (Function.Ready ? "Yes" : "No") + ", Error? " + (Function.Error ? "Yes: '" + Function.ErrorMessage + "'" : "No") + ")");
-        }
+        Application::Console().WriteRaw("Results waiting to be checked for errors (all states): " + std::to_string(LuaAPI::MP::Engine->GetResultsToCheckSize()));
     } else if (cmd == "events") {
         auto Events = LuaAPI::MP::Engine->Debug_GetEventsForState(mStateId);
         Application::Console().WriteRaw("Registered Events + Handlers for State '" + mStateId + "'");
@@ -581,6 +798,15 @@ void TConsole::HandleLuaInternalCommand(const std::string& cmd) {
                 Application::Console().WriteRaw("        " + Handler);
             }
         }
+    } else if (cmd == "handlers") {
+        const auto Prefix = mStateId + ":";
+        Application::Console().WriteRaw("Functions called in State '" + mStateId + "' (calls, total, mean)");
+        for (const auto& [Handler, Snapshot] : Metrics::LuaHandlerTime.Snapshot()) {
+            if (Handler.rfind(Prefix, 0) == 0 && Handler.find(':', Prefix.size()) == std::string::npos && Snapshot.Count > 0) {
+                Application::Console().WriteRaw(fmt::format("    {:<32} {:>8} {:>10.1f}ms {:>8.3f}ms", Handler.substr(Prefix.size()), Snapshot.Count, Snapshot.Sum * 1000, Snapshot.Sum * 1000 / double(Snapshot.Count)));
+            }
+        }
+        Application::Console().WriteRaw("Calls aborted for running over their budget: " + std::to_string(LuaAPI::MP::Engine->GetBudgetAborts(mStateId)));
     } else if (cmd == "help") {
         Application::Console().WriteRaw(R"(BeamMP Lua Debugger
     All commands must be prefixed with a `:`. Non-prefixed commands are interpreted as Lua.
@@ -589,21 +815,66 @@ Commands
     :exit         detaches (exits) from this Lua console
     :help         displays this help
     :events       shows a list of currently registered events
-    :queued       shows a list of all pending and queued functions)");
+    :queued       shows a list of all pending and queued functions
+    :handlers     shows how long the functions the server called in this state took)");
     } else {
         beammp_error("internal command '" + cmd + "' is not known");
     }
 }
 
 TConsole::TConsole() {
+    mLogger = std::thread(&TConsole::LoggerMain, this);
+    mLoggerRunning = true;
+}
+
+TConsole::~TConsole() {
+    mLoggerShutdown = true;
+    if (mLogger.joinable()) {
+        mLogger.join();
+    }
+    mLoggerRunning = false;
+    Flush();
+}
+
+void TConsole::LoggerMain() {
+    RegisterThread("Logger");
+    while (!mLoggerShutdown) {
+        Flush();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+}
+
+void TConsole::Flush() {
+    std::unique_lock Lock(mLogWriteMutex);
+    mLogBatch.clear();
+    mLogQueue.Drain(mLogBatch);
+    for (const auto& Record : mLogBatch) {
+        WriteRecord(Record);
+    }
+    if (!mCommandline && !mLogBatch.empty()) {
+        std::cout.flush();
+    }
+}
+
+void TConsole::WriteRecord(const TLogQueue::TRecord& Record) {
+    auto ToWrite = Record.Raw ? Record.Message : GetDate(Record.Time) + Record.Message;
+    // allows writing to stdout without an initialized console
+    if (mCommandline) {
+        mCommandline->write(ToWrite);
+    } else {
+        std::cout << ToWrite << '\n';
+    }
 }
 
 void TConsole::InitializeCommandline() {
-    mCommandline = std::make_unique<Commandline>();
+    {
+        // the logger thread might be writing to stdout right now
+        std::unique_lock Lock(mLogWriteMutex);
+        mCommandline = std::make_unique<Commandline>();
+    }
     mCommandline->enable_history();
     mCommandline->set_history_limit(20);
     mCommandline->set_prompt("> ");
-    BackupOldLog();
     mCommandline->on_command = [this](Commandline& c) {
         try {
             auto TrimmedCmd = c.get_command();
@@ -712,23 +983,25 @@ void TConsole::InitializeCommandline() {
     };
 }
 
-void TConsole::Write(const std::string& str) {
-    auto ToWrite = GetDate() + str;
-    // allows writing to stdout without an initialized console
-    if (mCommandline) {
-        mCommandline->write(ToWrite);
-    } else {
-        std::cout << ToWrite << std::endl;
+void TConsole::Write(const std::string& str, TLogQueue::Overflow Policy) {
+    TLogQueue::TRecord Record { std::chrono::system_clock::now(), str, false };
+    if (!mLoggerRunning) {
+        // during static destruction, nobody would write it out
+        std::unique_lock Lock(mLogWriteMutex);
+        WriteRecord(Record);
+        return;
     }
+    mLogQueue.Push(std::move(Record), Policy);
 }
 
 void TConsole::WriteRaw(const std::string& str) {
-    // allows writing to stdout without an initialized console
-    if (mCommandline) {
-        mCommandline->write(str);
-    } else {
-        std::cout << str << std::endl;
+    TLogQueue::TRecord Record { std::chrono::system_clock::now(), str, true };
+    if (!mLoggerRunning) {
+        std::unique_lock Lock(mLogWriteMutex);
+        WriteRecord(Record);
+        return;
     }
+    mLogQueue.Push(std::move(Record), TLogQueue::Overflow::Block);
 }
 
 void TConsole::InitializeLuaConsole(TLuaEngine& Engine) {
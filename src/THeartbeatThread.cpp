@@ -23,116 +23,107 @@
 //#include "SocketIO.h"
 #include <rapidjson/document.h>
 #include <rapidjson/rapidjson.h>
+#include <cmath>
 #include <sstream>
 
 namespace json = rapidjson;
 
-void THeartbeatThread::operator()() {
-    RegisterThread("Heartbeat");
-    std::string Body;
+void THeartbeatThread::Beat() {
+    ++mUpdateReminderCounter;
+    std::string Body = GenerateCall();
     std::string T;
+    // a hot-change occurs when a setting has changed, to update the backend of that change.
+    auto Now = std::chrono::high_resolution_clock::now();
+    bool Unchanged = mLast == Body;
+    auto TimePassed = (Now - mLastNormalUpdateTime);
+    auto Threshold = Unchanged ? 30 : 5;
+    if (TimePassed < std::chrono::seconds(Threshold)) {
+        return;
+    }
+    beammp_debug("heartbeat (after " + std::to_string(std::chrono::duration_cast<std::chrono::seconds>(TimePassed).count()) + "s)");
 
-    // these are "hot-change" related variables
-    static std::string Last;
-
-    static std::chrono::high_resolution_clock::time_point LastNormalUpdateTime = std::chrono::high_resolution_clock::now();
-    bool isAuth = false;
-    size_t UpdateReminderCounter = 0;
-    while (!Application::IsShuttingDown()) {
-        ++UpdateReminderCounter;
-        Body = GenerateCall();
-        // a hot-change occurs when a setting has changed, to update the backend of that change.
-        auto Now = std::chrono::high_resolution_clock::now();
-        bool Unchanged = Last == Body;
-        auto TimePassed = (Now - LastNormalUpdateTime);
-        auto Threshold = Unchanged ? 30 : 5;
-        if (TimePassed < std::chrono::seconds(Threshold)) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            continue;
-        }
-        beammp_debug("heartbeat (after " + std::to_string(std::chrono::duration_cast<std::chrono::seconds>(TimePassed).count()) + "s)");
-
-        Last = Body;
-        LastNormalUpdateTime = Now;
-        if (!Application::Settings.CustomIP.empty()) {
-            Body += "&ip=" + Application::Settings.CustomIP;
-        }
+    mLast = Body;
+    mLastNormalUpdateTime = Now;
+    if (!Application::Settings.CustomIP.empty()) {
+        Body += "&ip=" + Application::Settings.CustomIP;
+    }
+    // changes all the time, so it's not part of the comparison above
+    Body += GetTraffic();
 
-        auto Target = "/heartbeat";
-        unsigned int ResponseCode = 0;
+    auto Target = "/heartbeat";
+    unsigned int ResponseCode = 0;
 
-        json::Document Doc;
-        bool Ok = false;
-        for (const auto& Url : Application::GetBackendUrlsInOrder()) {
-            T = Http::POST(Url, 443, Target, Body, "application/x-www-form-urlencoded", &ResponseCode, { { "api-v", "2" } });
-            Doc.Parse(T.data(), T.size());
-            if (Doc.HasParseError() || !Doc.IsObject()) {
-                if (!Application::Settings.Private) {
-                    beammp_trace("Backend response failed to parse as valid json");
-                    beammp_trace("Response was: `" + T + "`");
-                }
-            } else if (ResponseCode != 200) {
-                beammp_errorf("Response code from the heartbeat: {}", ResponseCode);
-            } else {
-                // all ok
-                Ok = true;
-                break;
+    json::Document Doc;
+    bool Ok = false;
+    for (const auto& Url : Application::GetBackendUrlsInOrder()) {
+        T = Http::POST(Url, 443, Target, Body, "application/x-www-form-urlencoded", &ResponseCode, { { "api-v", "2" } });
+        Doc.Parse(T.data(), T.size());
+        if (Doc.HasParseError() || !Doc.IsObject()) {
+            if (!Application::Settings.Private) {
+                beammp_trace("Backend response failed to parse as valid json");
+                beammp_trace("Response was: `" + T + "`");
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        } else if (ResponseCode != 200) {
+            beammp_errorf("Response code from the heartbeat: {}", ResponseCode);
+        } else {
+            // all ok
+            Ok = true;
+            break;
         }
-        std::string Status {};
-        std::string Code {};
-        std::string Message {};
-        const auto StatusKey = "status";
-        const auto CodeKey = "code";
-        const auto MessageKey = "msg";
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+    std::string Status {};
+    std::string Code {};
+    std::string Message {};
+    const auto StatusKey = "status";
+    const auto CodeKey = "code";
+    const auto MessageKey = "msg";
 
-        if (Ok) {
-            if (Doc.HasMember(StatusKey) && Doc[StatusKey].IsString()) {
-                Status = Doc[StatusKey].GetString();
-            } else {
-                Ok = false;
-            }
-            if (Doc.HasMember(CodeKey) && Doc[CodeKey].IsString()) {
-                Code = Doc[CodeKey].GetString();
-            } else {
-                Ok = false;
-            }
-            if (Doc.HasMember(MessageKey) && Doc[MessageKey].IsString()) {
-                Message = Doc[MessageKey].GetString();
-            } else {
-                Ok = false;
-            }
-            if (!Ok) {
-                beammp_error("Missing/invalid json members in backend response");
-            }
+    if (Ok) {
+        if (Doc.HasMember(StatusKey) && Doc[StatusKey].IsString()) {
+            Status = Doc[StatusKey].GetString();
         } else {
-            if (!Application::Settings.Private) {
-                beammp_warn("Backend failed to respond to a heartbeat. Your server may temporarily disappear from the server list. This is not an error, and will likely resolve itself soon. Direct connect will still work.");
-            }
+            Ok = false;
         }
-
-        if (Ok && !isAuth && !Application::Settings.Private) {
-            if (Status == "2000") {
-                beammp_info(("Authenticated! " + Message));
-                isAuth = true;
-            } else if (Status == "200") {
-                beammp_info(("Resumed authenticated session! " + Message));
-                isAuth = true;
-            } else {
-                if (Message.empty()) {
-                    Message = "Backend didn't provide a reason.";
-                }
-                beammp_error("Backend REFUSED the auth key. Reason: " + Message);
-            }
+        if (Doc.HasMember(CodeKey) && Doc[CodeKey].IsString()) {
+            Code = Doc[CodeKey].GetString();
+        } else {
+            Ok = false;
         }
-        if (isAuth || Application::Settings.Private) {
-            Application::SetSubsystemStatus("Heartbeat", Application::Status::Good);
+        if (Doc.HasMember(MessageKey) && Doc[MessageKey].IsString()) {
+            Message = Doc[MessageKey].GetString();
+        } else {
+            Ok = false;
+        }
+        if (!Ok) {
+            beammp_error("Missing/invalid json members in backend response");
         }
-        if (!Application::Settings.HideUpdateMessages && UpdateReminderCounter % 5) {
-            Application::CheckForUpdates();
+    } else {
+        if (!Application::Settings.Private) {
+            beammp_warn("Backend failed to respond to a heartbeat. Your server may temporarily disappear from the server list. This is not an error, and will likely resolve itself soon. Direct connect will still work.");
         }
     }
+
+    if (Ok && !mIsAuth && !Application::Settings.Private) {
+        if (Status == "2000") {
+            beammp_info(("Authenticated! " + Message));
+            mIsAuth = true;
+        } else if (Status == "200") {
+            beammp_info(("Resumed authenticated session! " + Message));
+            mIsAuth = true;
+        } else {
+            if (Message.empty()) {
+                Message = "Backend didn't provide a reason.";
+            }
+            beammp_error("Backend REFUSED the auth key. Reason: " + Message);
+        }
+    }
+    if (mIsAuth || Application::Settings.Private) {
+        Application::SetSubsystemStatus("Heartbeat", Application::Status::Good);
+    }
+    if (!Application::Settings.HideUpdateMessages && mUpdateReminderCounter % 5) {
+        Application::CheckForUpdates();
+    }
 }
 
 std::string THeartbeatThread::GenerateCall() {
@@ -162,13 +153,31 @@ THeartbeatThread::THeartbeatThread(TResourceManager& ResourceManager, TServer& S
     Application::SetSubsystemStatus("Heartbeat", Application::Status::Starting);
     Application::RegisterShutdownHandler([&] {
         Application::SetSubsystemStatus("Heartbeat", Application::Status::ShuttingDown);
-        if (mThread.joinable()) {
-            mThread.join();
-        }
+        Application::Scheduler().Cancel(mTask);
         Application::SetSubsystemStatus("Heartbeat", Application::Status::Shutdown);
     });
-    Start();
+    mTask = Application::Scheduler().Every("Heartbeat", std::chrono::seconds(1), [this] { Beat(); }, TScheduler::Kind::Blocking);
+}
+
+THeartbeatThread::~THeartbeatThread() {
+    Application::Scheduler().Cancel(mTask);
 }
+std::string THeartbeatThread::GetTraffic() {
+    TTrafficStats::TRate In;
+    TTrafficStats::TRate Out;
+    mServer.ForEachClient([&](const std::weak_ptr<TClient>& ClientPtr) -> bool {
+        if (auto Client = ClientPtr.lock()) {
+            auto Rates = Client->Traffic().GetRates();
+            In += Rates.Total(TTrafficStats::Direction::In);
+            Out += Rates.Total(TTrafficStats::Direction::Out);
+        }
+        return true;
+    });
+    return fmt::format("&pps={}&ppsout={}&bpsin={}&bpsout={}",
+        std::lround(In.PacketsPerSecond), std::lround(Out.PacketsPerSecond),
+        std::lround(In.BytesPerSecond), std::lround(Out.BytesPerSecond));
+}
+
 std::string THeartbeatThread::GetPlayers() {
     std::string Return;
     mServer.ForEachClient([&](const std::weak_ptr<TClient>& ClientPtr) -> bool {
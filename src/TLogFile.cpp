@@ -0,0 +1,250 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "TLogFile.h"
+
+#include "Common.h"
+
+#include <algorithm>
+#include <array>
+#include <ctime>
+#include <zlib.h>
+
+TLogFile::TLogFile(std::filesystem::path Path)
+    : mPath(std::move(Path))
+    , mCompressor(&TLogFile::CompressorMain, this) {
+}
+
+TLogFile::~TLogFile() {
+    {
+        std::unique_lock Lock(mJobsMutex);
+        mShutdown = true;
+    }
+    mJobsCond.notify_all();
+    if (mCompressor.joinable()) {
+        mCompressor.join();
+    }
+}
+
+void TLogFile::Open(const TLimits& Limits) {
+    std::error_code ec;
+    if (fs::exists(mPath, ec) && fs::file_size(mPath, ec) > 0) {
+        Rotate(Limits);
+        return;
+    }
+    mFile.open(mPath, std::ios::trunc);
+    mBytes = 0;
+    mOpened = std::chrono::steady_clock::now();
+}
+
+void TLogFile::Write(const std::string& Line, const TLimits& Limits) {
+    if ((Limits.MaxBytes != 0 && mBytes >= Limits.MaxBytes)
+        || (Limits.MaxAge.count() != 0 && std::chrono::steady_clock::now() - mOpened >= Limits.MaxAge)) {
+        Rotate(Limits);
+    }
+    mFile.write(Line.c_str(), std::streamsize(Line.size()));
+    mFile.write("\n", 1);
+    mFile.flush();
+    mBytes += Line.size() + 1;
+}
+
+void TLogFile::Rotate(const TLimits& Limits) {
+    mFile.close();
+    auto Segment = NextSegmentPath();
+    std::error_code ec;
+    fs::rename(mPath, Segment, ec);
+    if (ec) {
+        // keep writing to the old file, it's better than losing the log
+        // and only try again once the limit is reached again, not every line
+        mFile.open(mPath, std::ios::app);
+        mBytes = 0;
+        mOpened = std::chrono::steady_clock::now();
+        mFile << "Failed to rotate log to '" << Segment.string() << "': " << ec.message() << "\n";
+        return;
+    }
+    mFile.open(mPath, std::ios::trunc);
+    mBytes = 0;
+    mOpened = std::chrono::steady_clock::now();
+    {
+        std::unique_lock Lock(mJobsMutex);
+        mJobs.push_back({ Segment, Limits.Retention });
+    }
+    mJobsCond.notify_all();
+}
+
+void TLogFile::WaitForCompression() {
+    std::unique_lock Lock(mJobsMutex);
+    mJobsCond.wait(Lock, [this] { return mJobs.empty() && !mBusy; });
+}
+
+std::filesystem::path TLogFile::NextSegmentPath() const {
+    auto Now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+    std::array<char, 32> Time {};
+    std::strftime(Time.data(), Time.size(), "%Y-%m-%d_%H.%M.%S", std::localtime(&Now));
+    const auto Base = mPath.parent_path() / (mPath.stem().string() + "." + Time.data());
+    auto Segment = fs::path(Base.string() + mPath.extension().string());
+    // more than one rotation in a second; '_' sorts after '.', so these
+    // still sort after the first one
+    for (int i = 1; fs::exists(Segment) || fs::exists(Segment.string() + ".gz"); ++i) {
+        Segment = fs::path(fmt::format("{}_{:02}{}", Base.string(), i, mPath.extension().string()));
+    }
+    return Segment;
+}
+
+std::vector<std::filesystem::path> TLogFile::CompressedSegments(const std::filesystem::path& Path) {
+    return Segments(Path, Path.extension().string() + ".gz");
+}
+
+std::vector<std::filesystem::path> TLogFile::RotatedSegments(const std::filesystem::path& Path) {
+    auto Result = Segments(Path, Path.extension().string());
+    auto Compressed = CompressedSegments(Path);
+    Result.insert(Result.end(), Compressed.begin(), Compressed.end());
+    std::sort(Result.begin(), Result.end());
+    return Result;
+}
+
+std::vector<std::filesystem::path> TLogFile::Segments(const std::filesystem::path& Path, const std::string& Suffix) {
+    const auto Prefix = Path.stem().string() + ".";
+    std::vector<fs::path> Result;
+    std::error_code ec;
+    auto Dir = Path.parent_path().empty() ? fs::path(".") : Path.parent_path();
+    for (const auto& Entry : fs::directory_iterator(Dir, ec)) {
+        const auto Name = Entry.path().filename().string();
+        if (Name.size() > Prefix.size() + Suffix.size() && Name.starts_with(Prefix) && Name.ends_with(Suffix)) {
+            Result.push_back(Entry.path());
+        }
+    }
+    // the timestamp in the name sorts chronologically
+    std::sort(Result.begin(), Result.end());
+    return Result;
+}
+
+bool TLogFile::Compress(const std::filesystem::path& From, const std::filesystem::path& To) {
+    std::ifstream In(From, std::ios::binary);
+    if (!In) {
+        return false;
+    }
+    gzFile Out = gzopen(To.string().c_str(), "wb6");
+    if (!Out) {
+        return false;
+    }
+    std::array<char, 64 * 1024> Buffer {};
+    bool Ok = true;
+    while (In) {
+        In.read(Buffer.data(), std::streamsize(Buffer.size()));
+        const auto N = In.gcount();
+        if (N > 0 && gzwrite(Out, Buffer.data(), unsigned(N)) != int(N)) {
+            Ok = false;
+            break;
+        }
+    }
+    Ok = gzclose(Out) == Z_OK && Ok;
+    In.close();
+    std::error_code ec;
+    if (Ok) {
+        fs::remove(From, ec);
+    } else {
+        fs::remove(To, ec);
+    }
+    return Ok;
+}
+
+void TLogFile::CompressorMain() {
+    RegisterThread("LogCompressor");
+    std::unique_lock Lock(mJobsMutex);
+    while (true) {
+        mJobsCond.wait(Lock, [this] { return mShutdown || !mJobs.empty(); });
+        if (mJobs.empty()) {
+            // shutting down, and nothing left to do
+            return;
+        }
+        auto Job = std::move(mJobs.front());
+        mJobs.pop_front();
+        mBusy = true;
+        Lock.unlock();
+        // can't log about failures here, the logger thread might be the one
+        // waiting for us. The uncompressed segment is kept in that case, and
+        // counts towards the retention like the others.
+        Compress(Job.Segment, Job.Segment.string() + ".gz");
+        if (Job.Retention != 0) {
+            auto Segments = RotatedSegments(mPath);
+            for (size_t i = 0; i + Job.Retention < Segments.size(); ++i) {
+                std::error_code ec;
+                fs::remove(Segments[i], ec);
+            }
+        }
+        Lock.lock();
+        mBusy = false;
+        mJobsCond.notify_all();
+    }
+}
+
+TEST_CASE("TLogFile rotation") {
+    const auto Dir = fs::temp_directory_path() / "beammp-logfile-test";
+    fs::remove_all(Dir);
+    fs::create_directories(Dir);
+    const auto Path = Dir / "Server.log";
+    // leftover from a previous run
+    std::ofstream(Path) << "old run\n";
+    {
+        TLogFile File(Path);
+        TLogFile::TLimits Limits { 100, std::chrono::seconds(0), 2 };
+        File.Open(Limits);
+        File.WaitForCompression();
+        CHECK(TLogFile::CompressedSegments(Path).size() == 1);
+        // 10 lines of 50 bytes, rotated every 2 lines
+        for (int i = 0; i < 10; ++i) {
+            File.Write(std::string(49, 'a'), Limits);
+        }
+        File.WaitForCompression();
+        CHECK(TLogFile::CompressedSegments(Path).size() == 2);
+        CHECK(fs::file_size(Path) == 100);
+    }
+    auto Segment = TLogFile::CompressedSegments(Path).back();
+    gzFile In = gzopen(Segment.string().c_str(), "rb");
+    REQUIRE(In);
+    std::array<char, 256> Buffer {};
+    CHECK(gzread(In, Buffer.data(), unsigned(Buffer.size())) == 100);
+    gzclose(In);
+    fs::remove_all(Dir);
+}
+
+TEST_CASE("TLogFile retention counts uncompressed segments") {
+    const auto Dir = fs::temp_directory_path() / "beammp-logfile-retention-test";
+    fs::remove_all(Dir);
+    fs::create_directories(Dir);
+    const auto Path = Dir / "Server.log";
+    // segments of earlier runs which couldn't be compressed
+    std::ofstream(Dir / "Server.2000-01-01_00.00.00.log") << "old\n";
+    std::ofstream(Dir / "Server.2000-01-02_00.00.00.log") << "old\n";
+    std::ofstream(Dir / "Server.2000-01-03_00.00.00.log.gz") << "old\n";
+    CHECK(TLogFile::RotatedSegments(Path).size() == 3);
+    {
+        TLogFile File(Path);
+        TLogFile::TLimits Limits { 100, std::chrono::seconds(0), 2 };
+        File.Open(Limits);
+        File.Write(std::string(150, 'a'), Limits);
+        File.Write("rotates", Limits);
+        File.WaitForCompression();
+    }
+    auto Segments = TLogFile::RotatedSegments(Path);
+    REQUIRE(Segments.size() == 2);
+    CHECK(Segments[0].filename() == "Server.2000-01-03_00.00.00.log.gz");
+    CHECK(!fs::exists(Dir / "Server.2000-01-01_00.00.00.log"));
+    fs::remove_all(Dir);
+}
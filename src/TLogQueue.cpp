@@ -0,0 +1,157 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "TLogQueue.h"
+
+#include "Common.h"
+
+#include <algorithm>
+#include <thread>
+
+static std::atomic_uint64_t sNextQueueID { 1 };
+
+// the rings this thread owns, one per queue, orphaned when the thread exits
+struct TThreadLogRings {
+    std::vector<std::pair<uint64_t, std::shared_ptr<void>>> Rings;
+    std::vector<std::atomic_bool*> OrphanFlags;
+
+    ~TThreadLogRings() {
+        for (auto* Flag : OrphanFlags) {
+            Flag->store(true, std::memory_order_release);
+        }
+    }
+};
+static thread_local TThreadLogRings tRings;
+
+TLogQueue::TLogQueue()
+    : mID(sNextQueueID.fetch_add(1)) {
+}
+
+TLogQueue::~TLogQueue() {
+    // threads may outlive the queue, their rings are kept alive by their
+    // thread local and only cleaned up when the thread exits
+}
+
+TLogQueue::TRing& TLogQueue::ThisThreadRing() {
+    for (const auto& [ID, Ring] : tRings.Rings) {
+        if (ID == mID) {
+            return *std::static_pointer_cast<TRing>(Ring);
+        }
+    }
+    auto Ring = std::make_shared<TRing>();
+    tRings.Rings.emplace_back(mID, Ring);
+    tRings.OrphanFlags.push_back(&Ring->Orphaned);
+    std::unique_lock Lock(mRingsMutex);
+    mRings.push_back(Ring);
+    return *Ring;
+}
+
+void TLogQueue::Push(TRecord&& Record, Overflow Policy) {
+    auto& Ring = ThisThreadRing();
+    const auto Tail = Ring.Tail.load(std::memory_order_relaxed);
+    if (Tail - Ring.Head.load(std::memory_order_acquire) >= RingCapacity) {
+        if (Policy == Overflow::Drop) {
+            ++mDropped;
+            return;
+        }
+        ++mBlocked;
+        while (Tail - Ring.Head.load(std::memory_order_acquire) >= RingCapacity) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+    Ring.Slots[Tail % RingCapacity] = std::move(Record);
+    Ring.Tail.store(Tail + 1, std::memory_order_release);
+    ++mPushed;
+}
+
+void TLogQueue::Drain(std::vector<TRecord>& Out) {
+    const auto Start = Out.size();
+    std::unique_lock Lock(mRingsMutex);
+    for (auto& Ring : mRings) {
+        const auto Head = Ring->Head.load(std::memory_order_relaxed);
+        const auto Tail = Ring->Tail.load(std::memory_order_acquire);
+        for (auto i = Head; i < Tail; ++i) {
+            Out.push_back(std::move(Ring->Slots[i % RingCapacity]));
+        }
+        Ring->Head.store(Tail, std::memory_order_release);
+    }
+    // rings of exited threads, which we just emptied
+    std::erase_if(mRings, [](const std::shared_ptr<TRing>& Ring) {
+        return Ring->Orphaned.load(std::memory_order_acquire)
+            && Ring->Head.load(std::memory_order_relaxed) == Ring->Tail.load(std::memory_order_acquire);
+    });
+    Lock.unlock();
+    // each ring is in order already, this interleaves the threads
+    std::stable_sort(Out.begin() + long(Start), Out.end(), [](const TRecord& A, const TRecord& B) {
+        return A.Time < B.Time;
+    });
+}
+
+TLogQueue::TStats TLogQueue::GetStats() const {
+    return TStats { mPushed.load(), mDropped.load(), mBlocked.load() };
+}
+
+TEST_CASE("TLogQueue") {
+    TLogQueue Queue;
+    auto Now = std::chrono::system_clock::now();
+    std::vector<TLogQueue::TRecord> Records;
+
+    SUBCASE("Records from several threads come out ordered by time") {
+        Queue.Push({ Now + std::chrono::seconds(2), "main 2" }, TLogQueue::Overflow::Block);
+        std::thread Other([&] {
+            Queue.Push({ Now + std::chrono::seconds(1), "other 1" }, TLogQueue::Overflow::Block);
+            Queue.Push({ Now + std::chrono::seconds(3), "other 3" }, TLogQueue::Overflow::Block);
+        });
+        Other.join();
+        Queue.Drain(Records);
+        REQUIRE(Records.size() == 3);
+        CHECK(Records[0].Message == "other 1");
+        CHECK(Records[1].Message == "main 2");
+        CHECK(Records[2].Message == "other 3");
+        Records.clear();
+        Queue.Drain(Records);
+        CHECK(Records.empty());
+    }
+    SUBCASE("A full ring drops droppable records") {
+        for (size_t i = 0; i < TLogQueue::RingCapacity + 10; ++i) {
+            Queue.Push({ Now, std::to_string(i) }, TLogQueue::Overflow::Drop);
+        }
+        CHECK(Queue.GetStats().Pushed == TLogQueue::RingCapacity);
+        CHECK(Queue.GetStats().Dropped == 10);
+        Queue.Drain(Records);
+        CHECK(Records.size() == TLogQueue::RingCapacity);
+        CHECK(Records.back().Message == std::to_string(TLogQueue::RingCapacity - 1));
+    }
+    SUBCASE("A full ring blocks until drained") {
+        for (size_t i = 0; i < TLogQueue::RingCapacity; ++i) {
+            Queue.Push({ Now, "" }, TLogQueue::Overflow::Block);
+        }
+        std::thread Drainer([&] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            Queue.Drain(Records);
+        });
+        Queue.Push({ Now, "last" }, TLogQueue::Overflow::Block);
+        Drainer.join();
+        CHECK(Queue.GetStats().Blocked == 1);
+        CHECK(Queue.GetStats().Dropped == 0);
+        Records.clear();
+        Queue.Drain(Records);
+        REQUIRE(Records.size() == 1);
+        CHECK(Records[0].Message == "last");
+    }
+}
@@ -0,0 +1,300 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "TLuaAllocator.h"
+
+#include "Benchmark.h"
+#include "Common.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+double TLuaAllocator::TStats::Fragmentation() const {
+    if (Reserved == 0 || Used >= Reserved) {
+        return 0;
+    }
+    return double(Reserved - Used) / double(Reserved);
+}
+
+TLuaAllocator::TLuaAllocator(std::string Name, size_t Limit)
+    : mName(std::move(Name))
+    , mLimit(Limit) {
+}
+
+TLuaAllocator::~TLuaAllocator() {
+    for (auto* Slab : mSlabs) {
+        std::free(Slab);
+    }
+}
+
+void* TLuaAllocator::Alloc(void* UserData, void* Ptr, size_t OldSize, size_t NewSize) {
+    auto& Self = *static_cast<TLuaAllocator*>(UserData);
+    std::unique_lock Lock(Self.mMutex);
+    if (!Ptr) {
+        // Lua passes the type of the new object in OldSize then
+        OldSize = 0;
+    }
+    if (NewSize == 0) {
+        if (Ptr) {
+            Self.Free(Ptr, OldSize);
+            Subtract(Self.mUsed, OldSize);
+        }
+        return nullptr;
+    }
+    if (NewSize > OldSize && !Self.Admit(NewSize - OldSize)) {
+        return nullptr;
+    }
+    void* Result = Ptr ? Self.Reallocate(Ptr, OldSize, NewSize) : Self.Allocate(NewSize);
+    if (!Result) {
+        Self.mRefused.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    Self.mAllocations.store(Self.mAllocations.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (NewSize > OldSize) {
+        Add(Self.mUsed, NewSize - OldSize);
+        const auto Used = Self.mUsed.load(std::memory_order_relaxed);
+        if (Used > Self.mPeak.load(std::memory_order_relaxed)) {
+            Self.mPeak.store(Used, std::memory_order_relaxed);
+        }
+    } else {
+        Subtract(Self.mUsed, OldSize - NewSize);
+    }
+    return Result;
+}
+
+bool TLuaAllocator::Admit(size_t Growth) {
+    if (mLimit == 0) {
+        return true;
+    }
+    const auto Used = mUsed.load(std::memory_order_relaxed);
+    if (Used + Growth <= mLimit) {
+        // warn again once it got some room back
+        if (mLimitWarned && Used < mLimit / 10 * 9) {
+            mLimitWarned = false;
+        }
+        return true;
+    }
+    mRefused.fetch_add(1, std::memory_order_relaxed);
+    if (!mLimitWarned) {
+        mLimitWarned = true;
+        beammp_warnf("Lua state \"{}\" reached its memory limit of {:.1f} MiB, allocations fail until it frees some (see LuaStateMemoryLimitMB)", mName, double(mLimit) / 1024 / 1024);
+    }
+    return false;
+}
+
+void* TLuaAllocator::Allocate(size_t Size) {
+    if (Size > MaxPooledSize) {
+        void* Block = std::malloc(Size);
+        if (Block) {
+            Add(mReserved, Size);
+        }
+        return Block;
+    }
+    auto& FreeList = mFreeLists[ClassOf(Size)];
+    if (FreeList) {
+        auto* Block = FreeList;
+        FreeList = Block->Next;
+        return Block;
+    }
+    const auto BlockSize = (ClassOf(Size) + 1) * Granularity;
+    if (size_t(mSlabEnd - mSlabCursor) < BlockSize) {
+        // the rest of the old slab is too small for this class, it stays unused
+        auto* Slab = static_cast<char*>(std::malloc(SlabSize));
+        if (!Slab) {
+            return nullptr;
+        }
+        mSlabs.push_back(Slab);
+        Add(mReserved, SlabSize);
+        mSlabCursor = Slab;
+        mSlabEnd = Slab + SlabSize;
+    }
+    auto* Block = mSlabCursor;
+    mSlabCursor += BlockSize;
+    return Block;
+}
+
+void TLuaAllocator::Free(void* Ptr, size_t Size) {
+    if (Size > MaxPooledSize) {
+        std::free(Ptr);
+        Subtract(mReserved, Size);
+        return;
+    }
+    auto* Block = static_cast<TFreeBlock*>(Ptr);
+    auto& FreeList = mFreeLists[ClassOf(Size)];
+    Block->Next = FreeList;
+    FreeList = Block;
+}
+
+void* TLuaAllocator::Reallocate(void* Ptr, size_t OldSize, size_t NewSize) {
+    if (OldSize > MaxPooledSize && NewSize > MaxPooledSize) {
+        void* Block = std::realloc(Ptr, NewSize);
+        if (!Block) {
+            // Lua expects shrinking to always work, the block just stays bigger
+            return NewSize < OldSize ? Ptr : nullptr;
+        }
+        if (NewSize > OldSize) {
+            Add(mReserved, NewSize - OldSize);
+        } else {
+            Subtract(mReserved, OldSize - NewSize);
+        }
+        return Block;
+    }
+    if (OldSize <= MaxPooledSize && NewSize <= MaxPooledSize && ClassOf(OldSize) == ClassOf(NewSize)) {
+        return Ptr;
+    }
+    void* Block = Allocate(NewSize);
+    if (!Block) {
+        if (NewSize > OldSize) {
+            return nullptr;
+        }
+        // Lua expects shrinking to always work, so the block is kept. From now on
+        // it's freed as a small one, so one from malloc is kept like a slab
+        if (OldSize > MaxPooledSize) {
+            mSlabs.push_back(Ptr);
+        }
+        return Ptr;
+    }
+    std::memcpy(Block, Ptr, std::min(OldSize, NewSize));
+    Free(Ptr, OldSize);
+    return Block;
+}
+
+TLuaAllocator::TStats TLuaAllocator::GetStats() const {
+    TStats Stats;
+    Stats.Used = mUsed.load(std::memory_order_relaxed);
+    Stats.Peak = mPeak.load(std::memory_order_relaxed);
+    Stats.Reserved = mReserved.load(std::memory_order_relaxed);
+    Stats.Limit = mLimit;
+    Stats.Allocations = mAllocations.load(std::memory_order_relaxed);
+    Stats.Refused = mRefused.load(std::memory_order_relaxed);
+    return Stats;
+}
+
+TEST_CASE("TLuaAllocator") {
+    TLuaAllocator Allocator("test", 4 * TLuaAllocator::SlabSize);
+    auto Alloc = [&Allocator](void* Ptr, size_t OldSize, size_t NewSize) {
+        return TLuaAllocator::Alloc(&Allocator, Ptr, OldSize, NewSize);
+    };
+
+    SUBCASE("small blocks are reused") {
+        auto* A = Alloc(nullptr, 5 /* LUA_TTABLE */, 40);
+        REQUIRE(A);
+        CHECK_EQ(reinterpret_cast<uintptr_t>(A) % TLuaAllocator::Granularity, 0);
+        std::memset(A, 0xAB, 40);
+        CHECK_EQ(Allocator.GetStats().Used, 40);
+        CHECK_EQ(Allocator.GetStats().Reserved, TLuaAllocator::SlabSize);
+        CHECK_EQ(Alloc(A, 40, 0), nullptr);
+        CHECK_EQ(Allocator.GetStats().Used, 0);
+        // same size class
+        CHECK_EQ(Alloc(nullptr, 0, 48), A);
+        CHECK_EQ(Allocator.GetStats().Peak, 48);
+        CHECK_EQ(Alloc(A, 48, 0), nullptr);
+    }
+    SUBCASE("resizing keeps the contents") {
+        auto* Block = static_cast<char*>(Alloc(nullptr, 0, 16));
+        REQUIRE(Block);
+        std::memcpy(Block, "0123456789abcde", 16);
+        // same class, same block
+        CHECK_EQ(Alloc(Block, 16, 10), Block);
+        // to a bigger class, then to malloc and back
+        auto* Bigger = static_cast<char*>(Alloc(Block, 10, 100));
+        REQUIRE(Bigger);
+        CHECK_EQ(std::memcmp(Bigger, "0123456789", 10), 0);
+        auto* Large = static_cast<char*>(Alloc(Bigger, 100, 5000));
+        REQUIRE(Large);
+        CHECK_EQ(std::memcmp(Large, "0123456789", 10), 0);
+        CHECK_EQ(Allocator.GetStats().Reserved, TLuaAllocator::SlabSize + 5000);
+        auto* Small = static_cast<char*>(Alloc(Large, 5000, 20));
+        REQUIRE(Small);
+        CHECK_EQ(std::memcmp(Small, "0123456789", 10), 0);
+        CHECK_EQ(Allocator.GetStats().Reserved, TLuaAllocator::SlabSize);
+        CHECK_EQ(Allocator.GetStats().Used, 20);
+        Alloc(Small, 20, 0);
+    }
+    SUBCASE("the limit is enforced") {
+        auto* Large = Alloc(nullptr, 0, 3 * TLuaAllocator::SlabSize);
+        REQUIRE(Large);
+        CHECK_EQ(Alloc(nullptr, 0, 2 * TLuaAllocator::SlabSize), nullptr);
+        CHECK_EQ(Alloc(Large, 3 * TLuaAllocator::SlabSize, 5 * TLuaAllocator::SlabSize), nullptr);
+        CHECK_EQ(Allocator.GetStats().Refused, 2);
+        CHECK_EQ(Allocator.GetStats().Used, 3 * TLuaAllocator::SlabSize);
+        // shrinking always works
+        auto* Shrunk = Alloc(Large, 3 * TLuaAllocator::SlabSize, TLuaAllocator::SlabSize);
+        REQUIRE(Shrunk);
+        auto* Another = Alloc(nullptr, 0, 2 * TLuaAllocator::SlabSize);
+        CHECK(Another);
+        Alloc(Another, 2 * TLuaAllocator::SlabSize, 0);
+        Alloc(Shrunk, TLuaAllocator::SlabSize, 0);
+        CHECK_EQ(Allocator.GetStats().Used, 0);
+    }
+    SUBCASE("other threads can allocate too") {
+        const auto Churn = [&Alloc] {
+            std::vector<void*> Blocks;
+            for (size_t i = 0; i < 64 * 150; ++i) {
+                Blocks.push_back(Alloc(nullptr, 0, 16 + i % 300));
+                if (Blocks.size() == 64) {
+                    for (size_t k = 0; k < Blocks.size(); ++k) {
+                        Alloc(Blocks[k], 16 + (i - 63 + k) % 300, 0);
+                    }
+                    Blocks.clear();
+                }
+            }
+        };
+        std::thread Other(Churn);
+        Churn();
+        Other.join();
+        CHECK_EQ(Allocator.GetStats().Used, 0);
+    }
+}
+
+TEST_CASE("TLuaAllocator::TStats::Fragmentation") {
+    TLuaAllocator::TStats Stats;
+    CHECK_EQ(Stats.Fragmentation(), 0);
+    Stats.Reserved = 1000;
+    Stats.Used = 250;
+    CHECK_EQ(Stats.Fragmentation(), 0.75);
+}
+
+BEAMMP_BENCHMARK("Lua/Allocator small blocks") {
+    TLuaAllocator Allocator("bench");
+    std::vector<void*> Blocks(1000);
+    State.SetItemsPerIteration(Blocks.size());
+    State.Run([&] {
+        for (size_t i = 0; i < Blocks.size(); ++i) {
+            Blocks[i] = TLuaAllocator::Alloc(&Allocator, nullptr, 0, 16 + i % 64);
+        }
+        for (size_t i = 0; i < Blocks.size(); ++i) {
+            TLuaAllocator::Alloc(&Allocator, Blocks[i], 16 + i % 64, 0);
+        }
+    });
+}
+
+BEAMMP_BENCHMARK("Lua/malloc small blocks") {
+    std::vector<void*> Blocks(1000);
+    State.SetItemsPerIteration(Blocks.size());
+    State.Run([&] {
+        for (size_t i = 0; i < Blocks.size(); ++i) {
+            Blocks[i] = std::malloc(16 + i % 64);
+        }
+        for (auto* Block : Blocks) {
+            std::free(Block);
+        }
+    });
+}
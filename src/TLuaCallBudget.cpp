@@ -0,0 +1,196 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "TLuaCallBudget.h"
+
+#include "Common.h"
+#include "Environment.h"
+#include "TLuaEngine.h"
+
+#include <algorithm>
+#include <thread>
+
+#ifdef BEAMMP_WINDOWS
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+thread_local TLuaCallBudget* TLuaCallBudget::sRunning = nullptr;
+
+TLuaCallBudget::TThreadCPUClock::time_point TLuaCallBudget::TThreadCPUClock::now() noexcept {
+#ifdef BEAMMP_WINDOWS
+    FILETIME Creation, Exit, Kernel, User;
+    if (!GetThreadTimes(GetCurrentThread(), &Creation, &Exit, &Kernel, &User)) {
+        return time_point {};
+    }
+    const auto Ticks = ((uint64_t(Kernel.dwHighDateTime) << 32) | Kernel.dwLowDateTime)
+        + ((uint64_t(User.dwHighDateTime) << 32) | User.dwLowDateTime);
+    // in units of 100ns
+    return time_point(duration(rep(Ticks) * 100));
+#else
+    timespec Now {};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &Now);
+    return time_point(std::chrono::seconds(Now.tv_sec) + std::chrono::nanoseconds(Now.tv_nsec));
+#endif
+}
+
+std::chrono::milliseconds TLuaCallBudget::Resolve(const std::string& EventName, std::chrono::milliseconds Default, const std::unordered_map<std::string, int>& Overrides) {
+    auto Iter = Overrides.find(EventName);
+    if (Iter == Overrides.end()) {
+        return Default;
+    }
+    return std::chrono::milliseconds(std::max(Iter->second, 0));
+}
+
+void TLuaCallBudget::Begin(std::chrono::milliseconds Budget, const std::string& CallName, const std::string& Plugin) {
+    mStart = TClock::now();
+    mDeadline = Budget.count() > 0 ? mStart + Budget : TClock::time_point::max();
+    mBudget = Budget;
+    mCallName = &CallName;
+    mPlugin = &Plugin;
+    mExceeded = false;
+    sRunning = this;
+}
+
+void TLuaCallBudget::End() {
+    mSpent = TClock::now() - mStart;
+    sRunning = nullptr;
+    mDeadline = TClock::time_point::max();
+}
+
+void TLuaCallBudget::Check(lua_State* L) {
+    auto* Running = sRunning;
+    if (!Running || TClock::now() < Running->mDeadline) {
+        return;
+    }
+    Running->mExceeded = true;
+    luaL_error(L, "\"%s\" in plugin \"%s\" ran longer than its budget of %d ms and was aborted",
+        Running->mCallName->c_str(), Running->mPlugin->c_str(), int(Running->mBudget.count()));
+}
+
+TEST_CASE("TLuaCallBudget::Resolve") {
+    const std::unordered_map<std::string, int> Overrides {
+        { "onChatMessage", 50 },
+        { "onPlayerJoin", 0 },
+        { "onBroken", -5 },
+    };
+    const auto Default = std::chrono::milliseconds(200);
+    CHECK_EQ(TLuaCallBudget::Resolve("onVehicleSpawn", Default, Overrides), Default);
+    CHECK_EQ(TLuaCallBudget::Resolve("", Default, Overrides), Default);
+    CHECK_EQ(TLuaCallBudget::Resolve("onChatMessage", Default, Overrides), std::chrono::milliseconds(50));
+    // an override can lift the budget, and negative ones do the same
+    CHECK_EQ(TLuaCallBudget::Resolve("onPlayerJoin", Default, Overrides), std::chrono::milliseconds(0));
+    CHECK_EQ(TLuaCallBudget::Resolve("onBroken", Default, Overrides), std::chrono::milliseconds(0));
+    // names are matched exactly
+    CHECK_EQ(TLuaCallBudget::Resolve("onchatmessage", Default, Overrides), Default);
+}
+
+TEST_CASE("TLuaCallBudget") {
+    sol::state Lua;
+    Lua.open_libraries(sol::lib::base);
+    lua_sethook(
+        Lua.lua_state(), [](lua_State* L, lua_Debug*) { TLuaCallBudget::Check(L); }, LUA_MASKCOUNT, TLuaCallBudget::CheckInterval);
+    const std::string Name = "Spin";
+    const std::string Plugin = "Test";
+    TLuaCallBudget Budget;
+    Lua.script(R"(
+        Caught = false
+        function Spin() while true do end end
+        function SpinInPcall()
+            Caught = not pcall(function() while true do end end)
+            while true do end
+        end
+        function Count(n)
+            local x = 0
+            for i = 1, n do x = x + 1 end
+            return x
+        end
+    )");
+
+    SUBCASE("an endless loop is aborted") {
+        sol::protected_function Spin = Lua["Spin"];
+        Budget.Begin(std::chrono::milliseconds(20), Name, Plugin);
+        auto Result = Spin();
+        Budget.End();
+        REQUIRE_FALSE(Result.valid());
+        CHECK(Budget.Exceeded());
+        sol::error Error = Result;
+        CHECK_NE(std::string(Error.what()).find("\"Spin\" in plugin \"Test\" ran longer than its budget of 20 ms"), std::string::npos);
+    }
+    SUBCASE("catching the error with pcall doesn't keep it running") {
+        sol::protected_function Spin = Lua["SpinInPcall"];
+        Budget.Begin(std::chrono::milliseconds(20), Name, Plugin);
+        auto Result = Spin();
+        Budget.End();
+        CHECK_FALSE(Result.valid());
+        CHECK(Budget.Exceeded());
+        CHECK(Lua["Caught"].get<bool>());
+    }
+    SUBCASE("calls within their budget, or without one, are left alone") {
+        sol::protected_function Count = Lua["Count"];
+        Budget.Begin(std::chrono::seconds(30), Name, Plugin);
+        auto Result = Count(1000000);
+        Budget.End();
+        REQUIRE(Result.valid());
+        CHECK_EQ(Result.get<int>(), 1000000);
+        CHECK_FALSE(Budget.Exceeded());
+
+        Budget.Begin(std::chrono::milliseconds(0), Name, Plugin);
+        auto Unlimited = Count(1000000);
+        Budget.End();
+        CHECK(Unlimited.valid());
+        CHECK_FALSE(Budget.Exceeded());
+    }
+    SUBCASE("waiting doesn't count against the budget") {
+        Lua.set_function("Wait", [](int Ms) { std::this_thread::sleep_for(std::chrono::milliseconds(Ms)); });
+        Lua.script(R"(
+            function WaitThenCount()
+                Wait(100)
+                return Count(100000)
+            end
+        )");
+        sol::protected_function WaitThenCount = Lua["WaitThenCount"];
+        Budget.Begin(std::chrono::milliseconds(50), Name, Plugin);
+        auto Result = WaitThenCount();
+        Budget.End();
+        CHECK(Result.valid());
+        CHECK_FALSE(Budget.Exceeded());
+        CHECK(Budget.Spent() < std::chrono::milliseconds(50));
+    }
+    SUBCASE("nothing is aborted once the call ended") {
+        sol::protected_function Count = Lua["Count"];
+        Budget.Begin(std::chrono::milliseconds(1), Name, Plugin);
+        Budget.End();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        CHECK(Count(1000000).valid());
+        CHECK_FALSE(Budget.Exceeded());
+    }
+}
+
+TEST_CASE("TLuaCallBudget::TThreadCPUClock") {
+    using TClock = TLuaCallBudget::TThreadCPUClock;
+    const auto Start = TClock::now();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    // sleeping uses next to no CPU time
+    CHECK(TClock::now() - Start < std::chrono::milliseconds(20));
+    const auto BusyUntil = std::chrono::steady_clock::now() + std::chrono::milliseconds(30);
+    while (std::chrono::steady_clock::now() < BusyUntil) {
+    }
+    CHECK(TClock::now() - Start >= std::chrono::milliseconds(10));
+}
@@ -17,6 +17,7 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "TLuaEngine.h"
+#include "Benchmark.h"
 #include "Client.h"
 #include "CustomAssert.h"
 #include "Http.h"
@@ -24,10 +25,15 @@
 #include "TLuaPlugin.h"
 #include "sol/object.hpp"
 
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <cmath>
 #include <condition_variable>
+#include <deque>
 #include <nlohmann/json.hpp>
 #include <random>
+#include <string_view>
 #include <thread>
 #include <tuple>
 
@@ -43,6 +49,42 @@ TLuaEngine::TLuaEngine()
     if (!fs::exists(mResourceServerPath)) {
         fs::create_directory(mResourceServerPath);
     }
+    mMetricsGauges.push_back(Metrics::RegisterGauge("beammp_lua_function_queue_length", "Lua function calls (mostly event handlers) waiting to run, by state.", [this] {
+        std::vector<Metrics::TGaugeSample> Samples;
+        for (const auto& [StateId, Size] : GetFunctionQueueSizes()) {
+            Samples.push_back({ fmt::format("state=\"{}\"", Metrics::EscapeLabel(StateId)), double(Size) });
+        }
+        return Samples;
+    }));
+    using TMemoryValue = double (*)(const TLuaAllocator::TStats&);
+    using TRegister = Metrics::TGaugeRegistration (*)(const std::string&, const std::string&, Metrics::TGaugeFunction);
+    const std::vector<std::tuple<const char*, const char*, TMemoryValue, TRegister>> MemoryGauges {
+        { "beammp_lua_memory_used_bytes", "Memory in use by each Lua state.", [](const TLuaAllocator::TStats& Stats) { return double(Stats.Used); }, &Metrics::RegisterGauge },
+        { "beammp_lua_memory_peak_bytes", "Most memory each Lua state has used at once.", [](const TLuaAllocator::TStats& Stats) { return double(Stats.Peak); }, &Metrics::RegisterGauge },
+        { "beammp_lua_memory_reserved_bytes", "Memory each Lua state's allocator got from the system.", [](const TLuaAllocator::TStats& Stats) { return double(Stats.Reserved); }, &Metrics::RegisterGauge },
+        { "beammp_lua_memory_fragmentation_ratio", "Share of each Lua state's reserved memory which isn't in use.", [](const TLuaAllocator::TStats& Stats) { return Stats.Fragmentation(); }, &Metrics::RegisterGauge },
+        { "beammp_lua_allocations_total", "Allocations and resizes done by each Lua state.", [](const TLuaAllocator::TStats& Stats) { return double(Stats.Allocations); }, &Metrics::RegisterCounter },
+        { "beammp_lua_allocations_refused_total", "Allocations refused because a Lua state hit LuaStateMemoryLimitMB or the system was out of memory.", [](const TLuaAllocator::TStats& Stats) { return double(Stats.Refused); }, &Metrics::RegisterCounter },
+    };
+    for (const auto& [Name, Help, Value, Register] : MemoryGauges) {
+        mMetricsGauges.push_back(Register(Name, Help, [this, Fn = Value] {
+            std::vector<Metrics::TGaugeSample> Samples;
+            for (const auto& [StateId, Stats] : GetMemoryStats()) {
+                Samples.push_back({ fmt::format("state=\"{}\"", Metrics::EscapeLabel(StateId)), Fn(Stats) });
+            }
+            return Samples;
+        }));
+    }
+    mMetricsGauges.push_back(Metrics::RegisterCounter("beammp_lua_budget_aborts_total", "Lua calls aborted for running over LuaCallBudgetMs or LuaEventBudgetsMs, by state.", [this] {
+        std::vector<Metrics::TGaugeSample> Samples;
+        for (const auto& [StateId, Aborts] : GetBudgetAborts()) {
+            Samples.push_back({ fmt::format("state=\"{}\"", Metrics::EscapeLabel(StateId)), double(Aborts) });
+        }
+        return Samples;
+    }));
+    mMetricsGauges.push_back(Metrics::RegisterGauge("beammp_lua_results_to_check", "Lua results waiting to be checked for errors.", [this] {
+        return std::vector<Metrics::TGaugeSample> { { "", double(GetResultsToCheckSize()) } };
+    }));
     Application::RegisterShutdownHandler([&] {
         Application::SetSubsystemStatus("LuaEngine", Application::Status::ShuttingDown);
         if (mThread.joinable()) {
@@ -73,74 +115,11 @@ void TLuaEngine::operator()() {
         }
     }
 
-    auto ResultCheckThread = std::thread([&] {
-        RegisterThread("ResultCheckThread");
-        while (!Application::IsShuttingDown()) {
-            std::unique_lock Lock(mResultsToCheckMutex);
-            if (!mResultsToCheck.empty()) {
-                mResultsToCheck.remove_if([](const std::shared_ptr<TLuaResult>& Ptr) -> bool {
-                    if (Ptr->Ready) {
-                        if (Ptr->Error) {
-                            if (Ptr->ErrorMessage != BeamMPFnNotFoundError) {
-                                beammp_lua_error(Ptr->Function + ": " + Ptr->ErrorMessage);
-                            }
-                        }
-                        return true;
-                    }
-                    return false;
-                });
-            } else {
-                mResultsToCheckCond.wait_for(Lock, std::chrono::milliseconds(20));
-            }
-        }
-    });
-    // event loop
-    auto Before = std::chrono::high_resolution_clock::now();
+    // event timers run on the scheduler, this thread only waits for shutdown
     while (!Application::IsShuttingDown()) {
-        { // Timed Events Scope
-            std::unique_lock Lock(mTimedEventsMutex);
-            for (auto& Timer : mTimedEvents) {
-                if (Timer.Expired()) {
-                    auto LastCompletionBeforeReset = Timer.LastCompletion;
-                    Timer.Reset();
-                    auto Handlers = GetEventHandlersForState(Timer.EventName, Timer.StateId);
-                    std::unique_lock StateLock(mLuaStatesMutex);
-                    std::unique_lock Lock2(mResultsToCheckMutex);
-                    for (auto& Handler : Handlers) {
-                        auto Res = mLuaStates[Timer.StateId]->EnqueueFunctionCallFromCustomEvent(Handler, {}, Timer.EventName, Timer.Strategy);
-                        if (Res) {
-                            mResultsToCheck.push_back(Res);
-                            mResultsToCheckCond.notify_one();
-                        } else {
-                            // "revert" reset
-                            Timer.LastCompletion = LastCompletionBeforeReset;
-                            // beammp_trace("Reverted reset of \"" + Timer.EventName + "\" timer");
-                            // no need to try to enqueue more handlers for this event (they will all fail)
-                            break;
-                        }
-                    }
-                }
-            }
-        }
-        if (mLuaStates.size() == 0) {
-            beammp_trace("No Lua states, event loop running extremely sparsely");
-            Application::SleepSafeSeconds(10);
-        } else {
-            constexpr double NsFactor = 1000000.0;
-            constexpr double Expected = 10.0; // ms
-            const auto Diff = (std::chrono::high_resolution_clock::now() - Before).count() / NsFactor;
-            if (Diff < Expected) {
-                std::this_thread::sleep_for(std::chrono::nanoseconds(size_t((Expected - Diff) * NsFactor)));
-            } else {
-                beammp_tracef("Event loop cannot keep up! Running {}ms behind", Diff);
-            }
-        }
-        Before = std::chrono::high_resolution_clock::now();
-    }
-
-    if (ResultCheckThread.joinable()) {
-        ResultCheckThread.join();
+        Application::SleepSafeSeconds(1);
     }
+    CancelAllEventTimers();
 }
 
 size_t TLuaEngine::CalculateMemoryUsage() {
@@ -174,21 +153,32 @@ TLuaStateId TLuaEngine::GetStateIDForPlugin(const fs::path& PluginPath) {
     return "";
 }
 
+std::vector<TLuaStateId> TLuaEngine::GetStateIDsForPlugin(const fs::path& PluginPath) {
+    std::vector<TLuaStateId> Result;
+    for (const auto& Plugin : mLuaPlugins) {
+        if (fs::equivalent(Plugin->GetFolder(), PluginPath)) {
+            const auto& Config = Plugin->GetConfig();
+            for (size_t Index = 0; Index < Config.Shards; ++Index) {
+                Result.push_back(Config.ShardStateId(Index));
+            }
+            return Result;
+        }
+    }
+    beammp_assert_not_reachable();
+    return Result;
+}
+
 void TLuaEngine::AddResultToCheck(const std::shared_ptr<TLuaResult>& Result) {
-    std::unique_lock Lock(mResultsToCheckMutex);
-    mResultsToCheck.push_back(Result);
-    mResultsToCheckCond.notify_one();
+    ReportErrors({ Result });
 }
 
 std::unordered_map<std::string /* event name */, std::vector<std::string> /* handlers */> TLuaEngine::Debug_GetEventsForState(TLuaStateId StateId) {
     std::unordered_map<std::string, std::vector<std::string>> Result;
-    std::unique_lock Lock(mLuaEventsMutex);
-    for (const auto& EventNameToEventMap : mLuaEvents) {
-        for (const auto& IdSetOfHandlersPair : EventNameToEventMap.second) {
-            if (IdSetOfHandlersPair.first == StateId) {
-                for (const auto& Handler : IdSetOfHandlersPair.second) {
-                    Result[EventNameToEventMap.first].push_back(Handler);
-                }
+    std::shared_lock Lock(mLuaEventsMutex);
+    for (size_t Event = 0; Event < mLuaEvents.size(); ++Event) {
+        for (const auto& Handler : mLuaEvents[Event]) {
+            if (Handler.StateId == StateId) {
+                Result[EventNameOf(TEventID(Event))].push_back(Handler.FunctionName);
             }
         }
     }
@@ -209,21 +199,6 @@ std::vector<TLuaEngine::QueuedFunction> TLuaEngine::Debug_GetStateFunctionQueueF
     return Result;
 }
 
-std::vector<TLuaResult> TLuaEngine::Debug_GetResultsToCheckForState(TLuaStateId StateId) {
-    std::unique_lock Lock(mResultsToCheckMutex);
-    auto ResultsToCheckCopy = mResultsToCheck;
-    Lock.unlock();
-    std::vector<TLuaResult> Result;
-    while (!ResultsToCheckCopy.empty()) {
-        auto ResultToCheck = std::move(ResultsToCheckCopy.front());
-        ResultsToCheckCopy.pop_front();
-        if (ResultToCheck->StateId == StateId) {
-            Result.push_back(*ResultToCheck);
-        }
-    }
-    return Result;
-}
-
 std::vector<std::string> TLuaEngine::GetStateGlobalKeysForState(TLuaStateId StateId) {
     std::unique_lock Lock(mLuaStatesMutex);
     auto Result = mLuaStates.at(StateId)->GetStateGlobalKeys();
@@ -299,28 +274,46 @@ std::vector<std::string> TLuaEngine::StateThreadData::GetStateTableKeys(const st
 
 */
 
+// counts down as results become ready, shared with their continuations so
+// that results which finish after WaitForAll gave up on them don't dangle
+struct TResultLatch {
+    std::mutex Mutex;
+    std::condition_variable Cond;
+    size_t Pending;
+};
+
 void TLuaEngine::WaitForAll(std::vector<std::shared_ptr<TLuaResult>>& Results, const std::optional<std::chrono::high_resolution_clock::duration>& Max) {
+    Tracing::TSpan Span("WaitForAll");
+    const auto Start = std::chrono::steady_clock::now();
+    auto Latch = std::make_shared<TResultLatch>();
+    Latch->Pending = Results.size();
     for (const auto& Result : Results) {
-        bool Cancelled = false;
-        size_t ms = 0;
-        std::set<std::string> WarnedResults;
-
-        while (!Result->Ready && !Cancelled) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            ms += 10;
-            if (Max.has_value() && std::chrono::milliseconds(ms) > Max.value()) {
-                beammp_trace("'" + Result->Function + "' in '" + Result->StateId + "' did not finish executing in time (took: " + std::to_string(ms) + "ms).");
-                Cancelled = true;
-            } else if (ms > 1000 * 60) {
-                auto ResultId = Result->StateId + "_" + Result->Function;
-                if (WarnedResults.count(ResultId) == 0) {
-                    WarnedResults.insert(ResultId);
-                    beammp_lua_warn("'" + Result->Function + "' in '" + Result->StateId + "' is taking very long. The event it's handling is too important to discard the result of this handler, but may block this event and possibly the whole lua state.");
-                }
+        Result->OnReady([Latch](const TLuaResult&) {
+            std::unique_lock Lock(Latch->Mutex);
+            if (--Latch->Pending == 0) {
+                Latch->Cond.notify_all();
+            }
+        });
+    }
+
+    std::unique_lock Lock(Latch->Mutex);
+    const auto AllReady = [&Latch] { return Latch->Pending == 0; };
+    if (Max.has_value()) {
+        Latch->Cond.wait_until(Lock, Start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(*Max), AllReady);
+    } else if (!Latch->Cond.wait_for(Lock, std::chrono::minutes(1), AllReady)) {
+        for (const auto& Result : Results) {
+            if (!Result->IsReady()) {
+                beammp_lua_warn("'" + Result->Function + "' in '" + Result->StateId + "' is taking very long. The event it's handling is too important to discard the result of this handler, but may block this event and possibly the whole lua state.");
             }
         }
+        Latch->Cond.wait(Lock, AllReady);
+    }
+    Lock.unlock();
 
-        if (Cancelled) {
+    for (const auto& Result : Results) {
+        if (!Result->IsReady()) {
+            const auto Waited = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - Start);
+            beammp_trace("'" + Result->Function + "' in '" + Result->StateId + "' did not finish executing in time (took: " + std::to_string(Waited.count()) + "ms).");
             beammp_lua_warn("'" + Result->Function + "' in '" + Result->StateId + "' failed to execute in time and was not waited for. It may still finish executing at a later time.");
             LuaAPI::MP::Engine->ReportErrors({ Result });
         } else if (Result->Error) {
@@ -331,12 +324,16 @@ void TLuaEngine::WaitForAll(std::vector<std::shared_ptr<TLuaResult>>& Results, c
     }
 }
 
-// run this on the error checking thread
 void TLuaEngine::ReportErrors(const std::vector<std::shared_ptr<TLuaResult>>& Results) {
-    std::unique_lock Lock2(mResultsToCheckMutex);
     for (const auto& Result : Results) {
-        mResultsToCheck.push_back(Result);
-        mResultsToCheckCond.notify_one();
+        mResultsToCheckCount.fetch_add(1, std::memory_order_relaxed);
+        // runs on the state thread which finishes the call
+        Result->OnReady([this](const TLuaResult& Done) {
+            if (Done.Error && Done.ErrorMessage != BeamMPFnNotFoundError) {
+                beammp_lua_error(Done.Function + ": " + Done.ErrorMessage);
+            }
+            mResultsToCheckCount.fetch_sub(1, std::memory_order_relaxed);
+        });
     }
 }
 
@@ -350,9 +347,100 @@ std::shared_ptr<TLuaResult> TLuaEngine::EnqueueScript(TLuaStateId StateID, const
     return mLuaStates.at(StateID)->EnqueueScript(Script);
 }
 
-std::shared_ptr<TLuaResult> TLuaEngine::EnqueueFunctionCall(TLuaStateId StateID, const std::string& FunctionName, const std::vector<TLuaArgTypes>& Args) {
+std::shared_ptr<TLuaResult> TLuaEngine::EnqueueFunctionCall(TLuaStateId StateID, const std::string& FunctionName, const std::vector<TLuaArgTypes>& Args, const std::string& EventName) {
+    std::unique_lock Lock(mLuaStatesMutex);
+    return mLuaStates.at(StateID)->EnqueueFunctionCall(FunctionName, Args, EventName);
+}
+
+// interned event names, shared by all engines; names are never removed, so
+// references into the deque stay valid
+static std::shared_mutex sEventNamesMutex;
+static std::unordered_map<std::string, TLuaEngine::TEventID> sEventIDs;
+static std::deque<std::string> sEventNames;
+
+TLuaEngine::TEventID TLuaEngine::InternEvent(const std::string& EventName) {
+    if (auto Event = FindEvent(EventName); Event != NoEvent) {
+        return Event;
+    }
+    std::unique_lock Lock(sEventNamesMutex);
+    auto [Iter, Inserted] = sEventIDs.try_emplace(EventName, TEventID(sEventNames.size()));
+    if (Inserted) {
+        sEventNames.push_back(EventName);
+    }
+    return Iter->second;
+}
+
+TLuaEngine::TEventID TLuaEngine::FindEvent(const std::string& EventName) {
+    std::shared_lock Lock(sEventNamesMutex);
+    auto Iter = sEventIDs.find(EventName);
+    return Iter == sEventIDs.end() ? NoEvent : Iter->second;
+}
+
+const std::string& TLuaEngine::EventNameOf(TEventID Event) {
+    static const std::string sUnknown = "<unknown event>";
+    std::shared_lock Lock(sEventNamesMutex);
+    return Event < sEventNames.size() ? sEventNames[Event] : sUnknown;
+}
+
+TEST_CASE("TLuaEngine event interning") {
+    CHECK_EQ(TLuaEngine::FindEvent("onTestInterning"), TLuaEngine::NoEvent);
+    const auto Event = TLuaEngine::InternEvent("onTestInterning");
+    CHECK_NE(Event, TLuaEngine::NoEvent);
+    CHECK_EQ(TLuaEngine::InternEvent("onTestInterning"), Event);
+    CHECK_EQ(TLuaEngine::FindEvent("onTestInterning"), Event);
+    CHECK_EQ(TLuaEngine::EventNameOf(Event), "onTestInterning");
+    CHECK_NE(TLuaEngine::InternEvent("onTestInterning2"), Event);
+}
+
+std::vector<std::pair<TLuaStateId, size_t>> TLuaEngine::GetFunctionQueueSizes() {
     std::unique_lock Lock(mLuaStatesMutex);
-    return mLuaStates.at(StateID)->EnqueueFunctionCall(FunctionName, Args);
+    std::vector<std::pair<TLuaStateId, size_t>> Sizes;
+    for (const auto& [StateId, State] : mLuaStates) {
+        Sizes.emplace_back(StateId, State->FunctionQueueSize());
+    }
+    return Sizes;
+}
+
+uint64_t TLuaEngine::GetBudgetAborts(TLuaStateId StateId) {
+    std::unique_lock Lock(mLuaStatesMutex);
+    auto Iter = mLuaStates.find(StateId);
+    return Iter == mLuaStates.end() ? 0 : Iter->second->BudgetAborts();
+}
+
+std::vector<std::pair<TLuaStateId, uint64_t>> TLuaEngine::GetBudgetAborts() {
+    std::unique_lock Lock(mLuaStatesMutex);
+    std::vector<std::pair<TLuaStateId, uint64_t>> Aborts;
+    for (const auto& [StateId, State] : mLuaStates) {
+        Aborts.emplace_back(StateId, State->BudgetAborts());
+    }
+    return Aborts;
+}
+
+std::shared_ptr<TLuaProfiler> TLuaEngine::StartProfile(TLuaStateId StateId) {
+    std::unique_lock Lock(mLuaStatesMutex);
+    auto Iter = mLuaStates.find(StateId);
+    if (Iter == mLuaStates.end()) {
+        return nullptr;
+    }
+    auto Profiler = std::make_shared<TLuaProfiler>();
+    return Iter->second->StartProfile(Profiler) ? Profiler : nullptr;
+}
+
+void TLuaEngine::StopProfile(TLuaStateId StateId) {
+    std::unique_lock Lock(mLuaStatesMutex);
+    auto Iter = mLuaStates.find(StateId);
+    if (Iter != mLuaStates.end()) {
+        Iter->second->StopProfile();
+    }
+}
+
+std::vector<std::pair<TLuaStateId, TLuaAllocator::TStats>> TLuaEngine::GetMemoryStats() {
+    std::unique_lock Lock(mLuaStatesMutex);
+    std::vector<std::pair<TLuaStateId, TLuaAllocator::TStats>> Stats;
+    for (const auto& [StateId, State] : mLuaStates) {
+        Stats.emplace_back(StateId, State->MemoryStats());
+    }
+    return Stats;
 }
 
 void TLuaEngine::CollectAndInitPlugins() {
@@ -376,8 +464,12 @@ void TLuaEngine::InitializePlugin(const fs::path& Folder, const TLuaPluginConfig
     beammp_assert(fs::exists(Folder));
     beammp_assert(fs::is_directory(Folder));
     std::unique_lock Lock(mLuaStatesMutex);
-    EnsureStateExists(Config.StateId, Folder.stem().string(), true);
-    mLuaStates[Config.StateId]->AddPath(Folder); // add to cpath + path
+    for (size_t Index = 0; Index < Config.Shards; ++Index) {
+        const auto StateId = Config.ShardStateId(Index);
+        const auto Name = Index == 0 ? Folder.stem().string() : fmt::format("{}#{}", Folder.stem().string(), Index);
+        EnsureStateExists(StateId, Name, true, { Config.StateId, Index, Config.Shards });
+        mLuaStates[StateId]->AddPath(Folder); // add to cpath + path
+    }
     Lock.unlock();
     auto Plugin = std::make_shared<TLuaPlugin>(*this, Config, Folder);
     mLuaPlugins.emplace_back(std::move(Plugin));
@@ -397,18 +489,35 @@ void TLuaEngine::FindAndParseConfig(const fs::path& Folder, TLuaPluginConfig& Co
                     beammp_debug("LuaStateID empty, using plugin name");
                 }
             }
+            if (Data.contains("Shards")) {
+                auto Shards = toml::find<int64_t>(Data, "Shards");
+                if (Shards < 1 || size_t(Shards) > TLuaPluginConfig::MaxShards) {
+                    beammp_errorf("{}: Shards has to be between 1 and {}, running the plugin in one state", Folder.string(), TLuaPluginConfig::MaxShards);
+                } else {
+                    beammp_debugf("Plugin \"{}\" runs in {} shards", Folder.string(), Shards);
+                    Config.Shards = size_t(Shards);
+                }
+            }
         } catch (const std::exception& e) {
             beammp_error(Folder.string() + ": " + e.what());
         }
     }
 }
 
-void TLuaEngine::EnsureStateExists(TLuaStateId StateId, const std::string& Name, bool DontCallOnInit) {
+void TLuaEngine::EnsureStateExists(TLuaStateId StateId, const std::string& Name, bool DontCallOnInit, const TShard& Shard) {
     beammp_assert(!StateId.empty());
     std::unique_lock Lock(mLuaStatesMutex);
-    if (mLuaStates.find(StateId) == mLuaStates.end()) {
+    auto Existing = mLuaStates.find(StateId);
+    if (Existing != mLuaStates.end() && Existing->second->Shard().Count != Shard.Count) {
+        beammp_warnf("Lua state \"{}\" already exists with {} shard(s), so \"{}\" doesn't get the {} it asked for", StateId, Existing->second->Shard().Count, Name, Shard.Count);
+    }
+    if (Existing == mLuaStates.end()) {
         beammp_debug("Creating lua state for state id \"" + StateId + "\"");
-        auto DataPtr = std::make_unique<StateThreadData>(Name, StateId, *this);
+        auto& SharedStore = mSharedStores[Shard.Group.empty() ? StateId : Shard.Group];
+        if (!SharedStore) {
+            SharedStore = std::make_shared<TLuaSharedStore>();
+        }
+        auto DataPtr = std::make_unique<StateThreadData>(Name, StateId, *this, Shard, SharedStore);
         mLuaStates[StateId] = std::move(DataPtr);
         RegisterEvent("onInit", StateId, "onInit");
         if (!DontCallOnInit) {
@@ -422,17 +531,52 @@ void TLuaEngine::EnsureStateExists(TLuaStateId StateId, const std::string& Name,
 }
 
 void TLuaEngine::RegisterEvent(const std::string& EventName, TLuaStateId StateId, const std::string& FunctionName) {
+    const auto Event = InternEvent(EventName);
+    StateThreadData* State = nullptr;
+    {
+        std::unique_lock StatesLock(mLuaStatesMutex);
+        State = mLuaStates.at(StateId).get();
+    }
+    const auto Handler = State->HandlerIndex(FunctionName);
     std::unique_lock Lock(mLuaEventsMutex);
-    mLuaEvents[EventName][StateId].insert(FunctionName);
+    if (mLuaEvents.size() <= Event) {
+        mLuaEvents.resize(Event + 1);
+    }
+    auto& Handlers = mLuaEvents[Event];
+    auto Iter = std::find_if(Handlers.begin(), Handlers.end(), [&](const TEventHandler& Existing) { return Existing.StateId == StateId; });
+    while (Iter != Handlers.end() && Iter->StateId == StateId && Iter->FunctionName < FunctionName) {
+        ++Iter;
+    }
+    if (Iter != Handlers.end() && Iter->StateId == StateId && Iter->FunctionName == FunctionName) {
+        // already registered
+        return;
+    }
+    Handlers.insert(Iter, TEventHandler { State, StateId, FunctionName, Handler, State->Shard().Index, State->Shard().Count });
 }
 
 std::set<std::string> TLuaEngine::GetEventHandlersForState(const std::string& EventName, TLuaStateId StateId) {
-    return mLuaEvents[EventName][StateId];
+    std::set<std::string> Result;
+    const auto Event = FindEvent(EventName);
+    std::shared_lock Lock(mLuaEventsMutex);
+    if (Event < mLuaEvents.size()) {
+        for (const auto& Handler : mLuaEvents[Event]) {
+            if (Handler.StateId == StateId) {
+                Result.insert(Handler.FunctionName);
+            }
+        }
+    }
+    return Result;
 }
 
 sol::table TLuaEngine::StateThreadData::Lua_TriggerGlobalEvent(const std::string& EventName, sol::variadic_args EventArgs) {
     auto Return = mEngine->TriggerEvent(EventName, mStateId, EventArgs);
-    auto MyHandlers = mEngine->GetEventHandlersForState(EventName, mStateId);
+    // the other shards of this plugin got it above if it's theirs, this one
+    // only runs it here if it's its own
+    const auto Key = ShardKey({ TLuaArgTypes { EventArgs } });
+    std::set<std::string> MyHandlers;
+    if (mShard.Count == 1 || !Key || *Key % mShard.Count == mShard.Index) {
+        MyHandlers = mEngine->GetEventHandlersForState(EventName, mStateId);
+    }
     for (const auto& Handler : MyHandlers) {
         auto Fn = mStateView[Handler];
         if (Fn.valid()) {
@@ -702,8 +846,7 @@ static void JsonDecodeRecursive(sol::state_view& StateView, sol::table& table, c
     }
 }
 
-sol::table TLuaEngine::StateThreadData::Lua_JsonDecode(const std::string& str) {
-    sol::state_view StateView(mState);
+static sol::table JsonDecode(sol::state_view StateView, const std::string& str) {
     auto table = StateView.create_table();
     if (!nlohmann::json::accept(str)) {
         beammp_lua_error("string given to JsonDecode is not valid json: `" + str + "`");
@@ -725,11 +868,168 @@ sol::table TLuaEngine::StateThreadData::Lua_JsonDecode(const std::string& str) {
     return table;
 }
 
-TLuaEngine::StateThreadData::StateThreadData(const std::string& Name, TLuaStateId StateId, TLuaEngine& Engine)
+sol::table TLuaEngine::StateThreadData::Lua_JsonDecode(const std::string& str) {
+    return JsonDecode(sol::state_view(mState), str);
+}
+
+static sol::table TrafficCountTable(sol::state_view StateView, const TTrafficStats::TCount& Count, const TTrafficStats::TRate& Rate) {
+    return StateView.create_table_with(
+        "packets", Count.Packets,
+        "bytes", Count.Bytes,
+        "packets_per_second", Rate.PacketsPerSecond,
+        "bytes_per_second", Rate.BytesPerSecond);
+}
+
+// the layout of TTrafficStats::ToJson, built without going through json
+static sol::table TrafficTable(sol::state_view StateView, const TTrafficStats::TSnapshot& Counts, const TTrafficStats::TRates& Rates) {
+    using Dir = TTrafficStats::Direction;
+    using Via = TTrafficStats::Transport;
+    constexpr std::array Directions { Dir::In, Dir::Out };
+    auto NameOf = [](Dir Direction) { return Direction == Dir::In ? "inbound" : "outbound"; };
+    sol::table Result = StateView.create_table();
+    for (auto Direction : Directions) {
+        sol::table Table = TrafficCountTable(StateView, Counts.Total(Direction), Rates.Total(Direction));
+        Table["tcp"] = TrafficCountTable(StateView, Counts.Get(Direction, Via::TCP), Rates.Get(Direction, Via::TCP));
+        Table["udp"] = TrafficCountTable(StateView, Counts.Get(Direction, Via::UDP), Rates.Get(Direction, Via::UDP));
+        Result[NameOf(Direction)] = Table;
+    }
+    sol::table Codes = StateView.create_table();
+    for (size_t Code = 0; Code < 256; ++Code) {
+        sol::table CodeTable;
+        for (auto Direction : Directions) {
+            const auto& Count = Counts.ByCode[size_t(Direction)][Code];
+            if (Count.Packets == 0) {
+                continue;
+            }
+            if (!CodeTable.valid()) {
+                CodeTable = StateView.create_table();
+            }
+            CodeTable[NameOf(Direction)] = TrafficCountTable(StateView, Count, Rates.ByCode[size_t(Direction)][Code]);
+        }
+        if (CodeTable.valid()) {
+            Codes[TTrafficStats::CodeName(uint8_t(Code))] = CodeTable;
+        }
+    }
+    Result["codes"] = Codes;
+    return Result;
+}
+
+sol::table TLuaEngine::StateThreadData::Lua_GetStats() {
+    TTrafficStats::TSnapshot TotalCounts;
+    TTrafficStats::TRates TotalRates;
+    sol::table Players = mStateView.create_table();
+    mEngine->Server().ForEachClient([&](std::weak_ptr<TClient> Client) -> bool {
+        if (!Client.expired()) {
+            auto locked = Client.lock();
+            auto Counts = locked->Traffic().Snapshot();
+            auto Rates = locked->Traffic().GetRates();
+            sol::table Player = TrafficTable(mStateView, Counts, Rates);
+            Player["name"] = locked->GetName();
+            Players[locked->GetID()] = Player;
+            TotalCounts += Counts;
+            TotalRates += Rates;
+        }
+        return true;
+    });
+    sol::table Result = TrafficTable(mStateView, TotalCounts, TotalRates);
+    Result["players"] = Players;
+    return Result;
+}
+
+BEAMMP_BENCHMARK("Lua/JsonDecode") {
+    sol::state Lua;
+    const std::string Json = R"({"jbm":"pickup","vcf":{"parts":{"pickup_body":"pickup_body","pickup_engine":"pickup_engine_v8"},"paints":[{"baseColor":[0.5,0.1,0.1,1.2],"metallic":0.5,"roughness":0.5}],"partConfigFilename":"vehicles/pickup/d15_4wd_A.pc"},"pro":"0","pos":[12.5,-3.25,100.0],"rot":[0,0,0.7071,0.7071]})";
+    State.Run([&] { Benchmark::DoNotOptimize(JsonDecode(Lua, Json)); });
+}
+
+// MP.Shared values are copied between states, so only plain values fit
+static std::optional<TLuaSharedStore::TValue> ToSharedValue(const sol::object& Value) {
+    switch (Value.get_type()) {
+    case sol::type::lua_nil:
+    case sol::type::none:
+        return TLuaSharedStore::TValue {};
+    case sol::type::boolean:
+        return TLuaSharedStore::TValue { Value.as<bool>() };
+    case sol::type::number: {
+        // integers are kept as such, so MP.Shared.Increment works on them
+        const auto Number = Value.as<double>();
+        if (std::floor(Number) == Number && std::abs(Number) < 9.2e18) {
+            return TLuaSharedStore::TValue { int64_t(Number) };
+        }
+        return TLuaSharedStore::TValue { Number };
+    }
+    case sol::type::string:
+        return TLuaSharedStore::TValue { Value.as<std::string>() };
+    default:
+        return std::nullopt;
+    }
+}
+
+static sol::object FromSharedValue(sol::state_view State, const TLuaSharedStore::TValue& Value) {
+    return std::visit([&State](const auto& Alternative) -> sol::object {
+        if constexpr (std::is_same_v<std::decay_t<decltype(Alternative)>, std::monostate>) {
+            return sol::make_object(State, sol::lua_nil);
+        } else {
+            return sol::make_object(State, Alternative);
+        }
+    },
+        Value);
+}
+
+std::optional<size_t> TLuaEngine::ShardKey(const std::vector<TLuaArgTypes>& Args) {
+    if (Args.empty()) {
+        return std::nullopt;
+    }
+    if (const auto* Int = std::get_if<int>(&Args.front())) {
+        if (*Int >= 0) {
+            return size_t(*Int);
+        }
+    } else if (const auto* LuaArgs = std::get_if<sol::variadic_args>(&Args.front())) {
+        // triggered from Lua
+        if (LuaArgs->size() > 0 && LuaArgs->get_type(0) == sol::type::number) {
+            const auto Number = LuaArgs->get<double>(0);
+            // above 2^53 doubles aren't exact integers anymore, and may not fit a size_t
+            constexpr double MaxExactInteger = 9007199254740992.0;
+            if (Number >= 0 && Number < MaxExactInteger && std::floor(Number) == Number) {
+                return size_t(Number);
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+TEST_CASE("TLuaEngine::ShardKey") {
+    CHECK_EQ(TLuaEngine::ShardKey({ TLuaArgTypes { 5 }, TLuaArgTypes { std::string("data") } }), 5);
+    CHECK_EQ(TLuaEngine::ShardKey({ TLuaArgTypes { 0 } }), 0);
+    CHECK(!TLuaEngine::ShardKey({ TLuaArgTypes { -1 } }));
+    CHECK(!TLuaEngine::ShardKey({ TLuaArgTypes { std::string("name") }, TLuaArgTypes { 5 } }));
+    CHECK(!TLuaEngine::ShardKey({}));
+
+    sol::state Lua;
+    Lua.set_function("Key", [](sol::variadic_args Args) -> int64_t {
+        auto Key = TLuaEngine::ShardKey({ TLuaArgTypes { Args } });
+        return Key ? int64_t(*Key) : -1;
+    });
+    CHECK_EQ(Lua.script("return Key(3, 'data')").get<int64_t>(), 3);
+    CHECK_EQ(Lua.script("return Key(2.5)").get<int64_t>(), -1);
+    CHECK_EQ(Lua.script("return Key(2^53 - 1)").get<int64_t>(), 9007199254740991);
+    CHECK_EQ(Lua.script("return Key(2^53)").get<int64_t>(), -1);
+    CHECK_EQ(Lua.script("return Key(1e30)").get<int64_t>(), -1);
+    CHECK_EQ(Lua.script("return Key(math.huge)").get<int64_t>(), -1);
+    CHECK_EQ(Lua.script("return Key(0/0)").get<int64_t>(), -1);
+    CHECK_EQ(Lua.script("return Key('3')").get<int64_t>(), -1);
+    CHECK_EQ(Lua.script("return Key()").get<int64_t>(), -1);
+}
+
+TLuaEngine::StateThreadData::StateThreadData(const std::string& Name, TLuaStateId StateId, TLuaEngine& Engine, const TShard& Shard, std::shared_ptr<TLuaSharedStore> SharedStore)
     : mName(Name)
     , mStateId(StateId)
-    , mState(luaL_newstate())
-    , mEngine(&Engine) {
+    , mShard(Shard)
+    , mSharedStore(std::move(SharedStore))
+    , mAllocator(StateId, size_t(std::max(Application::Settings.LuaStateMemoryLimitMB, 0)) * 1024 * 1024)
+    , mState(lua_newstate(&TLuaAllocator::Alloc, &mAllocator))
+    , mEngine(&Engine)
+    , mQueueWaitTime(&Metrics::LuaQueueWaitTime.WithLabel(StateId)) {
     if (!mState) {
         beammp_error("failed to create lua state for \"" + StateId + "\"");
         return;
@@ -737,6 +1037,8 @@ TLuaEngine::StateThreadData::StateThreadData(const std::string& Name, TLuaStateI
     luaL_openlibs(mState);
     sol::state_view StateView(mState);
     lua_atpanic(mState, LuaAPI::PanicHandler);
+    // coroutines created by the state inherit this
+    lua_sethook(mState, &StateThreadData::CountHook, LUA_MASKCOUNT, TLuaCallBudget::CheckInterval);
     // StateView.globals()["package"].get()
     StateView.set_function("print", &LuaAPI::Print);
     StateView.set_function("printRaw", &LuaAPI::MP::PrintRaw);
@@ -789,6 +1091,9 @@ TLuaEngine::StateThreadData::StateThreadData(const std::string& Name, TLuaStateI
     MPTable.set_function("GetPlayers", [&]() -> sol::table {
         return Lua_GetPlayers();
     });
+    MPTable.set_function("GetStats", [&]() -> sol::table {
+        return Lua_GetStats();
+    });
     MPTable.set_function("IsPlayerGuest", &LuaAPI::MP::IsPlayerGuest);
     MPTable.set_function("DropPlayer", &LuaAPI::MP::DropPlayer);
     MPTable.set_function("GetStateMemoryUsage", [&]() -> size_t {
@@ -818,8 +1123,8 @@ TLuaEngine::StateThreadData::StateThreadData(const std::string& Name, TLuaStateI
         auto EventName = Args.get<std::string>(0);
         auto IntervalMS = Args.get<size_t>(1);
         CallStrategy Strategy = Args.size() > 2 ? Args.get<CallStrategy>(2) : CallStrategy::BestEffort;
-        if (IntervalMS < 25) {
-            beammp_warn("Timer for \"" + EventName + "\" on \"" + mStateId + "\" is set to trigger at <25ms, which is likely too fast and won't cancel properly.");
+        if (IntervalMS < 10) {
+            beammp_warn("Timer for \"" + EventName + "\" on \"" + mStateId + "\" is set to trigger at <10ms, its handler has to be very fast to keep up with that.");
         }
         mEngine->CreateEventTimer(EventName, mStateId, IntervalMS, Strategy);
     });
@@ -827,6 +1132,39 @@ TLuaEngine::StateThreadData::StateThreadData(const std::string& Name, TLuaStateI
         mEngine->CancelEventTimers(EventName, mStateId);
     });
     MPTable.set_function("Set", &LuaAPI::MP::Set);
+    MPTable.set_function("GetShard", [this]() -> std::tuple<size_t, size_t> {
+        return { mShard.Index, mShard.Count };
+    });
+
+    auto SharedTable = MPTable.create_named("Shared");
+    SharedTable.set_function("Get", [this](const std::string& Key) -> sol::object {
+        return FromSharedValue(mStateView, mSharedStore->Get(Key));
+    });
+    SharedTable.set_function("Set", [this](const std::string& Key, const sol::object& Value) {
+        auto Converted = ToSharedValue(Value);
+        if (!Converted) {
+            beammp_lua_error("MP.Shared.Set expects nil, a boolean, a number or a string (encode tables with Util.JsonEncode)");
+            return;
+        }
+        mSharedStore->Set(Key, std::move(*Converted));
+    });
+    SharedTable.set_function("Increment", [this](const std::string& Key, sol::optional<int64_t> By) -> sol::object {
+        auto Result = mSharedStore->Increment(Key, By.value_or(1));
+        if (!Result) {
+            beammp_lua_error("MP.Shared.Increment: \"" + Key + "\" isn't an integer");
+            return sol::make_object(mStateView, sol::lua_nil);
+        }
+        return sol::make_object(mStateView, *Result);
+    });
+    SharedTable.set_function("CompareAndSet", [this](const std::string& Key, const sol::object& Expected, const sol::object& Desired) -> bool {
+        auto ConvertedExpected = ToSharedValue(Expected);
+        auto ConvertedDesired = ToSharedValue(Desired);
+        if (!ConvertedExpected || !ConvertedDesired) {
+            beammp_lua_error("MP.Shared.CompareAndSet expects nil, booleans, numbers or strings (encode tables with Util.JsonEncode)");
+            return false;
+        }
+        return mSharedStore->CompareAndSet(Key, *ConvertedExpected, std::move(*ConvertedDesired));
+    });
 
     auto UtilTable = StateView.create_named_table("Util");
     UtilTable.set_function("JsonEncode", &LuaAPI::MP::JsonEncode);
@@ -888,201 +1226,411 @@ TLuaEngine::StateThreadData::StateThreadData(const std::string& Name, TLuaStateI
 }
 
 std::shared_ptr<TLuaResult> TLuaEngine::StateThreadData::EnqueueScript(const TLuaChunk& Script) {
-    std::unique_lock Lock(mStateExecuteQueueMutex);
     auto Result = std::make_shared<TLuaResult>();
+    std::unique_lock Lock(mStateQueueMutex);
     mStateExecuteQueue.push({ Script, Result });
+    mStateQueueCond.notify_one();
     return Result;
 }
 
 std::shared_ptr<TLuaResult> TLuaEngine::StateThreadData::EnqueueFunctionCallFromCustomEvent(const std::string& FunctionName, const std::vector<TLuaArgTypes>& Args, const std::string& EventName, CallStrategy Strategy) {
-    // TODO: Document all this
-    decltype(mStateFunctionQueue)::iterator Iter = mStateFunctionQueue.end();
-    if (Strategy == CallStrategy::BestEffort) {
-        Iter = std::find_if(mStateFunctionQueue.begin(), mStateFunctionQueue.end(),
-            [&EventName](const QueuedFunction& Element) {
-                return Element.EventName == EventName;
-            });
-    }
-    if (Iter == mStateFunctionQueue.end()) {
-        auto Result = std::make_shared<TLuaResult>();
-        Result->StateId = mStateId;
-        Result->Function = FunctionName;
-        std::unique_lock Lock(mStateFunctionQueueMutex);
-        mStateFunctionQueue.push_back({ FunctionName, Result, Args, EventName });
-        mStateFunctionQueueCond.notify_all();
-        return Result;
-    } else {
+    // BestEffort skips this call if the previous one for the same event is still queued,
+    // so a timer which fires faster than its handler runs doesn't fill up the queue
+    const auto Handler = HandlerIndex(FunctionName);
+    const auto Event = InternEvent(EventName);
+    std::unique_lock Lock(mStateQueueMutex);
+    if (Strategy == CallStrategy::BestEffort
+        && mStateFunctionQueue.AnyOf([&EventName](const QueuedFunction& Element) { return Element.EventName == EventName; })) {
         return nullptr;
     }
+    auto Result = std::make_shared<TLuaResult>();
+    Result->StateId = mStateId;
+    Result->Function = FunctionName;
+    mStateFunctionQueue.PushBack({ FunctionName, Result, Args, EventName, Event, Tracing::CurrentFlowID(), Handler, std::chrono::steady_clock::now() });
+    mStateQueueCond.notify_one();
+    return Result;
 }
 
-std::shared_ptr<TLuaResult> TLuaEngine::StateThreadData::EnqueueFunctionCall(const std::string& FunctionName, const std::vector<TLuaArgTypes>& Args) {
+std::shared_ptr<TLuaResult> TLuaEngine::StateThreadData::EnqueueFunctionCall(const std::string& FunctionName, const std::vector<TLuaArgTypes>& Args, const std::string& EventName) {
+    return EnqueueHandlerCall(FunctionName, HandlerIndex(FunctionName), Args, EventName.empty() ? NoEvent : InternEvent(EventName));
+}
+
+std::shared_ptr<TLuaResult> TLuaEngine::StateThreadData::EnqueueHandlerCall(const std::string& FunctionName, size_t Handler, const std::vector<TLuaArgTypes>& Args, TEventID Event) {
     auto Result = std::make_shared<TLuaResult>();
     Result->StateId = mStateId;
     Result->Function = FunctionName;
-    std::unique_lock Lock(mStateFunctionQueueMutex);
-    mStateFunctionQueue.push_back({ FunctionName, Result, Args, "" });
-    mStateFunctionQueueCond.notify_all();
+    QueuedFunction Call { FunctionName, Result, Args, "", Event, Tracing::CurrentFlowID(), Handler, std::chrono::steady_clock::now() };
+    std::unique_lock Lock(mStateQueueMutex);
+    mStateFunctionQueue.PushBack(std::move(Call));
+    mStateQueueCond.notify_one();
     return Result;
 }
 
+size_t TLuaEngine::StateThreadData::HandlerIndex(const std::string& FunctionName) {
+    std::unique_lock Lock(mHandlerIndicesMutex);
+    return mHandlerIndices.try_emplace(FunctionName, mHandlerIndices.size()).first->second;
+}
+
+sol::protected_function TLuaEngine::StateThreadData::CachedHandler(size_t Handler, const std::string& FunctionName) {
+    if (Handler >= mHandlerCache.size()) {
+        mHandlerCache.resize(Handler + 1);
+    }
+    auto& Cached = mHandlerCache[Handler];
+    const auto Generation = mHandlerGeneration.load();
+    if (Cached.Generation != Generation || !Cached.Fn.valid()) {
+        // misses aren't cached, the function may still be defined later
+        auto Fn = mStateView[FunctionName];
+        Cached.Fn = Fn.valid() && Fn.get_type() == sol::type::function ? Fn.get<sol::protected_function>() : sol::protected_function();
+        Cached.Generation = Generation;
+    }
+    return Cached.Fn;
+}
+
+Metrics::THistogram& TLuaEngine::StateThreadData::HandlerTime(size_t Handler, const std::string& FunctionName) {
+    if (Handler >= mHandlerTimes.size()) {
+        mHandlerTimes.resize(Handler + 1, nullptr);
+    }
+    if (!mHandlerTimes[Handler]) {
+        mHandlerTimes[Handler] = &Metrics::LuaHandlerTime.WithLabel(mStateId + ":" + FunctionName);
+    }
+    return *mHandlerTimes[Handler];
+}
+
+std::chrono::milliseconds TLuaEngine::StateThreadData::BudgetFor(TEventID Event) {
+    const auto Default = std::chrono::milliseconds(std::max(Application::Settings.LuaCallBudgetMs, 0));
+    if (Event == NoEvent) {
+        return Default;
+    }
+    if (Event >= mEventBudgets.size()) {
+        mEventBudgets.resize(Event + 1);
+    }
+    auto& Budget = mEventBudgets[Event];
+    if (!Budget) {
+        Budget = TLuaCallBudget::Resolve(EventNameOf(Event), Default, Application::Settings.LuaEventBudgetsMs);
+    }
+    return *Budget;
+}
+
+thread_local TLuaEngine::StateThreadData* TLuaEngine::StateThreadData::sThreadState = nullptr;
+
+void TLuaEngine::StateThreadData::CountHook(lua_State* L, lua_Debug*) {
+    if (sThreadState && sThreadState->mProfiling.load(std::memory_order_relaxed)) {
+        sThreadState->Sample(L);
+    }
+    TLuaCallBudget::Check(L);
+}
+
+void TLuaEngine::StateThreadData::Sample(lua_State* L) {
+    std::unique_lock Lock(mProfilerMutex);
+    if (!mProfiler || !mProfiler->Due(TLuaProfiler::TClock::now())) {
+        return;
+    }
+    // L is the running coroutine, if any, so its stack is the one sampled
+    mSampleStack.clear();
+    lua_Debug Frame;
+    for (int Level = 0; Level < MaxProfileDepth && lua_getstack(L, Level, &Frame); ++Level) {
+        lua_getinfo(L, "Sn", &Frame);
+        const std::string_view What = Frame.what ? Frame.what : "";
+        const char* Name = Frame.name ? Frame.name : "?";
+        if (What == "main") {
+            mSampleStack.push_back(fmt::format("main chunk ({})", Frame.short_src));
+        } else if (What == "C") {
+            mSampleStack.push_back(fmt::format("{} [C]", Name));
+        } else {
+            mSampleStack.push_back(fmt::format("{} ({}:{})", Name, Frame.short_src, Frame.linedefined));
+        }
+    }
+    std::reverse(mSampleStack.begin(), mSampleStack.end());
+    mProfiler->AddSample(mSampleStack);
+}
+
+bool TLuaEngine::StateThreadData::StartProfile(std::shared_ptr<TLuaProfiler> Profiler) {
+    std::unique_lock Lock(mProfilerMutex);
+    if (mProfiler) {
+        return false;
+    }
+    mProfiler = std::move(Profiler);
+    mProfiling = true;
+    return true;
+}
+
+void TLuaEngine::StateThreadData::StopProfile() {
+    // once this has the lock, the state's thread is done with the profiler
+    std::unique_lock Lock(mProfilerMutex);
+    mProfiling = false;
+    mProfiler.reset();
+}
+
+Metrics::THistogram& TLuaEngine::StateThreadData::EventHandlerTime(TEventID Event) {
+    if (Event >= mEventHandlerTimes.size()) {
+        mEventHandlerTimes.resize(Event + 1, nullptr);
+    }
+    if (!mEventHandlerTimes[Event]) {
+        mEventHandlerTimes[Event] = &Metrics::LuaEventHandlerTime.WithLabel(EventNameOf(Event));
+    }
+    return *mEventHandlerTimes[Event];
+}
+
+size_t TLuaEngine::StateThreadData::FunctionQueueSize() {
+    std::unique_lock Lock(mStateQueueMutex);
+    return mStateFunctionQueue.Size();
+}
+
 void TLuaEngine::StateThreadData::RegisterEvent(const std::string& EventName, const std::string& FunctionName) {
     mEngine->RegisterEvent(EventName, mStateId, FunctionName);
+    ++mHandlerGeneration;
 }
 
 void TLuaEngine::StateThreadData::operator()() {
     RegisterThread("Lua:" + mStateId);
+    sThreadState = this;
+    std::queue<std::pair<TLuaChunk, std::shared_ptr<TLuaResult>>> Scripts;
+    std::vector<QueuedFunction> Batch;
+    Batch.reserve(FunctionBatchSize);
     while (!Application::IsShuttingDown()) {
-        { // StateExecuteQueue Scope
-            std::unique_lock Lock(mStateExecuteQueueMutex);
-            if (!mStateExecuteQueue.empty()) {
-                auto S = mStateExecuteQueue.front();
-                mStateExecuteQueue.pop();
-                Lock.unlock();
-
-                { // Paths Scope
-                    std::unique_lock Lock(mPathsMutex);
-                    if (!mPaths.empty()) {
-                        std::stringstream PathAdditions;
-                        std::stringstream CPathAdditions;
-                        while (!mPaths.empty()) {
-                            auto Path = mPaths.front();
-                            mPaths.pop();
-                            PathAdditions << ";" << (Path / "?.lua").string();
-                            PathAdditions << ";" << (Path / "lua/?.lua").string();
+        {
+            std::unique_lock Lock(mStateQueueMutex);
+            // times out so that shutdown is noticed
+            mStateQueueCond.wait_for(Lock, std::chrono::milliseconds(500),
+                [&]() -> bool { return !mStateExecuteQueue.empty() || !mStateFunctionQueue.Empty(); });
+            std::swap(Scripts, mStateExecuteQueue);
+            mStateFunctionQueue.PopFront(Batch, FunctionBatchSize);
+        }
+        // scripts first, they may define the functions which are called next
+        while (!Scripts.empty()) {
+            RunScript(Scripts.front().first, *Scripts.front().second);
+            Scripts.pop();
+        }
+        for (auto& Call : Batch) {
+            CallFunction(Call);
+        }
+        Batch.clear();
+    }
+}
+
+void TLuaEngine::StateThreadData::RunScript(const TLuaChunk& Script, TLuaResult& Result) {
+    { // Paths Scope
+        std::unique_lock Lock(mPathsMutex);
+        if (!mPaths.empty()) {
+            std::stringstream PathAdditions;
+            std::stringstream CPathAdditions;
+            while (!mPaths.empty()) {
+                auto Path = mPaths.front();
+                mPaths.pop();
+                PathAdditions << ";" << (Path / "?.lua").string();
+                PathAdditions << ";" << (Path / "lua/?.lua").string();
 #if WIN32
-                            CPathAdditions << ";" << (Path / "?.dll").string();
-                            CPathAdditions << ";" << (Path / "lib/?.dll").string();
+                CPathAdditions << ";" << (Path / "?.dll").string();
+                CPathAdditions << ";" << (Path / "lib/?.dll").string();
 #else // unix
-                            CPathAdditions << ";" << (Path / "?.so").string();
-                            CPathAdditions << ";" << (Path / "lib/?.so").string();
+                CPathAdditions << ";" << (Path / "?.so").string();
+                CPathAdditions << ";" << (Path / "lib/?.so").string();
 #endif
-                        }
-                        sol::state_view StateView(mState);
-                        auto PackageTable = StateView.globals().get<sol::table>("package");
-                        PackageTable["path"] = PackageTable.get<std::string>("path") + PathAdditions.str();
-                        PackageTable["cpath"] = PackageTable.get<std::string>("cpath") + CPathAdditions.str();
-                        StateView.globals()["package"] = PackageTable;
-                    }
-                }
-                sol::state_view StateView(mState);
-                auto Res = StateView.safe_script(*S.first.Content, sol::script_pass_on_error, S.first.FileName);
-                if (Res.valid()) {
-                    S.second->Error = false;
-                    S.second->Result = std::move(Res);
-                } else {
-                    S.second->Error = true;
-                    sol::error Err = Res;
-                    S.second->ErrorMessage = Err.what();
-                }
-                S.second->MarkAsReady();
             }
+            sol::state_view StateView(mState);
+            auto PackageTable = StateView.globals().get<sol::table>("package");
+            PackageTable["path"] = PackageTable.get<std::string>("path") + PathAdditions.str();
+            PackageTable["cpath"] = PackageTable.get<std::string>("cpath") + CPathAdditions.str();
+            StateView.globals()["package"] = PackageTable;
         }
-        { // StateFunctionQueue Scope
-            std::unique_lock Lock(mStateFunctionQueueMutex);
-            auto NotExpired = mStateFunctionQueueCond.wait_for(Lock,
-                std::chrono::milliseconds(500),
-                [&]() -> bool { return !mStateFunctionQueue.empty(); });
-            if (NotExpired) {
-                auto TheQueuedFunction = std::move(mStateFunctionQueue.front());
-                mStateFunctionQueue.erase(mStateFunctionQueue.begin());
-                Lock.unlock();
-                auto& FnName = TheQueuedFunction.FunctionName;
-                auto& Result = TheQueuedFunction.Result;
-                auto Args = TheQueuedFunction.Args;
-                // TODO: Use TheQueuedFunction.EventName for errors, warnings, etc
-                Result->StateId = mStateId;
-                sol::state_view StateView(mState);
-                auto Fn = StateView[FnName];
-                if (Fn.valid() && Fn.get_type() == sol::type::function) {
-                    std::vector<sol::object> LuaArgs;
-                    for (const auto& Arg : Args) {
-                        if (Arg.valueless_by_exception()) {
-                            continue;
-                        }
-                        switch (Arg.index()) {
-                        case TLuaArgTypes_String:
-                            LuaArgs.push_back(sol::make_object(StateView, std::get<std::string>(Arg)));
-                            break;
-                        case TLuaArgTypes_Int:
-                            LuaArgs.push_back(sol::make_object(StateView, std::get<int>(Arg)));
-                            break;
-                        case TLuaArgTypes_VariadicArgs:
-                            LuaArgs.push_back(sol::make_object(StateView, std::get<sol::variadic_args>(Arg)));
-                            break;
-                        case TLuaArgTypes_Bool:
-                            LuaArgs.push_back(sol::make_object(StateView, std::get<bool>(Arg)));
-                            break;
-                        case TLuaArgTypes_StringStringMap: {
-                            auto Map = std::get<std::unordered_map<std::string, std::string>>(Arg);
-                            auto Table = StateView.create_table();
-                            for (const auto& [k, v] : Map) {
-                                Table[k] = v;
-                            }
-                            LuaArgs.push_back(sol::make_object(StateView, Table));
-                            break;
-                        }
-                        default:
-                            beammp_error("Unknown argument type, passed as nil");
-                            break;
-                        }
-                    }
-                    auto Res = Fn(sol::as_args(LuaArgs));
-                    if (Res.valid()) {
-                        Result->Error = false;
-                        Result->Result = std::move(Res);
-                    } else {
-                        Result->Error = true;
-                        sol::error Err = Res;
-                        Result->ErrorMessage = Err.what();
-                    }
-                    Result->MarkAsReady();
-                } else {
-                    Result->Error = true;
-                    Result->ErrorMessage = BeamMPFnNotFoundError; // special error kind that we can ignore later
-                    Result->MarkAsReady();
+    }
+    sol::state_view StateView(mState);
+    auto Res = StateView.safe_script(*Script.Content, sol::script_pass_on_error, Script.FileName);
+    // the script may have (re)defined any handler
+    ++mHandlerGeneration;
+    if (Res.valid()) {
+        Result.Error = false;
+        Result.Result = std::move(Res);
+    } else {
+        Result.Error = true;
+        sol::error Err = Res;
+        Result.ErrorMessage = Err.what();
+    }
+    Result.MarkAsReady();
+}
+
+void TLuaEngine::StateThreadData::CallFunction(QueuedFunction& TheQueuedFunction) {
+    mQueueWaitTime->Observe(std::chrono::steady_clock::now() - TheQueuedFunction.Enqueued);
+
+    auto& FnName = TheQueuedFunction.FunctionName;
+    auto& Result = TheQueuedFunction.Result;
+    const auto& Args = TheQueuedFunction.Args;
+    Tracing::TFlowScope Flow(TheQueuedFunction.FlowID);
+    const bool IsEventHandler = TheQueuedFunction.HandledEvent != NoEvent;
+    Tracing::TSpan Span("Lua", IsEventHandler ? EventNameOf(TheQueuedFunction.HandledEvent) : FnName);
+    // TODO: Use TheQueuedFunction.EventName for errors, warnings, etc
+    Result->StateId = mStateId;
+    sol::state_view StateView(mState);
+    const auto Handler = TheQueuedFunction.Handler == NoHandler ? HandlerIndex(FnName) : TheQueuedFunction.Handler;
+    auto Fn = CachedHandler(Handler, FnName);
+    if (Fn.valid()) {
+        std::vector<sol::object> LuaArgs;
+        for (const auto& Arg : Args) {
+            if (Arg.valueless_by_exception()) {
+                continue;
+            }
+            switch (Arg.index()) {
+            case TLuaArgTypes_String:
+                LuaArgs.push_back(sol::make_object(StateView, std::get<std::string>(Arg)));
+                break;
+            case TLuaArgTypes_Int:
+                LuaArgs.push_back(sol::make_object(StateView, std::get<int>(Arg)));
+                break;
+            case TLuaArgTypes_VariadicArgs:
+                LuaArgs.push_back(sol::make_object(StateView, std::get<sol::variadic_args>(Arg)));
+                break;
+            case TLuaArgTypes_Bool:
+                LuaArgs.push_back(sol::make_object(StateView, std::get<bool>(Arg)));
+                break;
+            case TLuaArgTypes_StringStringMap: {
+                auto Map = std::get<std::unordered_map<std::string, std::string>>(Arg);
+                auto Table = StateView.create_table();
+                for (const auto& [k, v] : Map) {
+                    Table[k] = v;
                 }
+                LuaArgs.push_back(sol::make_object(StateView, Table));
+                break;
+            }
+            default:
+                beammp_error("Unknown argument type, passed as nil");
+                break;
             }
         }
+        const auto Budget = BudgetFor(TheQueuedFunction.HandledEvent);
+        const auto CallStart = std::chrono::steady_clock::now();
+        mCallBudget.Begin(Budget, FnName, mName);
+        auto Res = Fn(sol::as_args(LuaArgs));
+        mCallBudget.End();
+        if (IsEventHandler) {
+            EventHandlerTime(TheQueuedFunction.HandledEvent).Observe(std::chrono::steady_clock::now() - CallStart);
+        }
+        // CPU time, like the budget
+        HandlerTime(Handler, FnName).Observe(mCallBudget.Spent());
+        if (mCallBudget.Exceeded()) {
+            mBudgetAborts.fetch_add(1, std::memory_order_relaxed);
+            beammp_lua_warnf("\"{}\" in plugin \"{}\" (state \"{}\") was aborted after {} ms of CPU time, over its budget of {} ms",
+                FnName, mName, mStateId, std::chrono::duration_cast<std::chrono::milliseconds>(mCallBudget.Spent()).count(), Budget.count());
+        }
+        if (Res.valid()) {
+            Result->Error = false;
+            Result->Result = std::move(Res);
+        } else {
+            Result->Error = true;
+            sol::error Err = Res;
+            Result->ErrorMessage = Err.what();
+        }
+        Result->MarkAsReady();
+    } else {
+        Result->Error = true;
+        Result->ErrorMessage = BeamMPFnNotFoundError; // special error kind that we can ignore later
+        Result->MarkAsReady();
     }
 }
 
 std::queue<std::pair<TLuaChunk, std::shared_ptr<TLuaResult>>> TLuaEngine::StateThreadData::Debug_GetStateExecuteQueue() {
-    std::unique_lock Lock(mStateExecuteQueueMutex);
+    std::unique_lock Lock(mStateQueueMutex);
     return mStateExecuteQueue;
 }
 
 std::vector<TLuaEngine::QueuedFunction> TLuaEngine::StateThreadData::Debug_GetStateFunctionQueue() {
-    std::unique_lock Lock(mStateFunctionQueueMutex);
-    return mStateFunctionQueue;
+    std::unique_lock Lock(mStateQueueMutex);
+    return mStateFunctionQueue.ToVector();
 }
 
 void TLuaEngine::CreateEventTimer(const std::string& EventName, TLuaStateId StateId, size_t IntervalMS, CallStrategy Strategy) {
+    auto Event = std::make_shared<TimedEvent>();
+    // the scheduler ticks every millisecond, a zero interval fires on every tick
+    Event->Duration = std::chrono::milliseconds(std::max<size_t>(IntervalMS, 1));
+    Event->Due = std::chrono::steady_clock::now() + Event->Duration;
+    Event->EventName = EventName;
+    Event->StateId = StateId;
+    {
+        std::unique_lock StatesLock(mLuaStatesMutex);
+        Event->State = mLuaStates.at(StateId).get();
+    }
+    Event->Strategy = Strategy;
     std::unique_lock Lock(mTimedEventsMutex);
-    TimedEvent Event {
-        std::chrono::high_resolution_clock::duration { std::chrono::milliseconds(IntervalMS) },
-        std::chrono::high_resolution_clock::now(),
-        EventName,
-        StateId,
-        Strategy
-    };
-    mTimedEvents.push_back(std::move(Event));
+    mTimedEvents.push_back(Event);
+    ArmEventTimer(Event, Event->Due);
     beammp_trace("created event timer for \"" + EventName + "\" on \"" + StateId + "\" with " + std::to_string(IntervalMS) + "ms interval");
 }
 
 void TLuaEngine::CancelEventTimers(const std::string& EventName, TLuaStateId StateId) {
-    std::unique_lock Lock(mTimedEventsMutex);
-    beammp_trace("cancelling event timer for \"" + EventName + "\" on \"" + StateId + "\"");
-    for (;;) {
-        auto Iter = std::find_if(mTimedEvents.begin(), mTimedEvents.end(), [&](const TimedEvent& Event) -> bool {
-            return Event.EventName == EventName && Event.StateId == StateId;
+    std::vector<std::shared_ptr<TimedEvent>> Cancelled;
+    {
+        std::unique_lock Lock(mTimedEventsMutex);
+        beammp_trace("cancelling event timer for \"" + EventName + "\" on \"" + StateId + "\"");
+        std::erase_if(mTimedEvents, [&](const std::shared_ptr<TimedEvent>& Event) -> bool {
+            if (Event->EventName == EventName && Event->StateId == StateId) {
+                Event->Cancelled = true;
+                Cancelled.push_back(Event);
+                return true;
+            }
+            return false;
         });
-        if (Iter != mTimedEvents.end()) {
-            mTimedEvents.erase(Iter);
+    }
+    // outside the lock, this waits for a fire which is running right now, which re-arms under it
+    for (const auto& Event : Cancelled) {
+        Application::Scheduler().Cancel(Event->Task);
+    }
+}
+
+void TLuaEngine::CancelAllEventTimers() {
+    std::vector<std::shared_ptr<TimedEvent>> Cancelled;
+    {
+        std::unique_lock Lock(mTimedEventsMutex);
+        for (const auto& Event : mTimedEvents) {
+            Event->Cancelled = true;
+        }
+        Cancelled = std::move(mTimedEvents);
+        mTimedEvents.clear();
+    }
+    for (const auto& Event : Cancelled) {
+        Application::Scheduler().Cancel(Event->Task);
+    }
+}
+
+// with mTimedEventsMutex held
+void TLuaEngine::ArmEventTimer(const std::shared_ptr<TimedEvent>& Timer, std::chrono::steady_clock::time_point At) {
+    if (Timer->Cancelled) {
+        return;
+    }
+    const auto Delay = std::max(At - std::chrono::steady_clock::now(), std::chrono::steady_clock::duration::zero());
+    // a short task: it only queues the handler calls, so it never waits
+    // behind HTTP requests or plugin reloads on the blocking pool
+    Timer->Task = Application::Scheduler().After("Lua event timer", Delay, [this, Timer] {
+        FireEventTimer(Timer);
+    });
+}
+
+void TLuaEngine::FireEventTimer(const std::shared_ptr<TimedEvent>& Timer) {
+    static auto& sJitter = Metrics::ProbeTime.WithLabel("Lua timer jitter");
+    const auto Now = std::chrono::steady_clock::now();
+    bool Queued = true;
+    // no engine wide locks in here, CancelEventTimers waits for this to finish
+    for (auto& Handler : GetEventHandlersForState(Timer->EventName, Timer->StateId)) {
+        auto Res = Timer->State->EnqueueFunctionCallFromCustomEvent(Handler, {}, Timer->EventName, Timer->Strategy);
+        if (Res) {
+            ReportErrors({ Res });
         } else {
+            // the last call for this event is still queued (BestEffort), so are the
+            // other handlers', no need to try them
+            Queued = false;
             break;
         }
     }
+    std::unique_lock Lock(mTimedEventsMutex);
+    if (Queued) {
+        // how late the handlers were queued, which includes the time a BestEffort
+        // timer waited for its previous call
+        sJitter.Observe(Now - Timer->Due);
+        // like before, the interval counts from when it last fired, missed fires aren't made up
+        Timer->Due = Now + Timer->Duration;
+        ArmEventTimer(Timer, Timer->Due);
+    } else {
+        // stays due
+        ArmEventTimer(Timer, Now + std::min<std::chrono::steady_clock::duration>(Timer->Duration, BestEffortRetry));
+    }
 }
 
 void TLuaEngine::StateThreadData::AddPath(const fs::path& Path) {
@@ -1091,18 +1639,104 @@ void TLuaEngine::StateThreadData::AddPath(const fs::path& Path) {
 }
 
 void TLuaResult::MarkAsReady() {
+    decltype(Continuations) ToCall;
     {
         std::lock_guard<std::mutex> readyLock(*this->ReadyMutex);
         this->Ready = true;
+        std::swap(ToCall, this->Continuations);
     }
     this->ReadyCondition->notify_all();
+    for (const auto& Fn : ToCall) {
+        Fn(*this);
+    }
 }
 
 void TLuaResult::WaitUntilReady() {
     std::unique_lock readyLock(*this->ReadyMutex);
-    // wait if not ready yet
-    if(!this->Ready)
-        this->ReadyCondition->wait(readyLock);
+    this->ReadyCondition->wait(readyLock, [this] { return this->Ready; });
+}
+
+bool TLuaResult::IsReady() {
+    std::unique_lock readyLock(*this->ReadyMutex);
+    return this->Ready;
+}
+
+void TLuaResult::OnReady(std::function<void(const TLuaResult&)> Fn) {
+    {
+        std::unique_lock readyLock(*this->ReadyMutex);
+        if (!this->Ready) {
+            this->Continuations.push_back(std::move(Fn));
+            return;
+        }
+    }
+    Fn(*this);
+}
+
+TEST_CASE("TLuaEngine::WaitForAll") {
+    std::vector<std::shared_ptr<TLuaResult>> Results;
+    for (int i = 0; i < 8; ++i) {
+        Results.push_back(std::make_shared<TLuaResult>());
+    }
+    size_t Continued = 0;
+    Results.front()->OnReady([&Continued](const TLuaResult& Result) {
+        CHECK(Result.Ready);
+        ++Continued;
+    });
+    auto Worker = std::thread([Results] {
+        for (const auto& Result : Results) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            Result->MarkAsReady();
+        }
+    });
+    const auto Start = std::chrono::steady_clock::now();
+    TLuaEngine::WaitForAll(Results, std::chrono::seconds(5));
+    // the old polling wait took 10ms per result
+    CHECK(std::chrono::steady_clock::now() - Start < std::chrono::seconds(1));
+    Worker.join();
+    for (const auto& Result : Results) {
+        CHECK(Result->IsReady());
+    }
+    CHECK_EQ(Continued, 1);
+    // already ready, called right away
+    Results.back()->OnReady([&Continued](const TLuaResult&) { ++Continued; });
+    CHECK_EQ(Continued, 2);
+}
+
+// a handler round trip without Lua: hand a result to another thread, which
+// marks it as ready, and wait for it
+BEAMMP_BENCHMARK("Lua/WaitForAll round trip") {
+    std::mutex Mutex;
+    std::condition_variable Cond;
+    std::shared_ptr<TLuaResult> Pending;
+    bool Done = false;
+    auto Worker = std::thread([&] {
+        std::unique_lock Lock(Mutex);
+        while (true) {
+            Cond.wait(Lock, [&] { return Pending || Done; });
+            if (Done) {
+                return;
+            }
+            auto Result = std::move(Pending);
+            Lock.unlock();
+            Result->MarkAsReady();
+            Lock.lock();
+        }
+    });
+    State.Run([&] {
+        std::vector<std::shared_ptr<TLuaResult>> Results { std::make_shared<TLuaResult>() };
+        {
+            std::unique_lock Lock(Mutex);
+            Pending = Results.front();
+        }
+        Cond.notify_one();
+        TLuaEngine::WaitForAll(Results);
+    });
+    {
+        std::unique_lock Lock(Mutex);
+        Done = true;
+    }
+    Cond.notify_one();
+    Worker.join();
 }
 
 TLuaChunk::TLuaChunk(std::shared_ptr<std::string> Content, std::string FileName, std::string PluginPath)
@@ -1111,11 +1745,3 @@ TLuaChunk::TLuaChunk(std::shared_ptr<std::string> Content, std::string FileName,
     , PluginPath(PluginPath) {
 }
 
-bool TLuaEngine::TimedEvent::Expired() {
-    auto Waited = (std::chrono::high_resolution_clock::now() - LastCompletion);
-    return Waited >= Duration;
-}
-
-void TLuaEngine::TimedEvent::Reset() {
-    LastCompletion = std::chrono::high_resolution_clock::now();
-}
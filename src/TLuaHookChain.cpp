@@ -0,0 +1,205 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "TLuaHookChain.h"
+
+#include "Common.h"
+#include "LuaAPI.h"
+#include "TLuaEngine.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+struct TLuaHookChain::TEntry {
+    std::string Hook;
+    TResults Results;
+    TApply Apply;
+    std::atomic_size_t Waiting { 0 };
+    bool Done { false }; // guarded by TState::Mutex
+};
+
+// shared with the continuations and the timeout, which may outlive the chain
+struct TLuaHookChain::TState {
+    mutable std::mutex Mutex;
+    std::deque<std::shared_ptr<TEntry>> Entries;
+    TExecutor Executor;
+    // queued and not yet applied, including those handed to Executor
+    std::atomic_size_t Outstanding { 0 };
+};
+
+TLuaHookChain::TLuaHookChain()
+    : mState(std::make_shared<TState>()) {
+}
+
+TLuaHookChain::~TLuaHookChain() {
+    // whatever is still pending is dropped
+    std::unique_lock Lock(mState->Mutex);
+    mState->Entries.clear();
+}
+
+void TLuaHookChain::SetExecutor(TExecutor Executor) {
+    std::unique_lock Lock(mState->Mutex);
+    mState->Executor = std::move(Executor);
+}
+
+void TLuaHookChain::Queue(const std::string& Hook, TResults Results, std::chrono::milliseconds Timeout, TApply Apply) {
+    auto Entry = std::make_shared<TEntry>();
+    Entry->Hook = Hook;
+    Entry->Results = std::move(Results);
+    Entry->Apply = std::move(Apply);
+    Entry->Waiting = Entry->Results.size();
+    {
+        std::unique_lock Lock(mState->Mutex);
+        mState->Entries.push_back(Entry);
+        ++mState->Outstanding;
+    }
+    if (Entry->Results.empty()) {
+        Complete(mState, Entry);
+        return;
+    }
+    std::weak_ptr<TState> WeakState = mState;
+    std::weak_ptr<TEntry> WeakEntry = Entry;
+    if (Timeout.count() > 0) {
+        Application::Scheduler().After("Lua hook timeout", Timeout, [WeakState, WeakEntry] {
+            auto State = WeakState.lock();
+            auto TimedOut = WeakEntry.lock();
+            if (State && TimedOut) {
+                Complete(State, TimedOut);
+            }
+        });
+    }
+    for (const auto& Result : Entry->Results) {
+        Result->OnReady([WeakState, WeakEntry](const TLuaResult&) {
+            auto Ready = WeakEntry.lock();
+            if (Ready && --Ready->Waiting == 0) {
+                if (auto State = WeakState.lock()) {
+                    Complete(State, Ready);
+                }
+            }
+        });
+    }
+}
+
+void TLuaHookChain::Then(TApply Apply) {
+    Queue("", {}, std::chrono::milliseconds(0), std::move(Apply));
+}
+
+size_t TLuaHookChain::Pending() const {
+    return mState->Outstanding;
+}
+
+std::chrono::milliseconds TLuaHookChain::ConfiguredTimeout() {
+    return std::chrono::milliseconds(std::max(Application::Settings.LuaHookTimeout, 0));
+}
+
+void TLuaHookChain::Complete(const std::shared_ptr<TState>& State, const std::shared_ptr<TEntry>& Entry) {
+    std::unique_lock Lock(State->Mutex);
+    if (Entry->Done) {
+        // both the timeout and the last result got here
+        return;
+    }
+    Entry->Done = true;
+    while (!State->Entries.empty() && State->Entries.front()->Done) {
+        auto Front = std::move(State->Entries.front());
+        State->Entries.pop_front();
+        auto Apply = [State, Front] {
+            TResults Ready;
+            bool TimedOut = false;
+            for (const auto& Result : Front->Results) {
+                if (!Result->IsReady()) {
+                    TimedOut = true;
+                    beammp_lua_warn("'" + Result->Function + "' in '" + Result->StateId + "' did not finish handling " + Front->Hook + " in time, so it is treated as cancelled. It may still finish executing at a later time.");
+                    if (LuaAPI::MP::Engine) {
+                        LuaAPI::MP::Engine->ReportErrors({ Result });
+                    }
+                } else {
+                    if (Result->Error && Result->ErrorMessage != TLuaEngine::BeamMPFnNotFoundError) {
+                        beammp_lua_error(Result->Function + ": " + Result->ErrorMessage);
+                    }
+                    Ready.push_back(Result);
+                }
+            }
+            Front->Apply(Ready, TimedOut);
+            --State->Outstanding;
+        };
+        if (State->Executor) {
+            State->Executor(std::move(Apply));
+        } else {
+            Apply();
+        }
+    }
+}
+
+TEST_CASE("TLuaHookChain") {
+    TLuaHookChain Chain;
+    std::vector<std::string> Applied;
+    const auto Record = [&Applied](const std::string& Name) {
+        return [&Applied, Name](const TLuaHookChain::TResults& Results, bool TimedOut) {
+            Applied.push_back(Name + ":" + std::to_string(Results.size()) + (TimedOut ? ":late" : ""));
+        };
+    };
+
+    SUBCASE("applies in queue order") {
+        auto First = std::make_shared<TLuaResult>();
+        auto Second = std::make_shared<TLuaResult>();
+        Chain.Queue("first", { First }, std::chrono::milliseconds(0), Record("first"));
+        Chain.Queue("second", { Second }, std::chrono::milliseconds(0), Record("second"));
+        Chain.Then(Record("then"));
+        CHECK_EQ(Chain.Pending(), 3);
+        // the second finishing first doesn't get it applied before the first
+        Second->MarkAsReady();
+        CHECK(Applied.empty());
+        First->MarkAsReady();
+        const std::vector<std::string> Expected { "first:1", "second:1", "then:0" };
+        CHECK_EQ(Applied, Expected);
+        CHECK_EQ(Chain.Pending(), 0);
+        Chain.Then(Record("idle"));
+        CHECK_EQ(Applied.back(), "idle:0");
+    }
+    SUBCASE("pending until the executor applied it") {
+        std::vector<std::function<void()>> Deferred;
+        Chain.SetExecutor([&Deferred](std::function<void()> Apply) { Deferred.push_back(std::move(Apply)); });
+        Chain.Then(Record("then"));
+        REQUIRE_EQ(Deferred.size(), 1);
+        CHECK_EQ(Chain.Pending(), 1);
+        Deferred.front()();
+        CHECK_EQ(Chain.Pending(), 0);
+        const std::vector<std::string> Expected { "then:0" };
+        CHECK_EQ(Applied, Expected);
+    }
+    SUBCASE("times out without the late result") {
+        auto Late = std::make_shared<TLuaResult>();
+        auto Ready = std::make_shared<TLuaResult>();
+        Ready->MarkAsReady();
+        Chain.Queue("late", { Late, Ready }, std::chrono::milliseconds(20), Record("late"));
+        const auto Start = std::chrono::steady_clock::now();
+        while (Chain.Pending() != 0 && std::chrono::steady_clock::now() - Start < std::chrono::seconds(5)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        REQUIRE_EQ(Chain.Pending(), 0);
+        const std::vector<std::string> Expected { "late:1:late" };
+        CHECK_EQ(Applied, Expected);
+        // finishing afterwards doesn't apply it again
+        Late->MarkAsReady();
+        CHECK_EQ(Applied.size(), 1);
+    }
+}
@@ -54,9 +54,11 @@ TLuaPlugin::TLuaPlugin(TLuaEngine& Engine, const TLuaPluginConfig& Config, const
             Contents->resize(Size);
             FileStream.read(Contents->data(), Contents->size());
             mFileContents[fs::relative(Entry).string()] = Contents;
-            // Execute first time
-            auto Result = mEngine.EnqueueScript(mConfig.StateId, TLuaChunk(Contents, Entry.string(), MainFolder.string()));
-            ResultsToCheck.emplace_back(Entry.string(), std::move(Result));
+            // Execute first time, in every shard
+            for (size_t Shard = 0; Shard < mConfig.Shards; ++Shard) {
+                auto Result = mEngine.EnqueueScript(mConfig.ShardStateId(Shard), TLuaChunk(Contents, Entry.string(), MainFolder.string()));
+                ResultsToCheck.emplace_back(Entry.string(), std::move(Result));
+            }
         } catch (const std::exception& e) {
             beammp_error("Error loading file \"" + Entry.string() + "\": " + e.what());
         }
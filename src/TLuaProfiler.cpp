@@ -0,0 +1,139 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "TLuaProfiler.h"
+
+#include "Common.h"
+
+#include <algorithm>
+#include <iterator>
+#include <sstream>
+
+TLuaProfiler::TLuaProfiler(TClock::duration Interval)
+    : mInterval(Interval) {
+}
+
+bool TLuaProfiler::Due(TClock::time_point Now) {
+    if (Now < mNextSample) {
+        return false;
+    }
+    mNextSample = Now + mInterval;
+    return true;
+}
+
+void TLuaProfiler::AddSample(const std::vector<std::string>& Stack) {
+    if (Stack.empty()) {
+        return;
+    }
+    ++mSamples;
+    std::string Collapsed;
+    for (size_t i = 0; i < Stack.size(); ++i) {
+        const auto& Frame = Stack[i];
+        if (i > 0) {
+            Collapsed += ';';
+        }
+        // ';' separates frames in the collapsed format
+        std::replace_copy(Frame.begin(), Frame.end(), std::back_inserter(Collapsed), ';', ':');
+        // recursive functions only count once per sample towards their total
+        if (std::find(Stack.begin(), Stack.begin() + std::ptrdiff_t(i), Frame) == Stack.begin() + std::ptrdiff_t(i)) {
+            auto& Function = mFunctions[Frame];
+            if (Function.Name.empty()) {
+                Function.Name = Frame;
+            }
+            ++Function.Total;
+        }
+    }
+    ++mFunctions[Stack.back()].Self;
+    ++mStacks[Collapsed];
+}
+
+void TLuaProfiler::WriteCollapsed(std::ostream& Out) const {
+    for (const auto& [Stack, Samples] : mStacks) {
+        Out << Stack << ' ' << Samples << '\n';
+    }
+}
+
+std::vector<TLuaProfiler::TFunction> TLuaProfiler::Top(size_t Count) const {
+    std::vector<TFunction> Functions;
+    Functions.reserve(mFunctions.size());
+    for (const auto& [Name, Function] : mFunctions) {
+        Functions.push_back(Function);
+    }
+    std::sort(Functions.begin(), Functions.end(), [](const TFunction& a, const TFunction& b) {
+        if (a.Self != b.Self) {
+            return a.Self > b.Self;
+        }
+        if (a.Total != b.Total) {
+            return a.Total > b.Total;
+        }
+        return a.Name < b.Name;
+    });
+    if (Functions.size() > Count) {
+        Functions.resize(Count);
+    }
+    return Functions;
+}
+
+TEST_CASE("TLuaProfiler") {
+    TLuaProfiler Profiler(std::chrono::milliseconds(10));
+
+    SUBCASE("Due") {
+        const auto Start = TLuaProfiler::TClock::now();
+        CHECK(Profiler.Due(Start));
+        CHECK(!Profiler.Due(Start + std::chrono::milliseconds(9)));
+        CHECK(Profiler.Due(Start + std::chrono::milliseconds(10)));
+        CHECK(!Profiler.Due(Start + std::chrono::milliseconds(11)));
+    }
+    SUBCASE("Self and total") {
+        Profiler.AddSample({ "main", "onTick", "update" });
+        Profiler.AddSample({ "main", "onTick", "update" });
+        Profiler.AddSample({ "main", "onTick" });
+        Profiler.AddSample({ "main", "onChat" });
+        Profiler.AddSample({});
+        CHECK_EQ(Profiler.SampleCount(), 4);
+
+        auto Top = Profiler.Top(10);
+        REQUIRE_EQ(Top.size(), 4);
+        CHECK_EQ(Top[0].Name, "update");
+        CHECK_EQ(Top[0].Self, 2);
+        CHECK_EQ(Top[0].Total, 2);
+        CHECK_EQ(Top[1].Name, "onTick");
+        CHECK_EQ(Top[1].Self, 1);
+        CHECK_EQ(Top[1].Total, 3);
+        CHECK_EQ(Top[2].Name, "onChat");
+        CHECK_EQ(Top[3].Name, "main");
+        CHECK_EQ(Top[3].Self, 0);
+        CHECK_EQ(Top[3].Total, 4);
+        CHECK_EQ(Profiler.Top(1).size(), 1);
+    }
+    SUBCASE("Recursion counts once") {
+        Profiler.AddSample({ "walk", "walk", "walk" });
+        auto Top = Profiler.Top(10);
+        REQUIRE_EQ(Top.size(), 1);
+        CHECK_EQ(Top[0].Self, 1);
+        CHECK_EQ(Top[0].Total, 1);
+    }
+    SUBCASE("Collapsed") {
+        Profiler.AddSample({ "main", "onTick", "update" });
+        Profiler.AddSample({ "main", "onTick", "update" });
+        Profiler.AddSample({ "main", "a;b" });
+        std::stringstream Out;
+        Profiler.WriteCollapsed(Out);
+        CHECK_EQ(Out.str(), "main;a:b 1\nmain;onTick;update 2\n");
+    }
+}
@@ -0,0 +1,147 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "TLuaSharedStore.h"
+
+#include "Common.h"
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+TLuaSharedStore::TBucket& TLuaSharedStore::BucketFor(const std::string& Key) {
+    return mBuckets[std::hash<std::string> {}(Key) % BucketCount];
+}
+
+const TLuaSharedStore::TBucket& TLuaSharedStore::BucketFor(const std::string& Key) const {
+    return mBuckets[std::hash<std::string> {}(Key) % BucketCount];
+}
+
+TLuaSharedStore::TValue TLuaSharedStore::Get(const std::string& Key) const {
+    const auto& Bucket = BucketFor(Key);
+    std::shared_lock Lock(Bucket.Mutex);
+    auto Iter = Bucket.Values.find(Key);
+    if (Iter == Bucket.Values.end()) {
+        return {};
+    }
+    return Iter->second;
+}
+
+void TLuaSharedStore::Set(const std::string& Key, TValue Value) {
+    auto& Bucket = BucketFor(Key);
+    std::unique_lock Lock(Bucket.Mutex);
+    if (std::holds_alternative<std::monostate>(Value)) {
+        Bucket.Values.erase(Key);
+    } else {
+        Bucket.Values[Key] = std::move(Value);
+    }
+}
+
+std::optional<int64_t> TLuaSharedStore::Increment(const std::string& Key, int64_t By) {
+    auto& Bucket = BucketFor(Key);
+    std::unique_lock Lock(Bucket.Mutex);
+    auto [Iter, Inserted] = Bucket.Values.try_emplace(Key, int64_t(0));
+    auto* Integer = std::get_if<int64_t>(&Iter->second);
+    if (!Integer) {
+        return std::nullopt;
+    }
+    *Integer += By;
+    return *Integer;
+}
+
+bool TLuaSharedStore::CompareAndSet(const std::string& Key, const TValue& Expected, TValue Desired) {
+    auto& Bucket = BucketFor(Key);
+    std::unique_lock Lock(Bucket.Mutex);
+    auto Iter = Bucket.Values.find(Key);
+    const bool Matches = Iter == Bucket.Values.end()
+        ? std::holds_alternative<std::monostate>(Expected)
+        : Iter->second == Expected;
+    if (!Matches) {
+        return false;
+    }
+    if (std::holds_alternative<std::monostate>(Desired)) {
+        if (Iter != Bucket.Values.end()) {
+            Bucket.Values.erase(Iter);
+        }
+    } else if (Iter == Bucket.Values.end()) {
+        Bucket.Values.emplace(Key, std::move(Desired));
+    } else {
+        Iter->second = std::move(Desired);
+    }
+    return true;
+}
+
+size_t TLuaSharedStore::Size() const {
+    size_t Total = 0;
+    for (const auto& Bucket : mBuckets) {
+        std::shared_lock Lock(Bucket.Mutex);
+        Total += Bucket.Values.size();
+    }
+    return Total;
+}
+
+TEST_CASE("TLuaSharedStore") {
+    TLuaSharedStore Store;
+    CHECK(std::holds_alternative<std::monostate>(Store.Get("missing")));
+
+    Store.Set("name", std::string("lap"));
+    Store.Set("best", 61.25);
+    Store.Set("open", true);
+    CHECK_EQ(std::get<std::string>(Store.Get("name")), "lap");
+    CHECK_EQ(std::get<double>(Store.Get("best")), 61.25);
+    CHECK(std::get<bool>(Store.Get("open")));
+    CHECK_EQ(Store.Size(), 3);
+    Store.Set("open", {});
+    CHECK(std::holds_alternative<std::monostate>(Store.Get("open")));
+    CHECK_EQ(Store.Size(), 2);
+
+    SUBCASE("Increment") {
+        CHECK_EQ(Store.Increment("laps", 1), 1);
+        CHECK_EQ(Store.Increment("laps", 4), 5);
+        CHECK_EQ(Store.Increment("laps", -2), 3);
+        // not an integer, left alone
+        CHECK(!Store.Increment("name", 1));
+        CHECK_EQ(std::get<std::string>(Store.Get("name")), "lap");
+    }
+    SUBCASE("CompareAndSet") {
+        CHECK(!Store.CompareAndSet("name", std::string("other"), std::string("new")));
+        CHECK_EQ(std::get<std::string>(Store.Get("name")), "lap");
+        CHECK(Store.CompareAndSet("name", std::string("lap"), std::string("new")));
+        CHECK_EQ(std::get<std::string>(Store.Get("name")), "new");
+        // nil expects the key to be missing
+        CHECK(Store.CompareAndSet("leader", {}, int64_t(7)));
+        CHECK(!Store.CompareAndSet("leader", {}, int64_t(8)));
+        CHECK_EQ(std::get<int64_t>(Store.Get("leader")), 7);
+        CHECK(Store.CompareAndSet("leader", int64_t(7), {}));
+        CHECK(std::holds_alternative<std::monostate>(Store.Get("leader")));
+    }
+    SUBCASE("concurrent increments aren't lost") {
+        std::vector<std::thread> Threads;
+        for (int i = 0; i < 4; ++i) {
+            Threads.emplace_back([&Store] {
+                for (int j = 0; j < 10000; ++j) {
+                    (void)Store.Increment("counter", 1);
+                }
+            });
+        }
+        for (auto& Thread : Threads) {
+            Thread.join();
+        }
+        CHECK_EQ(std::get<int64_t>(Store.Get("counter")), 40000);
+    }
+}
@@ -17,20 +17,78 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "TNetwork.h"
+#include "Benchmark.h"
 #include "Client.h"
 #include "Common.h"
 #include "LuaAPI.h"
 #include "TLuaEngine.h"
+#include "Tracing.h"
 #include "nlohmann/json.hpp"
 #include <CustomAssert.h>
 #include <Http.h>
+#include <algorithm>
 #include <array>
 #include <boost/asio/ip/address.hpp>
 #include <boost/asio/ip/address_v4.hpp>
 #include <cstring>
 
+#if !defined(BEAMMP_WINDOWS)
+#include <poll.h>
+#endif
+
 typedef boost::asio::detail::socket_option::integer<SOL_SOCKET, SO_RCVTIMEO> rcv_timeout_option;
 
+// waits until Socket is readable (or closed), returns false if Timeout passed first
+static bool WaitForReadable(ip::tcp::socket& Socket, std::chrono::milliseconds Timeout) {
+#if defined(BEAMMP_WINDOWS)
+    WSAPOLLFD Fd { Socket.native_handle(), POLLRDNORM, 0 };
+    return WSAPoll(&Fd, 1, int(Timeout.count())) > 0;
+#else
+    pollfd Fd { Socket.native_handle(), POLLIN, 0 };
+    return ::poll(&Fd, 1, int(Timeout.count())) > 0;
+#endif
+}
+
+// like read(), but fails with error::timed_out if the buffer wasn't filled by the deadline.
+// SO_RCVTIMEO can't be used for this, as asio's blocking read retries on EAGAIN.
+static size_t ReadWithDeadline(ip::tcp::socket& Socket, mutable_buffer Buffer, std::optional<std::chrono::steady_clock::time_point> Deadline, boost::system::error_code& ec) {
+    if (!Deadline) {
+        return read(Socket, Buffer, ec);
+    }
+    size_t Total = 0;
+    while (Total < Buffer.size()) {
+        auto Remaining = std::chrono::duration_cast<std::chrono::milliseconds>(*Deadline - std::chrono::steady_clock::now());
+        if (Remaining.count() <= 0 || !WaitForReadable(Socket, Remaining)) {
+            ec = boost::asio::error::timed_out;
+            return Total;
+        }
+        Total += Socket.read_some(Buffer + Total, ec);
+        if (ec) {
+            return Total;
+        }
+    }
+    return Total;
+}
+
+// one of the TNetwork::MaxConcurrentHandshakes slots, taken in AdmitConnection
+class THandshakeSlot final {
+public:
+    explicit THandshakeSlot(std::atomic_size_t& InProgress)
+        : mInProgress(&InProgress) { }
+    THandshakeSlot(const THandshakeSlot&) = delete;
+    THandshakeSlot& operator=(const THandshakeSlot&) = delete;
+    ~THandshakeSlot() { Release(); }
+    void Release() {
+        if (mInProgress) {
+            --*mInProgress;
+            mInProgress = nullptr;
+        }
+    }
+
+private:
+    std::atomic_size_t* mInProgress;
+};
+
 std::vector<uint8_t> StringToVector(const std::string& Str) {
     return std::vector<uint8_t>(Str.data(), Str.data() + Str.size());
 }
@@ -44,6 +102,50 @@ static void CompressProperly(std::vector<uint8_t>& Data) {
     Data = CombinedData;
 }
 
+/*
+ * our TCP protocol sends a header of 4 bytes, followed by the data.
+ *
+ *  [][][][][][]...[]
+ *  ^------^^---...-^
+ *    size    data
+ */
+static void AppendFrame(std::vector<uint8_t>& Out, const std::vector<uint8_t>& Data) {
+    const auto Size = int32_t(Data.size());
+    const auto Offset = Out.size();
+    Out.resize(Offset + sizeof(Size) + Data.size());
+    std::memcpy(Out.data() + Offset, &Size, sizeof(Size));
+    std::memcpy(Out.data() + Offset + sizeof(Size), Data.data(), Data.size());
+}
+
+// frames every vehicle's 'Os' packet the way Respond(..., true, true) would send it
+static std::vector<uint8_t> BuildWorldSnapshot(TServer& Server) {
+    std::vector<uint8_t> Frames;
+    Server.ForEachClient([&](const std::weak_ptr<TClient>& ClientPtr) -> bool {
+        std::shared_ptr<TClient> Client;
+        {
+            ReadLock Lock(Server.GetClientMutex());
+            if (!ClientPtr.expired()) {
+                Client = ClientPtr.lock();
+            } else
+                return true;
+        }
+        TClient::TSetOfVehicleData VehicleData;
+        { // Vehicle Data Lock Scope
+            auto LockedData = Client->GetAllCars();
+            VehicleData = *LockedData.VehicleData;
+        } // End Vehicle Data Lock Scope
+        for (auto& v : VehicleData) {
+            auto Data = StringToVector(v.Data());
+            if (Data.size() > 400) {
+                CompressProperly(Data);
+            }
+            AppendFrame(Frames, Data);
+        }
+        return true;
+    });
+    return Frames;
+}
+
 TNetwork::TNetwork(TServer& Server, TPPSMonitor& PPSMonitor, TResourceManager& ResourceManager)
     : mServer(Server)
     , mPPSMonitor(PPSMonitor)
@@ -60,6 +162,9 @@ TNetwork::TNetwork(TServer& Server, TPPSMonitor& PPSMonitor, TResourceManager& R
             return true;
         });
     });
+    Application::RegisterShutdownHandler([&] {
+        mDispatcher.Shutdown();
+    });
     Application::RegisterShutdownHandler([&] {
         Application::SetSubsystemStatus("UDPNetwork", Application::Status::ShuttingDown);
         if (mUDPThread.joinable()) {
@@ -74,10 +179,61 @@ TNetwork::TNetwork(TServer& Server, TPPSMonitor& PPSMonitor, TResourceManager& R
         }
         Application::SetSubsystemStatus("TCPNetwork", Application::Status::Shutdown);
     });
+    mMetricsGauges.push_back(Metrics::RegisterGauge("beammp_players", "Connected players.", [this] {
+        return std::vector<Metrics::TGaugeSample> { { "", double(mServer.ClientCount()) } };
+    }));
+    mMetricsGauges.push_back(Metrics::RegisterGauge("beammp_client_send_queue_packets", "Packets queued for sending to clients, summed over and max of all clients.", [this] {
+        size_t Sum = 0;
+        size_t Max = 0;
+        mServer.ForEachClient([&](const std::weak_ptr<TClient>& ClientPtr) -> bool {
+            if (auto Client = ClientPtr.lock()) {
+                const auto Size = Client->MissedPacketQueueSize();
+                Sum += Size;
+                Max = std::max(Max, Size);
+            }
+            return true;
+        });
+        return std::vector<Metrics::TGaugeSample> { { "stat=\"sum\"", double(Sum) }, { "stat=\"max\"", double(Max) } };
+    }));
+    mMetricsGauges.push_back(Metrics::RegisterGauge("beammp_dispatch_queue_length", "Received packets waiting to be handled.", [this] {
+        return std::vector<Metrics::TGaugeSample> { { "", double(mDispatcher.GetStats().Queued) } };
+    }));
+    mMetricsGauges.push_back(Metrics::RegisterCounter("beammp_dispatch_dropped_total", "UDP packets dropped because the packet handlers fell behind.", [this] {
+        return std::vector<Metrics::TGaugeSample> { { "", double(mDispatcher.GetStats().Dropped) } };
+    }));
+    mMetricsGauges.push_back(Metrics::RegisterGauge("beammp_handshakes_in_progress", "Clients currently going through the handshake.", [this] {
+        return std::vector<Metrics::TGaugeSample> { { "", double(mHandshakesInProgress.load()) } };
+    }));
+    mMetricsGauges.push_back(Metrics::RegisterCounter("beammp_connections_rejected_total", "Connections turned away before their handshake, by reason.", [this] {
+        return std::vector<Metrics::TGaugeSample> {
+            { "reason=\"rate_limited\"", double(mRejectedRateLimited.load()) },
+            { "reason=\"too_many_handshakes\"", double(mRejectedTooManyHandshakes.load()) },
+        };
+    }));
+    mMetricsGauges.push_back(Metrics::RegisterCounter("beammp_handshake_timeouts_total", "Handshakes given up on because the client took too long.", [this] {
+        return std::vector<Metrics::TGaugeSample> { { "", double(mHandshakeTimeouts.load()) } };
+    }));
+    mMetricsGauges.push_back(Metrics::RegisterGauge("beammp_auth_pending", "Auth requests waiting for the backend.", [this] {
+        return std::vector<Metrics::TGaugeSample> { { "", double(mAuthService.GetStats().Pending) } };
+    }));
     mTCPThread = std::thread(&TNetwork::TCPServerMain, this);
     mUDPThread = std::thread(&TNetwork::UDPServerMain, this);
 }
 
+bool TNetwork::StartCapture(const std::string& Path) {
+    if (!mCapture.Start(Path)) {
+        return false;
+    }
+    // so that the replay knows about everyone who joined before the capture
+    mServer.ForEachClient([&](const std::weak_ptr<TClient>& ClientPtr) -> bool {
+        if (auto Client = ClientPtr.lock(); Client && Client->GetID() >= 0) {
+            mCapture.RecordJoin(*Client);
+        }
+        return true;
+    });
+    return true;
+}
+
 void TNetwork::UDPServerMain() {
     RegisterThread("UDPServer");
     ip::udp::endpoint UdpListenEndpoint(ip::address::from_string("0.0.0.0"), Application::Settings.Port);
@@ -101,10 +257,10 @@ void TNetwork::UDPServerMain() {
         try {
             ip::udp::endpoint client {};
             std::vector<uint8_t> Data = UDPRcvFromClient(client); // Receives any data from Socket
-            auto Pos = std::find(Data.begin(), Data.end(), ':');
-            if (Data.empty() || Pos > Data.begin() + 2)
+            auto Header = ParseUDPHeader(Data);
+            if (!Header)
                 continue;
-            uint8_t ID = uint8_t(Data.at(0)) - 1;
+            const int ID = Header->ID;
             mServer.ForEachClient([&](std::weak_ptr<TClient> ClientPtr) -> bool {
                 std::shared_ptr<TClient> Client;
                 {
@@ -118,8 +274,17 @@ void TNetwork::UDPServerMain() {
                 if (Client->GetID() == ID) {
                     Client->SetUDPAddr(client);
                     Client->SetIsConnected(true);
-                    Data.erase(Data.begin(), Data.begin() + 2);
-                    mServer.GlobalParser(ClientPtr, std::move(Data), mPPSMonitor, *this);
+                    Client->Traffic().AddTransport(TTrafficStats::Direction::In, TTrafficStats::Transport::UDP, Data.size());
+                    Data.erase(Data.begin(), Data.begin() + Header->Size);
+                    mCapture.Record(TTrafficCapture::Kind::UDP, ID, Data);
+                    Tracing::TFlowScope ReceiveFlow(Tracing::NewFlowID());
+                    Tracing::TSpan Span("UDPRcv", Tracing::FlowPhase::Begin);
+                    // UDP is unreliable anyway, so these may be dropped if the worker falls behind
+                    mDispatcher.Dispatch(ID, [this, ClientPtr, Data = std::move(Data), FlowID = Tracing::CurrentFlowID()]() mutable {
+                        Tracing::TFlowScope Flow(FlowID);
+                        mServer.GlobalParser(ClientPtr, std::move(Data), mPPSMonitor, *this);
+                    }, true);
+                    return false;
                 }
 
                 return true;
@@ -170,6 +335,11 @@ void TNetwork::TCPServerMain() {
             ip::tcp::socket ClientSocket = Acceptor.accept(ClientEp, ec);
             if (ec) {
                 beammp_errorf("failed to accept: {}", ec.message());
+                continue;
+            }
+            if (!AdmitConnection(ClientEp.address())) {
+                ClientSocket.close(ec);
+                continue;
             }
             TConnection Conn { std::move(ClientSocket), ClientEp };
             std::thread ID(&TNetwork::Identify, this, std::move(Conn));
@@ -187,11 +357,15 @@ namespace json = rapidjson;
 
 void TNetwork::Identify(TConnection&& RawConnection) {
     RegisterThreadAuto();
+    THandshakeSlot Slot(mHandshakesInProgress);
     char Code;
 
     boost::system::error_code ec;
-    read(RawConnection.Socket, buffer(&Code, 1), ec);
+    ReadWithDeadline(RawConnection.Socket, buffer(&Code, 1), std::chrono::steady_clock::now() + CodeTimeout, ec);
     if (ec) {
+        if (ec == boost::asio::error::timed_out) {
+            ++mHandshakeTimeouts;
+        }
         // TODO: is this right?!
         RawConnection.Socket.shutdown(socket_base::shutdown_both, ec);
         return;
@@ -199,9 +373,11 @@ void TNetwork::Identify(TConnection&& RawConnection) {
     std::shared_ptr<TClient> Client { nullptr };
     try {
         if (Code == 'C') {
-            Client = Authentication(std::move(RawConnection));
+            Client = Authentication(std::move(RawConnection), [&Slot] { Slot.Release(); });
         } else if (Code == 'D') {
-            HandleDownload(std::move(RawConnection));
+            HandleDownload(std::move(RawConnection), false);
+        } else if (Code == 'W') {
+            HandleDownload(std::move(RawConnection), true);
         } else if (Code == 'P') {
             boost::system::error_code ec;
             write(RawConnection.Socket, buffer("P"), ec);
@@ -223,16 +399,21 @@ void TNetwork::Identify(TConnection&& RawConnection) {
     }
 }
 
-void TNetwork::HandleDownload(TConnection&& Conn) {
-    char D;
+void TNetwork::HandleDownload(TConnection&& Conn, bool IsWideID) {
+    // legacy clients send their ID as one byte, wide clients as 16-bit big-endian
+    std::array<uint8_t, 2> D {};
+    const size_t IDSize = IsWideID ? 2 : 1;
     boost::system::error_code ec;
-    read(Conn.Socket, buffer(&D, 1), ec);
+    ReadWithDeadline(Conn.Socket, buffer(D.data(), IDSize), std::chrono::steady_clock::now() + CodeTimeout, ec);
     if (ec) {
+        if (ec == boost::asio::error::timed_out) {
+            ++mHandshakeTimeouts;
+        }
         Conn.Socket.shutdown(socket_base::shutdown_both, ec);
         // ignore ec
         return;
     }
-    auto ID = uint8_t(D);
+    const int ID = IsWideID ? (int(D[0]) << 8) | int(D[1]) : int(D[0]);
     mServer.ForEachClient([&](const std::weak_ptr<TClient>& ClientPtr) -> bool {
         ReadLock Lock(mServer.GetClientMutex());
         if (!ClientPtr.expired()) {
@@ -254,18 +435,25 @@ std::string HashPassword(const std::string& str) {
     return ret.str();
 }
 
-std::shared_ptr<TClient> TNetwork::Authentication(TConnection&& RawConnection) {
+std::shared_ptr<TClient> TNetwork::Authentication(TConnection&& RawConnection, const std::function<void()>& OnHandshakeDone) {
     auto Client = CreateClient(std::move(RawConnection.Socket));
     Client->SetIdentifier("ip", RawConnection.SockAddr.address().to_string());
     beammp_tracef("This thread is ip {}", RawConnection.SockAddr.address().to_string());
 
     beammp_info("Identifying new ClientConnection...");
 
-    auto Data = TCPRcv(*Client);
+    auto Data = TCPRcv(*Client, VersionTimeout);
 
     constexpr std::string_view VC = "VC";
     if (Data.size() > 3 && std::equal(Data.begin(), Data.begin() + VC.size(), VC.begin(), VC.end())) {
         std::string ClientVersionStr(reinterpret_cast<const char*>(Data.data() + 2), Data.size() - 2);
+        // newer clients append their capabilities, e.g. "VC2.0:W"
+        auto CapsSep = ClientVersionStr.find(':');
+        if (CapsSep != std::string::npos) {
+            auto Caps = ClientVersionStr.substr(CapsSep + 1);
+            Client->SetIsWideID(Caps.find('W') != std::string::npos);
+            ClientVersionStr = ClientVersionStr.substr(0, CapsSep);
+        }
         Version ClientVersion = Application::VersionStrToInts(ClientVersionStr + ".0");
         if (ClientVersion.major != Application::ClientMajorVersion()) {
             beammp_errorf("Client tried to connect with version '{}', but only versions '{}.x.x' is allowed",
@@ -278,12 +466,17 @@ std::shared_ptr<TClient> TNetwork::Authentication(TConnection&& RawConnection) {
         return nullptr;
     }
 
-    if (!TCPSend(*Client, StringToVector("A"))) { //changed to A for Accepted version
+    // "AW" tells the client that the server accepted its version and will use wide IDs
+    if (!TCPSend(*Client, StringToVector(Client->IsWideID() ? "AW" : "A"))) { //changed to A for Accepted version
         // TODO: handle
     }
 
-    Data = TCPRcv(*Client);
+    Data = TCPRcv(*Client, KeyTimeout);
 
+    if (Data.empty()) {
+        Client->Disconnect("No key received");
+        return nullptr;
+    }
     if (Data.size() > 50) {
         ClientKick(*Client, "Invalid Key (too long)!");
         return nullptr;
@@ -291,23 +484,32 @@ std::shared_ptr<TClient> TNetwork::Authentication(TConnection&& RawConnection) {
 
     std::string key(reinterpret_cast<const char*>(Data.data()), Data.size());
 
-    nlohmann::json AuthReq{};
-    std::string AuthResStr{};
+    std::string AuthReqStr {};
+    std::string AuthResStr {};
     try {
-        AuthReq = nlohmann::json {
+        AuthReqStr = nlohmann::json {
             { "key", key }
-        };
-
-        auto Target = "/pkToUser";
-        unsigned int ResponseCode = 0;
-        AuthResStr = Http::POST(Application::GetBackendUrlForAuth(), 443, Target, AuthReq.dump(), "application/json", &ResponseCode);
-
+        }.dump();
     } catch (const std::exception& e) {
         beammp_debugf("Invalid json sent by client, kicking: {}", e.what());
         ClientKick(*Client, "Invalid Key (invalid UTF8 string)!");
         return nullptr;
     }
 
+    try {
+        auto AuthRes = mAuthService.Authenticate(key, AuthReqStr);
+        if (AuthRes.wait_for(TAuthService::ResponseTimeout) != std::future_status::ready) {
+            beammp_warn("Authentication backend did not respond in time");
+            ClientKick(*Client, "Authentication timed out, please try again.");
+            return nullptr;
+        }
+        AuthResStr = AuthRes.get();
+    } catch (const std::exception& e) {
+        beammp_warnf("Failed to authenticate client: {}", e.what());
+        ClientKick(*Client, "Authentication failed, please try again.");
+        return nullptr;
+    }
+
     try {
         nlohmann::json AuthRes = nlohmann::json::parse(AuthResStr);
 
@@ -339,7 +541,7 @@ std::shared_ptr<TClient> TNetwork::Authentication(TConnection&& RawConnection) {
             // TODO: handle
         }
         beammp_info("Waiting for password");
-        Data = TCPRcv(*Client);
+        Data = TCPRcv(*Client, PasswordTimeout);
         std::string Pass = std::string(reinterpret_cast<const char*>(Data.data()), Data.size());
         if(Pass != HashPassword(Application::Settings.Password)) {
             beammp_debug(Client->GetName() + " attempted to connect with a wrong password");
@@ -369,31 +571,19 @@ std::shared_ptr<TClient> TNetwork::Authentication(TConnection&& RawConnection) {
     });
 
     auto Futures = LuaAPI::MP::Engine->TriggerEvent("onPlayerAuth", "", Client->GetName(), Client->GetRoles(), Client->IsGuest(), Client->GetIdentifiers());
-    TLuaEngine::WaitForAll(Futures);
-    bool NotAllowed = std::any_of(Futures.begin(), Futures.end(),
-        [](const std::shared_ptr<TLuaResult>& Result) {
-            return !Result->Error && Result->Result.is<int>() && bool(Result->Result.as<int>());
-        });
-    std::string Reason;
-    bool NotAllowedWithReason = std::any_of(Futures.begin(), Futures.end(),
-        [&Reason](const std::shared_ptr<TLuaResult>& Result) -> bool {
-            if (!Result->Error && Result->Result.is<std::string>()) {
-                Reason = Result->Result.as<std::string>();
-                return true;
-            }
-            return false;
-        });
-
-    if (NotAllowed) {
-        ClientKick(*Client, "you are not allowed on the server!");
-        return {};
-    } else if (NotAllowedWithReason) {
-        ClientKick(*Client, Reason);
+    // unlike the other hooks this one can wait, this thread only handles this client, which isn't let in until it's done
+    const auto HookTimeout = TLuaHookChain::ConfiguredTimeout();
+    TLuaEngine::WaitForAll(Futures, HookTimeout.count() > 0 ? std::optional<std::chrono::high_resolution_clock::duration>(HookTimeout) : std::nullopt);
+    if (auto Reason = AuthDenial(Futures)) {
+        ClientKick(*Client, *Reason);
         return {};
     }
 
     if (mServer.ClientCount() < size_t(Application::Settings.MaxPlayers)) {
         beammp_info("Identification success");
+        if (OnHandshakeDone) {
+            OnHandshakeDone();
+        }
         mServer.InsertClient(Client);
         TCPClient(Client);
     } else {
@@ -403,12 +593,180 @@ std::shared_ptr<TClient> TNetwork::Authentication(TConnection&& RawConnection) {
     return Client;
 }
 
+// a handler which didn't finish in time keeps the player out, as it may have been about to
+std::optional<std::string> TNetwork::AuthDenial(const std::vector<std::shared_ptr<TLuaResult>>& Results) {
+    for (const auto& Result : Results) {
+        if (!Result->IsReady()) {
+            beammp_lua_warnf("'{}' in '{}' did not finish handling onPlayerAuth in time, so the player is not let in. It may still finish executing at a later time.", Result->Function, Result->StateId);
+            return "the server took too long to let you in, please try again later";
+        }
+    }
+    bool NotAllowed = std::any_of(Results.begin(), Results.end(),
+        [](const std::shared_ptr<TLuaResult>& Result) {
+            return !Result->Error && Result->Result.is<int>() && bool(Result->Result.as<int>());
+        });
+    if (NotAllowed) {
+        return "you are not allowed on the server!";
+    }
+    for (const auto& Result : Results) {
+        if (!Result->Error && Result->Result.is<std::string>()) {
+            return Result->Result.as<std::string>();
+        }
+    }
+    return std::nullopt;
+}
+
+TEST_CASE("TNetwork::AuthDenial") {
+    sol::state State;
+    const auto Make = [](sol::object Value, bool Ready = true) {
+        auto Result = std::make_shared<TLuaResult>();
+        Result->Result = Value;
+        if (Ready) {
+            Result->MarkAsReady();
+        }
+        return Result;
+    };
+    const auto Allowed = Make(sol::make_object(State.lua_state(), sol::lua_nil));
+    const auto Denied = Make(sol::make_object(State.lua_state(), 1));
+    const auto WithReason = Make(sol::make_object(State.lua_state(), "banned"));
+
+    CHECK_FALSE(TNetwork::AuthDenial({}).has_value());
+    CHECK_FALSE(TNetwork::AuthDenial({ Allowed }).has_value());
+    CHECK_EQ(TNetwork::AuthDenial({ Allowed, Denied }), "you are not allowed on the server!");
+    CHECK_EQ(TNetwork::AuthDenial({ WithReason, Allowed }), "banned");
+    // a late handler may have been about to deny, so the player is kept out
+    const auto Late = Make(sol::make_object(State.lua_state(), sol::lua_nil), false);
+    CHECK(TNetwork::AuthDenial({ Allowed, Late }).has_value());
+    // and an error is no denial, as before
+    auto Errored = Make(sol::make_object(State.lua_state(), 1));
+    Errored->Error = true;
+    CHECK_FALSE(TNetwork::AuthDenial({ Errored }).has_value());
+}
+
+bool TNetwork::AdmitConnection(const ip::address& Address) {
+    if (!mAcceptLimiter.TryAdmit(Address)) {
+        ++mRejectedRateLimited;
+        beammp_debugf("Rejecting connection from {}: too many connection attempts", Address.to_string());
+        return false;
+    }
+    if (mHandshakesInProgress.fetch_add(1) >= MaxConcurrentHandshakes) {
+        --mHandshakesInProgress;
+        ++mRejectedTooManyHandshakes;
+        beammp_debugf("Rejecting connection from {}: too many concurrent handshakes", Address.to_string());
+        return false;
+    }
+    return true;
+}
+
+TNetwork::TAdmissionStats TNetwork::GetAdmissionStats() const {
+    return TAdmissionStats {
+        mRejectedRateLimited.load(),
+        mRejectedTooManyHandshakes.load(),
+        mHandshakeTimeouts.load(),
+        mHandshakesInProgress.load(),
+    };
+}
+
+bool TAcceptTokenBucket::TryTake(std::chrono::steady_clock::time_point Now) {
+    auto Elapsed = std::chrono::duration<double>(Now - LastRefill).count();
+    if (Elapsed > 0) {
+        Tokens = std::min(Burst, Tokens + Elapsed * RefillPerSecond);
+        LastRefill = Now;
+    }
+    if (Tokens < 1.0) {
+        return false;
+    }
+    Tokens -= 1.0;
+    return true;
+}
+
+bool TAcceptLimiter::TryAdmit(const ip::address& Address, std::chrono::steady_clock::time_point Now) {
+    if (IsExempt(Address)) {
+        return true;
+    }
+    std::unique_lock Lock(mMutex);
+    // forget addresses which haven't connected in a while, their buckets would be full anyway
+    if (mBuckets.size() > 4096) {
+        std::erase_if(mBuckets, [&Now](const auto& Pair) {
+            return Now - Pair.second.LastRefill > std::chrono::seconds(long(TAcceptTokenBucket::Burst / TAcceptTokenBucket::RefillPerSecond));
+        });
+    }
+    auto [Iter, Inserted] = mBuckets.try_emplace(Address.to_string());
+    if (Inserted) {
+        Iter->second.LastRefill = Now;
+    }
+    return Iter->second.TryTake(Now);
+}
+
+bool TAcceptLimiter::IsExempt(const ip::address& Address) {
+    if (Address.is_v6() && Address.to_v6().is_v4_mapped()) {
+        return Address.to_v6().to_v4().is_loopback();
+    }
+    return Address.is_loopback();
+}
+
+TEST_CASE("TAcceptLimiter") {
+    TAcceptLimiter Limiter;
+    auto Now = std::chrono::steady_clock::now();
+    const size_t Attempts = size_t(TAcceptTokenBucket::Burst) * 5;
+
+    SUBCASE("Remote addresses are limited") {
+        auto Remote = ip::make_address("203.0.113.7");
+        size_t Admitted = 0;
+        for (size_t i = 0; i < Attempts; ++i) {
+            Admitted += Limiter.TryAdmit(Remote, Now) ? 1 : 0;
+        }
+        CHECK_EQ(Admitted, size_t(TAcceptTokenBucket::Burst));
+        // other addresses have their own bucket
+        CHECK(Limiter.TryAdmit(ip::make_address("203.0.113.8"), Now));
+    }
+    SUBCASE("Loopback is never limited") {
+        for (const auto* Loopback : { "127.0.0.1", "127.0.0.2", "::1", "::ffff:127.0.0.1" }) {
+            auto Address = ip::make_address(Loopback);
+            size_t Admitted = 0;
+            for (size_t i = 0; i < Attempts; ++i) {
+                Admitted += Limiter.TryAdmit(Address, Now) ? 1 : 0;
+            }
+            CHECK_EQ(Admitted, Attempts);
+        }
+        CHECK(!TAcceptLimiter::IsExempt(ip::make_address("::ffff:203.0.113.7")));
+    }
+}
+
+TEST_CASE("TAcceptTokenBucket") {
+    TAcceptTokenBucket Bucket;
+    auto Now = Bucket.LastRefill;
+    for (int i = 0; i < int(TAcceptTokenBucket::Burst); ++i) {
+        CHECK(Bucket.TryTake(Now));
+    }
+    // burst used up
+    CHECK(!Bucket.TryTake(Now));
+    // refills over time, but never beyond the burst size
+    CHECK(Bucket.TryTake(Now + std::chrono::milliseconds(long(1000.0 / TAcceptTokenBucket::RefillPerSecond))));
+    Now += std::chrono::hours(1);
+    size_t Taken = 0;
+    while (Bucket.TryTake(Now)) {
+        ++Taken;
+    }
+    CHECK_EQ(Taken, size_t(TAcceptTokenBucket::Burst));
+}
+
 std::shared_ptr<TClient> TNetwork::CreateClient(ip::tcp::socket&& TCPSock) {
     auto c = std::make_shared<TClient>(mServer, std::move(TCPSock));
+    // Lua hooks are applied on the client's packet worker, in order with its packets
+    std::weak_ptr<TClient> Weak = c;
+    c->LuaHooks().SetExecutor([this, Weak](std::function<void()> Apply) {
+        if (auto Client = Weak.lock()) {
+            mDispatcher.Dispatch(Client->GetID(), std::move(Apply));
+        }
+    });
     return c;
 }
 
 bool TNetwork::TCPSend(TClient& c, const std::vector<uint8_t>& Data, bool IsSync) {
+    static auto& sLatency = Metrics::ProbeTime.WithLabel("TCPSend");
+    TScopedProbe Probe(sLatency);
+    Tracing::TSpan Span("TCPSend");
     if (!IsSync) {
         if (c.IsSyncing()) {
             if (!Data.empty()) {
@@ -422,19 +780,8 @@ bool TNetwork::TCPSend(TClient& c, const std::vector<uint8_t>& Data, bool IsSync
 
     auto& Sock = c.GetTCPSock();
 
-    /*
-     * our TCP protocol sends a header of 4 bytes, followed by the data.
-     *
-     *  [][][][][][]...[]
-     *  ^------^^---...-^
-     *    size    data
-     */
-
-    const auto Size = int32_t(Data.size());
     std::vector<uint8_t> ToSend;
-    ToSend.resize(Data.size() + sizeof(Size));
-    std::memcpy(ToSend.data(), &Size, sizeof(Size));
-    std::memcpy(ToSend.data() + sizeof(Size), Data.data(), Data.size());
+    AppendFrame(ToSend, Data);
     boost::system::error_code ec;
     write(Sock, buffer(ToSend), ec);
     if (ec) {
@@ -442,11 +789,16 @@ bool TNetwork::TCPSend(TClient& c, const std::vector<uint8_t>& Data, bool IsSync
         c.Disconnect("write() failed");
         return false;
     }
+    Metrics::PacketsSent.Add(Data, ToSend.size());
+    c.Traffic().AddTransport(TTrafficStats::Direction::Out, TTrafficStats::Transport::TCP, ToSend.size());
+    if (!Data.empty()) {
+        c.Traffic().AddCode(TTrafficStats::Direction::Out, Data.front(), ToSend.size());
+    }
     c.UpdatePingTime();
     return true;
 }
 
-std::vector<uint8_t> TNetwork::TCPRcv(TClient& c) {
+std::vector<uint8_t> TNetwork::TCPRcv(TClient& c, std::optional<std::chrono::milliseconds> Timeout) {
     if (c.IsDisconnected()) {
         beammp_error("Client disconnected, cancelling TCPRcv");
         return {};
@@ -454,16 +806,30 @@ std::vector<uint8_t> TNetwork::TCPRcv(TClient& c) {
 
     int32_t Header {};
     auto& Sock = c.GetTCPSock();
+    // the whole packet has to arrive within the timeout
+    std::optional<std::chrono::steady_clock::time_point> Deadline;
+    if (Timeout) {
+        Deadline = std::chrono::steady_clock::now() + *Timeout;
+    }
 
     boost::system::error_code ec;
     std::array<uint8_t, sizeof(Header)> HeaderData;
-    read(Sock, buffer(HeaderData), ec);
+    ReadWithDeadline(Sock, buffer(HeaderData), Deadline, ec);
     if (ec) {
+        if (ec == boost::asio::error::timed_out) {
+            ++mHandshakeTimeouts;
+            c.Disconnect("Timed out");
+        }
         // TODO: handle this case (read failed)
         beammp_debugf("TCPRcv: Reading header failed: {}", ec.message());
         return {};
     }
     Header = *reinterpret_cast<int32_t*>(HeaderData.data());
+    // a packet's journey through the server starts once its header arrived.
+    // TCPClient opens the packet's flow itself to hand it on to the
+    // dispatcher, for the handshake packets it ends with this function.
+    Tracing::TFlowScope Flow(Tracing::CurrentFlowID() != 0 ? Tracing::CurrentFlowID() : Tracing::NewFlowID());
+    Tracing::TSpan Span("TCPRcv", Tracing::FlowPhase::Begin);
 
     if (Header < 0) {
         ClientKick(c, "Invalid packet - header negative");
@@ -480,8 +846,12 @@ std::vector<uint8_t> TNetwork::TCPRcv(TClient& c) {
         beammp_warn("Client " + c.GetName() + " (" + std::to_string(c.GetID()) + ") sent header of >100MB - assuming malicious intent and disconnecting the client.");
         return {};
     }
-    auto N = read(Sock, buffer(Data), ec);
+    auto N = ReadWithDeadline(Sock, buffer(Data), Deadline, ec);
     if (ec) {
+        if (ec == boost::asio::error::timed_out) {
+            ++mHandshakeTimeouts;
+            c.Disconnect("Timed out");
+        }
         // TODO: handle this case properly
         beammp_debugf("TCPRcv: Reading data failed: {}", ec.message());
         return {};
@@ -490,6 +860,7 @@ std::vector<uint8_t> TNetwork::TCPRcv(TClient& c) {
     if (N != Header) {
         beammp_errorf("Expected to read {} bytes, instead got {}", Header, N);
     }
+    c.Traffic().AddTransport(TTrafficStats::Direction::In, TTrafficStats::Transport::TCP, sizeof(Header) + N);
 
     constexpr std::string_view ABG = "ABG:";
     if (Data.size() >= ABG.size() && std::equal(Data.begin(), Data.begin() + ABG.size(), ABG.begin(), ABG.end())) {
@@ -517,6 +888,7 @@ void TNetwork::Looper(const std::weak_ptr<TClient>& c) {
             break;
         }
         if (!Client->IsSyncing() && Client->IsSynced() && Client->MissedPacketQueueSize() != 0) {
+            Tracing::TSpan Span("Looper");
             // debug("sending " + std::to_string(Client->MissedPacketQueueSize()) + " queued packets");
             while (Client->MissedPacketQueueSize() > 0) {
                 std::vector<uint8_t> QData {};
@@ -551,7 +923,13 @@ void TNetwork::TCPClient(const std::weak_ptr<TClient>& c) {
         return;
     }
     OnConnect(c);
+    if (c.lock()->GetID() < 0) {
+        // no ID could be assigned, the client has already been kicked
+        mServer.RemoveClient(c);
+        return;
+    }
     RegisterThread("(" + std::to_string(c.lock()->GetID()) + ") \"" + c.lock()->GetName() + "\"");
+    mCapture.RecordJoin(*c.lock());
 
     std::thread QueueSync(&TNetwork::Looper, this, c);
 
@@ -564,13 +942,25 @@ void TNetwork::TCPClient(const std::weak_ptr<TClient>& c) {
             break;
         }
 
+        Tracing::TFlowScope Flow(Tracing::NewFlowID());
         auto res = TCPRcv(*Client);
         if (res.empty()) {
             beammp_debug("TCPRcv empty");
             Client->Disconnect("TCPRcv failed");
             break;
         }
-        mServer.GlobalParser(c, std::move(res), mPPSMonitor, *this);
+        mCapture.Record(TTrafficCapture::Kind::TCP, Client->GetID(), res);
+        // waits while this client has too much queued, so it isn't read from any faster than it's handled
+        if (!mDispatcher.DispatchOrWait(Client->GetID(), [this, c, res = std::move(res), FlowID = Tracing::CurrentFlowID()]() mutable {
+                Tracing::TFlowScope Flow(FlowID);
+                mServer.GlobalParser(c, std::move(res), mPPSMonitor, *this);
+            })) {
+            break;
+        }
+    }
+    // let everything this client sent be handled before it's removed
+    if (!c.expired()) {
+        mDispatcher.Flush(c.lock()->GetID());
     }
 
     if (QueueSync.joinable())
@@ -578,6 +968,7 @@ void TNetwork::TCPClient(const std::weak_ptr<TClient>& c) {
 
     if (!c.expired()) {
         auto Client = c.lock();
+        mCapture.RecordLeave(Client->GetID());
         OnDisconnect(c);
     } else {
         beammp_warn("client expired in TCPClient, should never happen");
@@ -629,31 +1020,39 @@ void TNetwork::OnDisconnect(const std::weak_ptr<TClient>& ClientPtr) {
     mServer.RemoveClient(ClientPtr);
 }
 
-int TNetwork::OpenID() {
-    int ID = 0;
-    bool found;
-    do {
-        found = true;
-        mServer.ForEachClient([&](const std::weak_ptr<TClient>& ClientPtr) -> bool {
-            ReadLock Lock(mServer.GetClientMutex());
-            if (!ClientPtr.expired()) {
-                auto c = ClientPtr.lock();
-                if (c->GetID() == ID) {
-                    found = false;
-                    ID++;
-                }
+// returns the lowest ID in [0, MaxID] which no client uses, or -1 if there is none
+static int FindOpenID(TServer& Server, int MaxID) {
+    std::vector<bool> Taken(size_t(MaxID) + 1, false);
+    Server.ForEachClient([&](const std::weak_ptr<TClient>& ClientPtr) -> bool {
+        ReadLock Lock(Server.GetClientMutex());
+        if (!ClientPtr.expired()) {
+            auto c = ClientPtr.lock();
+            if (c->GetID() >= 0 && c->GetID() <= MaxID) {
+                Taken[size_t(c->GetID())] = true;
             }
-            return true;
-        });
-    } while (!found);
-    return ID;
+        }
+        return true;
+    });
+    auto Iter = std::find(Taken.begin(), Taken.end(), false);
+    if (Iter == Taken.end()) {
+        return -1;
+    }
+    return int(std::distance(Taken.begin(), Iter));
+}
+
+int TNetwork::OpenID(bool IsWideID) {
+    return FindOpenID(mServer, IsWideID ? MaxWidePlayerID : MaxLegacyPlayerID);
 }
 
 void TNetwork::OnConnect(const std::weak_ptr<TClient>& c) {
     beammp_assert(!c.expired());
     beammp_info("Client connected");
     auto LockedClient = c.lock();
-    LockedClient->SetID(OpenID());
+    LockedClient->SetID(OpenID(LockedClient->IsWideID()));
+    if (LockedClient->GetID() < 0) {
+        ClientKick(*LockedClient, LockedClient->IsWideID() ? "Server full!" : "Server full! Please update your launcher to join servers with more than 255 players.");
+        return;
+    }
     beammp_info("Assigned ID " + std::to_string(LockedClient->GetID()) + " to " + LockedClient->GetName());
     LuaAPI::MP::Engine->ReportErrors(LuaAPI::MP::Engine->TriggerEvent("onPlayerConnecting", "", LockedClient->GetID()));
     SyncResources(*LockedClient);
@@ -670,7 +1069,7 @@ void TNetwork::SyncResources(TClient& c) {
     }
     std::vector<uint8_t> Data;
     while (!c.IsDisconnected()) {
-        Data = TCPRcv(c);
+        Data = TCPRcv(c, ResourceSyncTimeout);
         if (Data.empty()) {
             break;
         }
@@ -858,6 +1257,7 @@ bool TNetwork::TCPSendRaw(TClient& C, ip::tcp::socket& socket, const uint8_t* Da
         beammp_errorf("Failed to send raw data to client: {}", ec.message());
         return false;
     }
+    C.Traffic().AddTransport(TTrafficStats::Direction::Out, TTrafficStats::Transport::TCP, Size);
     C.UpdatePingTime();
     return true;
 }
@@ -901,33 +1301,44 @@ bool TNetwork::SyncClient(const std::weak_ptr<TClient>& c) {
     LockedClient->SetIsSyncing(true);
     bool Return = false;
     bool res = true;
-    mServer.ForEachClient([&](const std::weak_ptr<TClient>& ClientPtr) -> bool {
-        std::shared_ptr<TClient> client;
-        {
-            ReadLock Lock(mServer.GetClientMutex());
-            if (!ClientPtr.expired()) {
-                client = ClientPtr.lock();
-            } else
-                return true;
+    if (LockedClient->GetCarCount() == 0) {
+        // the usual case: the joiner has no vehicles of its own, so it gets the shared
+        // snapshot of everyone's vehicles in one write
+        auto Snapshot = GetWorldSnapshot();
+        if (!Snapshot->empty() && !TCPSendRaw(*LockedClient, LockedClient->GetTCPSock(), Snapshot->data(), Snapshot->size())) {
+            LockedClient->Disconnect("Failed to send world snapshot");
+            Return = true;
+            res = false;
         }
-        TClient::TSetOfVehicleData VehicleData;
-        { // Vehicle Data Lock Scope
-            auto LockedData = client->GetAllCars();
-            VehicleData = *LockedData.VehicleData;
-        } // End Vehicle Data Lock Scope
-        if (client != LockedClient) {
-            for (auto& v : VehicleData) {
-                if (LockedClient->IsDisconnected()) {
-                    Return = true;
-                    res = false;
-                    return false;
+    } else {
+        mServer.ForEachClient([&](const std::weak_ptr<TClient>& ClientPtr) -> bool {
+            std::shared_ptr<TClient> client;
+            {
+                ReadLock Lock(mServer.GetClientMutex());
+                if (!ClientPtr.expired()) {
+                    client = ClientPtr.lock();
+                } else
+                    return true;
+            }
+            TClient::TSetOfVehicleData VehicleData;
+            { // Vehicle Data Lock Scope
+                auto LockedData = client->GetAllCars();
+                VehicleData = *LockedData.VehicleData;
+            } // End Vehicle Data Lock Scope
+            if (client != LockedClient) {
+                for (auto& v : VehicleData) {
+                    if (LockedClient->IsDisconnected()) {
+                        Return = true;
+                        res = false;
+                        return false;
+                    }
+                    res = Respond(*LockedClient, StringToVector(v.Data()), true, true);
                 }
-                res = Respond(*LockedClient, StringToVector(v.Data()), true, true);
             }
-        }
 
-        return true;
-    });
+            return true;
+        });
+    }
     LockedClient->SetIsSyncing(false);
     if (Return) {
         return res;
@@ -937,22 +1348,74 @@ bool TNetwork::SyncClient(const std::weak_ptr<TClient>& c) {
     return true;
 }
 
-void TNetwork::SendToAll(TClient* c, const std::vector<uint8_t>& Data, bool Self, bool Rel) {
-    if (!Self)
-        beammp_assert(c);
+std::shared_ptr<const std::vector<uint8_t>> TNetwork::GetWorldSnapshot() {
+    std::unique_lock Lock(mWorldSnapshotMutex);
+    // read before building, so that changes made while building cause a rebuild next time
+    const auto Generation = mServer.VehicleGeneration();
+    if (!mWorldSnapshot.Frames || mWorldSnapshot.Generation != Generation) {
+        mWorldSnapshot.Frames = std::make_shared<const std::vector<uint8_t>>(BuildWorldSnapshot(mServer));
+        mWorldSnapshot.Generation = Generation;
+    }
+    return mWorldSnapshot.Frames;
+}
+
+TEST_CASE("BuildWorldSnapshot") {
+    TServer Server({});
+    auto A = std::make_shared<TClient>(Server, ip::tcp::socket(Server.IoCtx()));
+    auto B = std::make_shared<TClient>(Server, ip::tcp::socket(Server.IoCtx()));
+    Server.InsertClient(A);
+    Server.InsertClient(B);
+    CHECK(BuildWorldSnapshot(Server).empty());
+
+    const std::string Small = "Os:USER:A:0-0:{}";
+    const std::string Large = "Os:USER:B:1-0:{\"parts\":\"" + std::string(2000, 'x') + "\"}";
+    auto Generation = Server.VehicleGeneration();
+    A->AddNewCar(0, Small);
+    B->AddNewCar(0, Large);
+    CHECK_NE(Server.VehicleGeneration(), Generation);
+
+    // split the snapshot back into packets, as the client would
+    auto Frames = BuildWorldSnapshot(Server);
+    std::vector<std::string> Packets;
+    size_t Offset = 0;
+    while (Offset < Frames.size()) {
+        int32_t Size;
+        std::memcpy(&Size, Frames.data() + Offset, sizeof(Size));
+        Offset += sizeof(Size);
+        std::vector<uint8_t> Data(Frames.begin() + long(Offset), Frames.begin() + long(Offset) + Size);
+        Offset += size_t(Size);
+        constexpr std::string_view ABG = "ABG:";
+        if (Data.size() >= ABG.size() && std::equal(ABG.begin(), ABG.end(), Data.begin())) {
+            Data = DeComp(std::vector<uint8_t>(Data.begin() + ABG.size(), Data.end()));
+        }
+        Packets.emplace_back(Data.begin(), Data.end());
+    }
+    CHECK_EQ(Offset, Frames.size());
+    REQUIRE_EQ(Packets.size(), size_t(2));
+    CHECK(std::find(Packets.begin(), Packets.end(), Small) != Packets.end());
+    CHECK(std::find(Packets.begin(), Packets.end(), Large) != Packets.end());
+
+    Generation = Server.VehicleGeneration();
+    B->DeleteCar(0);
+    CHECK_NE(Server.VehicleGeneration(), Generation);
+}
+
+// the loop behind SendToAll. UDP sends go through SendUDP, so this runs
+// without a socket in the benchmarks and tests below.
+template <typename TSendUDP>
+static void FanOut(TServer& Server, const TClient* Except, const std::vector<uint8_t>& Data, bool Rel, TSendUDP&& SendUDP) {
     char C = Data.at(0);
-    bool ret = true;
-    mServer.ForEachClient([&](std::weak_ptr<TClient> ClientPtr) -> bool {
+    Server.ForEachClient([&](std::weak_ptr<TClient> ClientPtr) -> bool {
         std::shared_ptr<TClient> Client;
         try {
-            ReadLock Lock(mServer.GetClientMutex());
+            ReadLock Lock(Server.GetClientMutex());
             Client = ClientPtr.lock();
         } catch (const std::exception&) {
             // continue
             beammp_warn("Client expired, shouldn't happen - if a client disconnected recently, you can ignore this");
             return true;
         }
-        if (Self || Client.get() != c) {
+        if (Client.get() != Except) {
             if (Client->IsSynced() || Client->IsSyncing()) {
                 if (Rel || C == 'W' || C == 'Y' || C == 'V' || C == 'E') {
                     if (C == 'O' || C == 'T' || Data.size() > 1000) {
@@ -969,19 +1432,94 @@ void TNetwork::SendToAll(TClient* c, const std::vector<uint8_t>& Data, bool Self
                         // ret = TCPSend(*Client, Data);
                     }
                 } else {
-                    ret = UDPSend(*Client, Data);
+                    SendUDP(*Client, Data);
                 }
             }
         }
         return true;
     });
-    if (!ret) {
-        // TODO: handle
+}
+
+void TNetwork::SendToAll(TClient* c, const std::vector<uint8_t>& Data, bool Self, bool Rel) {
+    if (!Self)
+        beammp_assert(c);
+    FanOut(mServer, Self ? nullptr : c, Data, Rel, [this](TClient& Client, const std::vector<uint8_t>& Packet) {
+        if (!UDPSend(Client, Packet)) {
+            // TODO: handle
+        }
+    });
+}
+
+TEST_CASE("SendToAll fan-out") {
+    TServer Server({});
+    std::vector<std::shared_ptr<TClient>> Clients;
+    for (int i = 0; i < 3; ++i) {
+        auto Client = std::make_shared<TClient>(Server, ip::tcp::socket(Server.IoCtx()));
+        Client->SetID(i);
+        Client->SetIsSynced(i != 2);
+        Server.InsertClient(Client);
+        Clients.push_back(Client);
     }
-    return;
+    auto Queued = [](TClient& Client) {
+        std::unique_lock Lock(Client.MissedPacketQueueMutex());
+        return std::exchange(Client.MissedPacketQueue(), {}).size();
+    };
+    std::vector<int> SentUDP;
+    auto SendUDP = [&](TClient& Client, const std::vector<uint8_t>&) { SentUDP.push_back(Client.GetID()); };
+
+    // reliable packets are queued for every synced client but the sender
+    FanOut(Server, Clients[0].get(), StringToVector("C:hello"), true, SendUDP);
+    CHECK_EQ(Queued(*Clients[0]), 0);
+    CHECK_EQ(Queued(*Clients[1]), 1);
+    CHECK_EQ(Queued(*Clients[2]), 0);
+    CHECK(SentUDP.empty());
+
+    // the others go over UDP, to the sender too if it's included
+    FanOut(Server, nullptr, StringToVector("Zp:0:0"), false, SendUDP);
+    std::sort(SentUDP.begin(), SentUDP.end());
+    const std::vector<int> Expected { 0, 1 };
+    CHECK(SentUDP == Expected);
+    CHECK_EQ(Queued(*Clients[0]) + Queued(*Clients[1]), 0);
+}
+
+static void BenchmarkSendToAll(TBenchmarkState& State, size_t ClientCount) {
+    TServer Server({});
+    std::vector<std::shared_ptr<TClient>> Clients;
+    for (size_t i = 0; i < ClientCount; ++i) {
+        auto Client = std::make_shared<TClient>(Server, ip::tcp::socket(Server.IoCtx()));
+        Client->SetID(int(i));
+        Client->SetIsSynced(true);
+        Server.InsertClient(Client);
+        Clients.push_back(Client);
+    }
+    const auto Packet = StringToVector("C:bench: the quick brown fox jumps over the lazy dog");
+    State.SetItemsPerIteration(ClientCount);
+    State.Run([&] {
+        FanOut(Server, nullptr, Packet, true, [](TClient&, const std::vector<uint8_t>&) { });
+        // drain the queues like the clients' TCP threads would
+        for (const auto& Client : Clients) {
+            std::unique_lock Lock(Client->MissedPacketQueueMutex());
+            Client->MissedPacketQueue() = {};
+        }
+    });
+}
+
+BEAMMP_BENCHMARK("TNetwork/SendToAll/10") {
+    BenchmarkSendToAll(State, 10);
+}
+
+BEAMMP_BENCHMARK("TNetwork/SendToAll/100") {
+    BenchmarkSendToAll(State, 100);
+}
+
+BEAMMP_BENCHMARK("TNetwork/SendToAll/1000") {
+    BenchmarkSendToAll(State, 1000);
 }
 
 bool TNetwork::UDPSend(TClient& Client, std::vector<uint8_t> Data) {
+    static auto& sLatency = Metrics::ProbeTime.WithLabel("UDPSend");
+    TScopedProbe Probe(sLatency);
+    Tracing::TSpan Span("UDPSend");
     if (!Client.IsConnected() || Client.IsDisconnected()) {
         // this can happen if we try to send a packet to a client that is either
         // 1. not yet fully connected, or
@@ -990,6 +1528,7 @@ bool TNetwork::UDPSend(TClient& Client, std::vector<uint8_t> Data) {
         return true;
     }
     const auto Addr = Client.GetUDPAddr();
+    const char Code = Data.empty() ? '\0' : char(Data.front());
     if (Data.size() > 400) {
         CompressProperly(Data);
     }
@@ -1001,6 +1540,9 @@ bool TNetwork::UDPSend(TClient& Client, std::vector<uint8_t> Data) {
             Client.Disconnect("UDP send failed");
         return false;
     }
+    Metrics::PacketsSent.Add(Code, Data.size());
+    Client.Traffic().AddTransport(TTrafficStats::Direction::Out, TTrafficStats::Transport::UDP, Data.size());
+    Client.Traffic().AddCode(TTrafficStats::Direction::Out, uint8_t(Code), Data.size());
     return true;
 }
 
@@ -1015,3 +1557,91 @@ std::vector<uint8_t> TNetwork::UDPRcvFromClient(ip::udp::endpoint& ClientEndpoin
     beammp_assert(Rcv <= Ret.size());
     return std::vector<uint8_t>(Ret.begin(), Ret.begin() + Rcv);
 }
+
+std::optional<TUDPHeader> ParseUDPHeader(const std::vector<uint8_t>& Data) {
+    if (Data.size() >= 4 && Data[0] == 0 && Data[3] == ':') {
+        return TUDPHeader { (int(Data[1]) << 8) | int(Data[2]), 4 };
+    }
+    if (Data.size() >= 2 && Data[0] != 0 && Data[1] == ':') {
+        return TUDPHeader { int(Data[0]) - 1, 2 };
+    }
+    return std::nullopt;
+}
+
+std::vector<uint8_t> MakeUDPHeader(int ID, bool IsWideID) {
+    beammp_assert(ID >= 0 && ID <= (IsWideID ? MaxWidePlayerID : MaxLegacyPlayerID));
+    if (IsWideID) {
+        return { 0, uint8_t(ID >> 8), uint8_t(ID & 0xFF), ':' };
+    }
+    return { uint8_t(ID + 1), ':' };
+}
+
+TEST_CASE("ParseUDPHeader / MakeUDPHeader") {
+    SUBCASE("Legacy round trip") {
+        for (int ID = 0; ID <= MaxLegacyPlayerID; ++ID) {
+            auto Header = ParseUDPHeader(MakeUDPHeader(ID, false));
+            CHECK(Header);
+            CHECK_EQ(Header->ID, ID);
+            CHECK_EQ(Header->Size, size_t(2));
+        }
+    }
+    SUBCASE("Wide round trip") {
+        for (int ID = 0; ID <= MaxWidePlayerID; ++ID) {
+            auto Header = ParseUDPHeader(MakeUDPHeader(ID, true));
+            REQUIRE(Header);
+            REQUIRE_EQ(Header->ID, ID);
+            REQUIRE_EQ(Header->Size, size_t(4));
+        }
+    }
+    SUBCASE("Legacy ID that looks like a separator") {
+        // ID 57 is sent as ':'
+        auto Header = ParseUDPHeader({ ':', ':', 'Z', 'p' });
+        CHECK(Header);
+        CHECK_EQ(Header->ID, 57);
+    }
+    SUBCASE("Invalid") {
+        CHECK(!ParseUDPHeader({}));
+        CHECK(!ParseUDPHeader({ 1 }));
+        CHECK(!ParseUDPHeader({ 1, 'Z' }));
+        CHECK(!ParseUDPHeader({ 0, ':' }));
+        CHECK(!ParseUDPHeader({ 0, 1, 2, 'Z' }));
+    }
+}
+
+TEST_CASE("1000 wide clients") {
+    constexpr int ClientCount = 1000;
+    TServer Server({});
+    std::vector<std::shared_ptr<TClient>> Clients;
+    for (int i = 0; i < ClientCount; ++i) {
+        auto Client = std::make_shared<TClient>(Server, ip::tcp::socket(Server.IoCtx()));
+        Client->SetIsWideID(i >= MaxLegacyPlayerID + 1 || i % 2 == 0);
+        // legacy clients must still get an ID which fits into one byte
+        const int ID = FindOpenID(Server, Client->IsWideID() ? MaxWidePlayerID : MaxLegacyPlayerID);
+        REQUIRE_EQ(ID, i);
+        Client->SetID(ID);
+        Server.InsertClient(Client);
+        Clients.push_back(Client);
+    }
+    CHECK_EQ(Server.ClientCount(), ClientCount);
+    // the one-byte ID space is exhausted, legacy clients can't join anymore
+    CHECK_EQ(FindOpenID(Server, MaxLegacyPlayerID), -1);
+    CHECK_EQ(FindOpenID(Server, MaxWidePlayerID), ClientCount);
+
+    // every client's UDP packets must route back to exactly that client
+    for (const auto& Client : Clients) {
+        auto Packet = MakeUDPHeader(Client->GetID(), Client->IsWideID());
+        Packet.push_back('Z');
+        auto Header = ParseUDPHeader(Packet);
+        REQUIRE(Header);
+        auto Found = GetClient(Server, Header->ID);
+        REQUIRE(Found);
+        REQUIRE_EQ(Found->lock(), Client);
+        REQUIRE_EQ(Packet.at(Header->Size), 'Z');
+    }
+
+    // freed IDs are handed out again
+    Server.RemoveClient(Clients.at(500));
+    CHECK_EQ(FindOpenID(Server, MaxWidePlayerID), 500);
+    Server.RemoveClient(Clients.at(3));
+    CHECK_EQ(FindOpenID(Server, MaxLegacyPlayerID), 3);
+}
@@ -0,0 +1,264 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "TPacketDispatcher.h"
+
+#include "Common.h"
+
+#include <algorithm>
+#include <future>
+#include <map>
+#include <thread>
+
+TPacketDispatcher::TPacketDispatcher(size_t WorkerCount) {
+    if (WorkerCount == 0) {
+        WorkerCount = std::clamp<size_t>(std::thread::hardware_concurrency(), 2, 8);
+    }
+    for (size_t i = 0; i < WorkerCount; ++i) {
+        mWorkers.push_back(std::make_unique<TWorker>());
+    }
+    for (size_t i = 0; i < WorkerCount; ++i) {
+        mWorkers[i]->Thread = std::thread(&TPacketDispatcher::WorkerMain, this, std::ref(*mWorkers[i]), i);
+    }
+}
+
+TPacketDispatcher::~TPacketDispatcher() {
+    Shutdown();
+}
+
+void TPacketDispatcher::Shutdown() {
+    mShutdown = true;
+    for (auto& Worker : mWorkers) {
+        {
+            // taking the lock makes sure the worker is either waiting or will see mShutdown
+            std::unique_lock Lock(Worker->Mutex);
+        }
+        Worker->Cond.notify_all();
+        Worker->SpaceCond.notify_all();
+    }
+    for (auto& Worker : mWorkers) {
+        if (Worker->Thread.joinable() && Worker->Thread.get_id() != std::this_thread::get_id()) {
+            Worker->Thread.join();
+        }
+    }
+}
+
+TPacketDispatcher::TWorker& TPacketDispatcher::WorkerFor(int ClientID) {
+    return *mWorkers[size_t(std::max(ClientID, 0)) % mWorkers.size()];
+}
+
+bool TPacketDispatcher::Dispatch(int ClientID, TTask&& Task, bool Droppable) {
+    if (mShutdown) {
+        return false;
+    }
+    auto& Worker = WorkerFor(ClientID);
+    {
+        std::unique_lock Lock(Worker.Mutex);
+        if (Droppable && Worker.Queue.size() >= MaxDroppableQueueSize) {
+            ++mDropped;
+            return false;
+        }
+        Worker.Queue.push_back({ std::move(Task), ClientID });
+        ++Worker.QueuedPerClient[ClientID];
+        ++mQueued;
+    }
+    Worker.Cond.notify_one();
+    return true;
+}
+
+bool TPacketDispatcher::DispatchOrWait(int ClientID, TTask&& Task) {
+    auto& Worker = WorkerFor(ClientID);
+    {
+        std::unique_lock Lock(Worker.Mutex);
+        const auto HasSpace = [&] {
+            auto Iter = Worker.QueuedPerClient.find(ClientID);
+            return mShutdown || Iter == Worker.QueuedPerClient.end() || Iter->second < MaxQueuedPerClient;
+        };
+        if (!HasSpace()) {
+            ++mThrottled;
+            ++Worker.Waiting;
+            Worker.SpaceCond.wait(Lock, HasSpace);
+            --Worker.Waiting;
+        }
+        if (mShutdown) {
+            return false;
+        }
+        Worker.Queue.push_back({ std::move(Task), ClientID });
+        ++Worker.QueuedPerClient[ClientID];
+        ++mQueued;
+    }
+    Worker.Cond.notify_one();
+    return true;
+}
+
+void TPacketDispatcher::Flush(int ClientID) {
+    auto& Worker = WorkerFor(ClientID);
+    if (Worker.Thread.get_id() == std::this_thread::get_id()) {
+        // everything before us on this worker has already run
+        return;
+    }
+    // shared with the task, which may still run after we stopped waiting
+    auto Done = std::make_shared<std::promise<void>>();
+    auto DoneFuture = Done->get_future();
+    if (!Dispatch(ClientID, [Done] { Done->set_value(); })) {
+        return;
+    }
+    // the worker may be stopped before it gets to us during shutdown
+    while (DoneFuture.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+        if (mShutdown) {
+            return;
+        }
+    }
+}
+
+TPacketDispatcher::TStats TPacketDispatcher::GetStats() const {
+    return TStats {
+        mQueued.load(),
+        mDispatched.load(),
+        mDropped.load(),
+        mThrottled.load(),
+    };
+}
+
+void TPacketDispatcher::WorkerMain(TWorker& Worker, size_t Index) {
+    RegisterThread("Dispatch_" + std::to_string(Index));
+    while (true) {
+        TTask Task;
+        {
+            std::unique_lock Lock(Worker.Mutex);
+            Worker.Cond.wait(Lock, [&] { return mShutdown || !Worker.Queue.empty(); });
+            if (mShutdown) {
+                break;
+            }
+            auto& Front = Worker.Queue.front();
+            Task = std::move(Front.Task);
+            auto Queued = Worker.QueuedPerClient.find(Front.ClientID);
+            if (--Queued->second == 0) {
+                Worker.QueuedPerClient.erase(Queued);
+            }
+            Worker.Queue.pop_front();
+            --mQueued;
+            if (Worker.Waiting > 0) {
+                Worker.SpaceCond.notify_all();
+            }
+        }
+        try {
+            Task();
+        } catch (const std::exception& e) {
+            beammp_errorf("Exception while handling a packet: {}", e.what());
+        }
+        ++mDispatched;
+    }
+}
+
+TEST_CASE("TPacketDispatcher keeps per-client order") {
+    constexpr int ClientCount = 1000;
+    constexpr int PacketsPerClient = 100;
+    TPacketDispatcher Dispatcher(4);
+    std::mutex ReceivedMutex;
+    std::map<int, std::vector<int>> Received;
+    // interleave clients, like they would arrive on the UDP socket
+    for (int Packet = 0; Packet < PacketsPerClient; ++Packet) {
+        for (int Client = 0; Client < ClientCount; ++Client) {
+            CHECK(Dispatcher.Dispatch(Client, [&, Client, Packet] {
+                std::unique_lock Lock(ReceivedMutex);
+                Received[Client].push_back(Packet);
+            }));
+        }
+    }
+    for (int Client = 0; Client < ClientCount; ++Client) {
+        Dispatcher.Flush(Client);
+    }
+    std::unique_lock Lock(ReceivedMutex);
+    REQUIRE_EQ(Received.size(), size_t(ClientCount));
+    for (const auto& [Client, Packets] : Received) {
+        REQUIRE_EQ(Packets.size(), size_t(PacketsPerClient));
+        REQUIRE(std::is_sorted(Packets.begin(), Packets.end()));
+    }
+    auto Stats = Dispatcher.GetStats();
+    CHECK_EQ(Stats.Dropped, 0);
+    CHECK_EQ(Stats.Queued, 0);
+}
+
+TEST_CASE("TPacketDispatcher drops unreliable packets when overloaded") {
+    TPacketDispatcher Dispatcher(1);
+    std::promise<void> Unblock;
+    auto Blocker = Unblock.get_future().share();
+    CHECK(Dispatcher.Dispatch(0, [Blocker] { Blocker.wait(); }));
+    size_t Dropped = 0;
+    for (size_t i = 0; i < TPacketDispatcher::MaxDroppableQueueSize + 10; ++i) {
+        if (!Dispatcher.Dispatch(0, [] { }, true)) {
+            ++Dropped;
+        }
+    }
+    CHECK(Dropped > 0);
+    // reliable packets are never dropped
+    CHECK(Dispatcher.Dispatch(0, [] { }, false));
+    Unblock.set_value();
+    Dispatcher.Flush(0);
+    CHECK_EQ(Dispatcher.GetStats().Dropped, Dropped);
+}
+
+TEST_CASE("TPacketDispatcher makes a client's reader wait while it has too much queued") {
+    TPacketDispatcher Dispatcher(1);
+    std::promise<void> Unblock;
+    auto Blocker = Unblock.get_future().share();
+    // another client on the same worker holds it up
+    CHECK(Dispatcher.Dispatch(1, [Blocker] { Blocker.wait(); }));
+    std::atomic_size_t Handled { 0 };
+    std::atomic_size_t Queued { 0 };
+    std::thread Reader([&] {
+        for (size_t i = 0; i < TPacketDispatcher::MaxQueuedPerClient + 10; ++i) {
+            CHECK(Dispatcher.DispatchOrWait(0, [&Handled] { ++Handled; }));
+            ++Queued;
+        }
+    });
+    const auto Start = std::chrono::steady_clock::now();
+    while (Queued < TPacketDispatcher::MaxQueuedPerClient && std::chrono::steady_clock::now() - Start < std::chrono::seconds(5)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    // the reader stopped at the limit
+    CHECK_EQ(Queued.load(), TPacketDispatcher::MaxQueuedPerClient);
+    CHECK_EQ(Dispatcher.GetStats().Throttled, 1);
+    // other clients aren't held up by it
+    CHECK(Dispatcher.DispatchOrWait(2, [] { }));
+    Unblock.set_value();
+    Reader.join();
+    Dispatcher.Flush(0);
+    CHECK_EQ(Handled.load(), TPacketDispatcher::MaxQueuedPerClient + 10);
+    CHECK_EQ(Dispatcher.GetStats().Queued, 0);
+}
+
+TEST_CASE("TPacketDispatcher lets waiting readers go on shutdown") {
+    TPacketDispatcher Dispatcher(1);
+    std::promise<void> Unblock;
+    auto Blocker = Unblock.get_future().share();
+    CHECK(Dispatcher.Dispatch(1, [Blocker] { Blocker.wait(); }));
+    for (size_t i = 0; i < TPacketDispatcher::MaxQueuedPerClient; ++i) {
+        CHECK(Dispatcher.Dispatch(0, [] { }));
+    }
+    std::thread Reader([&] {
+        CHECK_FALSE(Dispatcher.DispatchOrWait(0, [] { }));
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::thread Stopper([&] { Dispatcher.Shutdown(); });
+    Reader.join();
+    Unblock.set_value();
+    Stopper.join();
+}
@@ -36,59 +36,62 @@ TPluginMonitor::TPluginMonitor(const fs::path& Path, std::shared_ptr<TLuaEngine>
     }
 
     Application::RegisterShutdownHandler([this] {
-        if (mThread.joinable()) {
-            mThread.join();
-        }
+        Application::Scheduler().Cancel(mTask);
+        Application::SetSubsystemStatus("PluginMonitor", Application::Status::Shutdown);
     });
 
-    Start();
-}
-
-void TPluginMonitor::operator()() {
-    RegisterThread("PluginMonitor");
+    mTask = Application::Scheduler().Every("PluginMonitor", std::chrono::seconds(3), [this] { Check(); }, TScheduler::Kind::Blocking);
     beammp_info("PluginMonitor started");
     Application::SetSubsystemStatus("PluginMonitor", Application::Status::Good);
-    while (!Application::IsShuttingDown()) {
-        std::vector<std::string> ToRemove;
-        for (const auto& Pair : mFileTimes) {
-            try {
-                auto CurrentTime = fs::last_write_time(Pair.first);
-                if (CurrentTime > Pair.second) {
-                    mFileTimes[Pair.first] = CurrentTime;
-                    // grandparent of the path should be Resources/Server
-                    if (fs::equivalent(fs::path(Pair.first).parent_path().parent_path(), mPath)) {
-                        beammp_infof("File \"{}\" changed, reloading", Pair.first);
-                        // is in root folder, so reload
-                        std::ifstream FileStream(Pair.first, std::ios::in | std::ios::binary);
-                        auto Size = std::filesystem::file_size(Pair.first);
-                        auto Contents = std::make_shared<std::string>();
-                        Contents->resize(Size);
-                        FileStream.read(Contents->data(), Contents->size());
-                        TLuaChunk Chunk(Contents, Pair.first, fs::path(Pair.first).parent_path().string());
-                        auto StateID = mEngine->GetStateIDForPlugin(fs::path(Pair.first).parent_path());
+}
+
+TPluginMonitor::~TPluginMonitor() {
+    Application::Scheduler().Cancel(mTask);
+}
+
+void TPluginMonitor::Check() {
+    std::vector<std::string> ToRemove;
+    for (const auto& Pair : mFileTimes) {
+        try {
+            auto CurrentTime = fs::last_write_time(Pair.first);
+            if (CurrentTime > Pair.second) {
+                mFileTimes[Pair.first] = CurrentTime;
+                // grandparent of the path should be Resources/Server
+                if (fs::equivalent(fs::path(Pair.first).parent_path().parent_path(), mPath)) {
+                    beammp_infof("File \"{}\" changed, reloading", Pair.first);
+                    // is in root folder, so reload
+                    std::ifstream FileStream(Pair.first, std::ios::in | std::ios::binary);
+                    auto Size = std::filesystem::file_size(Pair.first);
+                    auto Contents = std::make_shared<std::string>();
+                    Contents->resize(Size);
+                    FileStream.read(Contents->data(), Contents->size());
+                    TLuaChunk Chunk(Contents, Pair.first, fs::path(Pair.first).parent_path().string());
+                    bool Reloaded = true;
+                    for (const auto& StateID : mEngine->GetStateIDsForPlugin(fs::path(Pair.first).parent_path())) {
                         auto Res = mEngine->EnqueueScript(StateID, Chunk);
                         Res->WaitUntilReady();
                         if (Res->Error) {
-                            beammp_lua_errorf("Error while hot-reloading \"{}\": {}", Pair.first, Res->ErrorMessage);
+                            beammp_lua_errorf("Error while hot-reloading \"{}\" in \"{}\": {}", Pair.first, StateID, Res->ErrorMessage);
+                            Reloaded = false;
                         } else {
                             mEngine->ReportErrors(mEngine->TriggerLocalEvent(StateID, "onInit"));
-                            mEngine->ReportErrors(mEngine->TriggerEvent("onFileChanged", "", Pair.first));
                         }
-                    } else {
-                        // is in subfolder, dont reload, just trigger an event
-                        beammp_debugf("File \"{}\" changed, not reloading because it's in a subdirectory. Triggering 'onFileChanged' event instead", Pair.first);
+                    }
+                    if (Reloaded) {
                         mEngine->ReportErrors(mEngine->TriggerEvent("onFileChanged", "", Pair.first));
                     }
+                } else {
+                    // is in subfolder, dont reload, just trigger an event
+                    beammp_debugf("File \"{}\" changed, not reloading because it's in a subdirectory. Triggering 'onFileChanged' event instead", Pair.first);
+                    mEngine->ReportErrors(mEngine->TriggerEvent("onFileChanged", "", Pair.first));
                 }
-            } catch (const std::exception& e) {
-                ToRemove.push_back(Pair.first);
             }
+        } catch (const std::exception& e) {
+            ToRemove.push_back(Pair.first);
         }
-        Application::SleepSafeSeconds(3);
-        for (const auto& File : ToRemove) {
-            mFileTimes.erase(File);
-            beammp_warnf("File \"{}\" couldn't be accessed, so it was removed from plugin hot reload monitor (probably got deleted)", File);
-        }
     }
-    Application::SetSubsystemStatus("PluginMonitor", Application::Status::Shutdown);
+    for (const auto& File : ToRemove) {
+        mFileTimes.erase(File);
+        beammp_warnf("File \"{}\" couldn't be accessed, so it was removed from plugin hot reload monitor (probably got deleted)", File);
+    }
 }
@@ -0,0 +1,67 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "TRingBuffer.h"
+#include "Common.h"
+
+#include <memory>
+#include <string>
+
+TEST_CASE("TRingBuffer") {
+    TRingBuffer<std::string> Ring(3);
+    CHECK_EQ(Ring.Capacity(), 4);
+    CHECK(Ring.Empty());
+    CHECK(!Ring.PopFront());
+
+    SUBCASE("wraps around and grows in order") {
+        for (int Round = 0; Round < 3; ++Round) {
+            Ring.PushBack("a");
+            Ring.PushBack("b");
+            Ring.PushBack("c");
+            CHECK_EQ(*Ring.PopFront(), "a");
+            CHECK_EQ(*Ring.PopFront(), "b");
+            CHECK_EQ(*Ring.PopFront(), "c");
+        }
+        for (int i = 0; i < 10; ++i) {
+            Ring.PushBack(std::to_string(i));
+        }
+        CHECK_EQ(Ring.Capacity(), 16);
+        CHECK_EQ(Ring.Size(), 10);
+        CHECK(Ring.AnyOf([](const std::string& Value) { return Value == "9"; }));
+        CHECK(!Ring.AnyOf([](const std::string& Value) { return Value == "10"; }));
+        const auto All = Ring.ToVector();
+        REQUIRE_EQ(All.size(), 10);
+        CHECK_EQ(All.front(), "0");
+        CHECK_EQ(All.back(), "9");
+        std::vector<std::string> Batch;
+        CHECK_EQ(Ring.PopFront(Batch, 4), 4);
+        CHECK_EQ(Batch.back(), "3");
+        CHECK_EQ(Ring.PopFront(Batch, 100), 6);
+        CHECK_EQ(Batch.back(), "9");
+        CHECK(Ring.Empty());
+    }
+    SUBCASE("popped slots release their value") {
+        TRingBuffer<std::shared_ptr<int>> Pointers;
+        auto Value = std::make_shared<int>(1);
+        Pointers.PushBack(Value);
+        CHECK_EQ(Value.use_count(), 2);
+        Pointers.PopFront();
+        CHECK_EQ(Value.use_count(), 1);
+    }
+}
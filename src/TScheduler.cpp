@@ -0,0 +1,522 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "TScheduler.h"
+
+#include "Common.h"
+
+#include <algorithm>
+#include <future>
+#include <limits>
+
+static constexpr uint64_t SlotMask = TScheduler::SlotCount - 1;
+static constexpr uint64_t NoTick = std::numeric_limits<uint64_t>::max();
+
+// set on worker threads, so tasks posted from a task stay on that worker's queue,
+// and Cancel() called from a task doesn't wait for itself
+static thread_local const TScheduler* tScheduler = nullptr;
+static thread_local size_t tWorkerIndex = 0;
+static thread_local const void* tCurrentTask = nullptr;
+
+TScheduler::TScheduler(size_t Workers, size_t BlockingWorkers)
+    : mEpoch(TClock::now()) {
+    for (size_t i = 0; i < std::max<size_t>(Workers, 1); ++i) {
+        mWorkers.push_back(std::make_unique<TWorker>());
+    }
+    for (size_t i = 0; i < mWorkers.size(); ++i) {
+        mWorkers[i]->Thread = std::thread(&TScheduler::WorkerMain, this, i);
+    }
+    for (size_t i = 0; i < std::max<size_t>(BlockingWorkers, 1); ++i) {
+        mBlockingWorkers.emplace_back(&TScheduler::BlockingWorkerMain, this, i);
+    }
+    mTimerThread = std::thread(&TScheduler::TimerMain, this);
+}
+
+TScheduler::~TScheduler() {
+    Shutdown();
+}
+
+TScheduler::TTaskID TScheduler::Every(const std::string& Name, TClock::duration Interval, TTask Task, Kind Type) {
+    Interval = std::max(Interval, Tick);
+    return Schedule(Name, Interval, TClock::now() + Interval, std::move(Task), Type);
+}
+
+TScheduler::TTaskID TScheduler::After(const std::string& Name, TClock::duration Delay, TTask Task, Kind Type) {
+    return Schedule(Name, TClock::duration::zero(), TClock::now() + Delay, std::move(Task), Type);
+}
+
+TScheduler::TTaskID TScheduler::Post(const std::string& Name, TTask Task, Kind Type) {
+    return Schedule(Name, TClock::duration::zero(), TClock::now(), std::move(Task), Type);
+}
+
+TScheduler::TTaskID TScheduler::Schedule(const std::string& Name, TClock::duration Interval, TClock::time_point Due, TTask Task, Kind Type) {
+    auto Timer = std::make_shared<TTimer>();
+    Timer->Name = Name;
+    Timer->Fn = std::move(Task);
+    Timer->Interval = Interval;
+    Timer->Type = Type;
+    Timer->Due = Due;
+    {
+        std::unique_lock Lock(mTasksMutex);
+        Timer->ID = mNextID++;
+        mTasks.emplace(Timer->ID, Timer);
+    }
+    const auto ID = Timer->ID;
+    if (Due <= TClock::now()) {
+        Dispatch(std::move(Timer));
+    } else {
+        Arm(Timer);
+    }
+    return ID;
+}
+
+bool TScheduler::Cancel(TTaskID ID) {
+    std::unique_lock Lock(mTasksMutex);
+    auto Iter = mTasks.find(ID);
+    if (Iter == mTasks.end()) {
+        return false;
+    }
+    auto Timer = Iter->second;
+    Timer->Cancelled = true;
+    if (tCurrentTask != Timer.get()) {
+        mTaskDoneCond.wait(Lock, [&] { return !Timer->Running; });
+    }
+    // the timer itself is dropped when its slot comes up
+    mTasks.erase(ID);
+    return true;
+}
+
+TScheduler::TStats TScheduler::GetStats() const {
+    TStats Stats;
+    Stats.Workers = mWorkers.size();
+    Stats.BlockingWorkers = mBlockingWorkers.size();
+    {
+        std::unique_lock Lock(mTasksMutex);
+        Stats.Tasks = mTasks.size();
+    }
+    Stats.Runs = mRuns;
+    Stats.LateRuns = mLateRuns;
+    Stats.MaxLateness = std::chrono::nanoseconds(mMaxLateness.load());
+    return Stats;
+}
+
+void TScheduler::Shutdown() {
+    {
+        std::unique_lock Lock(mWheelMutex);
+        if (mShutdown.exchange(true)) {
+            return;
+        }
+    }
+    mWheelCond.notify_all();
+    {
+        std::unique_lock Lock(mWorkMutex);
+    }
+    mWorkCond.notify_all();
+    {
+        std::unique_lock Lock(mBlockingMutex);
+    }
+    mBlockingCond.notify_all();
+    if (mTimerThread.joinable()) {
+        mTimerThread.join();
+    }
+    for (auto& Worker : mWorkers) {
+        if (Worker->Thread.joinable()) {
+            Worker->Thread.join();
+        }
+    }
+    for (auto& Worker : mBlockingWorkers) {
+        if (Worker.joinable()) {
+            Worker.join();
+        }
+    }
+    std::unique_lock Lock(mTasksMutex);
+    for (auto& [ID, Timer] : mTasks) {
+        Timer->Cancelled = true;
+    }
+    mTasks.clear();
+}
+
+void TScheduler::Arm(const TTimerPtr& Timer) {
+    {
+        std::unique_lock Lock(mWheelMutex);
+        // never into the current tick's slot, that one was already handled
+        Timer->DueTick = std::max(TickOf(Timer->Due, true), mCurrentTick + 1);
+        Insert(Timer);
+    }
+    mWheelCond.notify_one();
+}
+
+void TScheduler::Insert(TTimerPtr Timer) {
+    constexpr uint64_t Range = uint64_t(1) << (LevelBits * LevelCount);
+    // anything further out than the wheel reaches waits in the last level, and
+    // is put back in when its slot is cascaded
+    const uint64_t Delta = std::min(Timer->DueTick - std::min(Timer->DueTick, mCurrentTick), Range - 1);
+    size_t Level = 0;
+    while (Level + 1 < LevelCount && Delta >= (uint64_t(1) << (LevelBits * (Level + 1)))) {
+        ++Level;
+    }
+    const auto Slot = ((mCurrentTick + Delta) >> (LevelBits * Level)) & SlotMask;
+    mWheel[Level][Slot].push_back(std::move(Timer));
+    ++mArmed;
+}
+
+void TScheduler::Advance(uint64_t Target, std::vector<TTimerPtr>& Expired) {
+    while (mCurrentTick < Target) {
+        const auto Next = NextEventTick();
+        if (Next > Target) {
+            mCurrentTick = Target;
+            break;
+        }
+        mCurrentTick = Next;
+        // higher levels first, so what they cascade down can be cascaded
+        // further in the same tick
+        for (size_t Level = LevelCount - 1; Level > 0; --Level) {
+            const auto Shift = LevelBits * Level;
+            if ((mCurrentTick & ((uint64_t(1) << Shift) - 1)) != 0) {
+                continue;
+            }
+            auto Slot = std::exchange(mWheel[Level][(mCurrentTick >> Shift) & SlotMask], {});
+            mArmed -= Slot.size();
+            for (auto& Timer : Slot) {
+                Insert(std::move(Timer));
+            }
+        }
+        auto Slot = std::exchange(mWheel[0][mCurrentTick & SlotMask], {});
+        mArmed -= Slot.size();
+        for (auto& Timer : Slot) {
+            Expired.push_back(std::move(Timer));
+        }
+    }
+}
+
+uint64_t TScheduler::NextEventTick() const {
+    if (mArmed == 0) {
+        return NoTick;
+    }
+    uint64_t Best = NoTick;
+    for (size_t Level = 0; Level < LevelCount; ++Level) {
+        const auto Shift = LevelBits * Level;
+        for (uint64_t i = 1; i <= SlotCount; ++i) {
+            const auto Candidate = ((mCurrentTick >> Shift) + i) << Shift;
+            if (Candidate >= Best) {
+                break;
+            }
+            if (!mWheel[Level][(Candidate >> Shift) & SlotMask].empty()) {
+                Best = Candidate;
+                break;
+            }
+        }
+    }
+    return Best;
+}
+
+uint64_t TScheduler::TickOf(TClock::time_point Time, bool RoundUp) const {
+    if (Time <= mEpoch) {
+        return 0;
+    }
+    const auto Since = Time - mEpoch;
+    auto Ticks = uint64_t(Since / Tick);
+    if (RoundUp && Since % Tick != TClock::duration::zero()) {
+        ++Ticks;
+    }
+    return Ticks;
+}
+
+TScheduler::TClock::time_point TScheduler::TimeOf(uint64_t TickNumber) const {
+    return mEpoch + Tick * int64_t(TickNumber);
+}
+
+void TScheduler::TimerMain() {
+    RegisterThread("SchedulerTimer");
+    std::vector<TTimerPtr> Expired;
+    std::unique_lock Lock(mWheelMutex);
+    while (!mShutdown) {
+        Advance(TickOf(TClock::now(), false), Expired);
+        if (!Expired.empty()) {
+            Lock.unlock();
+            for (auto& Timer : Expired) {
+                Dispatch(std::move(Timer));
+            }
+            Expired.clear();
+            Lock.lock();
+            continue;
+        }
+        const auto Next = NextEventTick();
+        if (Next == NoTick) {
+            mWheelCond.wait(Lock);
+        } else {
+            mWheelCond.wait_until(Lock, TimeOf(Next));
+        }
+    }
+}
+
+void TScheduler::Dispatch(TTimerPtr Timer) {
+    if (Timer->Cancelled) {
+        return;
+    }
+    if (Timer->Type == Kind::Blocking) {
+        {
+            std::unique_lock Lock(mBlockingMutex);
+            mBlockingJobs.push_back(std::move(Timer));
+        }
+        mBlockingCond.notify_one();
+        return;
+    }
+    const auto Index = tScheduler == this ? tWorkerIndex : mNextWorker++ % mWorkers.size();
+    {
+        std::unique_lock Lock(mWorkers[Index]->Mutex);
+        mWorkers[Index]->Jobs.push_back(std::move(Timer));
+    }
+    {
+        std::unique_lock Lock(mWorkMutex);
+        ++mQueued;
+    }
+    mWorkCond.notify_one();
+}
+
+TScheduler::TTimerPtr TScheduler::NextJob(size_t Index) {
+    {
+        std::unique_lock Lock(mWorkMutex);
+        mWorkCond.wait(Lock, [this] { return mQueued > 0 || mShutdown; });
+        if (mShutdown) {
+            return nullptr;
+        }
+        // reserves one job, which is already in one of the queues
+        --mQueued;
+    }
+    while (true) {
+        // own queue from the front, others' from the back
+        for (size_t i = 0; i < mWorkers.size(); ++i) {
+            auto& Worker = *mWorkers[(Index + i) % mWorkers.size()];
+            std::unique_lock Lock(Worker.Mutex);
+            if (!Worker.Jobs.empty()) {
+                TTimerPtr Job;
+                if (i == 0) {
+                    Job = std::move(Worker.Jobs.front());
+                    Worker.Jobs.pop_front();
+                } else {
+                    Job = std::move(Worker.Jobs.back());
+                    Worker.Jobs.pop_back();
+                }
+                return Job;
+            }
+        }
+        // raced with another worker which took the job we'd have found, and
+        // ours was pushed to a queue we already looked at
+        std::this_thread::yield();
+    }
+}
+
+void TScheduler::WorkerMain(size_t Index) {
+    RegisterThread("Scheduler" + std::to_string(Index));
+    tScheduler = this;
+    tWorkerIndex = Index;
+    while (auto Timer = NextJob(Index)) {
+        Run(Timer);
+    }
+}
+
+void TScheduler::BlockingWorkerMain(size_t Index) {
+    RegisterThread("SchedulerBlocking" + std::to_string(Index));
+    while (true) {
+        TTimerPtr Timer;
+        {
+            std::unique_lock Lock(mBlockingMutex);
+            mBlockingCond.wait(Lock, [this] { return !mBlockingJobs.empty() || mShutdown; });
+            if (mShutdown) {
+                return;
+            }
+            Timer = std::move(mBlockingJobs.front());
+            mBlockingJobs.pop_front();
+        }
+        Run(Timer);
+    }
+}
+
+void TScheduler::Run(const TTimerPtr& Timer) {
+    static auto& sLateness = Metrics::ProbeTime.WithLabel("Scheduler lateness");
+    {
+        std::unique_lock Lock(mTasksMutex);
+        if (Timer->Cancelled) {
+            return;
+        }
+        Timer->Running = true;
+    }
+    const auto Lateness = std::max(TClock::now() - Timer->Due, TClock::duration::zero());
+    sLateness.Observe(Lateness);
+    ++mRuns;
+    if (Lateness > LateThreshold) {
+        ++mLateRuns;
+    }
+    const int64_t LatenessNs = std::chrono::duration_cast<std::chrono::nanoseconds>(Lateness).count();
+    auto Max = mMaxLateness.load();
+    while (LatenessNs > Max && !mMaxLateness.compare_exchange_weak(Max, LatenessNs)) { }
+
+    tCurrentTask = Timer.get();
+    try {
+        Timer->Fn();
+    } catch (const std::exception& e) {
+        beammp_errorf("Scheduled task '{}' failed: {}", Timer->Name, e.what());
+    }
+    tCurrentTask = nullptr;
+
+    const bool Rearm = Timer->Interval > TClock::duration::zero() && !Timer->Cancelled && !mShutdown;
+    {
+        std::unique_lock Lock(mTasksMutex);
+        Timer->Running = false;
+        if (!Rearm) {
+            mTasks.erase(Timer->ID);
+        }
+    }
+    mTaskDoneCond.notify_all();
+    if (Rearm) {
+        const auto Now = TClock::now();
+        Timer->Due += Timer->Interval;
+        if (Timer->Due <= Now) {
+            // fell behind, skip the missed runs
+            Timer->Due = Now + Timer->Interval;
+        }
+        Arm(Timer);
+    }
+}
+
+TEST_CASE("TScheduler") {
+    TScheduler Scheduler(2);
+    using namespace std::chrono_literals;
+
+    SUBCASE("one-shot tasks run in order of their deadlines") {
+        std::mutex Mutex;
+        std::vector<int> Order;
+        std::promise<void> Done;
+        const auto Start = TScheduler::TClock::now();
+        Scheduler.After("second", 30ms, [&] {
+            std::unique_lock Lock(Mutex);
+            Order.push_back(2);
+            CHECK(TScheduler::TClock::now() - Start >= 30ms);
+            Done.set_value();
+        });
+        Scheduler.After("first", 5ms, [&] {
+            std::unique_lock Lock(Mutex);
+            Order.push_back(1);
+        });
+        Scheduler.Post("now", [&] {
+            std::unique_lock Lock(Mutex);
+            Order.push_back(0);
+        });
+        REQUIRE(Done.get_future().wait_for(2s) == std::future_status::ready);
+        std::unique_lock Lock(Mutex);
+        const std::vector<int> Expected { 0, 1, 2 };
+        CHECK_EQ(Order, Expected);
+    }
+    SUBCASE("timers further out than the first level cascade down") {
+        std::promise<void> Done;
+        const auto Start = TScheduler::TClock::now();
+        Scheduler.After("cascaded", 300ms, [&] { Done.set_value(); });
+        REQUIRE(Done.get_future().wait_for(2s) == std::future_status::ready);
+        const auto Elapsed = TScheduler::TClock::now() - Start;
+        CHECK(Elapsed >= 300ms);
+        CHECK(Elapsed < 1s);
+    }
+    SUBCASE("periodic tasks repeat until cancelled") {
+        std::atomic_int Runs { 0 };
+        auto ID = Scheduler.Every("periodic", 2ms, [&] { ++Runs; });
+        while (Runs < 3) {
+            std::this_thread::sleep_for(1ms);
+        }
+        CHECK(Scheduler.Cancel(ID));
+        const int After = Runs;
+        std::this_thread::sleep_for(20ms);
+        CHECK_EQ(Runs, After);
+        CHECK(!Scheduler.Cancel(ID));
+    }
+    SUBCASE("blocking tasks don't hold up short ones") {
+        std::promise<void> Release;
+        auto Released = Release.get_future().share();
+        std::atomic_int Started { 0 };
+        std::atomic_int Finished { 0 };
+        // more than there are workers of either kind
+        for (int i = 0; i < 6; ++i) {
+            Scheduler.Post("blocking", [&, Released] {
+                ++Started;
+                Released.wait();
+                ++Finished;
+            }, TScheduler::Kind::Blocking);
+        }
+        std::promise<void> Done;
+        const auto Start = TScheduler::TClock::now();
+        Scheduler.After("short", 20ms, [&] { Done.set_value(); });
+        REQUIRE(Done.get_future().wait_for(2s) == std::future_status::ready);
+        CHECK(TScheduler::TClock::now() - Start < 500ms);
+        CHECK(Started <= int(TScheduler::DefaultBlockingWorkers));
+        Release.set_value();
+        for (int i = 0; i < 2000 && Finished < 6; ++i) {
+            std::this_thread::sleep_for(1ms);
+        }
+        CHECK_EQ(Finished, 6);
+    }
+    SUBCASE("timers re-armed from their task keep low jitter next to blocking tasks") {
+        std::promise<void> Release;
+        auto Released = Release.get_future().share();
+        std::atomic_int Finished { 0 };
+        for (int i = 0; i < 4; ++i) {
+            Scheduler.Post("heartbeat", [&, Released] {
+                Released.wait();
+                ++Finished;
+            }, TScheduler::Kind::Blocking);
+        }
+        // the way Lua event timers re-arm themselves
+        constexpr int Runs = 20;
+        constexpr auto Interval = 5ms;
+        std::mutex Mutex;
+        TScheduler::TClock::duration MaxJitter { 0 };
+        std::promise<void> Done;
+        std::function<void(TScheduler::TClock::time_point, int)> Arm = [&](TScheduler::TClock::time_point Due, int Left) {
+            Scheduler.After("Lua event timer", Due - TScheduler::TClock::now(), [&, Due, Left] {
+                {
+                    std::unique_lock Lock(Mutex);
+                    MaxJitter = std::max(MaxJitter, TScheduler::TClock::now() - Due);
+                }
+                if (Left == 0) {
+                    Done.set_value();
+                } else {
+                    Arm(Due + Interval, Left - 1);
+                }
+            });
+        };
+        Arm(TScheduler::TClock::now() + Interval, Runs);
+        REQUIRE(Done.get_future().wait_for(5s) == std::future_status::ready);
+        {
+            std::unique_lock Lock(Mutex);
+            CHECK(MaxJitter < 50ms);
+        }
+        Release.set_value();
+        for (int i = 0; i < 2000 && Finished < 4; ++i) {
+            std::this_thread::sleep_for(1ms);
+        }
+        CHECK_EQ(Finished, 4);
+    }
+    SUBCASE("cancelled tasks never run") {
+        std::atomic_bool Ran { false };
+        auto ID = Scheduler.After("cancelled", 10s, [&] { Ran = true; });
+        CHECK_EQ(Scheduler.GetStats().Tasks, 1u);
+        CHECK(Scheduler.Cancel(ID));
+        CHECK_EQ(Scheduler.GetStats().Tasks, 0u);
+        CHECK(!Ran);
+    }
+}
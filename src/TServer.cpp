@@ -17,11 +17,13 @@
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "TServer.h"
+#include "Benchmark.h"
 #include "Client.h"
 #include "Common.h"
 #include "CustomAssert.h"
 #include "TNetwork.h"
 #include "TPPSMonitor.h"
+#include "Tracing.h"
 #include <TLuaPlugin.h>
 #include <algorithm>
 #include <any>
@@ -172,8 +174,28 @@ size_t TServer::ClientCount() const {
     return mClients.size();
 }
 
-void TServer::GlobalParser(const std::weak_ptr<TClient>& Client, std::vector<uint8_t>&& Packet, TPPSMonitor& PPSMonitor, TNetwork& Network) {
+// Packets about a vehicle whose spawn is still waiting on Lua hooks are held back
+// until the spawn is applied, and dropped if it was denied, so that nobody hears
+// of a vehicle before its 'Os'. Returns false if Send should be called right away.
+static bool DeferUntilSpawned(TClient& Owner, const std::weak_ptr<TClient>& WeakOwner, int VID, std::function<void(TClient&)> Send) {
+    if (Owner.LuaHooks().Pending() == 0 || !Owner.IsCarIDReserved(VID)) {
+        return false;
+    }
+    Owner.LuaHooks().Then([WeakOwner, VID, Send = std::move(Send)](const TLuaHookChain::TResults&, bool) {
+        auto Locked = WeakOwner.lock();
+        if (Locked && Locked->HasCar(VID)) {
+            Send(*Locked);
+        }
+    });
+    return true;
+}
+
+void TServer::GlobalParser(const std::weak_ptr<TClient>& Client, std::vector<uint8_t>&& Packet, TPPSMonitor&, TNetwork& Network) {
+    static auto& sLatency = Metrics::ProbeTime.WithLabel("GlobalParser");
+    TScopedProbe Probe(sLatency);
+    Tracing::TSpan Span("GlobalParser");
     constexpr std::string_view ABG = "ABG:";
+    const auto WireSize = Packet.size();
     if (Packet.size() >= ABG.size() && std::equal(Packet.begin(), Packet.begin() + ABG.size(), ABG.begin(), ABG.end())) {
         Packet.erase(Packet.begin(), Packet.begin() + ABG.size());
         Packet = DeComp(Packet);
@@ -181,11 +203,13 @@ void TServer::GlobalParser(const std::weak_ptr<TClient>& Client, std::vector<uin
     if (Packet.empty()) {
         return;
     }
+    Metrics::PacketsReceived.Add(char(Packet.front()), WireSize);
 
     if (Client.expired()) {
         return;
     }
     auto LockedClient = Client.lock();
+    LockedClient->Traffic().AddCode(TTrafficStats::Direction::In, Packet.front(), WireSize);
 
     std::any Res;
     char Code = Packet.at(0);
@@ -194,7 +218,6 @@ void TServer::GlobalParser(const std::weak_ptr<TClient>& Client, std::vector<uin
 
     // V to Y
     if (Code <= 89 && Code >= 86) {
-        PPSMonitor.IncrementInternalPPS();
         Network.SendToAll(LockedClient.get(), Packet, false, false);
         return;
     }
@@ -216,7 +239,7 @@ void TServer::GlobalParser(const std::weak_ptr<TClient>& Client, std::vector<uin
         if (Packet.size() > 1000) {
             beammp_debug(("Received data from: ") + LockedClient->GetName() + (" Size: ") + std::to_string(Packet.size()));
         }
-        ParseVehicle(*LockedClient, StringPacket, Network);
+        ParseVehicle(LockedClient, StringPacket, Network);
         return;
     case 'C': {
         if (Packet.size() < 4 || std::find(Packet.begin() + 3, Packet.end(), ':') == Packet.end())
@@ -231,19 +254,26 @@ void TServer::GlobalParser(const std::weak_ptr<TClient>& Client, std::vector<uin
             beammp_debugf("Empty chat message received from '{}' ({}), ignoring it", LockedClient->GetName(), LockedClient->GetID());
             return;
         }
-        auto Futures = LuaAPI::MP::Engine->TriggerEvent("onChatMessage", "", LockedClient->GetID(), LockedClient->GetName(), Message);
-        TLuaEngine::WaitForAll(Futures);
-        LogChatMessage(LockedClient->GetName(), LockedClient->GetID(), PacketAsString.substr(PacketAsString.find(':', 3) + 1));
-        if (std::any_of(Futures.begin(), Futures.end(),
-                [](const std::shared_ptr<TLuaResult>& Elem) {
-                    return !Elem->Error
-                        && Elem->Result.is<int>()
-                        && bool(Elem->Result.as<int>());
-                })) {
-            break;
-        }
-        std::string SanitizedPacket = fmt::format("C:{}: {}", LockedClient->GetName(), Message);
-        Network.SendToAll(nullptr, StringToVector(SanitizedPacket), true, true);
+        static const auto sOnChatMessage = TLuaEngine::InternEvent("onChatMessage");
+        auto Futures = LuaAPI::MP::Engine->TriggerEvent(sOnChatMessage, "", LockedClient->GetID(), LockedClient->GetName(), Message);
+        LockedClient->LuaHooks().Queue("onChatMessage", std::move(Futures), TLuaHookChain::ConfiguredTimeout(),
+            [Client, &Network, Message, Logged = PacketAsString.substr(ColonPos + 1)](const TLuaHookChain::TResults& Results, bool TimedOut) {
+                auto Sender = Client.lock();
+                if (!Sender) {
+                    return;
+                }
+                LogChatMessage(Sender->GetName(), Sender->GetID(), Logged);
+                if (TimedOut || std::any_of(Results.begin(), Results.end(),
+                        [](const std::shared_ptr<TLuaResult>& Elem) {
+                            return !Elem->Error
+                                && Elem->Result.is<int>()
+                                && bool(Elem->Result.as<int>());
+                        })) {
+                    return;
+                }
+                std::string SanitizedPacket = fmt::format("C:{}: {}", Sender->GetName(), Message);
+                Network.SendToAll(nullptr, StringToVector(SanitizedPacket), true, true);
+            });
         return;
     }
     case 'E':
@@ -253,11 +283,25 @@ void TServer::GlobalParser(const std::weak_ptr<TClient>& Client, std::vector<uin
         beammp_trace("got 'N' packet (" + std::to_string(Packet.size()) + ")");
         Network.SendToAll(LockedClient.get(), Packet, false, true);
         return;
-    case 'Z': // position packet
-        PPSMonitor.IncrementInternalPPS();
+    case 'Z': { // position packet
+        // only worth parsing while some spawn may still be waiting on Lua
+        if (LockedClient->LuaHooks().Pending() != 0) {
+            // Zp:PID-VID:DATA
+            const auto VIDEnd = StringPacket.find(':', 3);
+            auto MaybePidVid = VIDEnd == std::string::npos ? std::nullopt : GetPidVid(StringPacket.substr(3, VIDEnd - 3));
+            if (MaybePidVid
+                && DeferUntilSpawned(*LockedClient, Client, MaybePidVid->second,
+                    [this, &Network, Packet, StringPacket](TClient& Owner) {
+                        Network.SendToAll(&Owner, Packet, false, false);
+                        HandlePosition(Owner, StringPacket);
+                    })) {
+                return;
+            }
+        }
         Network.SendToAll(LockedClient.get(), Packet, false, false);
         HandlePosition(*LockedClient, StringPacket);
         return;
+    }
     default:
         return;
     }
@@ -301,9 +345,12 @@ bool TServer::ShouldSpawn(TClient& c, const std::string& CarJson, int ID) {
     }
 }
 
-void TServer::ParseVehicle(TClient& c, const std::string& Pckt, TNetwork& Network) {
+void TServer::ParseVehicle(const std::shared_ptr<TClient>& Client, const std::string& Pckt, TNetwork& Network) {
     if (Pckt.length() < 6)
         return;
+    TClient& c = *Client;
+    // Lua hooks are applied later, from the client's hook chain, which must not keep it alive
+    std::weak_ptr<TClient> WeakClient = Client;
     std::string Packet = Pckt;
     char Code = Packet.at(1);
     int PID = -1;
@@ -313,31 +360,39 @@ void TServer::ParseVehicle(TClient& c, const std::string& Pckt, TNetwork& Networ
     case 's':
         beammp_tracef("got 'Os' packet: '{}' ({})", Packet, Packet.size());
         if (Data.at(0) == '0') {
-            int CarID = c.GetOpenCarID();
+            int CarID = c.ReserveCarID();
             beammp_debugf("'{}' created a car with ID {}", c.GetName(), CarID);
 
             std::string CarJson = Packet.substr(5);
             Packet = "Os:" + c.GetRoles() + ":" + c.GetName() + ":" + std::to_string(c.GetID()) + "-" + std::to_string(CarID) + ":" + CarJson;
-            auto Futures = LuaAPI::MP::Engine->TriggerEvent("onVehicleSpawn", "", c.GetID(), CarID, Packet.substr(3));
-            TLuaEngine::WaitForAll(Futures);
-            bool ShouldntSpawn = std::any_of(Futures.begin(), Futures.end(),
-                [](const std::shared_ptr<TLuaResult>& Result) {
-                    return !Result->Error && Result->Result.is<int>() && Result->Result.as<int>() != 0;
+            static const auto sOnVehicleSpawn = TLuaEngine::InternEvent("onVehicleSpawn");
+            auto Futures = LuaAPI::MP::Engine->TriggerEvent(sOnVehicleSpawn, "", c.GetID(), CarID, Packet.substr(3));
+            c.LuaHooks().Queue("onVehicleSpawn", std::move(Futures), TLuaHookChain::ConfiguredTimeout(),
+                [WeakClient, &Network, Packet, CarJson, CarID](const TLuaHookChain::TResults& Results, bool TimedOut) {
+                    auto Locked = WeakClient.lock();
+                    if (!Locked) {
+                        return;
+                    }
+                    bool ShouldntSpawn = TimedOut || std::any_of(Results.begin(), Results.end(),
+                        [](const std::shared_ptr<TLuaResult>& Result) {
+                            return !Result->Error && Result->Result.is<int>() && Result->Result.as<int>() != 0;
+                        });
+
+                    if (ShouldSpawn(*Locked, CarJson, CarID) && !ShouldntSpawn) {
+                        Locked->AddNewCar(CarID, Packet);
+                        Network.SendToAll(nullptr, StringToVector(Packet), true, true);
+                    } else {
+                        if (!Network.Respond(*Locked, StringToVector(Packet), true)) {
+                            // TODO: handle
+                        }
+                        std::string Destroy = "Od:" + std::to_string(Locked->GetID()) + "-" + std::to_string(CarID);
+                        if (!Network.Respond(*Locked, StringToVector(Destroy), true)) {
+                            // TODO: handle
+                        }
+                        beammp_debugf("{} (force : car limit/lua) removed ID {}", Locked->GetName(), CarID);
+                    }
+                    Locked->ReleaseCarID(CarID);
                 });
-
-            if (ShouldSpawn(c, CarJson, CarID) && !ShouldntSpawn) {
-                c.AddNewCar(CarID, Packet);
-                Network.SendToAll(nullptr, StringToVector(Packet), true, true);
-            } else {
-                if (!Network.Respond(c, StringToVector(Packet), true)) {
-                    // TODO: handle
-                }
-                std::string Destroy = "Od:" + std::to_string(c.GetID()) + "-" + std::to_string(CarID);
-                if (!Network.Respond(c, StringToVector(Destroy), true)) {
-                    // TODO: handle
-                }
-                beammp_debugf("{} (force : car limit/lua) removed ID {}", c.GetName(), CarID);
-            }
         }
         return;
     case 'c': {
@@ -347,27 +402,34 @@ void TServer::ParseVehicle(TClient& c, const std::string& Pckt, TNetwork& Networ
             std::tie(PID, VID) = MaybePidVid.value();
         }
         if (PID != -1 && VID != -1 && PID == c.GetID()) {
-            auto Futures = LuaAPI::MP::Engine->TriggerEvent("onVehicleEdited", "", c.GetID(), VID, Packet.substr(3));
-            TLuaEngine::WaitForAll(Futures);
-            bool ShouldntAllow = std::any_of(Futures.begin(), Futures.end(),
-                [](const std::shared_ptr<TLuaResult>& Result) {
-                    return !Result->Error && Result->Result.is<int>() && Result->Result.as<int>() != 0;
+            static const auto sOnVehicleEdited = TLuaEngine::InternEvent("onVehicleEdited");
+            auto Futures = LuaAPI::MP::Engine->TriggerEvent(sOnVehicleEdited, "", c.GetID(), VID, Packet.substr(3));
+            c.LuaHooks().Queue("onVehicleEdited", std::move(Futures), TLuaHookChain::ConfiguredTimeout(),
+                [WeakClient, &Network, Packet, VID](const TLuaHookChain::TResults& Results, bool TimedOut) {
+                    auto Locked = WeakClient.lock();
+                    if (!Locked) {
+                        return;
+                    }
+                    bool ShouldntAllow = TimedOut || std::any_of(Results.begin(), Results.end(),
+                        [](const std::shared_ptr<TLuaResult>& Result) {
+                            return !Result->Error && Result->Result.is<int>() && Result->Result.as<int>() != 0;
+                        });
+
+                    auto FoundPos = Packet.find('{');
+                    FoundPos = FoundPos == std::string::npos ? 0 : FoundPos; // attempt at sanitizing this
+                    if ((Locked->GetUnicycleID() != VID || IsUnicycle(*Locked, Packet.substr(FoundPos)))
+                        && !ShouldntAllow) {
+                        Network.SendToAll(Locked.get(), StringToVector(Packet), false, true);
+                        Apply(*Locked, VID, Packet);
+                    } else {
+                        if (Locked->GetUnicycleID() == VID) {
+                            Locked->SetUnicycleID(-1);
+                        }
+                        std::string Destroy = "Od:" + std::to_string(Locked->GetID()) + "-" + std::to_string(VID);
+                        Network.SendToAll(nullptr, StringToVector(Destroy), true, true);
+                        Locked->DeleteCar(VID);
+                    }
                 });
-
-            auto FoundPos = Packet.find('{');
-            FoundPos = FoundPos == std::string::npos ? 0 : FoundPos; // attempt at sanitizing this
-            if ((c.GetUnicycleID() != VID || IsUnicycle(c, Packet.substr(FoundPos)))
-                && !ShouldntAllow) {
-                Network.SendToAll(&c, StringToVector(Packet), false, true);
-                Apply(c, VID, Packet);
-            } else {
-                if (c.GetUnicycleID() == VID) {
-                    c.SetUnicycleID(-1);
-                }
-                std::string Destroy = "Od:" + std::to_string(c.GetID()) + "-" + std::to_string(VID);
-                Network.SendToAll(nullptr, StringToVector(Destroy), true, true);
-                c.DeleteCar(VID);
-            }
         }
         return;
     }
@@ -378,14 +440,22 @@ void TServer::ParseVehicle(TClient& c, const std::string& Pckt, TNetwork& Networ
             std::tie(PID, VID) = MaybePidVid.value();
         }
         if (PID != -1 && VID != -1 && PID == c.GetID()) {
-            if (c.GetUnicycleID() == VID) {
-                c.SetUnicycleID(-1);
-            }
-            Network.SendToAll(nullptr, StringToVector(Packet), true, true);
-            // TODO: should this trigger on all vehicle deletions?
-            LuaAPI::MP::Engine->ReportErrors(LuaAPI::MP::Engine->TriggerEvent("onVehicleDeleted", "", c.GetID(), VID));
-            c.DeleteCar(VID);
-            beammp_debug(c.GetName() + (" deleted car with ID ") + std::to_string(VID));
+            // after any spawn or edit of this vehicle which is still waiting on Lua
+            c.LuaHooks().Then([WeakClient, &Network, Packet, VID](const TLuaHookChain::TResults&, bool) {
+                auto Locked = WeakClient.lock();
+                if (!Locked) {
+                    return;
+                }
+                if (Locked->GetUnicycleID() == VID) {
+                    Locked->SetUnicycleID(-1);
+                }
+                Network.SendToAll(nullptr, StringToVector(Packet), true, true);
+                // TODO: should this trigger on all vehicle deletions?
+                static const auto sOnVehicleDeleted = TLuaEngine::InternEvent("onVehicleDeleted");
+                LuaAPI::MP::Engine->ReportErrors(LuaAPI::MP::Engine->TriggerEvent(sOnVehicleDeleted, "", Locked->GetID(), VID));
+                Locked->DeleteCar(VID);
+                beammp_debug(Locked->GetName() + (" deleted car with ID ") + std::to_string(VID));
+            });
         }
         return;
     }
@@ -398,15 +468,28 @@ void TServer::ParseVehicle(TClient& c, const std::string& Pckt, TNetwork& Networ
 
         if (PID != -1 && VID != -1 && PID == c.GetID()) {
             Data = Data.substr(Data.find('{'));
-            LuaAPI::MP::Engine->ReportErrors(LuaAPI::MP::Engine->TriggerEvent("onVehicleReset", "", c.GetID(), VID, Data));
-            Network.SendToAll(&c, StringToVector(Packet), false, true);
+            const auto Reset = [&Network, Packet, Data, VID](TClient& Owner) {
+                static const auto sOnVehicleReset = TLuaEngine::InternEvent("onVehicleReset");
+                LuaAPI::MP::Engine->ReportErrors(LuaAPI::MP::Engine->TriggerEvent(sOnVehicleReset, "", Owner.GetID(), VID, Data));
+                Network.SendToAll(&Owner, StringToVector(Packet), false, true);
+            };
+            if (!DeferUntilSpawned(c, WeakClient, VID, Reset)) {
+                Reset(c);
+            }
         }
         return;
     }
-    case 't':
+    case 't': {
         beammp_trace(std::string(("got 'Ot' packet: '")) + Packet + ("' (") + std::to_string(Packet.size()) + (")"));
-        Network.SendToAll(&c, StringToVector(Packet), false, true);
+        const auto Send = [&Network, Packet](TClient& Owner) {
+            Network.SendToAll(&Owner, StringToVector(Packet), false, true);
+        };
+        auto MaybePidVid = GetPidVid(Data.substr(0, Data.find(':', 1)));
+        if (!MaybePidVid || !DeferUntilSpawned(c, WeakClient, MaybePidVid->second, Send)) {
+            Send(c);
+        }
         return;
+    }
     case 'm':
         Network.SendToAll(&c, StringToVector(Packet), true, true);
         return;
@@ -521,6 +604,53 @@ TEST_CASE("ParsePositionPacket") {
     }
 }
 
+BEAMMP_BENCHMARK("TServer/GetPidVid") {
+    const std::string PidVid = "12-3";
+    State.Run([&] { Benchmark::DoNotOptimize(GetPidVid(PidVid)); });
+}
+
+BEAMMP_BENCHMARK("TServer/ParsePositionPacket") {
+    const std::string Packet = R"(Zp:12-3:{"tim":10.428000331623,"vel":[-2.4171722121385e-05,-9.7184734153252e-06,-7.6420763232237e-06],"rot":[-0.0001296154171915,0.0031575385950029,0.98994906610295,0.14138903660382],"rvel":[5.3640324636461e-05,-9.9824529946024e-05,5.1664064641372e-05],"pos":[-0.27281248907838,-0.20515357944633,0.49695488960431],"ping":0.032999999821186})";
+    State.Run([&] { Benchmark::DoNotOptimize(ParsePositionPacket(Packet)); });
+}
+
+BEAMMP_BENCHMARK("TServer/Apply") {
+    TServer Server({});
+    TClient Client(Server, ip::tcp::socket(Server.IoCtx()));
+    Client.AddNewCar(0, R"({"jbm":"pickup","vcf":{"parts":{"pickup_body":"pickup_body"},"paints":[],"partConfigFilename":"vehicles/pickup/d15_4wd_A.pc"},"pro":"0","pos":[0,0,0],"rot":[0,0,0,1]})");
+    const std::string Edit = R"(Oc:0-0:{"vcf":{"parts":{"pickup_body":"pickup_body_alt"},"paints":[],"partConfigFilename":"vehicles/pickup/d15_4wd_M.pc"}})";
+    State.Run([&] { TServer::Apply(Client, 0, Edit); });
+}
+
+static void BenchmarkForEachClient(TBenchmarkState& State, size_t ClientCount) {
+    TServer Server({});
+    for (size_t i = 0; i < ClientCount; ++i) {
+        Server.InsertClient(std::make_shared<TClient>(Server, ip::tcp::socket(Server.IoCtx())));
+    }
+    State.SetItemsPerIteration(ClientCount);
+    State.Run([&] {
+        size_t Visited = 0;
+        Server.ForEachClient([&](const std::weak_ptr<TClient>& Client) -> bool {
+            Benchmark::DoNotOptimize(Client);
+            ++Visited;
+            return true;
+        });
+        Benchmark::DoNotOptimize(Visited);
+    });
+}
+
+BEAMMP_BENCHMARK("TServer/ForEachClient/10") {
+    BenchmarkForEachClient(State, 10);
+}
+
+BEAMMP_BENCHMARK("TServer/ForEachClient/100") {
+    BenchmarkForEachClient(State, 100);
+}
+
+BEAMMP_BENCHMARK("TServer/ForEachClient/1000") {
+    BenchmarkForEachClient(State, 1000);
+}
+
 void TServer::HandlePosition(TClient& c, const std::string& Packet) {
     if (auto Parsed = ParsePositionPacket(Packet); Parsed.has_value()) {
         c.SetCarPosition(Parsed.value().VID, Parsed.value().Data);
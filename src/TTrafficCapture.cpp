@@ -0,0 +1,281 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "TTrafficCapture.h"
+
+#include "Client.h"
+#include "Common.h"
+
+#include <array>
+#include <filesystem>
+#include <nlohmann/json.hpp>
+#include <sstream>
+
+template <typename T>
+static void PutLE(std::array<char, TTrafficCapture::RecordHeaderSize>& Buf, size_t& Offset, T Value) {
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        Buf[Offset++] = char(uint8_t(uint64_t(Value) >> (8 * i)));
+    }
+}
+
+template <typename T>
+static T GetLE(const std::array<char, TTrafficCapture::RecordHeaderSize>& Buf, size_t& Offset) {
+    uint64_t Value = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        Value |= uint64_t(uint8_t(Buf[Offset++])) << (8 * i);
+    }
+    return T(Value);
+}
+
+TTrafficCapture::~TTrafficCapture() {
+    Stop();
+}
+
+bool TTrafficCapture::Start(const std::string& Path) {
+    Stop();
+    std::ofstream File(Path, std::ios::binary | std::ios::trunc);
+    if (!File) {
+        beammp_errorf("Failed to open '{}' for traffic capture", Path);
+        return false;
+    }
+    File.write(Magic.data(), std::streamsize(Magic.size()));
+    std::unique_lock Lock(mMutex);
+    mFile = std::move(File);
+    mPath = Path;
+    mStart = std::chrono::steady_clock::now();
+    mRecords = 0;
+    mBytes = Magic.size();
+    mDropped = 0;
+    mStopping = false;
+    mActive = true;
+    mWriter = std::thread(&TTrafficCapture::WriterMain, this);
+    beammp_infof("Capturing traffic to '{}'", Path);
+    return true;
+}
+
+void TTrafficCapture::Stop() {
+    std::unique_lock Lock(mMutex);
+    if (!mWriter.joinable()) {
+        return;
+    }
+    mActive = false;
+    mStopping = true;
+    mQueueCond.notify_all();
+    auto Writer = std::move(mWriter);
+    Lock.unlock();
+    // writes out what's still queued
+    Writer.join();
+    Lock.lock();
+    beammp_infof("Stopped traffic capture to '{}' ({} records, {} bytes, {} dropped)", mPath, mRecords, mBytes, mDropped);
+}
+
+void TTrafficCapture::WriterMain() {
+    RegisterThread("Capture");
+    std::deque<TRecord> Batch;
+    std::unique_lock Lock(mMutex);
+    while (true) {
+        mQueueCond.wait(Lock, [this] { return mStopping || !mQueue.empty(); });
+        if (mQueue.empty()) {
+            break; // stopping, and everything is written
+        }
+        std::swap(Batch, mQueue);
+        mQueuedBytes = 0;
+        Lock.unlock();
+        size_t Bytes = 0;
+        for (const auto& Record : Batch) {
+            WriteRecord(mFile, Record);
+            Bytes += RecordHeaderSize + Record.Data.size();
+        }
+        mFile.flush();
+        const bool Failed = !mFile;
+        const size_t Records = Batch.size();
+        Batch.clear();
+        Lock.lock();
+        if (Failed) {
+            beammp_errorf("Failed to write to traffic capture '{}', stopping capture", mPath);
+            mActive = false;
+            mQueue.clear();
+            mQueuedBytes = 0;
+            break;
+        }
+        mRecords += Records;
+        mBytes += Bytes;
+    }
+    Lock.unlock();
+    mFile.close();
+}
+
+void TTrafficCapture::RecordJoin(const TClient& Client) {
+    if (!mActive) {
+        return;
+    }
+    nlohmann::json Info {
+        { "name", Client.GetName() },
+        { "roles", Client.GetRoles() },
+        { "guest", Client.IsGuest() },
+        { "wide_id", Client.IsWideID() },
+    };
+    auto Dumped = Info.dump();
+    Record(Kind::Join, Client.GetID(), std::vector<uint8_t>(Dumped.begin(), Dumped.end()));
+}
+
+void TTrafficCapture::RecordLeave(int ClientID) {
+    Record(Kind::Leave, ClientID, {});
+}
+
+void TTrafficCapture::Record(Kind Type, int ClientID, const std::vector<uint8_t>& Data) {
+    if (!mActive || ClientID < 0) {
+        return;
+    }
+    const auto Now = std::chrono::steady_clock::now();
+    std::unique_lock Lock(mMutex);
+    if (!mActive) {
+        return;
+    }
+    if (mQueuedBytes + RecordHeaderSize + Data.size() > MaxQueuedBytes) {
+        if (mDropped++ == 0) {
+            beammp_warnf("Traffic capture '{}' can't keep up, dropping records", mPath);
+        }
+        return;
+    }
+    mQueuedBytes += RecordHeaderSize + Data.size();
+    mQueue.push_back(TRecord {
+        Type,
+        uint16_t(ClientID),
+        std::chrono::duration_cast<std::chrono::microseconds>(Now - mStart),
+        Data,
+    });
+    Lock.unlock();
+    mQueueCond.notify_one();
+}
+
+TTrafficCapture::TStats TTrafficCapture::GetStats() const {
+    std::unique_lock Lock(mMutex);
+    return TStats { mActive, mPath, mRecords, mBytes, mDropped };
+}
+
+void TTrafficCapture::WriteRecord(std::ostream& Out, const TRecord& Record) {
+    std::array<char, RecordHeaderSize> Header {};
+    size_t Offset = 0;
+    PutLE(Header, Offset, uint8_t(Record.Type));
+    PutLE(Header, Offset, Record.ClientID);
+    PutLE(Header, Offset, uint64_t(Record.Time.count()));
+    PutLE(Header, Offset, uint32_t(Record.Data.size()));
+    Out.write(Header.data(), std::streamsize(Header.size()));
+    Out.write(reinterpret_cast<const char*>(Record.Data.data()), std::streamsize(Record.Data.size()));
+}
+
+std::optional<TTrafficCapture::TRecord> TTrafficCapture::ReadRecord(std::istream& In) {
+    std::array<char, RecordHeaderSize> Header {};
+    if (!In.read(Header.data(), std::streamsize(Header.size()))) {
+        return std::nullopt;
+    }
+    size_t Offset = 0;
+    TRecord Record {};
+    Record.Type = Kind(GetLE<uint8_t>(Header, Offset));
+    Record.ClientID = GetLE<uint16_t>(Header, Offset);
+    Record.Time = std::chrono::microseconds(GetLE<uint64_t>(Header, Offset));
+    const auto Size = GetLE<uint32_t>(Header, Offset);
+    if (Size > MaxRecordSize) {
+        return std::nullopt;
+    }
+    Record.Data.resize(Size);
+    if (!In.read(reinterpret_cast<char*>(Record.Data.data()), std::streamsize(Record.Data.size()))) {
+        return std::nullopt;
+    }
+    return Record;
+}
+
+bool TTrafficCapture::ReadHeader(std::istream& In) {
+    std::array<char, Magic.size()> Buf {};
+    if (!In.read(Buf.data(), std::streamsize(Buf.size()))) {
+        return false;
+    }
+    return std::string_view(Buf.data(), Buf.size()) == Magic;
+}
+
+TEST_CASE("TTrafficCapture record round trip") {
+    std::stringstream Stream;
+    Stream.write(TTrafficCapture::Magic.data(), std::streamsize(TTrafficCapture::Magic.size()));
+    const std::vector<TTrafficCapture::TRecord> Records {
+        { TTrafficCapture::Kind::Join, 3, std::chrono::microseconds(0), { '{', '}' } },
+        { TTrafficCapture::Kind::TCP, 3, std::chrono::microseconds(1500), { 'O', 's', ':', '0' } },
+        { TTrafficCapture::Kind::UDP, 65535, std::chrono::microseconds(0x1234567890), std::vector<uint8_t>(3000, 0xAB) },
+        { TTrafficCapture::Kind::Leave, 3, std::chrono::microseconds(2000), {} },
+    };
+    for (const auto& Record : Records) {
+        TTrafficCapture::WriteRecord(Stream, Record);
+    }
+    CHECK(TTrafficCapture::ReadHeader(Stream));
+    for (const auto& Expected : Records) {
+        auto Record = TTrafficCapture::ReadRecord(Stream);
+        REQUIRE(Record);
+        CHECK_EQ(Record->Type, Expected.Type);
+        CHECK_EQ(Record->ClientID, Expected.ClientID);
+        CHECK_EQ(Record->Time.count(), Expected.Time.count());
+        CHECK_EQ(Record->Data, Expected.Data);
+    }
+    CHECK(!TTrafficCapture::ReadRecord(Stream));
+
+    // a truncated record at the end (e.g. the server crashed mid-write) is ignored
+    std::stringstream Truncated;
+    TTrafficCapture::WriteRecord(Truncated, Records[1]);
+    auto Bytes = Truncated.str();
+    Truncated.str(Bytes.substr(0, Bytes.size() - 1));
+    CHECK(!TTrafficCapture::ReadRecord(Truncated));
+
+    // a corrupt size isn't trusted with an allocation
+    std::string Corrupt(TTrafficCapture::RecordHeaderSize, '\0');
+    Corrupt[1] = 3;
+    for (size_t i = 11; i < 15; ++i) {
+        Corrupt[i] = char(0xFF);
+    }
+    std::stringstream CorruptStream(Corrupt);
+    CHECK(!TTrafficCapture::ReadRecord(CorruptStream));
+}
+
+TEST_CASE("TTrafficCapture writer") {
+    const auto Path = (std::filesystem::temp_directory_path() / "beammp-capture-test.bin").string();
+    TTrafficCapture Capture;
+    Capture.Record(TTrafficCapture::Kind::TCP, 1, { 'x' }); // not active, ignored
+    REQUIRE(Capture.Start(Path));
+    for (uint8_t i = 0; i < 100; ++i) {
+        Capture.Record(TTrafficCapture::Kind::UDP, i, std::vector<uint8_t>(i, i));
+    }
+    Capture.RecordLeave(7);
+    Capture.Stop();
+    CHECK(!Capture.IsActive());
+    auto Stats = Capture.GetStats();
+    CHECK_EQ(Stats.Records, 101);
+    CHECK_EQ(Stats.Dropped, 0);
+
+    std::ifstream In(Path, std::ios::binary);
+    REQUIRE(TTrafficCapture::ReadHeader(In));
+    for (uint8_t i = 0; i < 100; ++i) {
+        auto Record = TTrafficCapture::ReadRecord(In);
+        REQUIRE(Record);
+        CHECK_EQ(Record->ClientID, i);
+        CHECK_EQ(Record->Data, std::vector<uint8_t>(i, i));
+    }
+    auto Leave = TTrafficCapture::ReadRecord(In);
+    REQUIRE(Leave);
+    CHECK_EQ(Leave->Type, TTrafficCapture::Kind::Leave);
+    CHECK(!TTrafficCapture::ReadRecord(In));
+    In.close();
+    std::filesystem::remove(Path);
+}
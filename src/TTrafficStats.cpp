@@ -0,0 +1,156 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "TTrafficStats.h"
+
+#include "Common.h"
+
+TTrafficStats::TTrafficStats()
+    : mLastUpdate(std::chrono::steady_clock::now()) {
+}
+
+void TTrafficStats::AddTransport(Direction Dir, Transport Via, size_t Bytes) {
+    mTransportPackets[size_t(Dir)][size_t(Via)].fetch_add(1, std::memory_order_relaxed);
+    mTransportBytes[size_t(Dir)][size_t(Via)].fetch_add(Bytes, std::memory_order_relaxed);
+}
+
+void TTrafficStats::AddCode(Direction Dir, uint8_t Code, size_t Bytes) {
+    mCodePackets[size_t(Dir)][Code].fetch_add(1, std::memory_order_relaxed);
+    mCodeBytes[size_t(Dir)][Code].fetch_add(Bytes, std::memory_order_relaxed);
+}
+
+TTrafficStats::TSnapshot TTrafficStats::Snapshot() const {
+    TSnapshot Result;
+    for (size_t Dir = 0; Dir < 2; ++Dir) {
+        for (size_t Via = 0; Via < 2; ++Via) {
+            Result.ByTransport[Dir][Via] = { mTransportPackets[Dir][Via].load(std::memory_order_relaxed), mTransportBytes[Dir][Via].load(std::memory_order_relaxed) };
+        }
+        for (size_t Code = 0; Code < 256; ++Code) {
+            Result.ByCode[Dir][Code] = { mCodePackets[Dir][Code].load(std::memory_order_relaxed), mCodeBytes[Dir][Code].load(std::memory_order_relaxed) };
+        }
+    }
+    return Result;
+}
+
+static TTrafficStats::TRate RateBetween(const TTrafficStats::TCount& Before, const TTrafficStats::TCount& After, double Seconds) {
+    return {
+        double(After.Packets - Before.Packets) / Seconds,
+        double(After.Bytes - Before.Bytes) / Seconds,
+    };
+}
+
+void TTrafficStats::UpdateRates() {
+    auto Now = std::chrono::steady_clock::now();
+    auto Current = Snapshot();
+    std::unique_lock Lock(mRatesMutex);
+    const auto Seconds = std::chrono::duration<double>(Now - mLastUpdate).count();
+    if (Seconds <= 0) {
+        return;
+    }
+    for (size_t Dir = 0; Dir < 2; ++Dir) {
+        for (size_t Via = 0; Via < 2; ++Via) {
+            mRates.ByTransport[Dir][Via] = RateBetween(mLastSnapshot.ByTransport[Dir][Via], Current.ByTransport[Dir][Via], Seconds);
+        }
+        for (size_t Code = 0; Code < 256; ++Code) {
+            mRates.ByCode[Dir][Code] = RateBetween(mLastSnapshot.ByCode[Dir][Code], Current.ByCode[Dir][Code], Seconds);
+        }
+    }
+    mLastSnapshot = Current;
+    mLastUpdate = Now;
+}
+
+TTrafficStats::TRates TTrafficStats::GetRates() const {
+    std::unique_lock Lock(mRatesMutex);
+    return mRates;
+}
+
+static nlohmann::json CountJson(const TTrafficStats::TCount& Count, const TTrafficStats::TRate& Rate) {
+    return {
+        { "packets", Count.Packets },
+        { "bytes", Count.Bytes },
+        { "packets_per_second", Rate.PacketsPerSecond },
+        { "bytes_per_second", Rate.BytesPerSecond },
+    };
+}
+
+nlohmann::json TTrafficStats::ToJson(const TSnapshot& Counts, const TRates& Rates) {
+    nlohmann::json Result;
+    nlohmann::json Codes = nlohmann::json::object();
+    for (auto Dir : { Direction::In, Direction::Out }) {
+        const auto Name = Dir == Direction::In ? "inbound" : "outbound";
+        auto& Json = Result[Name];
+        Json = CountJson(Counts.Total(Dir), Rates.Total(Dir));
+        Json["tcp"] = CountJson(Counts.Get(Dir, Transport::TCP), Rates.Get(Dir, Transport::TCP));
+        Json["udp"] = CountJson(Counts.Get(Dir, Transport::UDP), Rates.Get(Dir, Transport::UDP));
+        for (size_t Code = 0; Code < 256; ++Code) {
+            if (Counts.ByCode[size_t(Dir)][Code].Packets != 0) {
+                Codes[CodeName(uint8_t(Code))][Name] = CountJson(Counts.ByCode[size_t(Dir)][Code], Rates.ByCode[size_t(Dir)][Code]);
+            }
+        }
+    }
+    Result["codes"] = Codes;
+    return Result;
+}
+
+std::string TTrafficStats::CodeName(uint8_t Code) {
+    if (Code >= 0x20 && Code < 0x7f) {
+        return std::string(1, char(Code));
+    }
+    return fmt::format("0x{:02x}", Code);
+}
+
+TEST_CASE("TTrafficStats") {
+    TTrafficStats Stats;
+    Stats.AddTransport(TTrafficStats::Direction::In, TTrafficStats::Transport::UDP, 100);
+    Stats.AddTransport(TTrafficStats::Direction::In, TTrafficStats::Transport::UDP, 50);
+    Stats.AddTransport(TTrafficStats::Direction::In, TTrafficStats::Transport::TCP, 10);
+    Stats.AddTransport(TTrafficStats::Direction::Out, TTrafficStats::Transport::TCP, 1000);
+    Stats.AddCode(TTrafficStats::Direction::In, 'Z', 150);
+    Stats.AddCode(TTrafficStats::Direction::Out, 'O', 1000);
+
+    auto Counts = Stats.Snapshot();
+    CHECK(Counts.Get(TTrafficStats::Direction::In, TTrafficStats::Transport::UDP).Packets == 2);
+    CHECK(Counts.Get(TTrafficStats::Direction::In, TTrafficStats::Transport::UDP).Bytes == 150);
+    CHECK(Counts.Total(TTrafficStats::Direction::In).Packets == 3);
+    CHECK(Counts.Total(TTrafficStats::Direction::In).Bytes == 160);
+    CHECK(Counts.Total(TTrafficStats::Direction::Out).Bytes == 1000);
+    CHECK(Counts.ByCode[size_t(TTrafficStats::Direction::In)]['Z'].Packets == 1);
+
+    Stats.UpdateRates();
+    auto Rates = Stats.GetRates();
+    CHECK(Rates.Total(TTrafficStats::Direction::In).PacketsPerSecond > 0);
+    // nothing happened since the last update
+    Stats.UpdateRates();
+    CHECK(Stats.GetRates().Total(TTrafficStats::Direction::In).PacketsPerSecond == 0);
+
+    auto Json = TTrafficStats::ToJson(Counts, Rates);
+    CHECK(Json["inbound"]["packets"] == 3);
+    CHECK(Json["inbound"]["udp"]["bytes"] == 150);
+    CHECK(Json["outbound"]["tcp"]["packets"] == 1);
+    CHECK(Json["codes"]["Z"]["inbound"]["bytes"] == 150);
+    CHECK(Json["codes"].contains("O"));
+    CHECK(!Json["codes"]["O"].contains("inbound"));
+
+    // codes are whatever clients send, not all of them make valid UTF-8 keys
+    Stats.AddCode(TTrafficStats::Direction::In, 0xC3, 10);
+    Stats.AddCode(TTrafficStats::Direction::In, 0x00, 10);
+    Json = TTrafficStats::ToJson(Stats.Snapshot(), Stats.GetRates());
+    CHECK(Json["codes"]["0xc3"]["inbound"]["packets"] == 1);
+    CHECK(Json["codes"]["0x00"]["inbound"]["packets"] == 1);
+    CHECK_NOTHROW((void)Json.dump());
+}
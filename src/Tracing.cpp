@@ -0,0 +1,260 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "Tracing.h"
+
+#include "Common.h"
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <sstream>
+#include <vector>
+
+// spans kept per thread, older ones are overwritten
+static constexpr size_t sRingCapacity = 1 << 16;
+
+struct TTraceEvent {
+    const char* Name;
+    Tracing::FlowPhase Phase;
+    uint64_t FlowID;
+    std::chrono::steady_clock::time_point Start;
+    std::chrono::steady_clock::duration Duration;
+    std::string Detail;
+};
+
+struct TTraceThreadBuffer {
+    std::mutex Mutex;
+    size_t Generation { 0 };
+    size_t ThreadIndex { 0 };
+    std::string ThreadName;
+    std::vector<TTraceEvent> Events;
+    size_t Next { 0 };
+};
+
+static std::atomic_bool sActive { false };
+static std::atomic_uint64_t sNextFlowID { 1 };
+static std::atomic_size_t sSpans { 0 };
+// bumped on every start, so buffers of the previous trace aren't written to anymore
+static std::atomic_size_t sGeneration { 0 };
+// guards everything below
+static std::mutex sMutex;
+static std::string sPath;
+static std::chrono::steady_clock::time_point sStart;
+static std::vector<std::shared_ptr<TTraceThreadBuffer>> sBuffers;
+
+static thread_local uint64_t tCurrentFlowID { 0 };
+static thread_local std::shared_ptr<TTraceThreadBuffer> tBuffer;
+
+// the calling thread's buffer for the running trace, registered on first use
+static TTraceThreadBuffer& ThisThreadBuffer() {
+    if (tBuffer && tBuffer->Generation == sGeneration.load(std::memory_order_relaxed)) {
+        return *tBuffer;
+    }
+    std::unique_lock Lock(sMutex);
+    if (!tBuffer || tBuffer->Generation != sGeneration) {
+        tBuffer = std::make_shared<TTraceThreadBuffer>();
+        tBuffer->Generation = sGeneration;
+        tBuffer->ThreadIndex = sBuffers.size() + 1;
+        tBuffer->ThreadName = ThreadName(true);
+        // ThreadName() has a trailing space
+        if (!tBuffer->ThreadName.empty()) {
+            tBuffer->ThreadName.pop_back();
+        } else {
+            tBuffer->ThreadName = "Thread " + std::to_string(tBuffer->ThreadIndex);
+        }
+        sBuffers.push_back(tBuffer);
+    }
+    return *tBuffer;
+}
+
+static void WriteTrace(std::ostream& Out, const std::vector<std::shared_ptr<TTraceThreadBuffer>>& Buffers, std::chrono::steady_clock::time_point Start) {
+    auto Micros = [](std::chrono::steady_clock::duration Duration) {
+        return double(std::chrono::duration_cast<std::chrono::nanoseconds>(Duration).count()) / 1e3;
+    };
+    bool First = true;
+    auto Emit = [&](const nlohmann::json& Event) {
+        Out << (First ? "\n" : ",\n") << Event.dump();
+        First = false;
+    };
+    Out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    for (const auto& Buffer : Buffers) {
+        std::unique_lock Lock(Buffer->Mutex);
+        Emit({ { "name", "thread_name" }, { "ph", "M" }, { "pid", 1 }, { "tid", Buffer->ThreadIndex }, { "args", { { "name", Buffer->ThreadName } } } });
+        for (const auto& Event : Buffer->Events) {
+            const auto Ts = Micros(Event.Start - Start);
+            nlohmann::json Span {
+                { "name", Event.Name },
+                { "cat", "beammp" },
+                { "ph", "X" },
+                { "ts", Ts },
+                { "dur", Micros(Event.Duration) },
+                { "pid", 1 },
+                { "tid", Buffer->ThreadIndex },
+            };
+            if (!Event.Detail.empty()) {
+                Span["args"]["detail"] = Event.Detail;
+            }
+            if (Event.FlowID != 0) {
+                Span["args"]["flow"] = Event.FlowID;
+            }
+            Emit(Span);
+            if (Event.FlowID != 0 && Event.Phase != Tracing::FlowPhase::None) {
+                // binds to the span it's inside of
+                Emit({
+                    { "name", "packet" },
+                    { "cat", "flow" },
+                    { "ph", Event.Phase == Tracing::FlowPhase::Begin ? "s" : "t" },
+                    { "id", Event.FlowID },
+                    { "ts", Ts },
+                    { "pid", 1 },
+                    { "tid", Buffer->ThreadIndex },
+                });
+            }
+        }
+    }
+    Out << "\n]}\n";
+}
+
+bool Tracing::Start(const std::string& Path) {
+    std::unique_lock Lock(sMutex);
+    if (sActive) {
+        beammp_errorf("A trace to '{}' is already running", sPath);
+        return false;
+    }
+    ++sGeneration;
+    sBuffers.clear();
+    sPath = Path;
+    sStart = std::chrono::steady_clock::now();
+    sSpans = 0;
+    sActive = true;
+    beammp_infof("Tracing to '{}', stop with `trace stop`", Path);
+    return true;
+}
+
+bool Tracing::Stop() {
+    std::vector<std::shared_ptr<TTraceThreadBuffer>> Buffers;
+    std::string Path;
+    std::chrono::steady_clock::time_point Start;
+    {
+        std::unique_lock Lock(sMutex);
+        if (!sActive) {
+            return false;
+        }
+        sActive = false;
+        Buffers = std::move(sBuffers);
+        sBuffers.clear();
+        Path = sPath;
+        Start = sStart;
+    }
+    std::ofstream File(Path, std::ios::trunc);
+    WriteTrace(File, Buffers, Start);
+    if (!File) {
+        beammp_errorf("Failed to write trace to '{}'", Path);
+        return false;
+    }
+    beammp_infof("Wrote trace of {} spans on {} threads to '{}'", sSpans.load(), Buffers.size(), Path);
+    return true;
+}
+
+bool Tracing::IsActive() {
+    return sActive.load(std::memory_order_relaxed);
+}
+
+Tracing::TStats Tracing::GetStats() {
+    std::unique_lock Lock(sMutex);
+    return TStats { sActive, sPath, sBuffers.size(), sSpans };
+}
+
+uint64_t Tracing::NewFlowID() {
+    if (!IsActive()) {
+        return 0;
+    }
+    return sNextFlowID.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t Tracing::CurrentFlowID() {
+    return tCurrentFlowID;
+}
+
+void Tracing::SetCurrentFlowID(uint64_t FlowID) {
+    tCurrentFlowID = FlowID;
+}
+
+Tracing::TSpan::TSpan(const char* Name, FlowPhase Phase, const std::string& Detail)
+    : mName(Name)
+    , mActive(IsActive()) {
+    if (!mActive) {
+        return;
+    }
+    mFlowID = CurrentFlowID();
+    mPhase = mFlowID == 0 ? FlowPhase::None : Phase;
+    mDetail = Detail;
+    mStart = std::chrono::steady_clock::now();
+}
+
+Tracing::TSpan::~TSpan() {
+    if (!mActive || !IsActive()) {
+        return;
+    }
+    const auto Duration = std::chrono::steady_clock::now() - mStart;
+    auto& Buffer = ThisThreadBuffer();
+    std::unique_lock Lock(Buffer.Mutex);
+    TTraceEvent Event { mName, mPhase, mFlowID, mStart, Duration, std::move(mDetail) };
+    if (Buffer.Events.size() < sRingCapacity) {
+        Buffer.Events.push_back(std::move(Event));
+    } else {
+        Buffer.Events[Buffer.Next] = std::move(Event);
+        Buffer.Next = (Buffer.Next + 1) % sRingCapacity;
+    }
+    ++sSpans;
+}
+
+TEST_CASE("Tracing writes a Chrome trace with flows") {
+    const auto Path = (fs::temp_directory_path() / "beammp-trace-test.json").string();
+    CHECK(!Tracing::Stop());
+    CHECK(Tracing::NewFlowID() == 0);
+    REQUIRE(Tracing::Start(Path));
+    CHECK(!Tracing::Start(Path));
+    {
+        Tracing::TFlowScope Flow(Tracing::NewFlowID());
+        CHECK(Tracing::CurrentFlowID() != 0);
+        Tracing::TSpan Outer("Outer", Tracing::FlowPhase::Begin);
+        Tracing::TSpan Inner("Inner", "onChatMessage");
+    }
+    CHECK(Tracing::CurrentFlowID() == 0);
+    CHECK(Tracing::GetStats().Spans == 2);
+    REQUIRE(Tracing::Stop());
+
+    std::ifstream File(Path);
+    auto Trace = nlohmann::json::parse(File, nullptr, false);
+    REQUIRE(Trace.is_object());
+    std::vector<std::string> Phases;
+    for (const auto& Event : Trace["traceEvents"]) {
+        Phases.push_back(Event["ph"]);
+        if (Event["ph"] == "X" && Event["name"] == "Inner") {
+            CHECK(Event["args"]["detail"] == "onChatMessage");
+        }
+    }
+    // thread name, then each span followed by its flow event; spans are
+    // recorded when they end, so the inner one comes first
+    CHECK(Phases == std::vector<std::string> { "M", "X", "t", "X", "s" });
+    fs::remove(Path);
+}
@@ -142,11 +142,15 @@ int BeamMPServerMain(MainArguments Arguments) {
 
     SetupSignalHandlers();
 
+    std::mutex ShutdownMutex;
+    std::condition_variable ShutdownCond;
     bool Shutdown = false;
-    Application::RegisterShutdownHandler([&Shutdown] {
+    Application::RegisterShutdownHandler([&] {
         beammp_info("If this takes too long, you can press Ctrl+C repeatedly to force a shutdown.");
         Application::SetSubsystemStatus("Main", Application::Status::ShuttingDown);
+        std::unique_lock Lock(ShutdownMutex);
         Shutdown = true;
+        ShutdownCond.notify_all();
     });
     Application::RegisterShutdownHandler([] {
         auto Futures = LuaAPI::MP::Engine->TriggerEvent("onShutdown", "");
@@ -184,7 +188,8 @@ int BeamMPServerMain(MainArguments Arguments) {
     };
 
     bool FullyStarted = false;
-    while (!Shutdown) {
+    std::atomic<TScheduler::TTaskID> StartupCheck { 0 };
+    StartupCheck = Application::Scheduler().Every("StartupCheck", std::chrono::milliseconds(100), [&] {
         if (!FullyStarted) {
             FullyStarted = true;
             bool WithErrors = false;
@@ -211,8 +216,15 @@ int BeamMPServerMain(MainArguments Arguments) {
                 }
             }
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (FullyStarted) {
+            Application::Scheduler().Cancel(StartupCheck);
+        }
+    });
+    {
+        std::unique_lock Lock(ShutdownMutex);
+        ShutdownCond.wait(Lock, [&] { return Shutdown; });
     }
+    Application::Scheduler().Cancel(StartupCheck);
     Application::SetSubsystemStatus("Main", Application::Status::Shutdown);
     beammp_info("Shutdown.");
     return 0;
@@ -0,0 +1,123 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/*
+ * BeamMP-Server-bench: runs the BEAMMP_BENCHMARKs found throughout the
+ * sources and prints the results as json. Given a previous run's json as
+ * --baseline, it fails if any benchmark got slower than the threshold.
+ */
+
+#include "ArgsParser.h"
+#include "Benchmark.h"
+#include "Common.h"
+
+#include <fstream>
+#include <map>
+#include <nlohmann/json.hpp>
+
+static const std::string sBenchArguments = R"(
+USAGE:
+    BeamMP-Server-bench [arguments]
+
+ARGUMENTS:
+    --help
+                        Displays this help and exits.
+    --filter=<text>     Only runs benchmarks whose name contains <text>.
+    --min-time=<ms>     Minimum time spent measuring each benchmark (default: 250).
+    --json=<path>       Also writes the results to <path>.
+    --baseline=<path>   Compares against the results of a previous run, written with --json.
+    --threshold=<%>     How much slower than the baseline a benchmark may get
+                        before it counts as a regression (default: 10).
+)";
+
+int main(int argc, char** argv) {
+    std::vector<std::string_view> Arguments(argv + 1, argv + argc);
+    ArgsParser Parser;
+    Parser.RegisterArgument({ "help" }, ArgsParser::NONE);
+    for (const auto* Name : { "filter", "min-time", "json", "baseline", "threshold" }) {
+        Parser.RegisterArgument({ Name }, ArgsParser::HAS_VALUE);
+    }
+    Parser.Parse(Arguments);
+    if (!Parser.Verify()) {
+        return 1;
+    }
+    if (Parser.FoundArgument({ "help" })) {
+        Application::Console().WriteRaw(sBenchArguments);
+        return 0;
+    }
+
+    auto Value = [&Parser](const std::string& Name) { return Parser.GetValueOfArgument({ Name }); };
+    std::chrono::milliseconds MinTime { 250 };
+    double Threshold = 10;
+    try {
+        MinTime = std::chrono::milliseconds(std::stol(Value("min-time").value_or(std::to_string(MinTime.count()))));
+        Threshold = std::stod(Value("threshold").value_or(std::to_string(Threshold)));
+    } catch (const std::exception& e) {
+        beammp_errorf("Invalid argument: {}", e.what());
+        return 1;
+    }
+
+    nlohmann::json Baseline;
+    if (auto BaselinePath = Value("baseline")) {
+        std::ifstream BaselineFile(*BaselinePath);
+        if (!BaselineFile) {
+            beammp_errorf("Could not open baseline '{}'", *BaselinePath);
+            return 1;
+        }
+        try {
+            BaselineFile >> Baseline;
+        } catch (const std::exception& e) {
+            beammp_errorf("Baseline '{}' is not valid json: {}", *BaselinePath, e.what());
+            return 1;
+        }
+    }
+    std::map<std::string, double> BaselineNs;
+    for (const auto& Entry : Baseline.value("benchmarks", nlohmann::json::array())) {
+        BaselineNs[Entry.at("name").get<std::string>()] = Entry.at("ns_per_iter").get<double>();
+    }
+
+    auto Results = Benchmark::RunAll(Value("filter").value_or(""), MinTime);
+    nlohmann::json Report { { "benchmarks", nlohmann::json::array() } };
+    size_t Regressions = 0;
+    for (const auto& Result : Results) {
+        nlohmann::json Entry {
+            { "name", Result.Name },
+            { "ns_per_iter", Result.NsPerIteration },
+            { "iterations", Result.Iterations },
+            { "items_per_second", Result.ItemsPerSecond },
+        };
+        if (auto Iter = BaselineNs.find(Result.Name); Iter != BaselineNs.end() && Iter->second > 0) {
+            const double Change = (Result.NsPerIteration / Iter->second - 1.0) * 100.0;
+            Entry["baseline_ns_per_iter"] = Iter->second;
+            Entry["change_percent"] = Change;
+            if (Change > Threshold) {
+                beammp_warnf("{} regressed by {:.1f}% ({:.1f} ns -> {:.1f} ns)", Result.Name, Change, Iter->second, Result.NsPerIteration);
+                ++Regressions;
+            }
+        }
+        Report["benchmarks"].push_back(std::move(Entry));
+    }
+    Application::Console().WriteRaw(Report.dump(4));
+    if (auto JsonPath = Value("json")) {
+        std::ofstream(*JsonPath) << Report.dump(4);
+    }
+    if (Regressions > 0) {
+        beammp_errorf("{} benchmark(s) regressed by more than {}%", Regressions, Threshold);
+    }
+    return Regressions > 0 ? 2 : 0;
+}
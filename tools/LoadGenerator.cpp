@@ -0,0 +1,563 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/*
+ * BeamMP-Server-loadgen: simulates BeamMP clients against a (local) server.
+ *
+ * Each simulated client goes through the real handshake ('C', "VC", key,
+ * resource sync, 'H') and then sends a configurable mix of UDP positions,
+ * vehicle spawns and edits, chat messages and events, while measuring how
+ * long the server takes to answer or relay them.
+ *
+ * The server has to be built with BeamMP-Server_ENABLE_AUTH_MOCK and started
+ * with BEAMMP_AUTH_MOCK set, so that the keys sent by the load generator are
+ * accepted without the real auth backend.
+ */
+
+#include "ArgsParser.h"
+#include "BoostAliases.h"
+#include "Common.h"
+#include "TNetwork.h"
+
+#include <algorithm>
+#include <charconv>
+#include <csignal>
+#include <fstream>
+#include <nlohmann/json.hpp>
+#include <random>
+
+static const std::string sLoadGenArguments = R"(
+USAGE:
+    BeamMP-Server-loadgen [arguments]
+
+ARGUMENTS:
+    --help
+                        Displays this help and exits.
+    --host=<ip>         Server to connect to (default: 127.0.0.1).
+    --port=<port>       Port of the server (default: 30814).
+    --clients=<n>       Number of simulated clients (default: 10).
+    --duration=<s>      How long to run once all clients are connected (default: 30).
+    --ramp=<ms>         Delay between connecting two clients (default: 50). The server
+                        admits 10 connections from one IP at once, then 2 per second,
+                        but doesn't limit loopback. Against a server which isn't on
+                        this machine, use --ramp=500 or more.
+    --position-rate=<hz>
+                        UDP position packets per client per second (default: 20).
+    --edit-interval=<s> Seconds between vehicle edits per client, 0 to disable (default: 5).
+    --chat-interval=<s> Seconds between chat messages per client, 0 to disable (default: 10).
+    --event-interval=<s>
+                        Seconds between 'E' events per client, 0 to disable (default: 2).
+    --config-size=<b>   Approximate size of a vehicle config in bytes (default: 4000).
+    --wide-ids          Negotiate 16-bit player IDs (needed for more than 255 clients).
+    --json=<path>       Also write the final report as json to this file.
+
+EXAMPLES:
+    cmake -DBeamMP-Server_ENABLE_AUTH_MOCK=ON ... # the server has to be built with the mock auth backend
+    BEAMMP_AUTH_MOCK=1 BeamMP-Server &
+    BeamMP-Server-loadgen --clients=80 --duration=60
+)";
+
+struct TLoadGenConfig {
+    std::string Host = "127.0.0.1";
+    uint16_t Port = 30814;
+    size_t Clients = 10;
+    std::chrono::seconds Duration { 30 };
+    std::chrono::milliseconds Ramp { 50 };
+    double PositionRate = 20;
+    std::chrono::seconds EditInterval { 5 };
+    std::chrono::seconds ChatInterval { 10 };
+    std::chrono::seconds EventInterval { 2 };
+    size_t ConfigSize = 4000;
+    bool WideIDs = false;
+    std::optional<std::string> JsonPath;
+};
+
+using TClock = std::chrono::steady_clock;
+
+static int64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(TClock::now().time_since_epoch()).count();
+}
+
+static double NsToMs(int64_t Ns) {
+    return double(Ns) / 1e6;
+}
+
+class TLatencySamples {
+public:
+    void Add(double Ms) {
+        std::unique_lock Lock(mMutex);
+        mSamples.push_back(Ms);
+    }
+
+    nlohmann::json Summary() const {
+        std::unique_lock Lock(mMutex);
+        auto Samples = mSamples;
+        Lock.unlock();
+        if (Samples.empty()) {
+            return { { "count", 0 } };
+        }
+        std::sort(Samples.begin(), Samples.end());
+        auto At = [&Samples](double P) { return Samples[size_t(P * double(Samples.size() - 1))]; };
+        return {
+            { "count", Samples.size() },
+            { "p50_ms", At(0.5) },
+            { "p90_ms", At(0.9) },
+            { "p99_ms", At(0.99) },
+            { "max_ms", Samples.back() },
+        };
+    }
+
+private:
+    mutable std::mutex mMutex;
+    std::vector<double> mSamples;
+};
+
+struct TLoadGenStats {
+    std::atomic_size_t Connected { 0 };
+    std::atomic_size_t HandshakeFailures { 0 };
+    std::atomic_size_t Kicked { 0 };
+    std::atomic_size_t TCPPacketsSent { 0 };
+    std::atomic_size_t TCPPacketsReceived { 0 };
+    std::atomic_size_t TCPBytesReceived { 0 };
+    std::atomic_size_t UDPPacketsSent { 0 };
+    std::atomic_size_t UDPPacketsReceived { 0 };
+    std::atomic_size_t UDPBytesReceived { 0 };
+    std::atomic_size_t PositionsSent { 0 };
+    std::atomic_size_t PositionsReceived { 0 };
+    std::atomic_size_t PingsLost { 0 };
+    std::atomic_size_t SpawnsLost { 0 };
+    TLatencySamples Handshake;
+    TLatencySamples Ping;
+    TLatencySamples Spawn;
+    TLatencySamples Chat;
+    TLatencySamples Position;
+};
+
+static std::atomic_bool sStop { false };
+
+class TFakeClient {
+public:
+    TFakeClient(size_t Index, const TLoadGenConfig& Config, TLoadGenStats& Stats, io_context& IoCtx)
+        : mIndex(Index)
+        , mConfig(Config)
+        , mStats(Stats)
+        , mTCPSock(IoCtx)
+        , mUDPSock(IoCtx) { }
+
+    ~TFakeClient() {
+        Close();
+        if (mThread.joinable()) {
+            mThread.join();
+        }
+    }
+
+    void Start(TClock::time_point StopAt) {
+        mThread = std::thread([this, StopAt] { Run(StopAt); });
+    }
+
+private:
+    void Run(TClock::time_point StopAt) {
+        RegisterThread("Client_" + std::to_string(mIndex));
+        const auto HandshakeStart = NowNs();
+        try {
+            Handshake();
+        } catch (const std::exception& e) {
+            beammp_errorf("Client {} failed to join: {}", mIndex, e.what());
+            ++mStats.HandshakeFailures;
+            Close();
+            return;
+        }
+        mStats.Handshake.Add(NsToMs(NowNs() - HandshakeStart));
+        ++mStats.Connected;
+
+        std::thread TCPReader([this] { ReadTCP(); });
+        std::thread UDPReader([this] { ReadUDP(); });
+        Drive(StopAt);
+        Close();
+        TCPReader.join();
+        UDPReader.join();
+    }
+
+    void Handshake() {
+        ip::tcp::endpoint Server(ip::make_address(mConfig.Host), mConfig.Port);
+        mTCPSock.connect(Server);
+        write(mTCPSock, buffer("C", 1));
+        SendTCP(fmt::format("VC{}.0{}", Application::ClientMajorVersion(), mConfig.WideIDs ? ":W" : ""));
+        auto Accepted = ReceiveTCP();
+        if (Accepted != "A" && Accepted != "AW") {
+            throw std::runtime_error("version rejected: " + Accepted);
+        }
+        mWideID = Accepted == "AW";
+        SendTCP(fmt::format("loadgen-key-{}", mIndex));
+        auto Response = ReceiveTCP();
+        if (Response == "S") {
+            throw std::runtime_error("server requires a password, which the load generator doesn't support");
+        }
+        if (Response.empty() || Response.at(0) != 'P') {
+            throw std::runtime_error("unexpected response to key: " + Response);
+        }
+        mID = std::stoi(Response.substr(1));
+        SendTCP("SR");
+        (void)ReceiveTCP(); // mod list, we don't download any mods
+        SendTCP("Done");
+        auto Map = ReceiveTCP();
+        if (Map.empty() || Map.at(0) != 'M') {
+            throw std::runtime_error("expected map, got: " + Map);
+        }
+        mUDPSock.open(ip::udp::v4());
+        mUDPSock.connect(ip::udp::endpoint(Server.address(), mConfig.Port));
+        SendTCP("H");
+        // lets the server know our UDP endpoint
+        SendUDP("p");
+        mPingSentAt = NowNs();
+    }
+
+    void Drive(TClock::time_point StopAt) {
+        const auto PositionInterval = std::chrono::nanoseconds(int64_t(1e9 / std::max(mConfig.PositionRate, 0.001)));
+        auto NextPosition = TClock::now();
+        auto NextEdit = TClock::now() + mConfig.EditInterval;
+        auto NextChat = TClock::now() + RandomOffset(mConfig.ChatInterval);
+        auto NextEvent = TClock::now() + RandomOffset(mConfig.EventInterval);
+        auto NextPing = TClock::now() + std::chrono::seconds(1);
+
+        mSpawnSentAt = NowNs();
+        SendTCP("Os:0:" + MakeVehicleConfig());
+        while (!sStop && !mDisconnected && TClock::now() < StopAt) {
+            auto Now = TClock::now();
+            if (Now >= NextPosition && mVehicleID >= 0) {
+                SendUDP(fmt::format(R"(Zp:{}-{}:{{"tim":{},"vel":[0,0,0],"rot":[0,0,0,1],"rvel":[0,0,0],"pos":[{},0,0],"ping":0.03,"lg":{}}})",
+                    mID, mVehicleID.load(), double(NowNs()) / 1e9, mIndex, NowNs()));
+                ++mStats.PositionsSent;
+                NextPosition += PositionInterval;
+            }
+            if (mConfig.EditInterval.count() > 0 && Now >= NextEdit && mVehicleID >= 0) {
+                SendTCP(fmt::format(R"(Oc:{}-{}:{{"paint":{}}})", mID, mVehicleID.load(), Now.time_since_epoch().count() % 100));
+                NextEdit += mConfig.EditInterval;
+            }
+            if (mConfig.ChatInterval.count() > 0 && Now >= NextChat) {
+                SendTCP(fmt::format("C:{}: loadgen {}", Name(), NowNs()));
+                NextChat += mConfig.ChatInterval;
+            }
+            if (mConfig.EventInterval.count() > 0 && Now >= NextEvent) {
+                SendTCP(fmt::format("E:loadgen:{}", mIndex));
+                NextEvent += mConfig.EventInterval;
+            }
+            if (Now >= NextPing) {
+                auto SentAt = mPingSentAt.exchange(0);
+                if (SentAt != 0) {
+                    // no pong within a second
+                    ++mStats.PingsLost;
+                }
+                mPingSentAt = NowNs();
+                SendUDP("p");
+                NextPing += std::chrono::seconds(1);
+            }
+            // until spawned, there are no positions to send
+            std::this_thread::sleep_until(std::min(mVehicleID >= 0 ? NextPosition : Now + std::chrono::milliseconds(10), NextPing));
+        }
+        if (mVehicleID < 0) {
+            ++mStats.SpawnsLost;
+        }
+    }
+
+    void ReadTCP() {
+        while (!mDisconnected) {
+            std::string Packet;
+            try {
+                Packet = ReceiveTCP();
+            } catch (const std::exception&) {
+                break;
+            }
+            ++mStats.TCPPacketsReceived;
+            mStats.TCPBytesReceived += Packet.size() + 4;
+            if (Packet.starts_with("Sn")) {
+                std::unique_lock Lock(mNameMutex);
+                mName = Packet.substr(2);
+            } else if (Packet.starts_with("K")) {
+                beammp_warnf("Client {} was kicked: {}", mIndex, Packet.substr(1));
+                ++mStats.Kicked;
+                mDisconnected = true;
+            } else if (Packet.starts_with("Os:")) {
+                HandleSpawn(Packet);
+            } else if (Packet.starts_with("C:")) {
+                HandleChat(Packet);
+            }
+        }
+        mDisconnected = true;
+    }
+
+    void ReadUDP() {
+        std::array<char, 10240> Buffer {};
+        while (!mDisconnected) {
+            boost::system::error_code ec;
+            auto Size = mUDPSock.receive(buffer(Buffer), 0, ec);
+            if (ec) {
+                break;
+            }
+            ++mStats.UDPPacketsReceived;
+            mStats.UDPBytesReceived += Size;
+            auto Packet = Decompress(std::string(Buffer.data(), Size));
+            if (Packet == "p") {
+                auto SentAt = mPingSentAt.exchange(0);
+                if (SentAt != 0) {
+                    mStats.Ping.Add(NsToMs(NowNs() - SentAt));
+                }
+            } else if (Packet.starts_with("Zp:")) {
+                ++mStats.PositionsReceived;
+                if (auto Pos = Packet.find("\"lg\":"); Pos != std::string::npos) {
+                    int64_t SentAt = 0;
+                    auto Begin = Packet.data() + Pos + 5;
+                    std::from_chars(Begin, Packet.data() + Packet.size(), SentAt);
+                    mStats.Position.Add(NsToMs(NowNs() - SentAt));
+                }
+            }
+        }
+    }
+
+    // Os:ROLES:NAME:PID-VID:JSON
+    void HandleSpawn(const std::string& Packet) {
+        size_t Pos = 0;
+        for (int i = 0; i < 3 && Pos != std::string::npos; ++i) {
+            Pos = Packet.find(':', Pos + 1);
+        }
+        if (Pos == std::string::npos) {
+            return;
+        }
+        auto Dash = Packet.find('-', Pos);
+        auto End = Packet.find(':', Pos + 1);
+        if (Dash == std::string::npos || End == std::string::npos) {
+            return;
+        }
+        if (std::stoi(Packet.substr(Pos + 1, Dash - Pos - 1)) == mID && mVehicleID < 0) {
+            mVehicleID = std::stoi(Packet.substr(Dash + 1, End - Dash - 1));
+            mStats.Spawn.Add(NsToMs(NowNs() - mSpawnSentAt));
+        }
+    }
+
+    // C:NAME: loadgen TIMESTAMP
+    void HandleChat(const std::string& Packet) {
+        const auto Name = this->Name();
+        const auto Prefix = "C:" + Name + ": loadgen ";
+        if (!Name.empty() && Packet.starts_with(Prefix)) {
+            int64_t SentAt = 0;
+            std::from_chars(Packet.data() + Prefix.size(), Packet.data() + Packet.size(), SentAt);
+            mStats.Chat.Add(NsToMs(NowNs() - SentAt));
+        }
+    }
+
+    std::string Name() {
+        std::unique_lock Lock(mNameMutex);
+        return mName;
+    }
+
+    std::string MakeVehicleConfig() const {
+        nlohmann::json Config {
+            { "jbm", "pickup" },
+            { "vcf", { { "model", "pickup" }, { "parts", std::string(mConfig.ConfigSize, 'x') } } },
+            { "pos", { mIndex, 0, 0 } },
+            { "rot", { 0, 0, 0, 1 } },
+        };
+        return Config.dump();
+    }
+
+    std::chrono::milliseconds RandomOffset(std::chrono::seconds Interval) const {
+        // spreads the clients' periodic packets, so they don't all fire at once
+        std::minstd_rand Rng(uint32_t(mIndex));
+        auto Max = std::max<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(Interval).count(), 1);
+        return std::chrono::milliseconds(int64_t(Rng()) % Max);
+    }
+
+    void SendTCP(const std::string& Data) {
+        std::vector<uint8_t> Packet(Data.begin(), Data.end());
+        if (Packet.size() > 400) {
+            constexpr std::string_view ABG = "ABG:";
+            auto Compressed = Comp(Packet);
+            Packet.assign(ABG.begin(), ABG.end());
+            Packet.insert(Packet.end(), Compressed.begin(), Compressed.end());
+        }
+        const auto Size = int32_t(Packet.size());
+        std::vector<uint8_t> Frame(sizeof(Size) + Packet.size());
+        std::memcpy(Frame.data(), &Size, sizeof(Size));
+        std::memcpy(Frame.data() + sizeof(Size), Packet.data(), Packet.size());
+        std::unique_lock Lock(mTCPWriteMutex);
+        boost::system::error_code ec;
+        write(mTCPSock, buffer(Frame), ec);
+        if (ec) {
+            mDisconnected = true;
+            return;
+        }
+        ++mStats.TCPPacketsSent;
+    }
+
+    std::string ReceiveTCP() {
+        int32_t Size = 0;
+        read(mTCPSock, buffer(&Size, sizeof(Size)));
+        if (Size < 0 || Size > int32_t(100 * MB)) {
+            throw std::runtime_error("invalid packet size");
+        }
+        std::string Data(size_t(Size), '\0');
+        read(mTCPSock, buffer(Data));
+        return Decompress(std::move(Data));
+    }
+
+    void SendUDP(const std::string& Data) {
+        auto Packet = MakeUDPHeader(mID, mWideID);
+        Packet.insert(Packet.end(), Data.begin(), Data.end());
+        boost::system::error_code ec;
+        mUDPSock.send(buffer(Packet), 0, ec);
+        if (!ec) {
+            ++mStats.UDPPacketsSent;
+        }
+    }
+
+    static std::string Decompress(std::string Data) {
+        constexpr std::string_view ABG = "ABG:";
+        if (Data.starts_with(ABG)) {
+            auto Raw = DeComp(std::vector<uint8_t>(Data.begin() + ABG.size(), Data.end()));
+            return std::string(Raw.begin(), Raw.end());
+        }
+        return Data;
+    }
+
+    void Close() {
+        mDisconnected = true;
+        boost::system::error_code ec;
+        mTCPSock.shutdown(socket_base::shutdown_both, ec);
+        mTCPSock.close(ec);
+        mUDPSock.shutdown(socket_base::shutdown_both, ec);
+        mUDPSock.close(ec);
+    }
+
+    size_t mIndex;
+    const TLoadGenConfig& mConfig;
+    TLoadGenStats& mStats;
+    ip::tcp::socket mTCPSock;
+    ip::udp::socket mUDPSock;
+    std::mutex mTCPWriteMutex;
+    std::thread mThread;
+    int mID { -1 };
+    bool mWideID { false };
+    std::mutex mNameMutex;
+    std::string mName;
+    std::atomic_bool mDisconnected { false };
+    std::atomic_int mVehicleID { -1 };
+    std::atomic<int64_t> mPingSentAt { 0 };
+    int64_t mSpawnSentAt { 0 };
+};
+
+static nlohmann::json MakeReport(const TLoadGenConfig& Config, TLoadGenStats& Stats, double Seconds) {
+    const auto Connected = Stats.Connected.load();
+    // every position is relayed to every other connected client
+    const auto PositionsExpected = Stats.PositionsSent.load() * (Connected > 0 ? Connected - 1 : 0);
+    return {
+        { "clients", { { "requested", Config.Clients }, { "connected", Connected }, { "failed", Stats.HandshakeFailures.load() }, { "kicked", Stats.Kicked.load() } } },
+        { "seconds", Seconds },
+        { "throughput", {
+                            { "tcp_sent_per_s", double(Stats.TCPPacketsSent) / Seconds },
+                            { "tcp_received_per_s", double(Stats.TCPPacketsReceived) / Seconds },
+                            { "tcp_received_bytes_per_s", double(Stats.TCPBytesReceived) / Seconds },
+                            { "udp_sent_per_s", double(Stats.UDPPacketsSent) / Seconds },
+                            { "udp_received_per_s", double(Stats.UDPPacketsReceived) / Seconds },
+                            { "udp_received_bytes_per_s", double(Stats.UDPBytesReceived) / Seconds },
+                        } },
+        { "drops", {
+                       { "pings_lost", Stats.PingsLost.load() },
+                       { "spawns_lost", Stats.SpawnsLost.load() },
+                       { "positions_sent", Stats.PositionsSent.load() },
+                       { "positions_received", Stats.PositionsReceived.load() },
+                       { "positions_delivery_ratio", PositionsExpected > 0 ? double(Stats.PositionsReceived) / double(PositionsExpected) : 1.0 },
+                   } },
+        { "latency", {
+                         { "handshake", Stats.Handshake.Summary() },
+                         { "ping_rtt", Stats.Ping.Summary() },
+                         { "spawn_echo", Stats.Spawn.Summary() },
+                         { "chat_echo", Stats.Chat.Summary() },
+                         { "position_relay", Stats.Position.Summary() },
+                     } },
+    };
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string_view> Arguments(argv + 1, argv + argc);
+    ArgsParser Parser;
+    Parser.RegisterArgument({ "help" }, ArgsParser::NONE);
+    Parser.RegisterArgument({ "wide-ids" }, ArgsParser::NONE);
+    for (const auto* Name : { "host", "port", "clients", "duration", "ramp", "position-rate", "edit-interval", "chat-interval", "event-interval", "config-size", "json" }) {
+        Parser.RegisterArgument({ Name }, ArgsParser::HAS_VALUE);
+    }
+    Parser.Parse(Arguments);
+    if (!Parser.Verify()) {
+        return 1;
+    }
+    if (Parser.FoundArgument({ "help" })) {
+        Application::Console().WriteRaw(sLoadGenArguments);
+        return 0;
+    }
+
+    TLoadGenConfig Config;
+    try {
+        auto Value = [&Parser](const std::string& Name) { return Parser.GetValueOfArgument({ Name }); };
+        Config.Host = Value("host").value_or(Config.Host);
+        Config.Port = uint16_t(std::stoi(Value("port").value_or(std::to_string(Config.Port))));
+        Config.Clients = size_t(std::stoul(Value("clients").value_or(std::to_string(Config.Clients))));
+        Config.Duration = std::chrono::seconds(std::stol(Value("duration").value_or(std::to_string(Config.Duration.count()))));
+        Config.Ramp = std::chrono::milliseconds(std::stol(Value("ramp").value_or(std::to_string(Config.Ramp.count()))));
+        Config.PositionRate = std::stod(Value("position-rate").value_or(std::to_string(Config.PositionRate)));
+        Config.EditInterval = std::chrono::seconds(std::stol(Value("edit-interval").value_or(std::to_string(Config.EditInterval.count()))));
+        Config.ChatInterval = std::chrono::seconds(std::stol(Value("chat-interval").value_or(std::to_string(Config.ChatInterval.count()))));
+        Config.EventInterval = std::chrono::seconds(std::stol(Value("event-interval").value_or(std::to_string(Config.EventInterval.count()))));
+        Config.ConfigSize = size_t(std::stoul(Value("config-size").value_or(std::to_string(Config.ConfigSize))));
+        Config.WideIDs = Parser.FoundArgument({ "wide-ids" });
+        Config.JsonPath = Value("json");
+    } catch (const std::exception& e) {
+        beammp_errorf("Invalid argument: {}", e.what());
+        return 1;
+    }
+    if (Config.Clients > size_t(MaxLegacyPlayerID + 1) && !Config.WideIDs) {
+        beammp_warnf("More than {} clients need --wide-ids, the rest will be kicked", MaxLegacyPlayerID + 1);
+    }
+
+    std::signal(SIGINT, [](int) { sStop = true; });
+
+    io_context IoCtx;
+    TLoadGenStats Stats;
+    std::vector<std::unique_ptr<TFakeClient>> Clients;
+    beammp_infof("Connecting {} clients to {}:{}", Config.Clients, Config.Host, Config.Port);
+    const auto Start = TClock::now();
+    const auto StopAt = Start + Config.Ramp * Config.Clients + Config.Duration;
+    for (size_t i = 0; i < Config.Clients && !sStop; ++i) {
+        Clients.push_back(std::make_unique<TFakeClient>(i, Config, Stats, IoCtx));
+        Clients.back()->Start(StopAt);
+        std::this_thread::sleep_for(Config.Ramp);
+    }
+    while (!sStop && TClock::now() < StopAt) {
+        std::this_thread::sleep_for(std::chrono::seconds(5));
+        beammp_infof("{} connected, {} failed, {} pings lost, udp {} sent / {} received",
+            Stats.Connected.load(), Stats.HandshakeFailures.load(), Stats.PingsLost.load(), Stats.UDPPacketsSent.load(), Stats.UDPPacketsReceived.load());
+    }
+    sStop = true;
+    Clients.clear();
+
+    const auto Seconds = std::chrono::duration<double>(TClock::now() - Start).count();
+    auto Report = MakeReport(Config, Stats, Seconds);
+    Application::Console().WriteRaw(Report.dump(4));
+    if (Config.JsonPath) {
+        std::ofstream(*Config.JsonPath) << Report.dump(4);
+    }
+    return Stats.HandshakeFailures > 0 ? 2 : 0;
+}
@@ -0,0 +1,234 @@
+// BeamMP, the BeamNG.drive multiplayer mod.
+// Copyright (C) 2024 BeamMP Ltd., BeamMP team and contributors.
+//
+// BeamMP Ltd. can be contacted by electronic mail via contact@beammp.com.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/*
+ * BeamMP-Server-replay: feeds traffic recorded with the `capture` console
+ * command back into TServer::GlobalParser, with the server's Lua plugins
+ * loaded, to reproduce incidents and to benchmark real traffic offline.
+ *
+ * Clients are recreated from the capture's join records. They have no real
+ * connection, so anything the server sends back to them is discarded.
+ * Packets are handled one by one on the replay thread, in the order they
+ * were captured, which makes runs repeatable.
+ */
+
+#include "ArgsParser.h"
+#include "Client.h"
+#include "Common.h"
+#include "TLuaEngine.h"
+#include "TNetwork.h"
+#include "TPPSMonitor.h"
+#include "TResourceManager.h"
+#include "TServer.h"
+#include "TTrafficCapture.h"
+
+#include <fstream>
+#include <map>
+#include <nlohmann/json.hpp>
+
+static const std::string sReplayArguments = R"(
+USAGE:
+    BeamMP-Server-replay --capture=<path> [arguments]
+
+ARGUMENTS:
+    --help
+                        Displays this help and exits.
+    --capture=<path>    Capture file written by the server's `capture` command.
+    --speed=<factor>    Replays at this multiple of the original speed, 0 replays
+                        as fast as possible (default: 0).
+    --resources=<path>  Resource folder whose Server plugins get loaded (default: Resources).
+    --startup-delay=<ms>
+                        Time plugins get to load and run onInit before the replay starts (default: 2000).
+    --json=<path>       Also write the final report as json to this file.
+)";
+
+using TClock = std::chrono::steady_clock;
+
+struct TPacketStats {
+    size_t Count { 0 };
+    size_t Bytes { 0 };
+    std::chrono::nanoseconds Total { 0 };
+    std::chrono::nanoseconds Max { 0 };
+
+    void Add(size_t Size, std::chrono::nanoseconds Time) {
+        ++Count;
+        Bytes += Size;
+        Total += Time;
+        Max = std::max(Max, Time);
+    }
+
+    nlohmann::json Summary() const {
+        return {
+            { "count", Count },
+            { "bytes", Bytes },
+            { "total_ms", double(Total.count()) / 1e6 },
+            { "mean_us", Count == 0 ? 0.0 : double(Total.count()) / double(Count) / 1e3 },
+            { "max_us", double(Max.count()) / 1e3 },
+        };
+    }
+};
+
+static std::shared_ptr<TClient> MakeReplayClient(TServer& Server, int ID) {
+    auto Client = std::make_shared<TClient>(Server, ip::tcp::socket(Server.IoCtx()));
+    Client->SetID(ID);
+    Client->SetName("Replay" + std::to_string(ID));
+    Client->SetIsSynced(true);
+    Server.InsertClient(Client);
+    return Client;
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string_view> Arguments(argv + 1, argv + argc);
+    ArgsParser Parser;
+    Parser.RegisterArgument({ "help" }, ArgsParser::NONE);
+    for (const auto* Name : { "capture", "speed", "resources", "startup-delay", "json" }) {
+        Parser.RegisterArgument({ Name }, ArgsParser::HAS_VALUE);
+    }
+    Parser.Parse(Arguments);
+    if (!Parser.Verify()) {
+        return 1;
+    }
+    auto Value = [&Parser](const std::string& Name) { return Parser.GetValueOfArgument({ Name }); };
+    if (Parser.FoundArgument({ "help" }) || !Value("capture")) {
+        Application::Console().WriteRaw(sReplayArguments);
+        return Parser.FoundArgument({ "help" }) ? 0 : 1;
+    }
+    double Speed = 0;
+    std::chrono::milliseconds StartupDelay { 2000 };
+    try {
+        Speed = std::stod(Value("speed").value_or("0"));
+        StartupDelay = std::chrono::milliseconds(std::stol(Value("startup-delay").value_or(std::to_string(StartupDelay.count()))));
+    } catch (const std::exception& e) {
+        beammp_errorf("Invalid argument: {}", e.what());
+        return 1;
+    }
+
+    std::ifstream Capture(*Value("capture"), std::ios::binary);
+    if (!Capture || !TTrafficCapture::ReadHeader(Capture)) {
+        beammp_errorf("'{}' is not a traffic capture", *Value("capture"));
+        return 1;
+    }
+
+    Application::Settings.Resource = Value("resources").value_or(Application::Settings.Resource);
+    // the network is only needed for GlobalParser to send through, it doesn't have to be reachable
+    Application::Settings.Port = 0;
+    TServer Server({});
+    auto LuaEngine = std::make_shared<TLuaEngine>();
+    LuaEngine->SetServer(&Server);
+    TResourceManager ResourceManager;
+    // the PPS monitor kicks clients which don't ping, so it doesn't get to see the replayed ones
+    TServer PPSMonitorServer({});
+    TPPSMonitor PPSMonitor(PPSMonitorServer);
+    TNetwork Network(Server, PPSMonitor, ResourceManager);
+    LuaEngine->SetNetwork(&Network);
+    PPSMonitor.SetNetwork(Network);
+    std::this_thread::sleep_for(StartupDelay);
+
+    std::map<int, std::shared_ptr<TClient>> Clients;
+    std::map<std::string, TPacketStats> StatsByCode;
+    TPacketStats TCPStats;
+    TPacketStats UDPStats;
+    size_t Joins = 0;
+    size_t Records = 0;
+    const auto Start = TClock::now();
+    while (auto Record = TTrafficCapture::ReadRecord(Capture)) {
+        ++Records;
+        if (Speed > 0) {
+            std::this_thread::sleep_until(Start + std::chrono::duration_cast<TClock::duration>(Record->Time / Speed));
+        }
+        const int ID = Record->ClientID;
+        auto& Client = Clients[ID];
+        switch (Record->Type) {
+        case TTrafficCapture::Kind::Join: {
+            if (!Client) {
+                Client = MakeReplayClient(Server, ID);
+            }
+            auto Info = nlohmann::json::parse(Record->Data.begin(), Record->Data.end(), nullptr, false);
+            if (Info.is_object()) {
+                Client->SetName(Info.value("name", Client->GetName()));
+                Client->SetRoles(Info.value("roles", ""));
+                Client->SetIsGuest(Info.value("guest", false));
+                Client->SetIsWideID(Info.value("wide_id", false));
+            }
+            ++Joins;
+            break;
+        }
+        case TTrafficCapture::Kind::TCP:
+        case TTrafficCapture::Kind::UDP: {
+            if (!Client) {
+                // joined before the capture started
+                Client = MakeReplayClient(Server, ID);
+            }
+            const auto Size = Record->Data.size();
+            // compressed packets are counted together, GlobalParser only decompresses them
+            std::string Code(Record->Data.begin(), Record->Data.begin() + long(std::min<size_t>(Size, 1)));
+            if (Size >= 4 && std::equal(Record->Data.begin(), Record->Data.begin() + 4, "ABG:")) {
+                Code = "ABG";
+            }
+            const auto Before = TClock::now();
+            Server.GlobalParser(Client, std::move(Record->Data), PPSMonitor, Network);
+            const auto Time = TClock::now() - Before;
+            (Record->Type == TTrafficCapture::Kind::TCP ? TCPStats : UDPStats).Add(Size, Time);
+            StatsByCode[Code].Add(Size, Time);
+            // nobody sends the queued packets to replayed clients
+            std::unique_lock Lock(Client->MissedPacketQueueMutex());
+            Client->MissedPacketQueue() = {};
+            break;
+        }
+        case TTrafficCapture::Kind::Leave:
+            if (Client) {
+                Server.RemoveClient(Client);
+            }
+            Clients.erase(ID);
+            break;
+        default:
+            beammp_warnf("Unknown record type {} in capture, skipping", int(Record->Type));
+            break;
+        }
+    }
+    const auto Seconds = std::chrono::duration<double>(TClock::now() - Start).count();
+
+    nlohmann::json ByCode = nlohmann::json::object();
+    for (const auto& [Code, Stats] : StatsByCode) {
+        ByCode[Code] = Stats.Summary();
+    }
+    nlohmann::json Report {
+        { "capture", *Value("capture") },
+        { "speed", Speed },
+        { "duration_s", Seconds },
+        { "records", Records },
+        { "joins", Joins },
+        { "packets_per_second", double(TCPStats.Count + UDPStats.Count) / Seconds },
+        { "tcp", TCPStats.Summary() },
+        { "udp", UDPStats.Summary() },
+        { "by_code", ByCode },
+    };
+    Application::Console().WriteRaw(Report.dump(4));
+    if (auto JsonPath = Value("json")) {
+        std::ofstream(*JsonPath) << Report.dump(4);
+    }
+
+    for (const auto& [ID, Client] : Clients) {
+        if (Client) {
+            Server.RemoveClient(Client);
+        }
+    }
+    Clients.clear();
+    Application::GracefullyShutdown();
+    return 0;
+}